@@ -46,7 +46,7 @@ netadr_t net_local_adr;
 
 typedef struct
 {
-	byte data[MAX_MSGLEN];
+	byte data[MAX_FRAGMSGLEN];
 	int datalen;
 } loopmsg_t;
 
@@ -520,6 +520,9 @@ NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
 	int protocol;
 	int err;
 
+	/* net_latency and net_bandwidth */
+	NET_SendLagPackets();
+
 	if (NET_GetLoopPacket(sock, net_from, net_message))
 	{
 		return true;
@@ -586,6 +589,12 @@ NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 	int net_socket;
 	int addr_size = sizeof(struct sockaddr_in);
 
+	/* simulates a bad link for testing */
+	if (NET_LagPacket(sock, length, data, to))
+	{
+		return;
+	}
+
 	switch (to.type)
 	{
 		case NA_LOOPBACK:
@@ -1004,6 +1013,10 @@ NET_Sleep(int msec)
 
 	FD_SET(ip_sockets[NS_SERVER], &fdset); /* IPv4 network socket */
 	FD_SET(ip6_sockets[NS_SERVER], &fdset); /* IPv6 network socket */
+
+	/* wake up in time for the delayed packets */
+	msec = NET_LagSleep(msec);
+
 	timeout.tv_sec = msec / 1000;
 	timeout.tv_usec = (msec % 1000) * 1000;
 	select(MAX(ip_sockets[NS_SERVER],
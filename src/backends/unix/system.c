@@ -24,11 +24,17 @@
  * =======================================================================
  */
 
+/* for dladdr() */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -44,6 +50,7 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "../../common/header/common.h"
 #include "../../common/header/glob.h"
@@ -99,12 +106,212 @@ Sys_Milliseconds(void)
 	return curtime;
 }
 
+long long
+Sys_Microseconds(void)
+{
+	struct timeval tp;
+	static long long secbase;
+
+	gettimeofday(&tp, NULL);
+
+	if (!secbase)
+	{
+		secbase = tp.tv_sec;
+	}
+
+	return (tp.tv_sec - secbase) * 1000000LL + tp.tv_usec;
+}
+
+long long
+Sys_Nanoseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 void
 Sys_Sleep(int msec)
 {
 	usleep((unsigned int)1000 * msec);
 }
 
+typedef struct
+{
+	pthread_t thread;
+	void (*func)(void *);
+	void *arg;
+} systhread_t;
+
+static void *
+Sys_ThreadMain(void *arg)
+{
+	systhread_t *t = arg;
+
+	t->func(t->arg);
+
+	return NULL;
+}
+
+void *
+Sys_CreateThread(void (*func)(void *), void *arg)
+{
+	systhread_t *t;
+
+	t = malloc(sizeof(*t));
+
+	if (!t)
+	{
+		return NULL;
+	}
+
+	t->func = func;
+	t->arg = arg;
+
+	if (pthread_create(&t->thread, NULL, Sys_ThreadMain, t) != 0)
+	{
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/*
+ * Blocks until the thread returned
+ * and frees it.
+ */
+void
+Sys_WaitThread(void *thread)
+{
+	systhread_t *t = thread;
+
+	pthread_join(t->thread, NULL);
+	free(t);
+}
+
+void *
+Sys_CreateMutex(void)
+{
+	pthread_mutex_t *m;
+
+	m = malloc(sizeof(*m));
+
+	if (!m)
+	{
+		return NULL;
+	}
+
+	if (pthread_mutex_init(m, NULL) != 0)
+	{
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void
+Sys_DestroyMutex(void *mutex)
+{
+	pthread_mutex_destroy(mutex);
+	free(mutex);
+}
+
+void
+Sys_LockMutex(void *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void
+Sys_UnlockMutex(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+void
+Sys_SyncFile(FILE *f)
+{
+	fflush(f);
+	fsync(fileno(f));
+}
+
+qboolean
+Sys_ReplaceFile(const char *src, const char *dst)
+{
+	return rename(src, dst) == 0;
+}
+
+void *
+Sys_MapFile(const char *path, int *length)
+{
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+
+	if ((fstat(fd, &st) == -1) || (st.st_size <= 0) || (st.st_size > INT_MAX))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	*length = (int)st.st_size;
+
+	return base;
+}
+
+void
+Sys_UnmapFile(void *base, int length)
+{
+	munmap(base, length);
+}
+
+void *
+Sys_FindSymbol(void *addr, char *name, int size)
+{
+	Dl_info info;
+	const char *file;
+
+	if (!dladdr(addr, &info))
+	{
+		Com_sprintf(name, size, "%p", addr);
+		return addr;
+	}
+
+	/* static functions aren't in the dynamic symbols,
+	   the offset can be looked up with addr2line */
+	if (!info.dli_sname || !info.dli_saddr)
+	{
+		file = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+		Com_sprintf(name, size, "%s+0x%lx",
+				file ? file + 1 : (info.dli_fname ? info.dli_fname : "?"),
+				(unsigned long)((byte *)addr - (byte *)info.dli_fbase));
+		return addr;
+	}
+
+	Q_strlcpy(name, info.dli_sname, size);
+
+	return info.dli_saddr;
+}
+
 void
 Sys_Mkdir(char *path)
 {
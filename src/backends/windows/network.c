@@ -37,7 +37,7 @@
 
 typedef struct
 {
-	byte data[MAX_MSGLEN];
+	byte data[MAX_FRAGMSGLEN];
 	int datalen;
 } loopmsg_t;
 
@@ -549,6 +549,9 @@ NET_GetPacket(netsrc_t sock, netadr_t *net_from, sizebuf_t *net_message)
 	int protocol;
 	int err;
 
+	/* net_latency and net_bandwidth */
+	NET_SendLagPackets();
+
 	if (NET_GetLoopPacket(sock, net_from, net_message))
 	{
 		return true;
@@ -634,6 +637,12 @@ NET_SendPacket(netsrc_t sock, int length, void *data, netadr_t to)
 	int net_socket;
 	int addr_size = sizeof(struct sockaddr_in);
 
+	/* simulates a bad link for testing */
+	if (NET_LagPacket(sock, length, data, to))
+	{
+		return;
+	}
+
 	switch (to.type)
 	{
 		case NA_LOOPBACK:
@@ -1251,6 +1260,9 @@ NET_Sleep(int msec)
 		}
 	}
 
+	/* wake up in time for the delayed packets */
+	msec = NET_LagSleep(msec);
+
 	timeout.tv_sec = msec / 1000;
 	timeout.tv_usec = (msec % 1000) * 1000;
 	i = max(ip_sockets[NS_SERVER], ip6_sockets[NS_SERVER]);
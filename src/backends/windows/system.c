@@ -429,12 +429,231 @@ Sys_Milliseconds(void)
 	return curtime;
 }
 
+long long
+Sys_Microseconds(void)
+{
+	static LARGE_INTEGER freq;
+	static LARGE_INTEGER base;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&base);
+	}
+
+	QueryPerformanceCounter(&now);
+
+	return (now.QuadPart - base.QuadPart) * 1000000LL / freq.QuadPart;
+}
+
+long long
+Sys_Nanoseconds(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&freq);
+	}
+
+	QueryPerformanceCounter(&now);
+
+	/* split up, the product would overflow */
+	return (now.QuadPart / freq.QuadPart) * 1000000000LL +
+		   (now.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart;
+}
+
 void
 Sys_Sleep(int msec)
 {
 	Sleep(msec);
 }
 
+typedef struct
+{
+	HANDLE thread;
+	void (*func)(void *);
+	void *arg;
+} systhread_t;
+
+static DWORD WINAPI
+Sys_ThreadMain(LPVOID arg)
+{
+	systhread_t *t = arg;
+
+	t->func(t->arg);
+
+	return 0;
+}
+
+void *
+Sys_CreateThread(void (*func)(void *), void *arg)
+{
+	systhread_t *t;
+
+	t = malloc(sizeof(*t));
+
+	if (!t)
+	{
+		return NULL;
+	}
+
+	t->func = func;
+	t->arg = arg;
+	t->thread = CreateThread(NULL, 0, Sys_ThreadMain, t, 0, NULL);
+
+	if (!t->thread)
+	{
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/*
+ * Blocks until the thread returned
+ * and frees it.
+ */
+void
+Sys_WaitThread(void *thread)
+{
+	systhread_t *t = thread;
+
+	WaitForSingleObject(t->thread, INFINITE);
+	CloseHandle(t->thread);
+	free(t);
+}
+
+void *
+Sys_CreateMutex(void)
+{
+	CRITICAL_SECTION *m;
+
+	m = malloc(sizeof(*m));
+
+	if (!m)
+	{
+		return NULL;
+	}
+
+	InitializeCriticalSection(m);
+
+	return m;
+}
+
+void
+Sys_DestroyMutex(void *mutex)
+{
+	DeleteCriticalSection(mutex);
+	free(mutex);
+}
+
+void
+Sys_LockMutex(void *mutex)
+{
+	EnterCriticalSection(mutex);
+}
+
+void
+Sys_UnlockMutex(void *mutex)
+{
+	LeaveCriticalSection(mutex);
+}
+
+void
+Sys_SyncFile(FILE *f)
+{
+	fflush(f);
+	_commit(_fileno(f));
+}
+
+qboolean
+Sys_ReplaceFile(const char *src, const char *dst)
+{
+	/* rename() doesn't replace files, and removing dst
+	   first would lose it if we crash in between */
+	return MoveFileExA(src, dst,
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+void *
+Sys_MapFile(const char *path, int *length)
+{
+	HANDLE file, mapping;
+	DWORD size, high;
+	void *base;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	size = GetFileSize(file, &high);
+
+	if ((size == INVALID_FILE_SIZE) || high || !size || (size > 0x7fffffff))
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+
+	mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+
+	if (!mapping)
+	{
+		return NULL;
+	}
+
+	/* the view keeps the mapping alive */
+	base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if (!base)
+	{
+		return NULL;
+	}
+
+	*length = (int)size;
+
+	return base;
+}
+
+void
+Sys_UnmapFile(void *base, int length)
+{
+	UnmapViewOfFile(base);
+}
+
+void *
+Sys_FindSymbol(void *addr, char *name, int size)
+{
+	HMODULE module;
+	char path[MAX_OSPATH];
+	char *file;
+
+	/* there are no symbols without dbghelp,
+	   the offset into the module has to do */
+	if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+				GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, addr, &module) ||
+		!GetModuleFileNameA(module, path, sizeof(path)))
+	{
+		Com_sprintf(name, size, "%p", addr);
+		return addr;
+	}
+
+	file = strrchr(path, '\\');
+	Com_sprintf(name, size, "%s+0x%x", file ? file + 1 : path,
+			(unsigned int)((byte *)addr - (byte *)module));
+
+	return addr;
+}
+
 /* ======================================================================= */
 
 static qboolean
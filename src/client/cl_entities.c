@@ -95,12 +95,55 @@ S_RegisterSexedModel(entity_state_t *ent, char *base)
 
 extern int Developer_searchpath(int who);
 
+/*
+ * With server frames shorter than 100 msec an entity
+ * is lerped over the time between its last two changes.
+ * Players move every frame, entities moved by the game
+ * every 100 msec.
+ */
+static float
+CL_EntityLerpFrac(centity_t *cent)
+{
+	float frac;
+	int msec;
+
+	if ((cl.frametime >= 100) || cl_timedemo->value)
+	{
+		return cl.lerpfrac;
+	}
+
+	msec = cent->lerpmsec;
+
+	if (msec < cl.frametime)
+	{
+		msec = cl.frametime;
+	}
+	else if (msec > 100)
+	{
+		msec = 100;
+	}
+
+	frac = (float)(cl.time - cent->lerptime + cl.frametime) / msec;
+
+	if (frac < 0)
+	{
+		return 0;
+	}
+	else if (frac > 1)
+	{
+		return 1;
+	}
+
+	return frac;
+}
+
 void
 CL_AddPacketEntities(frame_t *frame)
 {
 	entity_t ent = {0};
 	entity_state_t *s1;
 	float autorotate;
+	float lerpfrac;
 	int i;
 	int pnum;
 	centity_t *cent;
@@ -179,8 +222,10 @@ CL_AddPacketEntities(frame_t *frame)
 			renderfx |= RF_SHELL_HALF_DAM;
 		}
 
+		lerpfrac = CL_EntityLerpFrac(cent);
+
 		ent.oldframe = cent->prev.frame;
-		ent.backlerp = 1.0f - cl.lerpfrac;
+		ent.backlerp = 1.0f - lerpfrac;
 
 		if (renderfx & (RF_FRAMELERP | RF_BEAM))
 		{
@@ -194,7 +239,7 @@ CL_AddPacketEntities(frame_t *frame)
 			/* interpolate origin */
 			for (i = 0; i < 3; i++)
 			{
-				ent.origin[i] = ent.oldorigin[i] = cent->prev.origin[i] + cl.lerpfrac *
+				ent.origin[i] = ent.oldorigin[i] = cent->prev.origin[i] + lerpfrac *
 				   	(cent->current.origin[i] - cent->prev.origin[i]);
 			}
 		}
@@ -301,7 +346,7 @@ CL_AddPacketEntities(frame_t *frame)
 			{
 				a1 = cent->current.angles[i];
 				a2 = cent->prev.angles[i];
-				ent.angles[i] = LerpAngle(a2, a1, cl.lerpfrac);
+				ent.angles[i] = LerpAngle(a2, a1, lerpfrac);
 			}
 		}
 
@@ -870,19 +915,21 @@ CL_AddEntities(void)
 		cl.time = cl.frame.servertime;
 		cl.lerpfrac = 1.0;
 	}
-	else if (cl.time < cl.frame.servertime - 100)
+	else if (cl.time < cl.frame.servertime - cl.frametime)
 	{
 		if (cl_showclamp->value)
 		{
-			Com_Printf("low clamp %i\n", cl.frame.servertime - 100 - cl.time);
+			Com_Printf("low clamp %i\n",
+					cl.frame.servertime - cl.frametime - cl.time);
 		}
 
-		cl.time = cl.frame.servertime - 100;
+		cl.time = cl.frame.servertime - cl.frametime;
 		cl.lerpfrac = 0;
 	}
 	else
 	{
-		cl.lerpfrac = 1.0 - (cl.frame.servertime - cl.time) * 0.01f;
+		cl.lerpfrac = 1.0 - (float)(cl.frame.servertime - cl.time) /
+			cl.frametime;
 	}
 
 	if (cl_timedemo->value)
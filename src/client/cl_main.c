@@ -53,12 +53,17 @@ cvar_t *cl_add_entities;
 cvar_t *cl_add_blend;
 cvar_t *cl_async;
 
+cvar_t *cl_compress;
+cvar_t *cl_packedents;
+cvar_t *cl_fragment;
+cvar_t *cl_tickrate;
 cvar_t *cl_shownet;
 cvar_t *cl_showmiss;
 cvar_t *cl_showclamp;
 
 cvar_t *cl_paused;
 cvar_t *cl_timedemo;
+cvar_t *cl_demo_compress;
 
 cvar_t *lookspring;
 cvar_t *lookstrafe;
@@ -115,8 +120,8 @@ CL_WriteDemoMessage(void)
 	/* the first eight bytes are just packet sequencing stuff */
 	len = net_message.cursize - 8;
 	swlen = LittleLong(len);
-	fwrite(&swlen, 4, 1, cls.demofile);
-	fwrite(net_message.data + 8, len, 1, cls.demofile);
+	FS_WriteAsync(cls.demofile, &swlen, 4);
+	FS_WriteAsync(cls.demofile, net_message.data + 8, len);
 }
 
 /*
@@ -135,8 +140,8 @@ CL_Stop_f(void)
 
 	len = -1;
 
-	fwrite(&len, 4, 1, cls.demofile);
-	fclose(cls.demofile);
+	FS_WriteAsync(cls.demofile, &len, 4);
+	FS_CloseAsync(cls.demofile);
 	cls.demofile = NULL;
 	cls.demorecording = false;
 	Com_Printf("Stopped demo.\n");
@@ -177,16 +182,17 @@ CL_Record_f(void)
 
 	Com_sprintf(name, sizeof(name), "%s/demos/%s.dm2", FS_Gamedir(), Cmd_Argv(1));
 
-	Com_Printf("recording to %s.\n", name);
 	FS_CreatePath(name);
-	cls.demofile = fopen(name, "wb");
+	cls.demofile = FS_OpenAsync(name, cl_demo_compress->value);
 
 	if (!cls.demofile)
 	{
-		Com_Printf("ERROR: couldn't open.\n");
+		Com_Printf("ERROR: couldn't open %s.\n", name);
 		return;
 	}
 
+	Com_Printf("recording to %s.\n", FS_AsyncName(cls.demofile));
+
 	cls.demorecording = true;
 
 	/* don't start saving messages until a non-delta compressed message is received */
@@ -197,7 +203,18 @@ CL_Record_f(void)
 
 	/* send the serverdata */
 	MSG_WriteByte(&buf, svc_serverdata);
-	MSG_WriteLong(&buf, PROTOCOL_VERSION);
+
+	/* the frames are copied verbatim, so
+	   keep the entity encoding version */
+	if (cls.serverProtocol == PROTOCOL_PACKEDENTS)
+	{
+		MSG_WriteLong(&buf, PROTOCOL_PACKEDENTS);
+	}
+	else
+	{
+		MSG_WriteLong(&buf, PROTOCOL_VERSION);
+	}
+
 	MSG_WriteLong(&buf, 0x10000 + cl.servercount);
 	MSG_WriteByte(&buf, 1);  /* demos are always attract loops */
 	MSG_WriteString(&buf, cl.gamedir);
@@ -205,6 +222,13 @@ CL_Record_f(void)
 
 	MSG_WriteString(&buf, cl.configstrings[CS_NAME]);
 
+	/* the demo server plays back at this rate */
+	if (cl.frametime != 100)
+	{
+		MSG_WriteByte(&buf, svc_frametime);
+		MSG_WriteByte(&buf, cl.frametime);
+	}
+
 	/* configstrings */
 	for (i = 0; i < MAX_CONFIGSTRINGS; i++)
 	{
@@ -213,8 +237,8 @@ CL_Record_f(void)
 			if (buf.cursize + strlen(cl.configstrings[i]) + 32 > buf.maxsize)
 			{
 				len = LittleLong(buf.cursize);
-				fwrite(&len, 4, 1, cls.demofile);
-				fwrite(buf.data, buf.cursize, 1, cls.demofile);
+				FS_WriteAsync(cls.demofile, &len, 4);
+				FS_WriteAsync(cls.demofile, buf.data, buf.cursize);
 				buf.cursize = 0;
 			}
 
@@ -240,8 +264,8 @@ CL_Record_f(void)
 		if (buf.cursize + 64 > buf.maxsize)
 		{
 			len = LittleLong(buf.cursize);
-			fwrite(&len, 4, 1, cls.demofile);
-			fwrite(buf.data, buf.cursize, 1, cls.demofile);
+			FS_WriteAsync(cls.demofile, &len, 4);
+			FS_WriteAsync(cls.demofile, buf.data, buf.cursize);
 			buf.cursize = 0;
 		}
 
@@ -257,8 +281,8 @@ CL_Record_f(void)
 
 	/* write it to the demo file */
 	len = LittleLong(buf.cursize);
-	fwrite(&len, 4, 1, cls.demofile);
-	fwrite(buf.data, buf.cursize, 1, cls.demofile);
+	FS_WriteAsync(cls.demofile, &len, 4);
+	FS_WriteAsync(cls.demofile, buf.data, buf.cursize);
 }
 
 void
@@ -330,6 +354,9 @@ CL_ClearState(void)
 	memset(&cl, 0, sizeof(cl));
 	memset(&cl_entities, 0, sizeof(cl_entities));
 
+	/* changed by svc_frametime */
+	cl.frametime = 100;
+
 	SZ_Clear(&cls.netchan.message);
 }
 
@@ -506,12 +533,17 @@ CL_InitLocal(void)
 	m_forward = Cvar_Get("m_forward", "1", 0);
 	m_side = Cvar_Get("m_side", "1", 0);
 
+	cl_compress = Cvar_Get("cl_compress", "1", CVAR_ARCHIVE);
+	cl_packedents = Cvar_Get("cl_packedents", "1", CVAR_ARCHIVE);
+	cl_fragment = Cvar_Get("cl_fragment", "0", CVAR_ARCHIVE);
+	cl_tickrate = Cvar_Get("cl_tickrate", "1", CVAR_ARCHIVE);
 	cl_shownet = Cvar_Get("cl_shownet", "0", 0);
 	cl_showmiss = Cvar_Get("cl_showmiss", "0", 0);
 	cl_showclamp = Cvar_Get("showclamp", "0", 0);
 	cl_timeout = Cvar_Get("cl_timeout", "120", 0);
 	cl_paused = Cvar_Get("paused", "0", 0);
 	cl_timedemo = Cvar_Get("timedemo", "0", 0);
+	cl_demo_compress = Cvar_Get("demo_compress", "0", CVAR_ARCHIVE);
 
 	gl_maxfps = Cvar_Get("gl_maxfps", "95", CVAR_ARCHIVE);
 
@@ -552,6 +584,7 @@ CL_InitLocal(void)
 	Cmd_AddCommand("disconnect", CL_Disconnect_f);
 	Cmd_AddCommand("record", CL_Record_f);
 	Cmd_AddCommand("stop", CL_Stop_f);
+	Cmd_AddCommand("deltabench", CL_DeltaBench_f);
 
 	Cmd_AddCommand("quit", CL_Quit_f);
 
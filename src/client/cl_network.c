@@ -106,6 +106,50 @@ CL_Drop(void)
 	}
 }
 
+/*
+ * True while the collision map is
+ * the one of a server, ours or not.
+ */
+qboolean
+CL_Connected(void)
+{
+	return cls.state > ca_disconnected;
+}
+
+/*
+ * Returns the protocol extensions we're
+ * going to announce to the server.
+ */
+static int
+CL_Capabilities(void)
+{
+	int capabilities;
+
+	capabilities = NETCAP_SUPPORTED;
+
+	if (!cl_compress->value)
+	{
+		capabilities &= ~NETCAP_COMPRESS;
+	}
+
+	if (!cl_packedents->value)
+	{
+		capabilities &= ~NETCAP_PACKEDENTS;
+	}
+
+	if (!cl_fragment->value)
+	{
+		capabilities &= ~NETCAP_FRAGMENT;
+	}
+
+	if (!cl_tickrate->value)
+	{
+		capabilities &= ~NETCAP_TICKRATE;
+	}
+
+	return capabilities;
+}
+
 /*
  * We have gotten a challenge from the server, so try and
  * connect.
@@ -134,8 +178,9 @@ CL_SendConnectPacket(void)
 
 	userinfo_modified = false;
 
-	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\"\n",
-			PROTOCOL_VERSION, port, cls.challenge, Cvar_Userinfo());
+	Netchan_OutOfBandPrint(NS_CLIENT, adr, "connect %i %i %i \"%s\" %i\n",
+			PROTOCOL_VERSION, port, cls.challenge, Cvar_Userinfo(),
+			CL_Capabilities());
 }
 
 /*
@@ -562,6 +607,7 @@ CL_ConnectionlessPacket(void)
 {
 	char *s;
 	char *c;
+	int capabilities;
 
 	MSG_BeginReading(&net_message);
 	MSG_ReadLong(&net_message); /* skip the -1 */
@@ -583,7 +629,13 @@ CL_ConnectionlessPacket(void)
 			return;
 		}
 
-		Netchan_Setup(NS_CLIENT, &cls.netchan, net_from, cls.quakePort);
+		/* old servers don't send any extensions */
+		capabilities = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+		capabilities &= CL_Capabilities();
+
+		Netchan_Setup(NS_CLIENT, &cls.netchan, net_from, cls.quakePort,
+				capabilities);
+		cls.connect_start = cls.realtime;
 
 		MSG_WriteChar(&cls.netchan.message, clc_stringcmd);
 		MSG_WriteString(&cls.netchan.message, "new");
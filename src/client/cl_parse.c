@@ -29,8 +29,6 @@
 void CL_DownloadFileName(char *dest, int destlen, char *fn);
 void CL_ParseDownload(void);
 
-int bitcounts[32]; /* just for protocol profiling */
-
 char *svc_strings[256] = {
 	"svc_bad",
 
@@ -54,7 +52,8 @@ char *svc_strings[256] = {
 	"svc_playerinfo",
 	"svc_packetentities",
 	"svc_deltapacketentities",
-	"svc_frame"
+	"svc_frame",
+	"svc_frametime"
 };
 
 void
@@ -86,7 +85,6 @@ int
 CL_ParseEntityBits(unsigned *bits)
 {
 	unsigned b, total;
-	int i;
 	int number;
 
 	total = MSG_ReadByte(&net_message);
@@ -109,15 +107,6 @@ CL_ParseEntityBits(unsigned *bits)
 		total |= b << 24;
 	}
 
-	/* count the bits for net profiling */
-	for (i = 0; i < 32; i++)
-	{
-		if (total & (1 << i))
-		{
-			bitcounts[i]++;
-		}
-	}
-
 	if (total & U_NUMBER16)
 	{
 		number = MSG_ReadShort(&net_message);
@@ -139,135 +128,22 @@ CL_ParseEntityBits(unsigned *bits)
 void
 CL_ParseDelta(entity_state_t *from, entity_state_t *to, int number, int bits)
 {
-	/* set everything to the state we are delta'ing from */
-	*to = *from;
-
-	VectorCopy(from->origin, to->old_origin);
-	to->number = number;
-
-	if (bits & U_MODEL)
-	{
-		to->modelindex = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL2)
-	{
-		to->modelindex2 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL3)
-	{
-		to->modelindex3 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_MODEL4)
-	{
-		to->modelindex4 = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_FRAME8)
-	{
-		to->frame = MSG_ReadByte(&net_message);
-	}
-
-	if (bits & U_FRAME16)
-	{
-		to->frame = MSG_ReadShort(&net_message);
-	}
-
-	/* used for laser colors */
-	if ((bits & U_SKIN8) && (bits & U_SKIN16))
-	{
-		to->skinnum = MSG_ReadLong(&net_message);
-	}
-	else if (bits & U_SKIN8)
-	{
-		to->skinnum = MSG_ReadByte(&net_message);
-	}
-	else if (bits & U_SKIN16)
-	{
-		to->skinnum = MSG_ReadShort(&net_message);
-	}
-
-	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
-	{
-		to->effects = MSG_ReadLong(&net_message);
-	}
-	else if (bits & U_EFFECTS8)
-	{
-		to->effects = MSG_ReadByte(&net_message);
-	}
-	else if (bits & U_EFFECTS16)
-	{
-		to->effects = MSG_ReadShort(&net_message);
-	}
-
-	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
-	{
-		to->renderfx = MSG_ReadLong(&net_message);
-	}
-	else if (bits & U_RENDERFX8)
-	{
-		to->renderfx = MSG_ReadByte(&net_message);
-	}
-	else if (bits & U_RENDERFX16)
-	{
-		to->renderfx = MSG_ReadShort(&net_message);
-	}
-
-	if (bits & U_ORIGIN1)
-	{
-		to->origin[0] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ORIGIN2)
-	{
-		to->origin[1] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ORIGIN3)
-	{
-		to->origin[2] = MSG_ReadCoord(&net_message);
-	}
-
-	if (bits & U_ANGLE1)
-	{
-		to->angles[0] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_ANGLE2)
-	{
-		to->angles[1] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_ANGLE3)
-	{
-		to->angles[2] = MSG_ReadAngle(&net_message);
-	}
-
-	if (bits & U_OLDORIGIN)
-	{
-		MSG_ReadPos(&net_message, to->old_origin);
-	}
+	MSG_ReadDeltaEntity(&net_message, from, to, number, bits);
+}
 
-	if (bits & U_SOUND)
-	{
-		to->sound = MSG_ReadByte(&net_message);
-	}
+/*
+ * True if the entity didn't move or animate,
+ * events are sent along with unchanged states
+ */
+static qboolean
+CL_EntityUnchanged(entity_state_t *state, entity_state_t *current)
+{
+	entity_state_t s;
 
-	if (bits & U_EVENT)
-	{
-		to->event = MSG_ReadByte(&net_message);
-	}
-	else
-	{
-		to->event = 0;
-	}
+	s = *state;
+	s.event = current->event;
 
-	if (bits & U_SOLID)
-	{
-		to->solid = MSG_ReadShort(&net_message);
-	}
+	return !memcmp(&s, current, sizeof(s));
 }
 
 /*
@@ -286,7 +162,14 @@ CL_DeltaEntity(frame_t *frame, int newnum, entity_state_t *old, int bits)
 	cl.parse_entities++;
 	frame->num_entities++;
 
-	CL_ParseDelta(old, state, newnum, bits);
+	if (cls.serverProtocol == PROTOCOL_PACKEDENTS)
+	{
+		MSG_ReadDeltaEntityPacked(&net_message, old, state, newnum, bits);
+	}
+	else
+	{
+		CL_ParseDelta(old, state, newnum, bits);
+	}
 
 	/* some data changes will force no lerping */
 	if ((state->modelindex != ent->current.modelindex) ||
@@ -322,11 +205,21 @@ CL_DeltaEntity(frame_t *frame, int newnum, entity_state_t *old, int bits)
 			VectorCopy(state->old_origin, ent->prev.origin);
 			VectorCopy(state->old_origin, ent->lerp_origin);
 		}
+
+		ent->lerptime = cl.frame.servertime;
+		ent->lerpmsec = cl.frametime;
+	}
+	else if ((cl.frametime < 100) && CL_EntityUnchanged(state, &ent->current))
+	{
+		/* the game moves most entities only every
+		   100 msec, keep lerping over that time */
 	}
 	else
 	{
 		/* shuffle the last state to previous */
 		ent->prev = ent->current;
+		ent->lerpmsec = cl.frame.servertime - ent->lerptime;
+		ent->lerptime = cl.frame.servertime;
 	}
 
 	ent->serverframe = cl.frame.serverframe;
@@ -346,12 +239,14 @@ CL_ParsePacketEntities(frame_t *oldframe, frame_t *newframe)
 	entity_state_t
 	*oldstate = NULL;
 	int oldindex, oldnum;
+	int lastnum;
 
 	newframe->parse_entities = cl.parse_entities;
 	newframe->num_entities = 0;
 
 	/* delta from the entities present in oldframe */
 	oldindex = 0;
+	lastnum = 0;
 
 	if (!oldframe)
 	{
@@ -375,7 +270,14 @@ CL_ParsePacketEntities(frame_t *oldframe, frame_t *newframe)
 
 	while (1)
 	{
-		newnum = CL_ParseEntityBits(&bits);
+		if (cls.serverProtocol == PROTOCOL_PACKEDENTS)
+		{
+			newnum = MSG_ReadEntityBitsPacked(&net_message, &bits, &lastnum);
+		}
+		else
+		{
+			newnum = CL_ParseEntityBits(&bits);
+		}
 
 		if (newnum >= MAX_EDICTS)
 		{
@@ -688,7 +590,7 @@ CL_ParseFrame(void)
 
 	cl.frame.serverframe = MSG_ReadLong(&net_message);
 	cl.frame.deltaframe = MSG_ReadLong(&net_message);
-	cl.frame.servertime = cl.frame.serverframe * 100;
+	cl.frame.servertime = cl.frame.serverframe * cl.frametime;
 
 	/* BIG HACK to let old demos continue to work */
 	if (cls.serverProtocol != 26)
@@ -745,9 +647,9 @@ CL_ParseFrame(void)
 		cl.time = cl.frame.servertime;
 	}
 
-	else if (cl.time < cl.frame.servertime - 100)
+	else if (cl.time < cl.frame.servertime - cl.frametime)
 	{
-		cl.time = cl.frame.servertime - 100;
+		cl.time = cl.frame.servertime - cl.frametime;
 	}
 
 	/* read areabits */
@@ -784,6 +686,13 @@ CL_ParseFrame(void)
 		/* getting a valid frame message ends the connection process */
 		if (cls.state != ca_active)
 		{
+			if (cls.connect_start)
+			{
+				Com_DPrintf("Connected in %i ms.\n",
+						cls.realtime - cls.connect_start);
+				cls.connect_start = 0;
+			}
+
 			cls.state = ca_active;
 			cl.force_refdef = true;
 			cl.predicted_origin[0] = cl.frame.playerstate.pmove.origin[0] * 0.125f;
@@ -811,6 +720,263 @@ CL_ParseFrame(void)
 	}
 }
 
+static entity_state_t *bench_from[MAX_EDICTS];
+static entity_state_t bench_classic[MAX_EDICTS];
+static entity_state_t bench_packed[MAX_EDICTS];
+
+/*
+ * Delta encodes the entities of a buffered frame against
+ * its predecessor, like the server would do it. Returns
+ * the number of entities.
+ */
+static int
+CL_BenchEncode(frame_t *from, frame_t *to, sizebuf_t *msg, qboolean packed)
+{
+	entity_state_t *oldent, *newent;
+	int oldindex, newindex;
+	int lastnum;
+	qboolean isnew;
+
+	SZ_Clear(msg);
+
+	oldindex = 0;
+	lastnum = 0;
+
+	for (newindex = 0; newindex < to->num_entities; newindex++)
+	{
+		newent = &cl_parse_entities[(to->parse_entities +
+				newindex) & (MAX_PARSE_ENTITIES - 1)];
+
+		/* find the entity in the old frame */
+		bench_from[newent->number] = &cl_entities[newent->number].baseline;
+		isnew = true;
+
+		while (oldindex < from->num_entities)
+		{
+			oldent = &cl_parse_entities[(from->parse_entities +
+					oldindex) & (MAX_PARSE_ENTITIES - 1)];
+
+			if (oldent->number == newent->number)
+			{
+				bench_from[newent->number] = oldent;
+				isnew = false;
+			}
+
+			if (oldent->number >= newent->number)
+			{
+				break;
+			}
+
+			oldindex++;
+		}
+
+		if (packed)
+		{
+			MSG_WriteDeltaEntityPacked(bench_from[newent->number], newent,
+					msg, isnew, isnew, &lastnum);
+		}
+		else
+		{
+			MSG_WriteDeltaEntity(bench_from[newent->number], newent,
+					msg, isnew, isnew);
+		}
+	}
+
+	if (packed)
+	{
+		MSG_WriteEntityEndPacked(msg);
+	}
+	else
+	{
+		MSG_WriteShort(msg, 0);
+	}
+
+	return to->num_entities;
+}
+
+static void
+CL_BenchDecode(sizebuf_t *msg, qboolean packed, entity_state_t *out)
+{
+	sizebuf_t saved;
+	unsigned bits;
+	int number;
+	int lastnum;
+
+	/* the classic parser is hardwired to net_message */
+	saved = net_message;
+	net_message = *msg;
+	MSG_BeginReading(&net_message);
+
+	lastnum = 0;
+
+	while (1)
+	{
+		if (packed)
+		{
+			number = MSG_ReadEntityBitsPacked(&net_message, &bits, &lastnum);
+		}
+		else
+		{
+			number = CL_ParseEntityBits(&bits);
+		}
+
+		if ((number <= 0) || (number >= MAX_EDICTS) ||
+			(net_message.readcount > net_message.cursize))
+		{
+			break;
+		}
+
+		if (packed)
+		{
+			MSG_ReadDeltaEntityPacked(&net_message, bench_from[number],
+					&out[number], number, bits);
+		}
+		else
+		{
+			CL_ParseDelta(bench_from[number], &out[number], number, bits);
+		}
+	}
+
+	net_message = saved;
+}
+
+/*
+ * Encodes and decodes the buffered frames with the
+ * classic and the bit packed entity encoding and
+ * prints the size and time per entity. Best used
+ * while playing back a demo.
+ */
+void
+CL_DeltaBench_f(void)
+{
+	static byte data[MAX_MSGLEN * 4];
+	const char *names[2] = {"classic", "packed"};
+	long long enc[2], dec[2], start;
+	int bytes[2];
+	int frames, entities, mismatches;
+	int iterations;
+	int codec, i, j, n;
+	frame_t *from, *to;
+	sizebuf_t msg;
+
+	if (cls.state != ca_active)
+	{
+		Com_Printf("Not connected, play a demo first.\n");
+		return;
+	}
+
+	iterations = 100;
+
+	if (Cmd_Argc() > 1)
+	{
+		iterations = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+
+		if (iterations < 1)
+		{
+			iterations = 1;
+		}
+	}
+
+	SZ_Init(&msg, data, sizeof(data));
+	msg.allowoverflow = true;
+
+	frames = 0;
+	entities = 0;
+	mismatches = 0;
+
+	for (codec = 0; codec < 2; codec++)
+	{
+		enc[codec] = 0;
+		dec[codec] = 0;
+		bytes[codec] = 0;
+	}
+
+	for (i = 0; i < UPDATE_BACKUP; i++)
+	{
+		to = &cl.frames[i];
+		from = &cl.frames[(to->serverframe - 1) & UPDATE_MASK];
+
+		/* both frames must still be in cl_parse_entities */
+		if (!to->valid || !from->valid ||
+			(from->serverframe != to->serverframe - 1) ||
+			(cl.parse_entities - from->parse_entities >
+			 MAX_PARSE_ENTITIES - 128))
+		{
+			continue;
+		}
+
+		n = 0;
+
+		for (codec = 0; codec < 2; codec++)
+		{
+			start = Sys_Microseconds();
+
+			for (j = 0; j < iterations; j++)
+			{
+				n = CL_BenchEncode(from, to, &msg, codec);
+			}
+
+			enc[codec] += Sys_Microseconds() - start;
+			bytes[codec] += msg.cursize;
+
+			start = Sys_Microseconds();
+
+			for (j = 0; j < iterations; j++)
+			{
+				CL_BenchDecode(&msg, codec, codec ?
+						bench_packed : bench_classic);
+			}
+
+			dec[codec] += Sys_Microseconds() - start;
+		}
+
+		if (msg.overflowed)
+		{
+			Com_Printf("Frame %i overflowed.\n", to->serverframe);
+			return;
+		}
+
+		/* both encodings must result in the same state */
+		for (j = 0; j < to->num_entities; j++)
+		{
+			int num = cl_parse_entities[(to->parse_entities + j) &
+					(MAX_PARSE_ENTITIES - 1)].number;
+
+			if (memcmp(&bench_classic[num], &bench_packed[num],
+						sizeof(entity_state_t)))
+			{
+				mismatches++;
+			}
+		}
+
+		frames++;
+		entities += n;
+	}
+
+	if (!entities)
+	{
+		Com_Printf("No consecutive frames buffered.\n");
+		return;
+	}
+
+	Com_Printf("%i frames, %i entities, %i iterations\n",
+			frames, entities, iterations);
+
+	for (codec = 0; codec < 2; codec++)
+	{
+		Com_Printf("%-8s %6.2f bytes/entity  %7.1f ns/entity encode"
+				"  %7.1f ns/entity decode\n", names[codec],
+				(float)bytes[codec] / entities,
+				enc[codec] * 1000.0 / ((double)entities * iterations),
+				dec[codec] * 1000.0 / ((double)entities * iterations));
+	}
+
+	if (mismatches)
+	{
+		Com_Printf("%i entities decoded differently!\n", mismatches);
+	}
+}
+
 void
 CL_ParseServerData(void)
 {
@@ -832,7 +998,7 @@ CL_ParseServerData(void)
 	if (Com_ServerState() && (PROTOCOL_VERSION == 34))
 	{
 	}
-	else if (i != PROTOCOL_VERSION)
+	else if ((i != PROTOCOL_VERSION) && (i != PROTOCOL_PACKEDENTS))
 	{
 		Com_Error(ERR_DROP, "Server returned version %i, not %i",
 				i, PROTOCOL_VERSION);
@@ -1375,6 +1541,17 @@ CL_ParseServerMessage(void)
 				CL_ParseFrame();
 				break;
 
+			case svc_frametime:
+				cl.frametime = MSG_ReadByte(&net_message);
+
+				if ((cl.frametime <= 0) || (cl.frametime > 100))
+				{
+					Com_Error(ERR_DROP, "CL_ParseServerMessage: bad frametime %i\n",
+							cl.frametime);
+				}
+
+				break;
+
 			case svc_inventory:
 				CL_ParseInventory();
 				break;
@@ -33,7 +33,7 @@
 /* the cl_parse_entities must be large enough to hold UPDATE_BACKUP frames of
    entities, so that when a delta compressed message arives from the server
    it can be un-deltad from the original */
-#define	MAX_PARSE_ENTITIES	1024
+#define	MAX_PARSE_ENTITIES	16384
 
 #define MAX_SUSTAINS		32
 #define	PARTICLE_GRAVITY 40
@@ -81,6 +81,9 @@ typedef struct
 	vec3_t		lerp_origin; /* for trails (variable hz) */
 
 	int			fly_stoptime;
+
+	int			lerptime; /* servertime of the current state */
+	int			lerpmsec; /* msec between the prev and current state */
 } centity_t;
 
 typedef struct
@@ -141,6 +144,7 @@ typedef struct
 
 	int			time; /* this is the time value that the client is rendering at. always <= cls.realtime */
 	float		lerpfrac; /* between oldframe and frame */
+	int			frametime; /* msec between server frames */
 
 	refdef_t	refdef;
 
@@ -224,6 +228,7 @@ typedef struct
 	/* connection information */
 	char		servername[256]; /* name of server from original connect */
 	float		connect_time; /* for connection retransmits */
+	int			connect_start; /* cls.realtime of client_connect */
 
 	int			quakePort; /* a 16 bit value that allows quake servers */
 						   /* to work around address translating routers */
@@ -244,7 +249,7 @@ typedef struct
 	/* demo recording info must be here, so it isn't cleared on level change */
 	qboolean	demorecording;
 	qboolean	demowaiting; /* don't record until a non-delta message is received */
-	FILE		*demofile;
+	asyncfile_t	*demofile;
 } client_static_t;
 
 extern client_static_t	cls;
@@ -268,6 +273,10 @@ extern	cvar_t	*cl_yawspeed;
 extern	cvar_t	*cl_pitchspeed;
 extern	cvar_t	*cl_run;
 extern	cvar_t	*cl_anglespeedkey;
+extern	cvar_t	*cl_compress;
+extern	cvar_t	*cl_packedents;
+extern	cvar_t	*cl_fragment;
+extern	cvar_t	*cl_tickrate;
 extern	cvar_t	*cl_shownet;
 extern	cvar_t	*cl_showmiss;
 extern	cvar_t	*cl_showclamp;
@@ -389,6 +398,7 @@ void CL_WidowSplash (vec3_t org);
 int CL_ParseEntityBits (unsigned *bits);
 void CL_ParseDelta (entity_state_t *from, entity_state_t *to, int number, int bits);
 void CL_ParseFrame (void);
+void CL_DeltaBench_f (void);
 
 void CL_ParseTEnt (void);
 void CL_ParseConfigString (void);
@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Files written in the background. Writes are copied into a ring
+ * buffer, a thread per file drains it to the disk, optionally gzip
+ * compressed. The caller only waits when the ring is full, that is
+ * when the disk falls behind by more than ASYNC_RING_SIZE bytes.
+ * It's used for demo recording, where a slow disk would otherwise
+ * stall the frame.
+ *
+ * "fs_async" lists the open files with the number of bytes queued
+ * and flushed to the disk.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+#ifdef ZIP
+ #include <zlib.h>
+#endif
+
+#define ASYNC_RING_SIZE (1024 * 1024)
+#define ASYNC_OUT_SIZE 65536
+
+/* how long the thread sleeps when there's
+   nothing to write, and the caller when
+   the ring is full */
+#define ASYNC_IDLE_MSEC 5
+#define ASYNC_FULL_MSEC 1
+
+struct asyncfile_s
+{
+	char name[MAX_OSPATH];
+	FILE *f;
+
+	byte *ring;
+
+	/* guarded by mutex, bytes written
+	   by the caller and by the thread */
+	long long queued;
+	long long flushed;
+	qboolean closing;
+	qboolean error;
+
+	void *mutex;
+	void *thread;
+
+	int stalls;
+
+#ifdef ZIP
+	qboolean compress;
+	z_stream zs;
+	byte *out;
+#endif
+
+	struct asyncfile_s *next;
+};
+
+static asyncfile_t *fs_asyncfiles;
+
+/*
+ * Runs in the writer thread, or in the
+ * caller's if no thread was created.
+ */
+static qboolean
+FS_AsyncOutput(asyncfile_t *af, byte *data, int size, qboolean finish)
+{
+#ifdef ZIP
+	int ret;
+
+	if (af->compress)
+	{
+		af->zs.next_in = data;
+		af->zs.avail_in = size;
+
+		do
+		{
+			af->zs.next_out = af->out;
+			af->zs.avail_out = ASYNC_OUT_SIZE;
+
+			ret = deflate(&af->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+
+			if (ret == Z_STREAM_ERROR)
+			{
+				return false;
+			}
+
+			size = ASYNC_OUT_SIZE - af->zs.avail_out;
+
+			if (size && (fwrite(af->out, size, 1, af->f) != 1))
+			{
+				return false;
+			}
+		}
+		while (af->zs.avail_out == 0 || (finish && ret != Z_STREAM_END));
+
+		return true;
+	}
+#endif
+
+	if (!size)
+	{
+		return true;
+	}
+
+	return fwrite(data, size, 1, af->f) == 1;
+}
+
+/*
+ * Writes everything queued so far. Returns
+ * false if there was nothing to write.
+ */
+static qboolean
+FS_AsyncDrain(asyncfile_t *af)
+{
+	long long queued, flushed;
+	int offset, size;
+	qboolean error;
+
+	Sys_LockMutex(af->mutex);
+	queued = af->queued;
+	flushed = af->flushed;
+	error = af->error;
+	Sys_UnlockMutex(af->mutex);
+
+	if (queued == flushed)
+	{
+		return false;
+	}
+
+	while (flushed < queued)
+	{
+		offset = (int)(flushed % ASYNC_RING_SIZE);
+		size = (int)(queued - flushed);
+
+		if (size > ASYNC_RING_SIZE - offset)
+		{
+			size = ASYNC_RING_SIZE - offset;
+		}
+
+		/* after an error the data is thrown away,
+		   the caller mustn't block on a full ring */
+		if (!error && !FS_AsyncOutput(af, af->ring + offset, size, false))
+		{
+			error = true;
+		}
+
+		flushed += size;
+	}
+
+	Sys_LockMutex(af->mutex);
+	af->flushed = flushed;
+	af->error = error;
+	Sys_UnlockMutex(af->mutex);
+
+	return true;
+}
+
+static void
+FS_AsyncThread(void *arg)
+{
+	asyncfile_t *af = arg;
+	qboolean closing;
+
+	while (1)
+	{
+		if (FS_AsyncDrain(af))
+		{
+			continue;
+		}
+
+		Sys_LockMutex(af->mutex);
+		closing = af->closing;
+		Sys_UnlockMutex(af->mutex);
+
+		if (closing)
+		{
+			/* a last drain, the caller may have
+			   written just before closing */
+			FS_AsyncDrain(af);
+			break;
+		}
+
+		Sys_Sleep(ASYNC_IDLE_MSEC);
+	}
+}
+
+/*
+ * Opens path for writing in the background. With compress
+ * set and ZIP support compiled in the file is written gzip
+ * compressed and ".gz" is appended to its name. Returns NULL
+ * if the file couldn't be opened.
+ */
+asyncfile_t *
+FS_OpenAsync(const char *path, qboolean compress)
+{
+	asyncfile_t *af;
+	qboolean failed;
+
+	af = malloc(sizeof(*af));
+
+	if (!af)
+	{
+		return NULL;
+	}
+
+	memset(af, 0, sizeof(*af));
+	Q_strlcpy(af->name, path, sizeof(af->name));
+
+#ifdef ZIP
+	if (compress)
+	{
+		/* a window of 15 bits plus 16 for a gzip header */
+		if (deflateInit2(&af->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+					15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(af);
+			return NULL;
+		}
+
+		af->compress = true;
+		Q_strlcat(af->name, ".gz", sizeof(af->name));
+	}
+#endif
+
+	af->f = fopen(af->name, "wb");
+	af->ring = malloc(ASYNC_RING_SIZE);
+	af->mutex = Sys_CreateMutex();
+	failed = !af->f || !af->ring || !af->mutex;
+
+#ifdef ZIP
+	if (af->compress)
+	{
+		af->out = malloc(ASYNC_OUT_SIZE);
+		failed |= !af->out;
+	}
+#endif
+
+	if (failed)
+	{
+		if (af->f)
+		{
+			fclose(af->f);
+		}
+
+		if (af->mutex)
+		{
+			Sys_DestroyMutex(af->mutex);
+		}
+
+#ifdef ZIP
+		if (af->compress)
+		{
+			deflateEnd(&af->zs);
+			free(af->out);
+		}
+#endif
+
+		free(af->ring);
+		free(af);
+		return NULL;
+	}
+
+	/* without a thread the
+	   caller writes the data */
+	af->thread = Sys_CreateThread(FS_AsyncThread, af);
+
+	af->next = fs_asyncfiles;
+	fs_asyncfiles = af;
+
+	return af;
+}
+
+void
+FS_WriteAsync(asyncfile_t *af, const void *buffer, int size)
+{
+	const byte *data = buffer;
+	long long queued, flushed;
+	int offset, len;
+
+	while (size > 0)
+	{
+		Sys_LockMutex(af->mutex);
+		queued = af->queued;
+		flushed = af->flushed;
+		Sys_UnlockMutex(af->mutex);
+
+		if (queued - flushed == ASYNC_RING_SIZE)
+		{
+			/* the disk is behind */
+			af->stalls++;
+			Sys_Sleep(ASYNC_FULL_MSEC);
+			continue;
+		}
+
+		offset = (int)(queued % ASYNC_RING_SIZE);
+		len = ASYNC_RING_SIZE - (int)(queued - flushed);
+
+		if (len > ASYNC_RING_SIZE - offset)
+		{
+			len = ASYNC_RING_SIZE - offset;
+		}
+
+		if (len > size)
+		{
+			len = size;
+		}
+
+		memcpy(af->ring + offset, data, len);
+
+		Sys_LockMutex(af->mutex);
+		af->queued += len;
+		Sys_UnlockMutex(af->mutex);
+
+		data += len;
+		size -= len;
+
+		if (!af->thread)
+		{
+			FS_AsyncDrain(af);
+		}
+	}
+}
+
+/*
+ * Writes the remaining data and closes the file.
+ * Returns false if any data couldn't be written.
+ */
+qboolean
+FS_CloseAsync(asyncfile_t *af)
+{
+	asyncfile_t **prev;
+	qboolean ok;
+
+	if (af->thread)
+	{
+		Sys_LockMutex(af->mutex);
+		af->closing = true;
+		Sys_UnlockMutex(af->mutex);
+
+		Sys_WaitThread(af->thread);
+	}
+	else
+	{
+		FS_AsyncDrain(af);
+	}
+
+	ok = !af->error;
+
+#ifdef ZIP
+	if (af->compress)
+	{
+		if (ok && !FS_AsyncOutput(af, NULL, 0, true))
+		{
+			ok = false;
+		}
+
+		deflateEnd(&af->zs);
+		free(af->out);
+	}
+#endif
+
+	if (fclose(af->f) != 0)
+	{
+		ok = false;
+	}
+
+	if (!ok)
+	{
+		Com_Printf("Couldn't write %s\n", af->name);
+	}
+
+	Com_DPrintf("%s: %lli bytes, waited %i times for the disk\n",
+			af->name, af->flushed, af->stalls);
+
+	for (prev = &fs_asyncfiles; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == af)
+		{
+			*prev = af->next;
+			break;
+		}
+	}
+
+	Sys_DestroyMutex(af->mutex);
+	free(af->ring);
+	free(af);
+
+	return ok;
+}
+
+char *
+FS_AsyncName(asyncfile_t *af)
+{
+	return af->name;
+}
+
+/*
+ * fs_async
+ */
+void
+FS_Async_f(void)
+{
+	long long queued, flushed;
+	asyncfile_t *af;
+
+	if (!fs_asyncfiles)
+	{
+		Com_Printf("No files are written in the background.\n");
+		return;
+	}
+
+	for (af = fs_asyncfiles; af; af = af->next)
+	{
+		Sys_LockMutex(af->mutex);
+		queued = af->queued;
+		flushed = af->flushed;
+		Sys_UnlockMutex(af->mutex);
+
+		Com_Printf("%s\n", af->name);
+		Com_Printf("  %lli bytes queued, %lli flushed, %lli pending\n",
+				queued, flushed, queued - flushed);
+		Com_Printf("  waited %i times for the disk%s\n", af->stalls,
+				af->thread ? "" : ", no writer thread");
+	}
+}
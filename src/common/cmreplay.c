@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Capture and replay of collision queries. With "cm_capture <name>"
+ * set, every CM_BoxTrace(), CM_TransformedBoxTrace(), CM_PointContents(),
+ * CM_TransformedPointContents(), CM_BoxLeafnums() and CM_HeadnodeForBox()
+ * call is written to captures/<name>.cmq, with its result. The capture
+ * ends with the map or when the cvar is cleared.
+ *
+ * "cm_replay <name> [rounds]" loads the map of a capture through
+ * CM_LoadMap() alone and runs the queries again, as fast as possible.
+ * It prints the queries per second and the latency percentiles, and
+ * checks that the results are still the same. Run by the dedicated
+ * server without a map, "q2ded +cm_replay <name> +quit", nothing but
+ * the collision code is involved.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+extern int numleafs;
+extern int numnodes;
+
+#define CAPTURE_IDENT (('Q' << 24) + ('M' << 16) + ('C' << 8) + 'Y')
+#define CAPTURE_VERSION 2
+
+typedef enum
+{
+	CMQ_TRACE,
+	CMQ_TRANSFORMEDTRACE,
+	CMQ_CONTENTS,
+	CMQ_TRANSFORMEDCONTENTS,
+	CMQ_LEAFNUMS,
+	CMQ_BOX,
+	CMQ_TYPES
+} cmquerytype_t;
+
+typedef struct
+{
+	int ident;
+	int version;
+	char map[MAX_QPATH];
+	unsigned checksum;
+} cmcapture_t;
+
+/* The same for every type, most of
+   it is unused by everything but traces */
+typedef struct
+{
+	int type;
+	int headnode;
+	int brushmask;                      /* listsize for CMQ_LEAFNUMS */
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t origin, angles;
+
+	/* what came out */
+	float fraction;
+	int result;                         /* contents, count or headnode */
+	int topnode;
+	vec3_t endpos;
+	vec3_t normal;
+	float dist;
+	int startsolid, allsolid;
+} cmquery_t;
+
+static const char *cmq_names[CMQ_TYPES] = {
+	"CM_BoxTrace",
+	"CM_TransformedBoxTrace",
+	"CM_PointContents",
+	"CM_TransformedPointContents",
+	"CM_BoxLeafnums",
+	"CM_HeadnodeForBox"
+};
+
+qboolean cm_capturing;
+static asyncfile_t *cm_capturefile;
+static int cm_capturecount;
+
+void
+CM_StopCapture(void)
+{
+	if (!cm_capturing)
+	{
+		return;
+	}
+
+	cm_capturing = false;
+
+	if (FS_CloseAsync(cm_capturefile))
+	{
+		Com_Printf("Captured %i collision queries.\n", cm_capturecount);
+	}
+
+	cm_capturefile = NULL;
+
+	/* the next map needs it set again */
+	Cvar_Set("cm_capture", "");
+}
+
+/*
+ * Starts capturing to captures/<name>.cmq,
+ * an empty name stops.
+ */
+void
+CM_Capture(char *name)
+{
+	char path[MAX_OSPATH];
+	cmcapture_t header;
+	char *map;
+
+	CM_StopCapture();
+
+	if (!name[0])
+	{
+		return;
+	}
+
+	if (strstr(name, "..") || strstr(name, "/") || strstr(name, "\\"))
+	{
+		Com_Printf("cm_capture: Illegal name.\n");
+		Cvar_Set("cm_capture", "");
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	map = CM_MapName(&header.checksum);
+
+	if (!map[0])
+	{
+		Com_Printf("cm_capture: No map loaded.\n");
+		Cvar_Set("cm_capture", "");
+		return;
+	}
+
+	Com_sprintf(path, sizeof(path), "%s/captures/%s.cmq", FS_Gamedir(), name);
+	FS_CreatePath(path);
+
+	cm_capturefile = FS_OpenAsync(path, false);
+
+	if (!cm_capturefile)
+	{
+		Com_Printf("cm_capture: Couldn't open %s.\n", path);
+		Cvar_Set("cm_capture", "");
+		return;
+	}
+
+	header.ident = CAPTURE_IDENT;
+	header.version = CAPTURE_VERSION;
+	Q_strlcpy(header.map, map, sizeof(header.map));
+	FS_WriteAsync(cm_capturefile, &header, sizeof(header));
+
+	cm_capturing = true;
+	cm_capturecount = 0;
+
+	Com_Printf("Capturing collision queries to %s.\n", path);
+}
+
+static void
+CM_CaptureQuery(cmquery_t *q)
+{
+	FS_WriteAsync(cm_capturefile, q, sizeof(*q));
+	cm_capturecount++;
+}
+
+void
+CM_CaptureTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask, vec3_t origin, vec3_t angles,
+		trace_t *trace)
+{
+	cmquery_t q;
+
+	memset(&q, 0, sizeof(q));
+	q.type = origin ? CMQ_TRANSFORMEDTRACE : CMQ_TRACE;
+	q.headnode = headnode;
+	q.brushmask = brushmask;
+	VectorCopy(start, q.start);
+	VectorCopy(end, q.end);
+	VectorCopy(mins, q.mins);
+	VectorCopy(maxs, q.maxs);
+
+	if (origin)
+	{
+		VectorCopy(origin, q.origin);
+		VectorCopy(angles, q.angles);
+	}
+
+	q.fraction = trace->fraction;
+	q.result = trace->contents;
+	VectorCopy(trace->endpos, q.endpos);
+	VectorCopy(trace->plane.normal, q.normal);
+	q.dist = trace->plane.dist;
+	q.startsolid = trace->startsolid;
+	q.allsolid = trace->allsolid;
+
+	CM_CaptureQuery(&q);
+}
+
+void
+CM_CaptureContents(vec3_t p, int headnode, vec3_t origin, vec3_t angles,
+		int contents)
+{
+	cmquery_t q;
+
+	memset(&q, 0, sizeof(q));
+	q.type = origin ? CMQ_TRANSFORMEDCONTENTS : CMQ_CONTENTS;
+	q.headnode = headnode;
+	VectorCopy(p, q.start);
+
+	if (origin)
+	{
+		VectorCopy(origin, q.origin);
+		VectorCopy(angles, q.angles);
+	}
+
+	q.result = contents;
+
+	CM_CaptureQuery(&q);
+}
+
+void
+CM_CaptureLeafnums(vec3_t mins, vec3_t maxs, int listsize,
+		int count, int topnode)
+{
+	cmquery_t q;
+
+	memset(&q, 0, sizeof(q));
+	q.type = CMQ_LEAFNUMS;
+	q.brushmask = listsize;
+	VectorCopy(mins, q.mins);
+	VectorCopy(maxs, q.maxs);
+	q.result = count;
+	q.topnode = topnode;
+
+	CM_CaptureQuery(&q);
+}
+
+void
+CM_CaptureBox(vec3_t mins, vec3_t maxs, int headnode)
+{
+	cmquery_t q;
+
+	memset(&q, 0, sizeof(q));
+	q.type = CMQ_BOX;
+	VectorCopy(mins, q.mins);
+	VectorCopy(maxs, q.maxs);
+	q.result = headnode;
+
+	CM_CaptureQuery(&q);
+}
+
+static qboolean
+CM_ReplayTrace(trace_t *trace, cmquery_t *q)
+{
+	return (trace->fraction == q->fraction) &&
+		   (trace->contents == q->result) &&
+		   VectorCompare(trace->endpos, q->endpos) &&
+		   VectorCompare(trace->plane.normal, q->normal) &&
+		   (trace->plane.dist == q->dist) &&
+		   (trace->startsolid == q->startsolid) &&
+		   (trace->allsolid == q->allsolid);
+}
+
+/*
+ * Runs a query, returns true if
+ * the result is the captured one.
+ */
+static qboolean
+CM_ReplayQuery(cmtrace_t *ctx, cmquery_t *q, int *leafs)
+{
+	trace_t trace;
+	int result, topnode;
+
+	switch (q->type)
+	{
+		case CMQ_TRACE:
+			trace = CM_BoxTrace_r(ctx, q->start, q->end, q->mins, q->maxs,
+					q->headnode, q->brushmask);
+			return CM_ReplayTrace(&trace, q);
+
+		case CMQ_TRANSFORMEDTRACE:
+			trace = CM_TransformedBoxTrace_r(ctx, q->start, q->end, q->mins,
+					q->maxs, q->headnode, q->brushmask, q->origin, q->angles);
+			return CM_ReplayTrace(&trace, q);
+
+		case CMQ_CONTENTS:
+			result = CM_PointContents_r(ctx, q->start, q->headnode);
+			return result == q->result;
+
+		case CMQ_TRANSFORMEDCONTENTS:
+			result = CM_TransformedPointContents_r(ctx, q->start, q->headnode,
+					q->origin, q->angles);
+			return result == q->result;
+
+		case CMQ_LEAFNUMS:
+			result = CM_BoxLeafnums(q->mins, q->maxs, leafs, q->brushmask,
+					&topnode);
+			return (result == q->result) && (topnode == q->topnode);
+
+		default:
+			result = CM_HeadnodeForBox_r(ctx, q->mins, q->maxs);
+			return result == q->result;
+	}
+}
+
+static int
+CM_ReplayCompare(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+CM_ReplayPercentiles(const char *name, int *times, int count)
+{
+	long long total;
+	int i;
+
+	if (!count)
+	{
+		return;
+	}
+
+	qsort(times, count, sizeof(int), CM_ReplayCompare);
+
+	total = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		total += times[i];
+	}
+
+	Com_Printf("%-27s %9i %7.2f %7.2f %7.2f %7.2f %8.2f\n", name, count,
+			total / 1000.0 / count, times[count / 2] / 1000.0,
+			times[count * 9 / 10] / 1000.0, times[count * 99 / 100] / 1000.0,
+			times[count - 1] / 1000.0);
+}
+
+/*
+ * cm_replay <name> [rounds]
+ */
+void
+CM_Replay_f(void)
+{
+	char path[MAX_QPATH];
+	cmcapture_t *header;
+	cmquery_t *queries;
+	cmtrace_t *ctx;
+	int *times, *typetimes, *leafs;
+	long long start, best, time;
+	unsigned checksum;
+	int len, count, rounds, mismatches;
+	int i, r, t, n;
+	byte *buf;
+
+	if ((Cmd_Argc() < 2) || (Cmd_Argc() > 3))
+	{
+		Com_Printf("Usage: cm_replay <name> [rounds]\n");
+		return;
+	}
+
+	rounds = (Cmd_Argc() > 2) ? (int)strtol(Cmd_Argv(2), (char **)NULL, 10) : 5;
+
+	if (rounds < 1)
+	{
+		Com_Printf("Usage: cm_replay <name> [rounds]\n");
+		return;
+	}
+
+	if (cm_capturing)
+	{
+		Com_Printf("Stop the capture first.\n");
+		return;
+	}
+
+	Com_sprintf(path, sizeof(path), "captures/%s.cmq", Cmd_Argv(1));
+	len = FS_LoadFile(path, (void **)&buf);
+
+	if (!buf)
+	{
+		Com_Printf("Couldn't load %s.\n", path);
+		return;
+	}
+
+	header = (cmcapture_t *)buf;
+
+	if ((len < sizeof(cmcapture_t)) || (header->ident != CAPTURE_IDENT) ||
+		(header->version != CAPTURE_VERSION))
+	{
+		Com_Printf("%s isn't a capture of this version.\n", path);
+		FS_FreeFile(buf);
+		return;
+	}
+
+	header->map[sizeof(header->map) - 1] = 0;
+
+	/* the server's map mustn't be replaced */
+	if (Com_ServerState() && strcmp(CM_MapName(&checksum), header->map))
+	{
+		Com_Printf("%s is of %s, kill the server first.\n", path, header->map);
+		FS_FreeFile(buf);
+		return;
+	}
+
+#ifndef DEDICATED_ONLY
+	/* neither the map the client got from a server */
+	if (!Com_ServerState() && CL_Connected())
+	{
+		Com_Printf("Disconnect before replaying %s.\n", path);
+		FS_FreeFile(buf);
+		return;
+	}
+#endif
+
+	/* as a client, so a running server's
+	   area portals stay as they are */
+	CM_LoadMap(header->map, true, &checksum);
+
+	if (checksum != header->checksum)
+	{
+		Com_Printf("WARNING: %s has changed since the capture.\n", header->map);
+	}
+
+	queries = (cmquery_t *)(buf + sizeof(cmcapture_t));
+	count = (len - sizeof(cmcapture_t)) / sizeof(cmquery_t);
+
+	if (!count)
+	{
+		Com_Printf("%s is empty.\n", path);
+		FS_FreeFile(buf);
+		return;
+	}
+
+	/* the capture is a file like any other, the
+	   nodes include the six of the box hull and
+	   the leafs the box leaf */
+	for (i = 0; i < count; i++)
+	{
+		if ((queries[i].type < 0) || (queries[i].type >= CMQ_TYPES) ||
+			(queries[i].headnode < -1 - numleafs) ||
+			(queries[i].headnode >= numnodes + 6) ||
+			((queries[i].type == CMQ_LEAFNUMS) &&
+			 (queries[i].brushmask < 0)))
+		{
+			Com_Printf("%s is broken at query %i.\n", path, i);
+			FS_FreeFile(buf);
+			return;
+		}
+
+		if ((queries[i].type == CMQ_LEAFNUMS) &&
+			(queries[i].brushmask > MAX_MAP_LEAFS))
+		{
+			queries[i].brushmask = MAX_MAP_LEAFS;
+		}
+	}
+
+	ctx = Z_Malloc(sizeof(cmtrace_t));
+	CM_InitTrace(ctx);
+
+	leafs = Z_Malloc(MAX_MAP_LEAFS * sizeof(int));
+
+	/* first the throughput, then once more with
+	   each query timed for the latencies */
+	mismatches = 0;
+	best = 0;
+
+	for (r = 0; r < rounds; r++)
+	{
+		start = Sys_Nanoseconds();
+
+		for (i = 0; i < count; i++)
+		{
+			if (!CM_ReplayQuery(ctx, &queries[i], leafs) && !r)
+			{
+				mismatches++;
+			}
+		}
+
+		time = Sys_Nanoseconds() - start;
+
+		if (!r || (time < best))
+		{
+			best = time;
+		}
+	}
+
+	times = Z_Malloc(count * sizeof(int));
+	typetimes = Z_Malloc(count * sizeof(int));
+
+	for (i = 0; i < count; i++)
+	{
+		start = Sys_Nanoseconds();
+		CM_ReplayQuery(ctx, &queries[i], leafs);
+		times[i] = (int)(Sys_Nanoseconds() - start);
+	}
+
+	Com_Printf("%s: %i queries on %s, best of %i rounds\n", path, count,
+			header->map, rounds);
+	Com_Printf("%.0f queries per second, %.2f ms per round\n",
+			count / (best / 1000000000.0), best / 1000000.0);
+	Com_Printf("query                           count  avg us  p50 us  p90 us"
+			"  p99 us   max us\n");
+	Com_Printf("--------------------------- --------- ------- ------- -------"
+			" ------- --------\n");
+
+	for (t = 0; t < CMQ_TYPES; t++)
+	{
+		n = 0;
+
+		for (i = 0; i < count; i++)
+		{
+			if (queries[i].type == t)
+			{
+				typetimes[n++] = times[i];
+			}
+		}
+
+		CM_ReplayPercentiles(cmq_names[t], typetimes, n);
+	}
+
+	CM_ReplayPercentiles("all", times, count);
+
+	if (mismatches)
+	{
+		Com_Printf("%i results differ from the capture.\n", mismatches);
+	}
+	else
+	{
+		Com_Printf("All results match the capture.\n");
+	}
+
+	Z_Free(leafs);
+	Z_Free(typetimes);
+	Z_Free(times);
+	Z_Free(ctx);
+	FS_FreeFile(buf);
+}
@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Stress test for the reentrant collision functions. A set of random
+ * traces through the loaded map is run once with the functions without
+ * a context, as reference, and then by several threads at the same
+ * time, each with its own context and starting at a different trace.
+ * Every result has to match the reference.
+ *
+ * cm_simdtest runs the same kind of traces with the SIMD brush clipping
+ * and without, checks that the results are bit for bit the same and
+ * compares the time.
+ *
+ * cm_bench times CM_BoxTrace() and CM_PointContents() through the
+ * world alone, the latter with and without the leaf grid.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+#define STRESS_MAX_THREADS 64
+
+typedef struct
+{
+	vec3_t start, end;
+	vec3_t mins, maxs;
+
+	/* a submodel or the box hull is moved
+	   and rotated, the world isn't */
+	vec3_t origin, angles;
+	vec3_t boxmins, boxmaxs;
+	int headnode; /* -1 for the box hull */
+	int brushmask;
+
+	/* the reference */
+	trace_t trace;
+	int contents;
+	int cluster;
+	unsigned pvs;
+} stresstrace_t;
+
+typedef struct
+{
+	stresstrace_t *traces;
+	int count;
+	int first;
+	int rounds;
+	cmtrace_t *ctx;
+	byte pvs[MAX_MAP_LEAFS / 8];
+	int mismatches;
+} stressthread_t;
+
+static unsigned
+CM_StressRandom(unsigned *state)
+{
+	/* xorshift, randk() is the game's */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static float
+CM_StressRange(unsigned *state, float min, float max)
+{
+	return min + (max - min) * (CM_StressRandom(state) & 0xffff) / 65535.0f;
+}
+
+static unsigned
+CM_StressHashRow(const byte *row)
+{
+	unsigned hash;
+	int i;
+
+	hash = 2166136261u;
+
+	for (i = 0; i < (CM_NumClusters() + 7) >> 3; i++)
+	{
+		hash = (hash ^ row[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static qboolean
+CM_StressMatch(trace_t *a, trace_t *b)
+{
+	return (a->allsolid == b->allsolid) && (a->startsolid == b->startsolid) &&
+		(a->fraction == b->fraction) && VectorCompare(a->endpos, b->endpos) &&
+		VectorCompare(a->plane.normal, b->plane.normal) &&
+		(a->plane.dist == b->plane.dist) && (a->surface == b->surface) &&
+		(a->contents == b->contents);
+}
+
+#ifdef CM_SIMD
+static qboolean
+CM_StressIdentical(trace_t *a, trace_t *b)
+{
+	return (a->allsolid == b->allsolid) && (a->startsolid == b->startsolid) &&
+		!memcmp(&a->fraction, &b->fraction, sizeof(float)) &&
+		!memcmp(a->endpos, b->endpos, sizeof(vec3_t)) &&
+		!memcmp(a->plane.normal, b->plane.normal, sizeof(vec3_t)) &&
+		!memcmp(&a->plane.dist, &b->plane.dist, sizeof(float)) &&
+		(a->surface == b->surface) && (a->contents == b->contents);
+}
+#endif
+
+/*
+ * Random traces starting inside the map. Everything
+ * outside of it is solid, so that's easy to find out.
+ */
+static int
+CM_StressFill(stresstrace_t *traces, int count)
+{
+	static const int masks[] = {
+		MASK_PLAYERSOLID, MASK_MONSTERSOLID, MASK_SHOT, MASK_SOLID,
+		MASK_OPAQUE, MASK_WATER
+	};
+	unsigned state;
+	stresstrace_t *st;
+	int submodels;
+	int i, j, tries;
+
+	state = 0x2545f491;
+	submodels = CM_NumInlineModels();
+
+	for (i = 0; i < count; i++)
+	{
+		st = &traces[i];
+		memset(st, 0, sizeof(*st));
+
+		for (tries = 0; tries < 10000; tries++)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				st->start[j] = CM_StressRange(&state, -4096, 4096);
+			}
+
+			if (!(CM_PointContents(st->start, 0) & CONTENTS_SOLID))
+			{
+				break;
+			}
+		}
+
+		if (tries == 10000)
+		{
+			return i;
+		}
+
+		/* every 8th is a position test */
+		if (CM_StressRandom(&state) % 8)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				st->end[j] = st->start[j] +
+					CM_StressRange(&state, -1024, 1024);
+			}
+		}
+		else
+		{
+			VectorCopy(st->start, st->end);
+		}
+
+		switch (CM_StressRandom(&state) % 3)
+		{
+			case 0:
+				break; /* a point */
+
+			case 1:
+				VectorSet(st->mins, -16, -16, -24);
+				VectorSet(st->maxs, 16, 16, 32);
+				break;
+
+			default:
+				for (j = 0; j < 3; j++)
+				{
+					st->mins[j] = -CM_StressRange(&state, 0, 32);
+					st->maxs[j] = CM_StressRange(&state, 0, 32);
+				}
+
+				break;
+		}
+
+		st->brushmask = masks[CM_StressRandom(&state) %
+			(sizeof(masks) / sizeof(masks[0]))];
+
+		switch (CM_StressRandom(&state) % 8)
+		{
+			case 0:
+				/* a box hull right in the way */
+				st->headnode = -1;
+
+				for (j = 0; j < 3; j++)
+				{
+					st->boxmins[j] = -CM_StressRange(&state, 8, 64);
+					st->boxmaxs[j] = CM_StressRange(&state, 8, 64);
+					st->origin[j] = st->start[j] + CM_StressRange(&state,
+							0, 1) * (st->end[j] - st->start[j]);
+				}
+
+				st->brushmask |= CONTENTS_MONSTER;
+				break;
+
+			case 1:
+				if (submodels > 1)
+				{
+					st->headnode = CM_InlineModel(va("*%i", 1 +
+								CM_StressRandom(&state) %
+								(submodels - 1)))->headnode;
+
+					for (j = 0; j < 3; j++)
+					{
+						st->origin[j] = CM_StressRange(&state, -64, 64);
+						st->angles[j] = CM_StressRange(&state, 0, 360);
+					}
+				}
+
+				break;
+
+			default:
+				break; /* the world */
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Runs a trace, with ctx or with
+ * the functions without one.
+ */
+static trace_t
+CM_StressTrace(cmtrace_t *ctx, stresstrace_t *st, int *contents)
+{
+	trace_t trace;
+	int headnode;
+
+	headnode = st->headnode;
+
+	if (ctx)
+	{
+		if (headnode == -1)
+		{
+			headnode = CM_HeadnodeForBox_r(ctx, st->boxmins, st->boxmaxs);
+		}
+
+		trace = CM_TransformedBoxTrace_r(ctx, st->start, st->end, st->mins,
+				st->maxs, headnode, st->brushmask, st->origin, st->angles);
+		*contents = CM_TransformedPointContents_r(ctx, st->end, headnode,
+				st->origin, st->angles);
+	}
+	else
+	{
+		if (headnode == -1)
+		{
+			headnode = CM_HeadnodeForBox(st->boxmins, st->boxmaxs);
+		}
+
+		trace = CM_TransformedBoxTrace(st->start, st->end, st->mins,
+				st->maxs, headnode, st->brushmask, st->origin, st->angles);
+		*contents = CM_TransformedPointContents(st->end, headnode,
+				st->origin, st->angles);
+	}
+
+	return trace;
+}
+
+static void
+CM_StressThread(void *arg)
+{
+	stressthread_t *t = arg;
+	stresstrace_t *st;
+	trace_t trace;
+	int contents;
+	int i, r;
+
+	for (r = 0; r < t->rounds; r++)
+	{
+		for (i = 0; i < t->count; i++)
+		{
+			st = &t->traces[(t->first + i) % t->count];
+
+			trace = CM_StressTrace(t->ctx, st, &contents);
+
+			if (!CM_StressMatch(&trace, &st->trace) ||
+				(contents != st->contents) ||
+				(CM_StressHashRow(CM_ClusterPVS_r(st->cluster,
+					t->pvs)) != st->pvs))
+			{
+				t->mismatches++;
+			}
+		}
+	}
+}
+
+/*
+ * cm_stress [threads] [traces] [rounds]
+ */
+void
+CM_Stress_f(void)
+{
+	stressthread_t *threads;
+	stresstrace_t *traces;
+	void *handles[STRESS_MAX_THREADS];
+	long long start, reftime, time;
+	int numthreads, count, rounds;
+	int mismatches, inplace;
+	int i;
+
+	numthreads = 4;
+	count = 20000;
+	rounds = 5;
+
+	if (Cmd_Argc() > 1)
+	{
+		numthreads = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+	}
+
+	if (Cmd_Argc() > 2)
+	{
+		count = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
+	}
+
+	if (Cmd_Argc() > 3)
+	{
+		rounds = (int)strtol(Cmd_Argv(3), (char **)NULL, 10);
+	}
+
+	if ((numthreads < 1) || (numthreads > STRESS_MAX_THREADS) ||
+		(count < 1) || (rounds < 1))
+	{
+		Com_Printf("Usage: cm_stress [threads] [traces] [rounds]\n");
+		return;
+	}
+
+	if (!CM_NumInlineModels())
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	traces = Z_Malloc(count * sizeof(stresstrace_t));
+	count = CM_StressFill(traces, count);
+
+	if (!count)
+	{
+		Com_Printf("Couldn't find a place inside the map.\n");
+		Z_Free(traces);
+		return;
+	}
+
+	threads = Z_Malloc(numthreads * sizeof(stressthread_t));
+
+	/* the reference */
+	start = Sys_Nanoseconds();
+
+	for (i = 0; i < count; i++)
+	{
+		traces[i].trace = CM_StressTrace(NULL, &traces[i], &traces[i].contents);
+		traces[i].cluster = CM_LeafCluster(CM_PointLeafnum(traces[i].start));
+		traces[i].pvs = CM_StressHashRow(CM_ClusterPVS(traces[i].cluster));
+	}
+
+	reftime = Sys_Nanoseconds() - start;
+
+	for (i = 0; i < numthreads; i++)
+	{
+		threads[i].traces = traces;
+		threads[i].count = count;
+		threads[i].first = (int)((long long)count * i / numthreads);
+		threads[i].rounds = rounds;
+		threads[i].ctx = Z_Malloc(sizeof(cmtrace_t));
+
+		CM_InitTrace(threads[i].ctx);
+	}
+
+	inplace = 0;
+	start = Sys_Nanoseconds();
+
+	for (i = 0; i < numthreads; i++)
+	{
+		handles[i] = Sys_CreateThread(CM_StressThread, &threads[i]);
+
+		if (!handles[i])
+		{
+			CM_StressThread(&threads[i]);
+			inplace++;
+		}
+	}
+
+	for (i = 0; i < numthreads; i++)
+	{
+		if (handles[i])
+		{
+			Sys_WaitThread(handles[i]);
+		}
+	}
+
+	time = Sys_Nanoseconds() - start;
+
+	mismatches = 0;
+
+	for (i = 0; i < numthreads; i++)
+	{
+		mismatches += threads[i].mismatches;
+		Z_Free(threads[i].ctx);
+	}
+
+	Com_Printf("%i traces, %i threads, %i rounds\n", count, numthreads, rounds);
+	Com_Printf("reference: %.0f traces per second\n",
+			count * 1000000000.0 / (reftime ? reftime : 1));
+	Com_Printf("threads:   %.0f traces per second\n",
+			(double)count * rounds * numthreads * 1000000000.0 /
+			(time ? time : 1));
+
+	if (inplace)
+	{
+		Com_Printf("%i threads couldn't be created and ran in place.\n",
+				inplace);
+	}
+
+	if (mismatches)
+	{
+		Com_Printf("FAILED, %i of %i results differ.\n", mismatches,
+				count * rounds * numthreads);
+	}
+	else
+	{
+		Com_Printf("Passed, all %i results match.\n",
+				count * rounds * numthreads);
+	}
+
+	Z_Free(threads);
+	Z_Free(traces);
+}
+
+/*
+ * cm_simdtest [traces] [rounds]
+ */
+void
+CM_SIMDTest_f(void)
+{
+#ifdef CM_SIMD
+	stresstrace_t *traces;
+	trace_t *results;
+	int *contents;
+	long long start, time[2];
+	int count, rounds, differ;
+	int simd, i, r;
+	float old;
+
+	count = 100000;
+	rounds = 5;
+
+	if (Cmd_Argc() > 1)
+	{
+		count = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+	}
+
+	if (Cmd_Argc() > 2)
+	{
+		rounds = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
+	}
+
+	if ((count < 1) || (rounds < 1))
+	{
+		Com_Printf("Usage: cm_simdtest [traces] [rounds]\n");
+		return;
+	}
+
+	if (!CM_NumInlineModels())
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	traces = Z_Malloc(count * sizeof(stresstrace_t));
+	count = CM_StressFill(traces, count);
+
+	if (!count)
+	{
+		Com_Printf("Couldn't find a place inside the map.\n");
+		Z_Free(traces);
+		return;
+	}
+
+	results = Z_Malloc(count * sizeof(trace_t));
+	contents = Z_Malloc(count * sizeof(int));
+	old = Cvar_VariableValue("map_simd");
+
+	/* the scalar code is the reference */
+	Cvar_SetValue("map_simd", 0);
+
+	for (i = 0; i < count; i++)
+	{
+		traces[i].trace = CM_StressTrace(NULL, &traces[i], &traces[i].contents);
+	}
+
+	time[0] = time[1] = 0;
+	differ = 0;
+
+	/* they take turns, so that neither
+	   of them runs on a cold cache */
+	for (r = 0; r < rounds; r++)
+	{
+		for (simd = 0; simd < 2; simd++)
+		{
+			Cvar_SetValue("map_simd", simd);
+			start = Sys_Nanoseconds();
+
+			for (i = 0; i < count; i++)
+			{
+				results[i] = CM_StressTrace(NULL, &traces[i], &contents[i]);
+			}
+
+			time[simd] += Sys_Nanoseconds() - start;
+
+			for (i = 0; i < count; i++)
+			{
+				if (!CM_StressIdentical(&results[i], &traces[i].trace) ||
+					(contents[i] != traces[i].contents))
+				{
+					differ++;
+				}
+			}
+		}
+	}
+
+	Cvar_SetValue("map_simd", old);
+
+	Com_Printf("%i traces, %i rounds\n", count, rounds);
+	Com_Printf("scalar: %.0f traces per second\n",
+			(double)count * rounds * 1000000000.0 / (time[0] ? time[0] : 1));
+	Com_Printf("SSE2:   %.0f traces per second\n",
+			(double)count * rounds * 1000000000.0 / (time[1] ? time[1] : 1));
+
+	if (differ)
+	{
+		Com_Printf("FAILED, %i of %i results differ.\n", differ,
+				count * rounds * 2);
+	}
+	else
+	{
+		Com_Printf("Passed, all %i results are bit for bit the same.\n",
+				count * rounds * 2);
+	}
+
+	Z_Free(contents);
+	Z_Free(results);
+	Z_Free(traces);
+#else
+	Com_Printf("Brushes are clipped without SIMD in this build.\n");
+#endif
+}
+
+/*
+ * cm_bench [count] [rounds]
+ */
+void
+CM_Bench_f(void)
+{
+	static const char *names[4] = {
+		"CM_BoxTrace, box", "CM_BoxTrace, point", "CM_PointContents",
+		"  without leaf grid"
+	};
+	stresstrace_t *traces;
+	long long start, time[4];
+	float fraction, grid;
+	int count, rounds, contents, differ;
+	int i, r, t;
+
+	count = 100000;
+	rounds = 5;
+
+	if (Cmd_Argc() > 1)
+	{
+		count = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+	}
+
+	if (Cmd_Argc() > 2)
+	{
+		rounds = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
+	}
+
+	if ((count < 1) || (rounds < 1))
+	{
+		Com_Printf("Usage: cm_bench [count] [rounds]\n");
+		return;
+	}
+
+	if (!CM_NumInlineModels())
+	{
+		Com_Printf("No map loaded.\n");
+		return;
+	}
+
+	traces = Z_Malloc(count * sizeof(stresstrace_t));
+	count = CM_StressFill(traces, count);
+
+	if (!count)
+	{
+		Com_Printf("Couldn't find a place inside the map.\n");
+		Z_Free(traces);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		/* a player sized box, a shot and
+		   a point in the world, nothing else */
+		VectorSet(traces[i].mins, -16, -16, -24);
+		VectorSet(traces[i].maxs, 16, 16, 32);
+
+		if (VectorCompare(traces[i].start, traces[i].end))
+		{
+			traces[i].end[2] -= 256;
+		}
+	}
+
+	time[0] = time[1] = time[2] = time[3] = 0;
+	fraction = 0;
+	contents = 0;
+	grid = Cvar_VariableValue("map_leafgrid");
+
+	for (r = 0; r < rounds; r++)
+	{
+		for (t = 0; t < 4; t++)
+		{
+			Cvar_SetValue("map_leafgrid", (t == 3) ? 0 : grid);
+			start = Sys_Nanoseconds();
+
+			for (i = 0; i < count; i++)
+			{
+				switch (t)
+				{
+					case 0:
+						fraction += CM_BoxTrace(traces[i].start, traces[i].end,
+								traces[i].mins, traces[i].maxs, 0,
+								MASK_PLAYERSOLID).fraction;
+						break;
+
+					case 1:
+						fraction += CM_BoxTrace(traces[i].start, traces[i].end,
+								vec3_origin, vec3_origin, 0, MASK_SHOT).fraction;
+						break;
+
+					default:
+						contents |= CM_PointContents(traces[i].end, 0);
+						break;
+				}
+			}
+
+			time[t] += Sys_Nanoseconds() - start;
+		}
+	}
+
+	/* the leaf grid mustn't change a single lookup */
+	differ = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		Cvar_SetValue("map_leafgrid", 0);
+		r = CM_PointLeafnum(traces[i].start);
+		t = CM_PointLeafnum(traces[i].end);
+
+		Cvar_SetValue("map_leafgrid", 1);
+
+		if ((CM_PointLeafnum(traces[i].start) != r) ||
+			(CM_PointLeafnum(traces[i].end) != t))
+		{
+			differ++;
+		}
+	}
+
+	Cvar_SetValue("map_leafgrid", grid);
+
+	Com_Printf("%i calls, %i rounds\n", count, rounds);
+
+	for (t = 0; t < 4; t++)
+	{
+		Com_Printf("%-20s %10.0f per second\n", names[t],
+				(double)count * rounds * 1000000000.0 / (time[t] ? time[t] : 1));
+	}
+
+	if (differ)
+	{
+		Com_Printf("FAILED, the leaf grid changes %i of %i leafs.\n",
+				differ, count * 2);
+	}
+
+	/* so that nothing is optimized away */
+	Com_DPrintf("%f %i\n", fraction, contents);
+
+	Z_Free(traces);
+}
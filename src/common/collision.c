@@ -25,20 +25,41 @@
  * =======================================================================
  */
 
+#include <limits.h>
+
 #include "header/common.h"
 
+#ifdef CM_SIMD
+ #include <emmintrin.h>
+#endif
+
+/* Everything refers to planes and surfaces by index,
+   so that the collision cache can be mapped anywhere. */
 typedef struct
 {
-	cplane_t	*plane;
+	int			planenum;
 	int			children[2]; /* negative numbers are leafs */
 } cnode_t;
 
 typedef struct
 {
-	cplane_t	*plane;
-	mapsurface_t	*surface;
+	int			planenum;
+	int			surfacenum; /* -1 = nullsurface */
 } cbrushside_t;
 
+/* The nodes once more, for traces and point lookups. The plane is
+   inlined and the tree is in depth first order, so that a walk down
+   touches one cache line per node. The box hull keeps its numbers
+   after the map's nodes, its distances are in the trace context. */
+typedef struct
+{
+	float		normal[3];
+	float		dist;
+	int			type;
+	int			children[2]; /* negative numbers are leafs */
+	int			pad;
+} cflatnode_t;
+
 typedef struct
 {
 	int			contents;
@@ -53,7 +74,6 @@ typedef struct
 	int			contents;
 	int			numsides;
 	int			firstbrushside;
-	int			checkcount;	/* to avoid repeated testings */
 } cbrush_t;
 
 typedef struct
@@ -64,33 +84,69 @@ typedef struct
 	int		floodvalid;
 } carea_t;
 
+/* Storage for the parts of the map that are never written,
+   unless a collision cache is mapped in their place. */
+static byte cm_visibility[MAX_MAP_VISIBILITY];
+static cbrush_t cm_brushes[MAX_MAP_BRUSHES];
+static cbrushside_t cm_brushsides[MAX_MAP_BRUSHSIDES];
+static cleaf_t cm_leafs[MAX_MAP_LEAFS];
+static cnode_t cm_nodes[MAX_MAP_NODES+6]; /* extra for box hull */
+static cplane_t cm_planes[MAX_MAP_PLANES+6]; /* extra for box hull */
+static unsigned short cm_leafbrushes[MAX_MAP_LEAFBRUSHES];
+
+/* The clusters below the headnodes of edicts in too many
+   leafs, a slot in map_headnodesets or -1 for each node */
+#define MAX_HEADNODESETS 1024
+static int *map_headnodeslots;
+static headnodeset_t *map_headnodesets;
+static byte *map_headnodebits;
+static int map_numheadnodesets;
+
+/* Built after loading, unless a collision cache is mapped */
+static cflatnode_t cm_flatnodes[MAX_MAP_NODES+6];
+static int cm_flatnum[MAX_MAP_NODES]; /* map_nodes to map_flatnodes */
+static cflatnode_t *map_flatnodes = cm_flatnodes;
+static int *map_flatnum = cm_flatnum;
+
+/* A coarse grid over the world. Each cell holds the deepest
+   flat node whose subtree contains all of the cell, or -1 - leaf
+   if the cell is inside one leaf. Point lookups start there. */
+#define LEAFGRID_CELLS 65536
+#define LEAFGRID_MIN_CELL 32
+static int *cm_leafgrid;
+static int cm_leafgridsize[3];
+static vec3_t cm_leafgridorigin;
+static float cm_leafgridscale; /* 1 / cell size */
+
 byte *cmod_base;
-byte map_visibility[MAX_MAP_VISIBILITY];
+byte *map_visibility = cm_visibility;
 byte pvsrow[MAX_MAP_LEAFS / 8];
 byte phsrow[MAX_MAP_LEAFS / 8];
+byte *map_pvs, *map_phs; /* decompressed, from the collision cache */
+int map_visrowbytes;
 carea_t	map_areas[MAX_MAP_AREAS];
-cbrush_t map_brushes[MAX_MAP_BRUSHES];
-cbrushside_t map_brushsides[MAX_MAP_BRUSHSIDES];
+cbrush_t *map_brushes = cm_brushes;
+cbrushside_t *map_brushsides = cm_brushsides;
 char map_name[MAX_QPATH];
+static unsigned last_checksum;
 char map_entitystring[MAX_MAP_ENTSTRING];
 cbrush_t *box_brush;
 cleaf_t	*box_leaf;
-cleaf_t	map_leafs[MAX_MAP_LEAFS];
+cleaf_t	*map_leafs = cm_leafs;
 cmodel_t map_cmodels[MAX_MAP_MODELS];
-cnode_t	map_nodes[MAX_MAP_NODES+6]; /* extra for box hull */
+cnode_t	*map_nodes = cm_nodes;
 cplane_t *box_planes;
-cplane_t map_planes[MAX_MAP_PLANES+6]; /* extra for box hull */
+cplane_t *map_planes = cm_planes;
 cvar_t *map_noareas;
+cvar_t *map_cache;
+cvar_t *map_vismemory;
+cvar_t *map_simd;
+cvar_t *map_leafgrid;
 dareaportal_t map_areaportals[MAX_MAP_AREAPORTALS];
-dvis_t *map_vis = (dvis_t *)map_visibility;
+dvis_t *map_vis = (dvis_t *)cm_visibility;
 int box_headnode;
-int	checkcount;
 int	emptyleaf, solidleaf;
 int	floodvalid;
-float *leaf_mins, *leaf_maxs;
-int leaf_count, leaf_maxcount;
-int *leaf_list;
-int leaf_topnode;
 int	numareaportals;
 int numareas = 1;
 int	numbrushes;
@@ -104,16 +160,33 @@ int	numnodes;
 int	numplanes;
 int	numtexinfo;
 int	numvisibility;
-int trace_contents;
 mapsurface_t map_surfaces[MAX_MAP_TEXINFO];
 mapsurface_t nullsurface;
 qboolean portalopen[MAX_MAP_AREAPORTALS];
-qboolean trace_ispoint; /* optimized case */
-trace_t trace_trace;
-unsigned short	map_leafbrushes[MAX_MAP_LEAFBRUSHES];
-vec3_t trace_start, trace_end;
-vec3_t trace_mins, trace_maxs;
-vec3_t trace_extents;
+unsigned short	*map_leafbrushes = cm_leafbrushes;
+
+/* for the functions without a context */
+static cmtrace_t cm_trace;
+
+#ifdef CM_SIMD
+/* The sides of each brush in groups of four, as structure of arrays.
+   Unused lanes get a plane that's never crossed. */
+typedef struct
+{
+	float normal[3][4];
+	float dist[4];
+} cbrushlanes_t;
+
+/* start, end, mins and maxs of a trace, broadcast to all lanes */
+typedef struct
+{
+	__m128 start[3], end[3];
+	__m128 mins[3], maxs[3];
+} lanetrace_t;
+
+static cbrushlanes_t *map_brushlanes;
+static int *map_brushfirstlanes;
+#endif
 
 #ifndef DEDICATED_ONLY
 int		c_pointcontents;
@@ -254,9 +327,9 @@ CM_WriteAreaBits(byte *buffer, int area)
  * Writes the portal state to a savegame file
  */
 void
-CM_WritePortalState(FILE *f)
+CM_WritePortalState(sizebuf_t *buf)
 {
-	fwrite(portalopen, sizeof(portalopen), 1, f);
+	SZ_Write(buf, portalopen, sizeof(portalopen));
 }
 
 /*
@@ -270,12 +343,8 @@ CM_ReadPortalState(fileHandle_t f)
 	FloodAreaConnections();
 }
 
-/*
- * Returns true if any leaf under headnode has a cluster that
- * is potentially visible
- */
-qboolean
-CM_HeadnodeVisible(int nodenum, byte *visbits)
+static qboolean
+CM_HeadnodeVisible_r(int nodenum, const byte *visbits)
 {
 	int leafnum1;
 	int cluster;
@@ -301,18 +370,158 @@ CM_HeadnodeVisible(int nodenum, byte *visbits)
 
 	node = &map_nodes[nodenum];
 
-	if (CM_HeadnodeVisible(node->children[0], visbits))
+	if (CM_HeadnodeVisible_r(node->children[0], visbits))
 	{
 		return true;
 	}
 
-	return CM_HeadnodeVisible(node->children[1], visbits);
+	return CM_HeadnodeVisible_r(node->children[1], visbits);
+}
+
+static void
+CM_HeadnodeClusters_r(int nodenum, headnodeset_t *set)
+{
+	int cluster;
+
+	while (nodenum >= 0)
+	{
+		CM_HeadnodeClusters_r(map_nodes[nodenum].children[0], set);
+		nodenum = map_nodes[nodenum].children[1];
+	}
+
+	cluster = map_leafs[-1 - nodenum].cluster;
+
+	if (cluster == -1)
+	{
+		return;
+	}
+
+	set->bits[cluster >> 3] |= 1 << (cluster & 7);
+
+	if ((cluster >> 3) < set->first)
+	{
+		set->first = cluster >> 3;
+	}
+
+	if ((cluster >> 3) > set->last)
+	{
+		set->last = cluster >> 3;
+	}
+}
+
+static void
+CM_FreeHeadnodeSets(void)
+{
+	free(map_headnodesets);
+	free(map_headnodeslots);
+	free(map_headnodebits);
+
+	map_headnodesets = NULL;
+	map_headnodeslots = NULL;
+	map_headnodebits = NULL;
+	map_numheadnodesets = 0;
+}
+
+/*
+ * The clusters of all leafs below nodenum. Built the first time
+ * it's asked for and kept until the map changes. NULL if there
+ * are already too many.
+ */
+const headnodeset_t *
+CM_HeadnodeClusters(int nodenum)
+{
+	headnodeset_t *set;
+	int rowbytes, i;
+
+	if ((nodenum < 0) || (nodenum >= numnodes))
+	{
+		return NULL;
+	}
+
+	rowbytes = (numclusters + 7) >> 3;
+
+	if (!map_headnodeslots)
+	{
+		map_headnodeslots = malloc(numnodes * sizeof(int));
+		map_headnodesets = malloc(MAX_HEADNODESETS * sizeof(headnodeset_t));
+		map_headnodebits = calloc(MAX_HEADNODESETS, rowbytes ? rowbytes : 1);
+
+		if (!map_headnodeslots || !map_headnodesets || !map_headnodebits)
+		{
+			Com_Error(ERR_FATAL, "CM_HeadnodeClusters: Out of memory");
+		}
+
+		for (i = 0; i < numnodes; i++)
+		{
+			map_headnodeslots[i] = -1;
+		}
+	}
+
+	if (map_headnodeslots[nodenum] != -1)
+	{
+		return &map_headnodesets[map_headnodeslots[nodenum]];
+	}
+
+	if (map_numheadnodesets == MAX_HEADNODESETS)
+	{
+		return NULL;
+	}
+
+	set = &map_headnodesets[map_numheadnodesets];
+	set->bits = map_headnodebits + map_numheadnodesets * rowbytes;
+	set->first = rowbytes;
+	set->last = -1;
+
+	CM_HeadnodeClusters_r(nodenum, set);
+
+	map_headnodeslots[nodenum] = map_numheadnodesets++;
+
+	return set;
+}
+
+/*
+ * Returns true if any leaf under headnode has a cluster that
+ * is potentially visible
+ */
+qboolean
+CM_HeadnodeVisible(int nodenum, const byte *visbits)
+{
+	const headnodeset_t *set;
+	int i;
+
+	set = CM_HeadnodeClusters(nodenum);
+
+	if (!set)
+	{
+		return CM_HeadnodeVisible_r(nodenum, visbits);
+	}
+
+	for (i = set->first; i <= set->last; i++)
+	{
+		if (set->bits[i] & visbits[i])
+		{
+			return true;
+		}
+	}
+
+	return false;
 }
 
 /*
  * Set up the planes and nodes so that the six floats of a bounding box
  * can just be stored out and get a proper clipping hull structure.
  */
+static void
+CM_SetBoxHull(void)
+{
+	box_headnode = numnodes;
+	box_planes = &map_planes[numplanes];
+	box_brush = &map_brushes[numbrushes];
+	box_leaf = &map_leafs[numleafs];
+
+	CM_InitTrace(&cm_trace);
+}
+
 void
 CM_InitBoxHull(void)
 {
@@ -322,8 +531,7 @@ CM_InitBoxHull(void)
 	cplane_t *p;
 	cbrushside_t *s;
 
-	box_headnode = numnodes;
-	box_planes = &map_planes[numplanes];
+	CM_SetBoxHull();
 
 	if ((numnodes + 6 > MAX_MAP_NODES) ||
 		(numbrushes + 1 > MAX_MAP_BRUSHES) ||
@@ -334,12 +542,10 @@ CM_InitBoxHull(void)
 		Com_Error(ERR_DROP, "Not enough room for box tree");
 	}
 
-	box_brush = &map_brushes[numbrushes];
 	box_brush->numsides = 6;
 	box_brush->firstbrushside = numbrushsides;
 	box_brush->contents = CONTENTS_MONSTER;
 
-	box_leaf = &map_leafs[numleafs];
 	box_leaf->contents = CONTENTS_MONSTER;
 	box_leaf->firstleafbrush = numleafbrushes;
 	box_leaf->numleafbrushes = 1;
@@ -352,12 +558,12 @@ CM_InitBoxHull(void)
 
 		/* brush sides */
 		s = &map_brushsides[numbrushsides + i];
-		s->plane = map_planes + (numplanes + i * 2 + side);
-		s->surface = &nullsurface;
+		s->planenum = numplanes + i * 2 + side;
+		s->surfacenum = -1;
 
 		/* nodes */
 		c = &map_nodes[box_headnode + i];
-		c->plane = map_planes + (numplanes + i * 2);
+		c->planenum = numplanes + i * 2;
 		c->children[side] = -1 - emptyleaf;
 
 		if (i != 5)
@@ -386,801 +592,2002 @@ CM_InitBoxHull(void)
 }
 
 /*
- * To keep everything totally uniform, bounding boxes are turned into
- * small BSP trees instead of being compared directly.
+ * Prepares a trace context. The box hull planes get their
+ * normals here, CM_HeadnodeForBox_r() only sets the distances.
  */
-int
-CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
+void
+CM_InitTrace(cmtrace_t *ctx)
 {
-	box_planes[0].dist = maxs[0];
-	box_planes[1].dist = -maxs[0];
-	box_planes[2].dist = mins[0];
-	box_planes[3].dist = -mins[0];
-	box_planes[4].dist = maxs[1];
-	box_planes[5].dist = -maxs[1];
-	box_planes[6].dist = mins[1];
-	box_planes[7].dist = -mins[1];
-	box_planes[8].dist = maxs[2];
-	box_planes[9].dist = -maxs[2];
-	box_planes[10].dist = mins[2];
-	box_planes[11].dist = -mins[2];
+	int i;
+	cplane_t *p;
 
-	return box_headnode;
+	memset(ctx, 0, sizeof(*ctx));
+
+	for (i = 0; i < 6; i++)
+	{
+		p = &ctx->boxplanes[i * 2];
+		p->type = i >> 1;
+		p->normal[i >> 1] = 1;
+
+		p = &ctx->boxplanes[i * 2 + 1];
+		p->type = 3 + (i >> 1);
+		p->normal[i >> 1] = -1;
+	}
 }
 
-int
-CM_PointLeafnum_r(vec3_t p, int num)
+/*
+ * The box hull's planes follow the map's, but
+ * every context has its own copy of them.
+ */
+static cplane_t *
+CM_TracePlane(cmtrace_t *ctx, int planenum)
+{
+	if (planenum >= numplanes)
+	{
+		return &ctx->boxplanes[planenum - numplanes];
+	}
+
+	return &map_planes[planenum];
+}
+
+/*
+ * Builds cm_flatnodes from map_nodes and map_planes.
+ * Each node is followed by the subtree in front of it,
+ * then the one behind it. The world comes first, then
+ * the submodels.
+ */
+static void
+CM_BuildFlatNodes(void)
 {
-	float d;
+	cflatnode_t *out;
 	cnode_t *node;
 	cplane_t *plane;
+	int *stack;
+	int sp, count, num, i, j;
 
-	while (num >= 0)
+	for (i = 0; i < numnodes; i++)
+	{
+		cm_flatnum[i] = -1;
+	}
+
+	stack = Z_Malloc((numnodes + 1) * sizeof(int));
+	count = 0;
+
+	for (i = 0; i <= numcmodels + numnodes; i++)
 	{
-		node = map_nodes + num;
-		plane = node->plane;
+		/* the headnodes, then anything that wasn't reached */
+		num = (i < numcmodels) ? map_cmodels[i].headnode : i - numcmodels;
 
-		if (plane->type < 3)
+		if ((num < 0) || (num >= numnodes) || (cm_flatnum[num] != -1))
 		{
-			d = p[plane->type] - plane->dist;
+			continue;
 		}
 
-		else
+		sp = 0;
+		stack[sp++] = num;
+		cm_flatnum[num] = -2;
+
+		while (sp)
 		{
-			d = DotProduct(plane->normal, p) - plane->dist;
+			num = stack[--sp];
+			cm_flatnum[num] = count++;
+
+			node = &map_nodes[num];
+
+			for (j = 1; j >= 0; j--)
+			{
+				if ((node->children[j] >= 0) &&
+					(cm_flatnum[node->children[j]] == -1))
+				{
+					stack[sp++] = node->children[j];
+					cm_flatnum[node->children[j]] = -2;
+				}
+			}
 		}
+	}
 
-		if (d < 0)
+	Z_Free(stack);
+
+	for (i = 0; i < numnodes + 6; i++)
+	{
+		node = &map_nodes[i];
+		out = &cm_flatnodes[(i < numnodes) ? cm_flatnum[i] : i];
+
+		/* the box hull's planes aren't in
+		   the map, but always the same */
+		if (i < numnodes)
 		{
-			num = node->children[1];
+			plane = &map_planes[node->planenum];
 		}
-
 		else
 		{
-			num = node->children[0];
+			plane = &cm_trace.boxplanes[(i - numnodes) * 2];
 		}
-	}
 
-#ifndef DEDICATED_ONLY
-	c_pointcontents++; /* optimize counter */
-#endif
+		VectorCopy(plane->normal, out->normal);
+		out->dist = plane->dist;
+		out->type = plane->type;
+		out->pad = 0;
 
-	return -1 - num;
+		for (j = 0; j < 2; j++)
+		{
+			if ((node->children[j] >= 0) && (node->children[j] < numnodes))
+			{
+				out->children[j] = cm_flatnum[node->children[j]];
+			}
+			else
+			{
+				out->children[j] = node->children[j];
+			}
+		}
+	}
 }
 
-int
-CM_PointLeafnum(vec3_t p)
+/*
+ * A node number as it's known outside, to map_flatnodes.
+ */
+static int
+CM_FlatNode(int num)
 {
-	if (!numplanes)
+	if ((num >= 0) && (num < numnodes))
 	{
-		return 0; /* sound may call this without map loaded */
+		return map_flatnum[num];
 	}
 
-	return CM_PointLeafnum_r(p, 0);
+	return num;
 }
 
 /*
- * Fills in a list of all the leafs touched
+ * The box hull's nodes have their distances
+ * in the context, the others in the node.
  */
+static float
+CM_FlatNodeDist(cmtrace_t *ctx, cflatnode_t *node, int num)
+{
+	if (num >= numnodes)
+	{
+		return ctx->boxplanes[(num - numnodes) * 2].dist;
+	}
 
-void
-CM_BoxLeafnums_r(int nodenum)
+	return node->dist;
+}
+
+static void
+CM_FreeLeafGrid(void)
 {
-	cplane_t *plane;
-	cnode_t *node;
-	int s;
+	free(cm_leafgrid);
+	cm_leafgrid = NULL;
+}
 
-	while (1)
+/*
+ * The deepest node of the world whose subtree holds all
+ * of the box. The box is grown by a unit, so that points
+ * rounded into a neighbouring cell still end up below it.
+ */
+static int
+CM_LeafGridNode(vec3_t mins, vec3_t maxs)
+{
+	cflatnode_t *node;
+	float lo, hi;
+	int num, i;
+
+	num = CM_FlatNode(map_cmodels[0].headnode);
+
+	while (num >= 0)
 	{
-		if (nodenum < 0)
+		node = &map_flatnodes[num];
+
+		if (node->type < 3)
+		{
+			lo = mins[node->type] - 1;
+			hi = maxs[node->type] + 1;
+		}
+		else
 		{
-			if (leaf_count >= leaf_maxcount)
+			lo = hi = 0;
+
+			for (i = 0; i < 3; i++)
 			{
-				return;
+				if (node->normal[i] < 0)
+				{
+					lo += node->normal[i] * (maxs[i] + 1);
+					hi += node->normal[i] * (mins[i] - 1);
+				}
+				else
+				{
+					lo += node->normal[i] * (mins[i] - 1);
+					hi += node->normal[i] * (maxs[i] + 1);
+				}
 			}
 
-			leaf_list[leaf_count++] = -1 - nodenum;
-			return;
+			/* make up for the rounding of the dot product */
+			lo -= 1;
+			hi += 1;
 		}
 
-		node = &map_nodes[nodenum];
-		plane = node->plane;
-		s = BOX_ON_PLANE_SIDE(leaf_mins, leaf_maxs, plane);
-
-		if (s == 1)
+		if (lo - node->dist >= 0)
 		{
-			nodenum = node->children[0];
+			num = node->children[0];
 		}
-
-		else if (s == 2)
+		else if (hi - node->dist < 0)
 		{
-			nodenum = node->children[1];
+			num = node->children[1];
 		}
-
 		else
 		{
-			/* go down both */
-			if (leaf_topnode == -1)
-			{
-				leaf_topnode = nodenum;
-			}
-
-			CM_BoxLeafnums_r(node->children[0]);
-			nodenum = node->children[1];
+			break;
 		}
 	}
+
+	return num;
 }
 
-int
-CM_BoxLeafnums_headnode(vec3_t mins, vec3_t maxs, int *list,
-		int listsize, int headnode, int *topnode)
+/*
+ * Builds cm_leafgrid over the bounds of the world. The
+ * cells are as small as possible, but not below
+ * LEAFGRID_MIN_CELL units, with at most LEAFGRID_CELLS
+ * of them.
+ */
+static void
+CM_BuildLeafGrid(void)
 {
-	leaf_list = list;
-	leaf_count = 0;
-	leaf_maxcount = listsize;
-	leaf_mins = mins;
-	leaf_maxs = maxs;
+	vec3_t mins, maxs;
+	float cell;
+	int x, y, z, i;
+	int leafcells;
+	int *out;
 
-	leaf_topnode = -1;
+	CM_FreeLeafGrid();
 
-	CM_BoxLeafnums_r(headnode);
-
-	if (topnode)
+	if ((numcmodels < 1) || (numnodes < 1))
 	{
-		*topnode = leaf_topnode;
+		return;
 	}
 
-	return leaf_count;
-}
+	for (cell = LEAFGRID_MIN_CELL; ; cell *= 2)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			cm_leafgridsize[i] = (int)ceil((map_cmodels[0].maxs[i] -
+						map_cmodels[0].mins[i]) / cell);
 
-int
-CM_BoxLeafnums(vec3_t mins, vec3_t maxs, int *list, int listsize, int *topnode)
-{
-	return CM_BoxLeafnums_headnode(mins, maxs, list,
-			listsize, map_cmodels[0].headnode, topnode);
-}
+			if (cm_leafgridsize[i] < 1)
+			{
+				cm_leafgridsize[i] = 1;
+			}
+		}
 
-int
-CM_PointContents(vec3_t p, int headnode)
-{
-	int l;
+		if ((double)cm_leafgridsize[0] * cm_leafgridsize[1] *
+			cm_leafgridsize[2] <= LEAFGRID_CELLS)
+		{
+			break;
+		}
+	}
 
-	if (!numnodes) /* map not loaded */
+	VectorCopy(map_cmodels[0].mins, cm_leafgridorigin);
+	cm_leafgridscale = 1.0f / cell;
+
+	cm_leafgrid = malloc(cm_leafgridsize[0] * cm_leafgridsize[1] *
+			cm_leafgridsize[2] * sizeof(int));
+
+	if (!cm_leafgrid)
 	{
-		return 0;
+		return;
 	}
 
-	l = CM_PointLeafnum_r(p, headnode);
-
-	return map_leafs[l].contents;
-}
+	out = cm_leafgrid;
+	leafcells = 0;
+
+	for (z = 0; z < cm_leafgridsize[2]; z++)
+	{
+		for (y = 0; y < cm_leafgridsize[1]; y++)
+		{
+			for (x = 0; x < cm_leafgridsize[0]; x++)
+			{
+				mins[0] = cm_leafgridorigin[0] + x * cell;
+				mins[1] = cm_leafgridorigin[1] + y * cell;
+				mins[2] = cm_leafgridorigin[2] + z * cell;
+				VectorSet(maxs, mins[0] + cell, mins[1] + cell,
+						mins[2] + cell);
+
+				*out = CM_LeafGridNode(mins, maxs);
+
+				if (*out++ < 0)
+				{
+					leafcells++;
+				}
+			}
+		}
+	}
+
+	Com_DPrintf("Leaf grid: %i cells of %i units, %i inside one leaf\n",
+			(int)(out - cm_leafgrid), (int)cell, leafcells);
+}
 
 /*
- * Handles offseting and rotation of the end points for moving and
- * rotating entities
+ * Where a lookup of p in the world can start,
+ * num if p is outside the grid.
  */
-int
-CM_TransformedPointContents(vec3_t p, int headnode,
-		vec3_t origin, vec3_t angles)
+static int
+CM_LeafGridStart(vec3_t p, int num)
 {
-	vec3_t p_l;
-	vec3_t temp;
-	vec3_t forward, right, up;
-	int l;
-
-	/* subtract origin offset */
-	VectorSubtract(p, origin, p_l);
+	int i, c[3];
+	float f;
 
-	/* rotate start and end into the models frame of reference */
-	if ((headnode != box_headnode) &&
-		(angles[0] || angles[1] || angles[2]))
+	for (i = 0; i < 3; i++)
 	{
-		AngleVectors(angles, forward, right, up);
+		f = (p[i] - cm_leafgridorigin[i]) * cm_leafgridscale;
 
-		VectorCopy(p_l, temp);
-		p_l[0] = DotProduct(temp, forward);
-		p_l[1] = -DotProduct(temp, right);
-		p_l[2] = DotProduct(temp, up);
+		if (!(f >= 0) || (f >= cm_leafgridsize[i]))
+		{
+			return num;
+		}
+
+		c[i] = (int)f;
 	}
 
-	l = CM_PointLeafnum_r(p_l, headnode);
+	return cm_leafgrid[(c[2] * cm_leafgridsize[1] + c[1]) *
+		cm_leafgridsize[0] + c[0]];
+}
 
-	return map_leafs[l].contents;
+/*
+ * To keep everything totally uniform, bounding boxes are turned into
+ * small BSP trees instead of being compared directly. The tree is
+ * valid for traces with the same context until the next call.
+ */
+int
+CM_HeadnodeForBox_r(cmtrace_t *ctx, vec3_t mins, vec3_t maxs)
+{
+	cplane_t *p;
+
+	p = ctx->boxplanes;
+
+	p[0].dist = maxs[0];
+	p[1].dist = -maxs[0];
+	p[2].dist = mins[0];
+	p[3].dist = -mins[0];
+	p[4].dist = maxs[1];
+	p[5].dist = -maxs[1];
+	p[6].dist = mins[1];
+	p[7].dist = -mins[1];
+	p[8].dist = maxs[2];
+	p[9].dist = -maxs[2];
+	p[10].dist = mins[2];
+	p[11].dist = -mins[2];
+
+	return box_headnode;
 }
 
-void
-CM_ClipBoxToBrush(vec3_t mins, vec3_t maxs, vec3_t p1,
-		vec3_t p2, trace_t *trace, cbrush_t *brush)
+int
+CM_HeadnodeForBox(vec3_t mins, vec3_t maxs)
 {
-	int i, j;
-	cplane_t *plane, *clipplane;
-	float dist;
-	float enterfrac, leavefrac;
-	vec3_t ofs;
-	float d1, d2;
-	qboolean getout, startout;
-	float f;
-	cbrushside_t *side, *leadside;
+	int headnode;
 
-	enterfrac = -1;
-	leavefrac = 1;
-	clipplane = NULL;
+	headnode = CM_HeadnodeForBox_r(&cm_trace, mins, maxs);
 
-	if (!brush->numsides)
+	if (cm_capturing)
 	{
-		return;
+		CM_CaptureBox(mins, maxs, headnode);
 	}
 
-#ifndef DEDICATED_ONLY
-	c_brush_traces++;
-#endif
+	return headnode;
+}
 
-	getout = false;
-	startout = false;
-	leadside = NULL;
+static int
+CM_PointLeafnum_r(cmtrace_t *ctx, vec3_t p, int num)
+{
+	float d, dist;
+	cflatnode_t *node;
 
-	for (i = 0; i < brush->numsides; i++)
+	if (cm_leafgrid && (num == map_cmodels[0].headnode) &&
+		map_leafgrid->value)
 	{
-		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
-
-		if (!trace_ispoint)
-		{
-			/* general box case
-			   push the plane out
-			   apropriately for mins/maxs */
-			for (j = 0; j < 3; j++)
-			{
-				if (plane->normal[j] < 0)
-				{
-					ofs[j] = maxs[j];
-				}
+		num = CM_LeafGridStart(p, CM_FlatNode(num));
+	}
+	else
+	{
+		num = CM_FlatNode(num);
+	}
 
-				else
-				{
-					ofs[j] = mins[j];
-				}
-			}
+	while (num >= 0)
+	{
+		node = &map_flatnodes[num];
+		dist = CM_FlatNodeDist(ctx, node, num);
 
-			dist = DotProduct(ofs, plane->normal);
-			dist = plane->dist - dist;
+		if (node->type < 3)
+		{
+			d = p[node->type] - dist;
 		}
 
 		else
 		{
-			/* special point case */
-			dist = plane->dist;
+			d = DotProduct(node->normal, p) - dist;
 		}
 
-		d1 = DotProduct(p1, plane->normal) - dist;
-		d2 = DotProduct(p2, plane->normal) - dist;
-
-		if (d2 > 0)
+		if (d < 0)
 		{
-			getout = true; /* endpoint is not in solid */
+			num = node->children[1];
 		}
 
-		if (d1 > 0)
+		else
 		{
-			startout = true;
+			num = node->children[0];
 		}
+	}
 
-		/* if completely in front of face, no intersection */
-		if ((d1 > 0) && (d2 >= d1))
+	return -1 - num;
+}
+
+int
+CM_PointLeafnum(vec3_t p)
+{
+	if (!numplanes)
+	{
+		return 0; /* sound may call this without map loaded */
+	}
+
+#ifndef DEDICATED_ONLY
+	c_pointcontents++; /* optimize counter */
+#endif
+
+	return CM_PointLeafnum_r(&cm_trace, p, 0);
+}
+
+/*
+ * Fills in a list of all the leafs touched
+ */
+
+typedef struct
+{
+	cmtrace_t *ctx;
+	float *mins, *maxs;
+	int *list;
+	int count, maxcount;
+	int topnode;
+} leaflist_t;
+
+static void
+CM_BoxLeafnums_r(leaflist_t *ll, int nodenum)
+{
+	cplane_t *plane;
+	cnode_t *node;
+	int s;
+
+	while (1)
+	{
+		if (nodenum < 0)
 		{
+			if (ll->count >= ll->maxcount)
+			{
+				return;
+			}
+
+			ll->list[ll->count++] = -1 - nodenum;
 			return;
 		}
 
-		if ((d1 <= 0) && (d2 <= 0))
+		node = &map_nodes[nodenum];
+		plane = CM_TracePlane(ll->ctx, node->planenum);
+		s = BOX_ON_PLANE_SIDE(ll->mins, ll->maxs, plane);
+
+		if (s == 1)
 		{
-			continue;
+			nodenum = node->children[0];
 		}
 
-		/* crosses face */
-		if (d1 > d2)
+		else if (s == 2)
 		{
-			/* enter */
-			f = (d1 - DIST_EPSILON) / (d1 - d2);
-
-			if (f > enterfrac)
-			{
-				enterfrac = f;
-				clipplane = plane;
-				leadside = side;
-			}
+			nodenum = node->children[1];
 		}
 
 		else
 		{
-			/* leave */
-			f = (d1 + DIST_EPSILON) / (d1 - d2);
-
-			if (f < leavefrac)
+			/* go down both */
+			if (ll->topnode == -1)
 			{
-				leavefrac = f;
+				ll->topnode = nodenum;
 			}
+
+			CM_BoxLeafnums_r(ll, node->children[0]);
+			nodenum = node->children[1];
 		}
 	}
+}
 
-	if (!startout)
+static int
+CM_BoxLeafnums_headnode(cmtrace_t *ctx, vec3_t mins, vec3_t maxs,
+		int *list, int listsize, int headnode, int *topnode)
+{
+	leaflist_t ll;
+
+	ll.ctx = ctx;
+	ll.list = list;
+	ll.count = 0;
+	ll.maxcount = listsize;
+	ll.mins = mins;
+	ll.maxs = maxs;
+
+	ll.topnode = -1;
+
+	CM_BoxLeafnums_r(&ll, headnode);
+
+	if (topnode)
 	{
-		/* original point was inside brush */
-		trace->startsolid = true;
+		*topnode = ll.topnode;
+	}
 
-		if (!getout)
-		{
-			trace->allsolid = true;
-		}
+	return ll.count;
+}
 
-		return;
+/*
+ * Only walks the world, which is never changed
+ * by a trace, so it's safe to call in parallel.
+ */
+int
+CM_BoxLeafnums(vec3_t mins, vec3_t maxs, int *list, int listsize, int *topnode)
+{
+	int count, top;
+
+	count = CM_BoxLeafnums_headnode(&cm_trace, mins, maxs, list,
+			listsize, map_cmodels[0].headnode, &top);
+
+	if (topnode)
+	{
+		*topnode = top;
 	}
 
-	if (enterfrac < leavefrac)
+	if (cm_capturing)
 	{
-		if ((enterfrac > -1) && (enterfrac < trace->fraction))
-		{
-			if (enterfrac < 0)
-			{
-				enterfrac = 0;
-			}
+		CM_CaptureLeafnums(mins, maxs, listsize, count, top);
+	}
 
-			if (clipplane == NULL)
-			{
-				Com_Error(ERR_FATAL, "clipplane was NULL!\n");
-			}
+	return count;
+}
+
+int
+CM_PointContents_r(cmtrace_t *ctx, vec3_t p, int headnode)
+{
+	int l;
+
+	if (!numnodes) /* map not loaded */
+	{
+		return 0;
+	}
+
+	l = CM_PointLeafnum_r(ctx, p, headnode);
+
+	return map_leafs[l].contents;
+}
+
+int
+CM_PointContents(vec3_t p, int headnode)
+{
+	int contents;
+
+#ifndef DEDICATED_ONLY
+	c_pointcontents++;
+#endif
+
+	contents = CM_PointContents_r(&cm_trace, p, headnode);
+
+	if (cm_capturing)
+	{
+		CM_CaptureContents(p, headnode, NULL, NULL, contents);
+	}
+
+	return contents;
+}
+
+/*
+ * Handles offseting and rotation of the end points for moving and
+ * rotating entities
+ */
+int
+CM_TransformedPointContents_r(cmtrace_t *ctx, vec3_t p, int headnode,
+		vec3_t origin, vec3_t angles)
+{
+	vec3_t p_l;
+	vec3_t temp;
+	vec3_t forward, right, up;
+	int l;
+
+	/* subtract origin offset */
+	VectorSubtract(p, origin, p_l);
+
+	/* rotate start and end into the models frame of reference */
+	if ((headnode != box_headnode) &&
+		(angles[0] || angles[1] || angles[2]))
+	{
+		AngleVectors(angles, forward, right, up);
+
+		VectorCopy(p_l, temp);
+		p_l[0] = DotProduct(temp, forward);
+		p_l[1] = -DotProduct(temp, right);
+		p_l[2] = DotProduct(temp, up);
+	}
+
+	l = CM_PointLeafnum_r(ctx, p_l, headnode);
+
+	return map_leafs[l].contents;
+}
+
+int
+CM_TransformedPointContents(vec3_t p, int headnode,
+		vec3_t origin, vec3_t angles)
+{
+	int contents;
+
+#ifndef DEDICATED_ONLY
+	c_pointcontents++;
+#endif
+
+	contents = CM_TransformedPointContents_r(&cm_trace, p, headnode,
+			origin, angles);
+
+	if (cm_capturing)
+	{
+		CM_CaptureContents(p, headnode, origin, angles, contents);
+	}
+
+	return contents;
+}
+
+#ifdef CM_SIMD
+static void
+CM_FreeBrushLanes(void)
+{
+	free(map_brushlanes);
+	free(map_brushfirstlanes);
+
+	map_brushlanes = NULL;
+	map_brushfirstlanes = NULL;
+}
+
+static int
+CM_NumBrushLanes(void)
+{
+	int count, i;
+
+	count = 0;
+
+	for (i = 0; i < numbrushes; i++)
+	{
+		count += (map_brushes[i].numsides + 3) >> 2;
+	}
+
+	return count;
+}
+
+/*
+ * Builds the groups of brush sides
+ * for the map as it was loaded.
+ */
+static void
+CM_BuildBrushLanes(void)
+{
+	cbrushlanes_t *l;
+	cbrush_t *b;
+	cplane_t *p;
+	int count, i, j, k, n;
+
+	count = CM_NumBrushLanes();
+
+	/* malloc() aligns to 16 bytes on x86_64 */
+	map_brushlanes = malloc((count + 1) * sizeof(cbrushlanes_t));
+	map_brushfirstlanes = malloc((numbrushes + 1) * sizeof(int));
+
+	if (!map_brushlanes || !map_brushfirstlanes)
+	{
+		/* the scalar code works anyway */
+		CM_FreeBrushLanes();
+		return;
+	}
+
+	l = map_brushlanes;
+
+	for (i = 0; i < numbrushes; i++)
+	{
+		b = &map_brushes[i];
+		map_brushfirstlanes[i] = (int)(l - map_brushlanes);
+
+		for (j = 0; j < b->numsides; j += 4, l++)
+		{
+			for (k = 0; k < 4; k++)
+			{
+				if (j + k >= b->numsides)
+				{
+					for (n = 0; n < 3; n++)
+					{
+						l->normal[n][k] = 0;
+					}
+
+					l->dist[k] = 1e30f;
+					continue;
+				}
+
+				p = &map_planes[map_brushsides[b->firstbrushside + j + k].planenum];
+
+				for (n = 0; n < 3; n++)
+				{
+					l->normal[n][k] = p->normal[n];
+				}
+
+				l->dist[k] = p->dist;
+			}
+		}
+	}
+}
+
+static void
+CM_SetupLaneTrace(cmtrace_t *ctx, lanetrace_t *lt)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		lt->start[i] = _mm_set1_ps(ctx->start[i]);
+		lt->end[i] = _mm_set1_ps(ctx->end[i]);
+		lt->mins[i] = _mm_set1_ps(ctx->mins[i]);
+		lt->maxs[i] = _mm_set1_ps(ctx->maxs[i]);
+	}
+}
+
+/*
+ * The plane distances of four brush sides, pushed out for the box
+ * unless it's a point.
+ */
+static __m128
+CM_LaneDist(lanetrace_t *lt, cbrushlanes_t *l, qboolean ispoint)
+{
+	__m128 d, n, neg, ofs;
+
+	if (ispoint)
+	{
+		return _mm_load_ps(l->dist);
+	}
+
+	n = _mm_load_ps(l->normal[0]);
+	neg = _mm_cmplt_ps(n, _mm_setzero_ps());
+	ofs = _mm_or_ps(_mm_and_ps(neg, lt->maxs[0]),
+			_mm_andnot_ps(neg, lt->mins[0]));
+	d = _mm_mul_ps(ofs, n);
+
+	n = _mm_load_ps(l->normal[1]);
+	neg = _mm_cmplt_ps(n, _mm_setzero_ps());
+	ofs = _mm_or_ps(_mm_and_ps(neg, lt->maxs[1]),
+			_mm_andnot_ps(neg, lt->mins[1]));
+	d = _mm_add_ps(d, _mm_mul_ps(ofs, n));
+
+	n = _mm_load_ps(l->normal[2]);
+	neg = _mm_cmplt_ps(n, _mm_setzero_ps());
+	ofs = _mm_or_ps(_mm_and_ps(neg, lt->maxs[2]),
+			_mm_andnot_ps(neg, lt->mins[2]));
+	d = _mm_add_ps(d, _mm_mul_ps(ofs, n));
+
+	return _mm_sub_ps(_mm_load_ps(l->dist), d);
+}
+
+/*
+ * The distance of p to four brush sides. The same operations in
+ * the same order as the scalar code, so the results are the same.
+ */
+static __m128
+CM_LanePoint(cbrushlanes_t *l, __m128 *p, __m128 dist)
+{
+	__m128 d;
+
+	d = _mm_mul_ps(p[0], _mm_load_ps(l->normal[0]));
+	d = _mm_add_ps(d, _mm_mul_ps(p[1], _mm_load_ps(l->normal[1])));
+	d = _mm_add_ps(d, _mm_mul_ps(p[2], _mm_load_ps(l->normal[2])));
+
+	return _mm_sub_ps(d, dist);
+}
+
+/*
+ * The loop over the sides of CM_ClipBoxToBrush(), four at a time.
+ * Returns false if the trace is completely in front of a side, it
+ * can't touch the brush then. Otherwise the fractions, the number
+ * of the side that's entered last or -1 and if start and end are
+ * outside are returned. Like in the scalar loop, the first side
+ * wins when two are entered at the same fraction.
+ */
+static qboolean
+CM_ClipLanes(cmtrace_t *ctx, cbrush_t *brush, float *enterfrac,
+		float *leavefrac, int *leadnum, qboolean *getout, qboolean *startout)
+{
+	lanetrace_t lt;
+	cbrushlanes_t *l;
+	__m128 zero, eps, dist, d1, d2, frac, enter, leave, cross, num;
+	__m128 bestenter, bestnum, minleave;
+	float enters[4], nums[4], leaves[4];
+	int i, outmask, startmask;
+
+	CM_SetupLaneTrace(ctx, &lt);
+	l = &map_brushlanes[map_brushfirstlanes[brush - map_brushes]];
+
+	zero = _mm_setzero_ps();
+	eps = _mm_set1_ps(DIST_EPSILON);
+	num = _mm_setr_ps(0, 1, 2, 3);
+	bestenter = _mm_set1_ps(-1);
+	bestnum = _mm_set1_ps(-1);
+	minleave = _mm_set1_ps(1);
+	outmask = startmask = 0;
+
+	for (i = 0; i < brush->numsides; i += 4, l++)
+	{
+		dist = CM_LaneDist(&lt, l, ctx->ispoint);
+		d1 = CM_LanePoint(l, lt.start, dist);
+		d2 = CM_LanePoint(l, lt.end, dist);
+
+		/* completely in front of face, no intersection */
+		if (_mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(d1, zero),
+						_mm_cmpge_ps(d2, d1))))
+		{
+			return false;
+		}
+
+		outmask |= _mm_movemask_ps(_mm_cmpgt_ps(d2, zero));
+		startmask |= _mm_movemask_ps(_mm_cmpgt_ps(d1, zero));
+
+		/* crosses face, either entering or leaving */
+		cross = _mm_or_ps(_mm_cmpgt_ps(d1, zero), _mm_cmpgt_ps(d2, zero));
+		enter = _mm_and_ps(cross, _mm_cmpgt_ps(d1, d2));
+		leave = _mm_andnot_ps(enter, cross);
+
+		frac = _mm_div_ps(_mm_sub_ps(d1, eps), _mm_sub_ps(d1, d2));
+		enter = _mm_and_ps(enter, _mm_cmpgt_ps(frac, bestenter));
+		bestenter = _mm_or_ps(_mm_and_ps(enter, frac),
+				_mm_andnot_ps(enter, bestenter));
+		bestnum = _mm_or_ps(_mm_and_ps(enter, num),
+				_mm_andnot_ps(enter, bestnum));
+
+		frac = _mm_div_ps(_mm_add_ps(d1, eps), _mm_sub_ps(d1, d2));
+		minleave = _mm_min_ps(minleave, _mm_or_ps(_mm_and_ps(leave, frac),
+					_mm_andnot_ps(leave, minleave)));
+
+		num = _mm_add_ps(num, _mm_set1_ps(4));
+	}
+
+	_mm_storeu_ps(enters, bestenter);
+	_mm_storeu_ps(nums, bestnum);
+	_mm_storeu_ps(leaves, minleave);
+
+	*enterfrac = -1;
+	*leavefrac = 1;
+	*leadnum = -1;
+
+	for (i = 0; i < 4; i++)
+	{
+		if ((enters[i] > *enterfrac) ||
+			((enters[i] == *enterfrac) && (nums[i] < *leadnum)))
+		{
+			*enterfrac = enters[i];
+			*leadnum = (int)nums[i];
+		}
+
+		if (leaves[i] < *leavefrac)
+		{
+			*leavefrac = leaves[i];
+		}
+	}
+
+	*getout = outmask != 0;
+	*startout = startmask != 0;
+
+	return true;
+}
+
+/*
+ * Returns true if the box at start is behind all sides.
+ */
+static qboolean
+CM_TestLanes(cmtrace_t *ctx, cbrush_t *brush)
+{
+	lanetrace_t lt;
+	cbrushlanes_t *l;
+	__m128 d;
+	int i;
+
+	CM_SetupLaneTrace(ctx, &lt);
+	l = &map_brushlanes[map_brushfirstlanes[brush - map_brushes]];
+
+	for (i = 0; i < brush->numsides; i += 4, l++)
+	{
+		d = CM_LanePoint(l, lt.start, CM_LaneDist(&lt, l, false));
+
+		if (_mm_movemask_ps(_mm_cmpgt_ps(d, _mm_setzero_ps())))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+#endif
+
+void
+CM_ClipBoxToBrush(cmtrace_t *ctx, cbrush_t *brush)
+{
+	int i, j;
+	cplane_t *plane, *clipplane;
+	float dist;
+	float enterfrac, leavefrac;
+	vec3_t ofs;
+	float d1, d2;
+	qboolean getout, startout;
+	float f;
+	cbrushside_t *side, *leadside;
+	trace_t *trace;
+#ifdef CM_SIMD
+	int leadnum;
+#endif
+
+	enterfrac = -1;
+	leavefrac = 1;
+	clipplane = NULL;
+
+	if (!brush->numsides)
+	{
+		return;
+	}
+
+	ctx->brushtraces++;
+
+	trace = &ctx->trace;
+	getout = false;
+	startout = false;
+	leadside = NULL;
+
+#ifdef CM_SIMD
+	if (ctx->simd && map_brushlanes && (brush != box_brush))
+	{
+		if (!CM_ClipLanes(ctx, brush, &enterfrac, &leavefrac, &leadnum,
+					&getout, &startout))
+		{
+			return;
+		}
+
+		if (leadnum != -1)
+		{
+			leadside = &map_brushsides[brush->firstbrushside + leadnum];
+			clipplane = &map_planes[leadside->planenum];
+		}
+	}
+	else
+#endif
+	for (i = 0; i < brush->numsides; i++)
+	{
+		side = &map_brushsides[brush->firstbrushside + i];
+		plane = CM_TracePlane(ctx, side->planenum);
+
+		if (!ctx->ispoint)
+		{
+			/* general box case
+			   push the plane out
+			   apropriately for mins/maxs */
+			for (j = 0; j < 3; j++)
+			{
+				if (plane->normal[j] < 0)
+				{
+					ofs[j] = ctx->maxs[j];
+				}
+
+				else
+				{
+					ofs[j] = ctx->mins[j];
+				}
+			}
+
+			dist = DotProduct(ofs, plane->normal);
+			dist = plane->dist - dist;
+		}
+
+		else
+		{
+			/* special point case */
+			dist = plane->dist;
+		}
+
+		d1 = DotProduct(ctx->start, plane->normal) - dist;
+		d2 = DotProduct(ctx->end, plane->normal) - dist;
+
+		if (d2 > 0)
+		{
+			getout = true; /* endpoint is not in solid */
+		}
+
+		if (d1 > 0)
+		{
+			startout = true;
+		}
+
+		/* if completely in front of face, no intersection */
+		if ((d1 > 0) && (d2 >= d1))
+		{
+			return;
+		}
+
+		if ((d1 <= 0) && (d2 <= 0))
+		{
+			continue;
+		}
+
+		/* crosses face */
+		if (d1 > d2)
+		{
+			/* enter */
+			f = (d1 - DIST_EPSILON) / (d1 - d2);
+
+			if (f > enterfrac)
+			{
+				enterfrac = f;
+				clipplane = plane;
+				leadside = side;
+			}
+		}
+
+		else
+		{
+			/* leave */
+			f = (d1 + DIST_EPSILON) / (d1 - d2);
+
+			if (f < leavefrac)
+			{
+				leavefrac = f;
+			}
+		}
+	}
+
+	if (!startout)
+	{
+		/* original point was inside brush */
+		trace->startsolid = true;
+
+		if (!getout)
+		{
+			trace->allsolid = true;
+		}
+
+		return;
+	}
+
+	if (enterfrac < leavefrac)
+	{
+		if ((enterfrac > -1) && (enterfrac < trace->fraction))
+		{
+			if (enterfrac < 0)
+			{
+				enterfrac = 0;
+			}
+
+			if (clipplane == NULL)
+			{
+				Com_Error(ERR_FATAL, "clipplane was NULL!\n");
+			}
+
+			trace->fraction = enterfrac;
+			trace->plane = *clipplane;
+
+			if (leadside->surfacenum < 0)
+			{
+				trace->surface = &(nullsurface.c);
+			}
+			else
+			{
+				trace->surface = &(map_surfaces[leadside->surfacenum].c);
+			}
+
+			trace->contents = brush->contents;
+		}
+	}
+}
+
+void
+CM_TestBoxInBrush(cmtrace_t *ctx, cbrush_t *brush)
+{
+	int i, j;
+	cplane_t *plane;
+	float dist;
+	vec3_t ofs;
+	float d1;
+	cbrushside_t *side;
+
+	if (!brush->numsides)
+	{
+		return;
+	}
+
+#ifdef CM_SIMD
+	if (ctx->simd && map_brushlanes && (brush != box_brush))
+	{
+		if (!CM_TestLanes(ctx, brush))
+		{
+			return;
+		}
+	}
+	else
+#endif
+	for (i = 0; i < brush->numsides; i++)
+	{
+		side = &map_brushsides[brush->firstbrushside + i];
+		plane = CM_TracePlane(ctx, side->planenum);
+
+		/* general box case
+		   push the plane out
+		   apropriately for mins/maxs */
+		for (j = 0; j < 3; j++)
+		{
+			if (plane->normal[j] < 0)
+			{
+				ofs[j] = ctx->maxs[j];
+			}
+
+			else
+			{
+				ofs[j] = ctx->mins[j];
+			}
+		}
+
+		dist = DotProduct(ofs, plane->normal);
+		dist = plane->dist - dist;
+
+		d1 = DotProduct(ctx->start, plane->normal) - dist;
+
+		/* if completely in front of face, no intersection */
+		if (d1 > 0)
+		{
+			return;
+		}
+	}
+
+	/* inside this brush */
+	ctx->trace.startsolid = ctx->trace.allsolid = true;
+	ctx->trace.fraction = 0;
+	ctx->trace.contents = brush->contents;
+}
+
+void
+CM_TraceToLeaf(cmtrace_t *ctx, int leafnum)
+{
+	int k;
+	int brushnum;
+	cleaf_t *leaf;
+	cbrush_t *b;
+
+	leaf = &map_leafs[leafnum];
+
+	if (!(leaf->contents & ctx->contents))
+	{
+		return;
+	}
+
+	/* trace line against all brushes in the leaf */
+	for (k = 0; k < leaf->numleafbrushes; k++)
+	{
+		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
+		b = &map_brushes[brushnum];
+
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
+		{
+			continue; /* already checked this brush in another leaf */
+		}
+
+		ctx->brushchecks[brushnum] = ctx->checkcount;
+
+		if (!(b->contents & ctx->contents))
+		{
+			continue;
+		}
+
+		CM_ClipBoxToBrush(ctx, b);
+
+		if (!ctx->trace.fraction)
+		{
+			return;
+		}
+	}
+}
+
+void
+CM_TestInLeaf(cmtrace_t *ctx, int leafnum)
+{
+	int k;
+	int brushnum;
+	cleaf_t *leaf;
+	cbrush_t *b;
+
+	leaf = &map_leafs[leafnum];
+
+	if (!(leaf->contents & ctx->contents))
+	{
+		return;
+	}
+
+	/* trace line against all brushes in the leaf */
+	for (k = 0; k < leaf->numleafbrushes; k++)
+	{
+		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
+		b = &map_brushes[brushnum];
+
+		if (ctx->brushchecks[brushnum] == ctx->checkcount)
+		{
+			continue; /* already checked this brush in another leaf */
+		}
+
+		ctx->brushchecks[brushnum] = ctx->checkcount;
+
+		if (!(b->contents & ctx->contents))
+		{
+			continue;
+		}
+
+		CM_TestBoxInBrush(ctx, b);
+
+		if (!ctx->trace.fraction)
+		{
+			return;
+		}
+	}
+}
+
+void
+CM_RecursiveHullCheck(cmtrace_t *ctx, int num, float p1f, float p2f,
+		vec3_t p1, vec3_t p2)
+{
+	cflatnode_t *node;
+	float t1, t2, offset, dist;
+	float frac, frac2;
+	float idist;
+	int i;
+	vec3_t mid;
+	int side;
+	float midf;
+
+	if (ctx->trace.fraction <= p1f)
+	{
+		return; /* already hit something nearer */
+	}
+
+	/* if < 0, we are in a leaf node */
+	if (num < 0)
+	{
+		CM_TraceToLeaf(ctx, -1 - num);
+		return;
+	}
+
+	/* find the point distances to the seperating plane
+	   and the offset for the size of the box */
+	node = &map_flatnodes[num];
+	dist = CM_FlatNodeDist(ctx, node, num);
+
+	if (node->type < 3)
+	{
+		t1 = p1[node->type] - dist;
+		t2 = p2[node->type] - dist;
+		offset = ctx->extents[node->type];
+	}
+
+	else
+	{
+		t1 = DotProduct(node->normal, p1) - dist;
+		t2 = DotProduct(node->normal, p2) - dist;
+
+		if (ctx->ispoint)
+		{
+			offset = 0;
+		}
+
+		else
+		{
+			offset = (float)fabs(ctx->extents[0] * node->normal[0]) +
+					 (float)fabs(ctx->extents[1] * node->normal[1]) +
+					 (float)fabs(ctx->extents[2] * node->normal[2]);
+		}
+	}
+
+	/* see which sides we need to consider */
+	if ((t1 >= offset) && (t2 >= offset))
+	{
+		CM_RecursiveHullCheck(ctx, node->children[0], p1f, p2f, p1, p2);
+		return;
+	}
+
+	if ((t1 < -offset) && (t2 < -offset))
+	{
+		CM_RecursiveHullCheck(ctx, node->children[1], p1f, p2f, p1, p2);
+		return;
+	}
+
+	/* put the crosspoint DIST_EPSILON pixels on the near side */
+	if (t1 < t2)
+	{
+		idist = 1.0f / (t1 - t2);
+		side = 1;
+		frac2 = (t1 + offset + DIST_EPSILON) * idist;
+		frac = (t1 - offset + DIST_EPSILON) * idist;
+	}
+
+	else if (t1 > t2)
+	{
+		idist = 1.0 / (t1 - t2);
+		side = 0;
+		frac2 = (t1 - offset - DIST_EPSILON) * idist;
+		frac = (t1 + offset + DIST_EPSILON) * idist;
+	}
+
+	else
+	{
+		side = 0;
+		frac = 1;
+		frac2 = 0;
+	}
+
+	/* move up to the node */
+	if (frac < 0)
+	{
+		frac = 0;
+	}
+
+	if (frac > 1)
+	{
+		frac = 1;
+	}
+
+	midf = p1f + (p2f - p1f) * frac;
+
+	for (i = 0; i < 3; i++)
+	{
+		mid[i] = p1[i] + frac * (p2[i] - p1[i]);
+	}
+
+	CM_RecursiveHullCheck(ctx, node->children[side], p1f, midf, p1, mid);
+
+	/* go past the node */
+	if (frac2 < 0)
+	{
+		frac2 = 0;
+	}
+
+	if (frac2 > 1)
+	{
+		frac2 = 1;
+	}
+
+	midf = p1f + (p2f - p1f) * frac2;
+
+	for (i = 0; i < 3; i++)
+	{
+		mid[i] = p1[i] + frac2 * (p2[i] - p1[i]);
+	}
+
+	CM_RecursiveHullCheck(ctx, node->children[side ^ 1], midf, p2f, mid, p2);
+}
+
+/*
+ * Everything a trace changes is in ctx, traces with
+ * different contexts can run at the same time.
+ */
+trace_t
+CM_BoxTrace_r(cmtrace_t *ctx, vec3_t start, vec3_t end, vec3_t mins,
+		vec3_t maxs, int headnode, int brushmask)
+{
+	int i;
+
+	/* for multi-check avoidance, the stamps
+	   start over before the counter wraps */
+	if (ctx->checkcount == INT_MAX)
+	{
+		memset(ctx->brushchecks, 0, sizeof(ctx->brushchecks));
+		ctx->checkcount = 0;
+	}
+
+	ctx->checkcount++;
+
+	/* fill in a default trace */
+	memset(&ctx->trace, 0, sizeof(ctx->trace));
+	ctx->trace.fraction = 1;
+	ctx->trace.surface = &(nullsurface.c);
+
+	if (!numnodes)  /* map not loaded */
+	{
+		return ctx->trace;
+	}
+
+	ctx->contents = brushmask;
+	ctx->simd = map_simd->value != 0;
+	VectorCopy(start, ctx->start);
+	VectorCopy(end, ctx->end);
+	VectorCopy(mins, ctx->mins);
+	VectorCopy(maxs, ctx->maxs);
+
+	/* check for position test special case */
+	if ((start[0] == end[0]) && (start[1] == end[1]) && (start[2] == end[2]))
+	{
+		int leafs[1024];
+		int i, numleafs;
+		vec3_t c1, c2;
+		int topnode;
+
+		VectorAdd(start, mins, c1);
+		VectorAdd(start, maxs, c2);
+
+		for (i = 0; i < 3; i++)
+		{
+			c1[i] -= 1;
+			c2[i] += 1;
+		}
+
+		numleafs = CM_BoxLeafnums_headnode(ctx, c1, c2, leafs, 1024,
+				headnode, &topnode);
+
+		for (i = 0; i < numleafs; i++)
+		{
+			CM_TestInLeaf(ctx, leafs[i]);
+
+			if (ctx->trace.allsolid)
+			{
+				break;
+			}
+		}
+
+		VectorCopy(start, ctx->trace.endpos);
+		return ctx->trace;
+	}
+
+	/* check for point special case */
+	if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
+		(maxs[0] == 0) && (maxs[1] == 0) && (maxs[2] == 0))
+	{
+		ctx->ispoint = true;
+		VectorClear(ctx->extents);
+	}
+
+	else
+	{
+		ctx->ispoint = false;
+		ctx->extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
+		ctx->extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
+		ctx->extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
+	}
+
+	/* general sweeping through world */
+	CM_RecursiveHullCheck(ctx, CM_FlatNode(headnode), 0, 1, start, end);
+
+	if (ctx->trace.fraction == 1)
+	{
+		VectorCopy(end, ctx->trace.endpos);
+	}
+
+	else
+	{
+		for (i = 0; i < 3; i++)
+		{
+			ctx->trace.endpos[i] = start[i] + ctx->trace.fraction *
+									(end[i] - start[i]);
+		}
+	}
+
+	return ctx->trace;
+}
+
+trace_t
+CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask)
+{
+#ifndef DEDICATED_ONLY
+	c_traces++; /* for statistics, may be zeroed */
+	cm_trace.brushtraces = 0;
+#endif
+
+	CM_BoxTrace_r(&cm_trace, start, end, mins, maxs, headnode, brushmask);
+
+#ifndef DEDICATED_ONLY
+	c_brush_traces += cm_trace.brushtraces;
+#endif
+
+	if (cm_capturing)
+	{
+		CM_CaptureTrace(start, end, mins, maxs, headnode, brushmask,
+				NULL, NULL, &cm_trace.trace);
+	}
+
+	return cm_trace.trace;
+}
+
+/*
+ * Handles offseting and rotation of the end points for moving and
+ * rotating entities
+ */
+trace_t
+CM_TransformedBoxTrace_r(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask,
+		vec3_t origin, vec3_t angles)
+{
+	trace_t trace;
+	vec3_t start_l, end_l;
+	vec3_t a;
+	vec3_t forward, right, up;
+	vec3_t temp;
+	qboolean rotated;
+
+	/* subtract origin offset */
+	VectorSubtract(start, origin, start_l);
+	VectorSubtract(end, origin, end_l);
+
+	/* rotate start and end into the models frame of reference */
+	if ((headnode != box_headnode) &&
+		(angles[0] || angles[1] || angles[2]))
+	{
+		rotated = true;
+	}
+
+	else
+	{
+		rotated = false;
+	}
+
+	if (rotated)
+	{
+		AngleVectors(angles, forward, right, up);
+
+		VectorCopy(start_l, temp);
+		start_l[0] = DotProduct(temp, forward);
+		start_l[1] = -DotProduct(temp, right);
+		start_l[2] = DotProduct(temp, up);
+
+		VectorCopy(end_l, temp);
+		end_l[0] = DotProduct(temp, forward);
+		end_l[1] = -DotProduct(temp, right);
+		end_l[2] = DotProduct(temp, up);
+	}
+
+	/* sweep the box through the model */
+	trace = CM_BoxTrace_r(ctx, start_l, end_l, mins, maxs,
+			headnode, brushmask);
+
+	if (rotated && (trace.fraction != 1.0))
+	{
+		VectorNegate(angles, a);
+		AngleVectors(a, forward, right, up);
+
+		VectorCopy(trace.plane.normal, temp);
+		trace.plane.normal[0] = DotProduct(temp, forward);
+		trace.plane.normal[1] = -DotProduct(temp, right);
+		trace.plane.normal[2] = DotProduct(temp, up);
+	}
+
+	trace.endpos[0] = start[0] + trace.fraction * (end[0] - start[0]);
+	trace.endpos[1] = start[1] + trace.fraction * (end[1] - start[1]);
+	trace.endpos[2] = start[2] + trace.fraction * (end[2] - start[2]);
+
+	return trace;
+}
+
+trace_t
+CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask, vec3_t origin, vec3_t angles)
+{
+	trace_t trace;
+
+#ifndef DEDICATED_ONLY
+	c_traces++;
+	cm_trace.brushtraces = 0;
+#endif
+
+	trace = CM_TransformedBoxTrace_r(&cm_trace, start, end, mins, maxs,
+			headnode, brushmask, origin, angles);
+
+#ifndef DEDICATED_ONLY
+	c_brush_traces += cm_trace.brushtraces;
+#endif
 
-			trace->fraction = enterfrac;
-			trace->plane = *clipplane;
-			trace->surface = &(leadside->surface->c);
-			trace->contents = brush->contents;
-		}
+	if (cm_capturing)
+	{
+		CM_CaptureTrace(start, end, mins, maxs, headnode, brushmask,
+				origin, angles, &trace);
 	}
+
+	return trace;
 }
 
 void
-CM_TestBoxInBrush(vec3_t mins, vec3_t maxs, vec3_t p1, 
-		trace_t *trace, cbrush_t *brush)
+CMod_LoadSubmodels(lump_t *l)
 {
-	int i, j;
-	cplane_t *plane;
-	float dist;
-	vec3_t ofs;
-	float d1;
-	cbrushside_t *side;
+	dmodel_t *in;
+	cmodel_t *out;
+	int i, j, count;
 
-	if (!brush->numsides)
+	in = (void *)(cmod_base + l->fileofs);
+
+	if (l->filelen % sizeof(*in))
 	{
-		return;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	for (i = 0; i < brush->numsides; i++)
-	{
-		side = &map_brushsides[brush->firstbrushside + i];
-		plane = side->plane;
+	count = l->filelen / sizeof(*in);
 
-		/* general box case
-		   push the plane out
-		   apropriately for mins/maxs */
-		for (j = 0; j < 3; j++)
-		{
-			if (plane->normal[j] < 0)
-			{
-				ofs[j] = maxs[j];
-			}
+	if (count < 1)
+	{
+		Com_Error(ERR_DROP, "Map with no models");
+	}
 
-			else
-			{
-				ofs[j] = mins[j];
-			}
-		}
+	if (count > MAX_MAP_MODELS)
+	{
+		Com_Error(ERR_DROP, "Map has too many models");
+	}
 
-		dist = DotProduct(ofs, plane->normal);
-		dist = plane->dist - dist;
+	numcmodels = count;
 
-		d1 = DotProduct(p1, plane->normal) - dist;
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		out = &map_cmodels[i];
 
-		/* if completely in front of face, no intersection */
-		if (d1 > 0)
+		for (j = 0; j < 3; j++)
 		{
-			return;
+			/* spread the mins / maxs by a pixel */
+			out->mins[j] = LittleFloat(in->mins[j]) - 1;
+			out->maxs[j] = LittleFloat(in->maxs[j]) + 1;
+			out->origin[j] = LittleFloat(in->origin[j]);
 		}
-	}
 
-	/* inside this brush */
-	trace->startsolid = trace->allsolid = true;
-	trace->fraction = 0;
-	trace->contents = brush->contents;
+		out->headnode = LittleLong(in->headnode);
+	}
 }
 
 void
-CM_TraceToLeaf(int leafnum)
+CMod_LoadSurfaces(lump_t *l)
 {
-	int k;
-	int brushnum;
-	cleaf_t *leaf;
-	cbrush_t *b;
+	texinfo_t *in;
+	mapsurface_t *out;
+	int i, count;
 
-	leaf = &map_leafs[leafnum];
+	in = (void *)(cmod_base + l->fileofs);
 
-	if (!(leaf->contents & trace_contents))
+	if (l->filelen % sizeof(*in))
 	{
-		return;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	/* trace line against all brushes in the leaf */
-	for (k = 0; k < leaf->numleafbrushes; k++)
-	{
-		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
-		b = &map_brushes[brushnum];
-
-		if (b->checkcount == checkcount)
-		{
-			continue; /* already checked this brush in another leaf */
-		}
+	count = l->filelen / sizeof(*in);
 
-		b->checkcount = checkcount;
+	if (count < 1)
+	{
+		Com_Error(ERR_DROP, "Map with no surfaces");
+	}
 
-		if (!(b->contents & trace_contents))
-		{
-			continue;
-		}
+	if (count > MAX_MAP_TEXINFO)
+	{
+		Com_Error(ERR_DROP, "Map has too many surfaces");
+	}
 
-		CM_ClipBoxToBrush(trace_mins, trace_maxs, trace_start,
-				trace_end, &trace_trace, b);
+	numtexinfo = count;
+	out = map_surfaces;
 
-		if (!trace_trace.fraction)
-		{
-			return;
-		}
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		Q_strlcpy(out->c.name, in->texture, sizeof(out->c.name));
+		Q_strlcpy(out->rname, in->texture, sizeof(out->rname));
+		out->c.flags = LittleLong(in->flags);
+		out->c.value = LittleLong(in->value);
 	}
 }
 
 void
-CM_TestInLeaf(int leafnum)
+CMod_LoadNodes(lump_t *l)
 {
-	int k;
-	int brushnum;
-	cleaf_t *leaf;
-	cbrush_t *b;
+	dnode_t *in;
+	int child;
+	cnode_t *out;
+	int i, j, count;
 
-	leaf = &map_leafs[leafnum];
+	in = (void *)(cmod_base + l->fileofs);
 
-	if (!(leaf->contents & trace_contents))
+	if (l->filelen % sizeof(*in))
 	{
-		return;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	/* trace line against all brushes in the leaf */
-	for (k = 0; k < leaf->numleafbrushes; k++)
+	count = l->filelen / sizeof(*in);
+
+	if (count < 1)
 	{
-		brushnum = map_leafbrushes[leaf->firstleafbrush + k];
-		b = &map_brushes[brushnum];
+		Com_Error(ERR_DROP, "Map has no nodes");
+	}
 
-		if (b->checkcount == checkcount)
-		{
-			continue; /* already checked this brush in another leaf */
-		}
+	if (count > MAX_MAP_NODES)
+	{
+		Com_Error(ERR_DROP, "Map has too many nodes");
+	}
 
-		b->checkcount = checkcount;
+	out = map_nodes;
 
-		if (!(b->contents & trace_contents))
-		{
-			continue;
-		}
+	numnodes = count;
 
-		CM_TestBoxInBrush(trace_mins, trace_maxs, trace_start, &trace_trace, b);
+	for (i = 0; i < count; i++, out++, in++)
+	{
+		out->planenum = LittleLong(in->planenum);
 
-		if (!trace_trace.fraction)
+		for (j = 0; j < 2; j++)
 		{
-			return;
+			child = LittleLong(in->children[j]);
+			out->children[j] = child;
 		}
 	}
 }
 
 void
-CM_RecursiveHullCheck(int num, float p1f, float p2f, vec3_t p1, vec3_t p2)
+CMod_LoadBrushes(lump_t *l)
 {
-	cnode_t *node;
-	cplane_t *plane;
-	float t1, t2, offset;
-	float frac, frac2;
-	float idist;
-	int i;
-	vec3_t mid;
-	int side;
-	float midf;
+	dbrush_t *in;
+	cbrush_t *out;
+	int i, count;
 
-	if (trace_trace.fraction <= p1f)
-	{
-		return; /* already hit something nearer */
-	}
+	in = (void *)(cmod_base + l->fileofs);
 
-	/* if < 0, we are in a leaf node */
-	if (num < 0)
+	if (l->filelen % sizeof(*in))
 	{
-		CM_TraceToLeaf(-1 - num);
-		return;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	/* find the point distances to the seperating plane
-	   and the offset for the size of the box */
-	node = map_nodes + num;
-	plane = node->plane;
+	count = l->filelen / sizeof(*in);
 
-	if (plane->type < 3)
+	if (count > MAX_MAP_BRUSHES)
 	{
-		t1 = p1[plane->type] - plane->dist;
-		t2 = p2[plane->type] - plane->dist;
-		offset = trace_extents[plane->type];
+		Com_Error(ERR_DROP, "Map has too many brushes");
 	}
 
-	else
-	{
-		t1 = DotProduct(plane->normal, p1) - plane->dist;
-		t2 = DotProduct(plane->normal, p2) - plane->dist;
-
-		if (trace_ispoint)
-		{
-			offset = 0;
-		}
+	out = map_brushes;
 
-		else
-		{
-			offset = (float)fabs(trace_extents[0] * plane->normal[0]) +
-					 (float)fabs(trace_extents[1] * plane->normal[1]) +
-					 (float)fabs(trace_extents[2] * plane->normal[2]);
-		}
-	}
+	numbrushes = count;
 
-	/* see which sides we need to consider */
-	if ((t1 >= offset) && (t2 >= offset))
+	for (i = 0; i < count; i++, out++, in++)
 	{
-		CM_RecursiveHullCheck(node->children[0], p1f, p2f, p1, p2);
-		return;
+		out->firstbrushside = LittleLong(in->firstside);
+		out->numsides = LittleLong(in->numsides);
+		out->contents = LittleLong(in->contents);
 	}
+}
 
-	if ((t1 < -offset) && (t2 < -offset))
-	{
-		CM_RecursiveHullCheck(node->children[1], p1f, p2f, p1, p2);
-		return;
-	}
+void
+CMod_LoadLeafs(lump_t *l)
+{
+	int i;
+	cleaf_t *out;
+	dleaf_t *in;
+	int count;
 
-	/* put the crosspoint DIST_EPSILON pixels on the near side */
-	if (t1 < t2)
-	{
-		idist = 1.0f / (t1 - t2);
-		side = 1;
-		frac2 = (t1 + offset + DIST_EPSILON) * idist;
-		frac = (t1 - offset + DIST_EPSILON) * idist;
-	}
+	in = (void *)(cmod_base + l->fileofs);
 
-	else if (t1 > t2)
+	if (l->filelen % sizeof(*in))
 	{
-		idist = 1.0 / (t1 - t2);
-		side = 0;
-		frac2 = (t1 - offset - DIST_EPSILON) * idist;
-		frac = (t1 + offset + DIST_EPSILON) * idist;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	else
-	{
-		side = 0;
-		frac = 1;
-		frac2 = 0;
-	}
+	count = l->filelen / sizeof(*in);
 
-	/* move up to the node */
-	if (frac < 0)
+	if (count < 1)
 	{
-		frac = 0;
+		Com_Error(ERR_DROP, "Map with no leafs");
 	}
 
-	if (frac > 1)
+	/* need to save space for box planes */
+	if (count > MAX_MAP_PLANES)
 	{
-		frac = 1;
+		Com_Error(ERR_DROP, "Map has too many planes");
 	}
 
-	midf = p1f + (p2f - p1f) * frac;
+	out = map_leafs;
+	numleafs = count;
+	numclusters = 0;
 
-	for (i = 0; i < 3; i++)
+	for (i = 0; i < count; i++, in++, out++)
 	{
-		mid[i] = p1[i] + frac * (p2[i] - p1[i]);
+		out->contents = LittleLong(in->contents);
+		out->cluster = LittleShort(in->cluster);
+		out->area = LittleShort(in->area);
+		out->firstleafbrush = LittleShort(in->firstleafbrush);
+		out->numleafbrushes = LittleShort(in->numleafbrushes);
+
+		if (out->cluster >= numclusters)
+		{
+			numclusters = out->cluster + 1;
+		}
 	}
 
-	CM_RecursiveHullCheck(node->children[side], p1f, midf, p1, mid);
-
-	/* go past the node */
-	if (frac2 < 0)
+	if (map_leafs[0].contents != CONTENTS_SOLID)
 	{
-		frac2 = 0;
+		Com_Error(ERR_DROP, "Map leaf 0 is not CONTENTS_SOLID");
 	}
 
-	if (frac2 > 1)
+	solidleaf = 0;
+	emptyleaf = -1;
+
+	for (i = 1; i < numleafs; i++)
 	{
-		frac2 = 1;
+		if (!map_leafs[i].contents)
+		{
+			emptyleaf = i;
+			break;
+		}
 	}
 
-	midf = p1f + (p2f - p1f) * frac2;
-
-	for (i = 0; i < 3; i++)
+	if (emptyleaf == -1)
 	{
-		mid[i] = p1[i] + frac2 * (p2[i] - p1[i]);
+		Com_Error(ERR_DROP, "Map does not have an empty leaf");
 	}
-
-	CM_RecursiveHullCheck(node->children[side ^ 1], midf, p2f, mid, p2);
 }
 
-trace_t
-CM_BoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
-		int headnode, int brushmask)
+void
+CMod_LoadPlanes(lump_t *l)
 {
-	int i;
-
-	checkcount++; /* for multi-check avoidance */
-
-#ifndef DEDICATED_ONLY
-	c_traces++; /* for statistics, may be zeroed */
-#endif
+	int i, j;
+	cplane_t *out;
+	dplane_t *in;
+	int count;
+	int bits;
 
-	/* fill in a default trace */
-	memset(&trace_trace, 0, sizeof(trace_trace));
-	trace_trace.fraction = 1;
-	trace_trace.surface = &(nullsurface.c);
+	in = (void *)(cmod_base + l->fileofs);
 
-	if (!numnodes)  /* map not loaded */
+	if (l->filelen % sizeof(*in))
 	{
-		return trace_trace;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	trace_contents = brushmask;
-	VectorCopy(start, trace_start);
-	VectorCopy(end, trace_end);
-	VectorCopy(mins, trace_mins);
-	VectorCopy(maxs, trace_maxs);
+	count = l->filelen / sizeof(*in);
 
-	/* check for position test special case */
-	if ((start[0] == end[0]) && (start[1] == end[1]) && (start[2] == end[2]))
+	if (count < 1)
 	{
-		int leafs[1024];
-		int i, numleafs;
-		vec3_t c1, c2;
-		int topnode;
+		Com_Error(ERR_DROP, "Map with no planes");
+	}
 
-		VectorAdd(start, mins, c1);
-		VectorAdd(start, maxs, c2);
+	/* need to save space for box planes */
+	if (count > MAX_MAP_PLANES)
+	{
+		Com_Error(ERR_DROP, "Map has too many planes");
+	}
 
-		for (i = 0; i < 3; i++)
-		{
-			c1[i] -= 1;
-			c2[i] += 1;
-		}
+	out = map_planes;
+	numplanes = count;
 
-		numleafs = CM_BoxLeafnums_headnode(c1, c2, leafs, 1024,
-				headnode, &topnode);
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		bits = 0;
 
-		for (i = 0; i < numleafs; i++)
+		for (j = 0; j < 3; j++)
 		{
-			CM_TestInLeaf(leafs[i]);
+			out->normal[j] = LittleFloat(in->normal[j]);
 
-			if (trace_trace.allsolid)
+			if (out->normal[j] < 0)
 			{
-				break;
+				bits |= 1 << j;
 			}
 		}
 
-		VectorCopy(start, trace_trace.endpos);
-		return trace_trace;
+		out->dist = LittleFloat(in->dist);
+		out->type = LittleLong(in->type);
+		out->signbits = bits;
 	}
+}
 
-	/* check for point special case */
-	if ((mins[0] == 0) && (mins[1] == 0) && (mins[2] == 0) &&
-		(maxs[0] == 0) && (maxs[1] == 0) && (maxs[2] == 0))
-	{
-		trace_ispoint = true;
-		VectorClear(trace_extents);
-	}
+void
+CMod_LoadLeafBrushes(lump_t *l)
+{
+	int i;
+	unsigned short *out;
+	unsigned short *in;
+	int count;
 
-	else
+	in = (void *)(cmod_base + l->fileofs);
+
+	if (l->filelen % sizeof(*in))
 	{
-		trace_ispoint = false;
-		trace_extents[0] = -mins[0] > maxs[0] ? -mins[0] : maxs[0];
-		trace_extents[1] = -mins[1] > maxs[1] ? -mins[1] : maxs[1];
-		trace_extents[2] = -mins[2] > maxs[2] ? -mins[2] : maxs[2];
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	/* general sweeping through world */
-	CM_RecursiveHullCheck(headnode, 0, 1, start, end);
+	count = l->filelen / sizeof(*in);
 
-	if (trace_trace.fraction == 1)
+	if (count < 1)
 	{
-		VectorCopy(end, trace_trace.endpos);
+		Com_Error(ERR_DROP, "Map with no planes");
 	}
 
-	else
+	/* need to save space for box planes */
+	if (count > MAX_MAP_LEAFBRUSHES)
 	{
-		for (i = 0; i < 3; i++)
-		{
-			trace_trace.endpos[i] = start[i] + trace_trace.fraction *
-									(end[i] - start[i]);
-		}
+		Com_Error(ERR_DROP, "Map has too many leafbrushes");
 	}
 
-	return trace_trace;
+	out = map_leafbrushes;
+	numleafbrushes = count;
+
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		*out = LittleShort(*in);
+	}
 }
 
-/*
- * Handles offseting and rotation of the end points for moving and
- * rotating entities
- */
-trace_t
-CM_TransformedBoxTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
-		int headnode, int brushmask, vec3_t origin, vec3_t angles)
+void
+CMod_LoadBrushSides(lump_t *l)
 {
-	trace_t trace;
-	vec3_t start_l, end_l;
-	vec3_t a;
-	vec3_t forward, right, up;
-	vec3_t temp;
-	qboolean rotated;
+	int i, j;
+	cbrushside_t *out;
+	dbrushside_t *in;
+	int count;
+	int num;
 
-	/* subtract origin offset */
-	VectorSubtract(start, origin, start_l);
-	VectorSubtract(end, origin, end_l);
+	in = (void *)(cmod_base + l->fileofs);
 
-	/* rotate start and end into the models frame of reference */
-	if ((headnode != box_headnode) &&
-		(angles[0] || angles[1] || angles[2]))
+	if (l->filelen % sizeof(*in))
 	{
-		rotated = true;
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
 	}
 
-	else
+	count = l->filelen / sizeof(*in);
+
+	/* need to save space for box planes */
+	if (count > MAX_MAP_BRUSHSIDES)
 	{
-		rotated = false;
+		Com_Error(ERR_DROP, "Map has too many planes");
 	}
 
-	if (rotated)
+	out = map_brushsides;
+	numbrushsides = count;
+
+	for (i = 0; i < count; i++, in++, out++)
 	{
-		AngleVectors(angles, forward, right, up);
+		num = LittleShort(in->planenum);
+		out->planenum = num;
+		j = LittleShort(in->texinfo);
 
-		VectorCopy(start_l, temp);
-		start_l[0] = DotProduct(temp, forward);
-		start_l[1] = -DotProduct(temp, right);
-		start_l[2] = DotProduct(temp, up);
+		if (j >= numtexinfo)
+		{
+			Com_Error(ERR_DROP, "Bad brushside texinfo");
+		}
 
-		VectorCopy(end_l, temp);
-		end_l[0] = DotProduct(temp, forward);
-		end_l[1] = -DotProduct(temp, right);
-		end_l[2] = DotProduct(temp, up);
+		out->surfacenum = j;
 	}
+}
 
-	/* sweep the box through the model */
-	trace = CM_BoxTrace(start_l, end_l, mins, maxs, headnode, brushmask);
+void
+CMod_LoadAreas(lump_t *l)
+{
+	int i;
+	carea_t *out;
+	darea_t *in;
+	int count;
 
-	if (rotated && (trace.fraction != 1.0))
+	in = (void *)(cmod_base + l->fileofs);
+
+	if (l->filelen % sizeof(*in))
 	{
-		VectorNegate(angles, a);
-		AngleVectors(a, forward, right, up);
+		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+	}
 
-		VectorCopy(trace.plane.normal, temp);
-		trace.plane.normal[0] = DotProduct(temp, forward);
-		trace.plane.normal[1] = -DotProduct(temp, right);
-		trace.plane.normal[2] = DotProduct(temp, up);
+	count = l->filelen / sizeof(*in);
+
+	if (count > MAX_MAP_AREAS)
+	{
+		Com_Error(ERR_DROP, "Map has too many areas");
 	}
 
-	trace.endpos[0] = start[0] + trace.fraction * (end[0] - start[0]);
-	trace.endpos[1] = start[1] + trace.fraction * (end[1] - start[1]);
-	trace.endpos[2] = start[2] + trace.fraction * (end[2] - start[2]);
+	out = map_areas;
+	numareas = count;
 
-	return trace;
+	for (i = 0; i < count; i++, in++, out++)
+	{
+		out->numareaportals = LittleLong(in->numareaportals);
+		out->firstareaportal = LittleLong(in->firstareaportal);
+		out->floodvalid = 0;
+		out->floodnum = 0;
+	}
 }
 
 void
-CMod_LoadSubmodels(lump_t *l)
+CMod_LoadAreaPortals(lump_t *l)
 {
-	dmodel_t *in;
-	cmodel_t *out;
-	int i, j, count;
+	dareaportal_t *out;
+	dareaportal_t *in;
+	int count;
 
 	in = (void *)(cmod_base + l->fileofs);
 
@@ -1191,435 +2598,694 @@ CMod_LoadSubmodels(lump_t *l)
 
 	count = l->filelen / sizeof(*in);
 
-	if (count < 1)
+	if (count > MAX_MAP_AREAS)
+	{
+		Com_Error(ERR_DROP, "Map has too many areas");
+	}
+
+	out = map_areaportals;
+	numareaportals = count;
+
+	memcpy(out, in, sizeof(dareaportal_t) * count);
+}
+
+void
+CMod_LoadVisibility(lump_t *l)
+{
+	numvisibility = l->filelen;
+
+	if (l->filelen > MAX_MAP_VISIBILITY)
+	{
+		Com_Error(ERR_DROP, "Map has too large visibility lump");
+	}
+
+	memcpy(map_visibility, cmod_base + l->fileofs, l->filelen);
+
+	map_vis->numclusters = LittleLong(map_vis->numclusters);
+}
+
+void
+CMod_LoadEntityString(lump_t *l)
+{
+	numentitychars = l->filelen;
+
+	if (l->filelen > MAX_MAP_ENTSTRING)
 	{
-		Com_Error(ERR_DROP, "Map with no models");
+		Com_Error(ERR_DROP, "Map has too large entity lump");
 	}
 
-	if (count > MAX_MAP_MODELS)
-	{
-		Com_Error(ERR_DROP, "Map has too many models");
-	}
+	memcpy(map_entitystring, cmod_base + l->fileofs, l->filelen);
+}
 
-	numcmodels = count;
+/*
+ * A map read by a background thread, while the
+ * current one is still played.
+ */
+typedef struct
+{
+	char name[MAX_QPATH];
+	void *thread;
+	fileHandle_t file;
+	byte *buf;
+	int length;
+	unsigned checksum;
+	qboolean ok;
+	volatile qboolean abort; /* set by CM_CancelPreload() */
+} cpreload_t;
 
-	for (i = 0; i < count; i++, in++, out++)
+static cpreload_t cm_preload;
+
+#define CM_PRELOAD_CHUNK 0x10000
+
+static void
+CM_PreloadThread(void *arg)
+{
+	cpreload_t *p = arg;
+	int chunk, done;
+
+	/* in chunks, so it can be aborted in time */
+	for (done = 0; done < p->length; done += chunk)
 	{
-		out = &map_cmodels[i];
+		if (p->abort)
+		{
+			return;
+		}
 
-		for (j = 0; j < 3; j++)
+		chunk = p->length - done;
+
+		if (chunk > CM_PRELOAD_CHUNK)
 		{
-			/* spread the mins / maxs by a pixel */
-			out->mins[j] = LittleFloat(in->mins[j]) - 1;
-			out->maxs[j] = LittleFloat(in->maxs[j]) + 1;
-			out->origin[j] = LittleFloat(in->origin[j]);
+			chunk = CM_PRELOAD_CHUNK;
 		}
 
-		out->headnode = LittleLong(in->headnode);
+		if (FS_ReadUnlocked(p->buf + done, chunk, p->file) != chunk)
+		{
+			return;
+		}
 	}
+
+	p->checksum = LittleLong(Com_BlockChecksum(p->buf, p->length));
+	p->ok = true;
 }
 
-void
-CMod_LoadSurfaces(lump_t *l)
+/*
+ * Waits for the preload thread. Returns the loaded file if
+ * it's the given map, otherwise it's thrown away. The buffer
+ * must be freed with FS_FreeFile().
+ */
+static byte *
+CM_TakePreload(char *name, int *length, unsigned *checksum)
 {
-	texinfo_t *in;
-	mapsurface_t *out;
-	int i, count;
-
-	in = (void *)(cmod_base + l->fileofs);
+	byte *buf;
 
-	if (l->filelen % sizeof(*in))
+	if (!cm_preload.thread)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		return NULL;
 	}
 
-	count = l->filelen / sizeof(*in);
+	Sys_WaitThread(cm_preload.thread);
+	FS_FCloseFile(cm_preload.file);
 
-	if (count < 1)
+	buf = NULL;
+
+	if (cm_preload.ok && name && !strcmp(name, cm_preload.name))
 	{
-		Com_Error(ERR_DROP, "Map with no surfaces");
+		buf = cm_preload.buf;
+		*length = cm_preload.length;
+		*checksum = cm_preload.checksum;
 	}
-
-	if (count > MAX_MAP_TEXINFO)
+	else
 	{
-		Com_Error(ERR_DROP, "Map has too many surfaces");
+		FS_FreeFile(cm_preload.buf);
 	}
 
-	numtexinfo = count;
-	out = map_surfaces;
+	memset(&cm_preload, 0, sizeof(cm_preload));
 
-	for (i = 0; i < count; i++, in++, out++)
-	{
-		Q_strlcpy(out->c.name, in->texture, sizeof(out->c.name));
-		Q_strlcpy(out->rname, in->texture, sizeof(out->rname));
-		out->c.flags = LittleLong(in->flags);
-		out->c.value = LittleLong(in->value);
-	}
+	return buf;
 }
 
+/*
+ * Stops the preload thread and throws its map away. Must be
+ * called before the file it reads from can go away: on server
+ * shutdown, on quit and when the game dir changes.
+ */
 void
-CMod_LoadNodes(lump_t *l)
+CM_CancelPreload(void)
 {
-	dnode_t *in;
-	int child;
-	cnode_t *out;
-	int i, j, count;
-
-	in = (void *)(cmod_base + l->fileofs);
+	int length;
+	unsigned checksum;
 
-	if (l->filelen % sizeof(*in))
+	if (!cm_preload.thread)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		return;
 	}
 
-	count = l->filelen / sizeof(*in);
+	cm_preload.abort = true;
+	CM_TakePreload(NULL, &length, &checksum);
+}
 
-	if (count < 1)
+/*
+ * Starts reading the given map in the background, so a
+ * following CM_LoadMap() doesn't need to wait for the
+ * disk. Only one map is preloaded at a time.
+ */
+void
+CM_PreloadMap(char *name)
+{
+	int length;
+	unsigned checksum;
+	fileHandle_t f;
+
+	if (!name || !name[0] || !strcmp(name, map_name))
 	{
-		Com_Error(ERR_DROP, "Map has no nodes");
+		return;
 	}
 
-	if (count > MAX_MAP_NODES)
+	if (cm_preload.thread && !strcmp(name, cm_preload.name))
 	{
-		Com_Error(ERR_DROP, "Map has too many nodes");
+		return; /* already on its way */
 	}
 
-	out = map_nodes;
+	CM_TakePreload(NULL, &length, &checksum);
 
-	numnodes = count;
+	length = FS_FOpenFile(name, &f, false);
 
-	for (i = 0; i < count; i++, out++, in++)
+	if (length <= 0)
 	{
-		out->plane = map_planes + LittleLong(in->planenum);
-
-		for (j = 0; j < 2; j++)
+		if (f)
 		{
-			child = LittleLong(in->children[j]);
-			out->children[j] = child;
+			FS_FCloseFile(f);
 		}
-	}
-}
 
-void
-CMod_LoadBrushes(lump_t *l)
-{
-	dbrush_t *in;
-	cbrush_t *out;
-	int i, count;
+		return;
+	}
 
-	in = (void *)(cmod_base + l->fileofs);
+	Q_strlcpy(cm_preload.name, name, sizeof(cm_preload.name));
+	cm_preload.file = f;
+	cm_preload.buf = Z_Malloc(length);
+	cm_preload.length = length;
+	cm_preload.thread = Sys_CreateThread(CM_PreloadThread, &cm_preload);
 
-	if (l->filelen % sizeof(*in))
+	if (!cm_preload.thread)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		FS_FCloseFile(f);
+		FS_FreeFile(cm_preload.buf);
+		memset(&cm_preload, 0, sizeof(cm_preload));
+		return;
 	}
 
-	count = l->filelen / sizeof(*in);
+	Com_DPrintf("Preloading %s\n", name);
+}
 
-	if (count > MAX_MAP_BRUSHES)
-	{
-		Com_Error(ERR_DROP, "Map has too many brushes");
-	}
+/*
+ * The collision cache holds the parsed nodes, planes, leafs and
+ * brushes of a map, the box hull included, the decompressed PVS
+ * and PHS, and what's built from them for the traces: the flat
+ * nodes and the brush lanes. It's written on the first load and
+ * mapped copy on write by every later one, so processes running
+ * the same map share it. Only the page with the box hull planes
+ * gets private. The file is native endian, the version and the
+ * lump sizes reject caches written by other builds.
+ */
+#define CMCACHE_IDENT (('M' << 24) + ('C' << 16) + ('Q' << 8) + 'Y')
+#define CMCACHE_VERSION 2
 
-	out = map_brushes;
+enum
+{
+	CMCACHE_PLANES,
+	CMCACHE_NODES,
+	CMCACHE_LEAFS,
+	CMCACHE_LEAFBRUSHES,
+	CMCACHE_BRUSHES,
+	CMCACHE_BRUSHSIDES,
+	CMCACHE_PVS,
+	CMCACHE_PHS,
+	CMCACHE_FLATNODES,
+	CMCACHE_FLATNUM,
+	CMCACHE_BRUSHLANES,      /* empty without CM_SIMD */
+	CMCACHE_BRUSHFIRSTLANES,
+	CMCACHE_LUMPS
+};
 
-	numbrushes = count;
+typedef struct
+{
+	int ident;
+	int version;
+	unsigned checksum; /* of the bsp */
+	int numplanes, numnodes, numleafs;
+	int numleafbrushes, numbrushes, numbrushsides;
+	int numclusters, emptyleaf;
+	int rowbytes;
+	lump_t lumps[CMCACHE_LUMPS];
+} cmcache_t;
+
+static void *cm_cachebase;
+static int cm_cachelength;
+
+void CM_DecompressVis(byte *in, byte *out);
+static void CM_BuildVisRows(void);
+static void CM_FreeVisRows(void);
+
+static void
+CM_CacheName(char *name, unsigned checksum, char *path, int size)
+{
+	char base[MAX_QPATH];
 
-	for (i = 0; i < count; i++, out++, in++)
+	COM_FileBase(name, base);
+	Com_sprintf(path, size, "%s/cmcache/%s-%08x.cm", FS_Gamedir(),
+			base, checksum);
+}
+
+/*
+ * Back to the private arrays.
+ */
+static void
+CM_UnmapCache(void)
+{
+	if (!cm_cachebase)
 	{
-		out->firstbrushside = LittleLong(in->firstside);
-		out->numsides = LittleLong(in->numsides);
-		out->contents = LittleLong(in->contents);
+		return;
+	}
+
+#ifdef CM_SIMD
+	/* the lanes were mapped as well, not allocated */
+	if (((byte *)map_brushlanes >= (byte *)cm_cachebase) &&
+		((byte *)map_brushlanes < (byte *)cm_cachebase + cm_cachelength))
+	{
+		map_brushlanes = NULL;
+		map_brushfirstlanes = NULL;
 	}
+#endif
+
+	Sys_UnmapFile(cm_cachebase, cm_cachelength);
+	cm_cachebase = NULL;
+
+	map_planes = cm_planes;
+	map_nodes = cm_nodes;
+	map_leafs = cm_leafs;
+	map_leafbrushes = cm_leafbrushes;
+	map_brushes = cm_brushes;
+	map_brushsides = cm_brushsides;
+	map_pvs = map_phs = NULL;
+	map_flatnodes = cm_flatnodes;
+	map_flatnum = cm_flatnum;
 }
 
-void
-CMod_LoadLeafs(lump_t *l)
+/*
+ * Returns a pointer to the lump if it's inside
+ * the file and has count elements of size.
+ */
+static void *
+CM_CacheLump(cmcache_t *header, int lump, int count, int size)
 {
-	int i;
-	cleaf_t *out;
-	dleaf_t *in;
-	int count;
+	lump_t *l;
 
-	in = (void *)(cmod_base + l->fileofs);
+	l = &header->lumps[lump];
 
-	if (l->filelen % sizeof(*in))
+	if ((l->fileofs < sizeof(*header)) || (l->filelen != count * size) ||
+		(l->fileofs > cm_cachelength - l->filelen))
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		return NULL;
 	}
 
-	count = l->filelen / sizeof(*in);
+	return (byte *)cm_cachebase + l->fileofs;
+}
 
-	if (count < 1)
-	{
-		Com_Error(ERR_DROP, "Map with no leafs");
-	}
+/*
+ * Checks that every index in the mapped
+ * lumps is inside the map. The file may be
+ * damaged or written by someone else, the
+ * traces don't check anything.
+ */
+static qboolean
+CM_CheckCache(cmcache_t *header)
+{
+	int planes, nodes, leafs, leafbrushes, brushes, brushsides;
+	cflatnode_t *flat;
+	cbrushside_t *side;
+	cplane_t *plane;
+	cbrush_t *brush;
+	cleaf_t *leaf;
+	cnode_t *node;
+	int i, j;
 
-	/* need to save space for box planes */
-	if (count > MAX_MAP_PLANES)
+	planes = header->numplanes + 12;
+	nodes = header->numnodes + 6;
+	leafs = header->numleafs + 1;
+	leafbrushes = header->numleafbrushes + 1;
+	brushes = header->numbrushes + 1;
+	brushsides = header->numbrushsides + 6;
+
+	if ((header->emptyleaf < 0) || (header->emptyleaf >= header->numleafs))
 	{
-		Com_Error(ERR_DROP, "Map has too many planes");
+		return false;
 	}
 
-	out = map_leafs;
-	numleafs = count;
-	numclusters = 0;
-
-	for (i = 0; i < count; i++, in++, out++)
+	for (i = 0, plane = map_planes; i < planes; i++, plane++)
 	{
-		out->contents = LittleLong(in->contents);
-		out->cluster = LittleShort(in->cluster);
-		out->area = LittleShort(in->area);
-		out->firstleafbrush = LittleShort(in->firstleafbrush);
-		out->numleafbrushes = LittleShort(in->numleafbrushes);
-
-		if (out->cluster >= numclusters)
+		if ((plane->type > 5) || (plane->signbits > 7))
 		{
-			numclusters = out->cluster + 1;
+			return false;
 		}
 	}
 
-	if (map_leafs[0].contents != CONTENTS_SOLID)
+	for (i = 0, node = map_nodes; i < nodes; i++, node++)
 	{
-		Com_Error(ERR_DROP, "Map leaf 0 is not CONTENTS_SOLID");
-	}
-
-	solidleaf = 0;
-	emptyleaf = -1;
+		if ((node->planenum < 0) || (node->planenum >= planes))
+		{
+			return false;
+		}
 
-	for (i = 1; i < numleafs; i++)
-	{
-		if (!map_leafs[i].contents)
+		for (j = 0; j < 2; j++)
 		{
-			emptyleaf = i;
-			break;
+			if ((node->children[j] >= nodes) ||
+				(node->children[j] < -leafs))
+			{
+				return false;
+			}
 		}
 	}
 
-	if (emptyleaf == -1)
+	for (i = 0, leaf = map_leafs; i < leafs; i++, leaf++)
 	{
-		Com_Error(ERR_DROP, "Map does not have an empty leaf");
+		if ((leaf->firstleafbrush + leaf->numleafbrushes > leafbrushes) ||
+			(leaf->cluster < -1) || (leaf->cluster >= header->numclusters) ||
+			(leaf->area < 0) || (leaf->area >= numareas))
+		{
+			return false;
+		}
 	}
-}
-
-void
-CMod_LoadPlanes(lump_t *l)
-{
-	int i, j;
-	cplane_t *out;
-	dplane_t *in;
-	int count;
-	int bits;
 
-	in = (void *)(cmod_base + l->fileofs);
-
-	if (l->filelen % sizeof(*in))
+	for (i = 0; i < leafbrushes; i++)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		if (map_leafbrushes[i] >= brushes)
+		{
+			return false;
+		}
 	}
 
-	count = l->filelen / sizeof(*in);
-
-	if (count < 1)
+	for (i = 0, brush = map_brushes; i < brushes; i++, brush++)
 	{
-		Com_Error(ERR_DROP, "Map with no planes");
+		if ((brush->numsides < 0) || (brush->firstbrushside < 0) ||
+			(brush->firstbrushside > brushsides - brush->numsides))
+		{
+			return false;
+		}
 	}
 
-	/* need to save space for box planes */
-	if (count > MAX_MAP_PLANES)
+	for (i = 0, side = map_brushsides; i < brushsides; i++, side++)
 	{
-		Com_Error(ERR_DROP, "Map has too many planes");
+		if ((side->planenum < 0) || (side->planenum >= planes) ||
+			(side->surfacenum < -1) || (side->surfacenum >= numtexinfo))
+		{
+			return false;
+		}
 	}
 
-	out = map_planes;
-	numplanes = count;
-
-	for (i = 0; i < count; i++, in++, out++)
+	for (i = 0, flat = map_flatnodes; i < nodes; i++, flat++)
 	{
-		bits = 0;
-
-		for (j = 0; j < 3; j++)
+		if ((flat->type < 0) || (flat->type > 5))
 		{
-			out->normal[j] = LittleFloat(in->normal[j]);
+			return false;
+		}
 
-			if (out->normal[j] < 0)
+		for (j = 0; j < 2; j++)
+		{
+			if ((flat->children[j] >= nodes) ||
+				(flat->children[j] < -leafs))
 			{
-				bits |= 1 << j;
+				return false;
 			}
 		}
-
-		out->dist = LittleFloat(in->dist);
-		out->type = LittleLong(in->type);
-		out->signbits = bits;
 	}
+
+	for (i = 0; i < header->numnodes; i++)
+	{
+		if ((map_flatnum[i] < 0) || (map_flatnum[i] >= header->numnodes))
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
-void
-CMod_LoadLeafBrushes(lump_t *l)
+#ifdef CM_SIMD
+/*
+ * Takes the brush lanes from the cache, if
+ * the build that wrote it had them. Else
+ * CM_LoadMap() builds them as usual.
+ */
+static void
+CM_MapBrushLanes(cmcache_t *header)
 {
-	int i;
-	unsigned short *out;
-	unsigned short *in;
-	int count;
-
-	in = (void *)(cmod_base + l->fileofs);
+	cbrushlanes_t *lanes;
+	int *first;
+	int count, i;
 
-	if (l->filelen % sizeof(*in))
-	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
-	}
+	count = CM_NumBrushLanes();
 
-	count = l->filelen / sizeof(*in);
+	lanes = CM_CacheLump(header, CMCACHE_BRUSHLANES,
+			count, sizeof(cbrushlanes_t));
+	first = CM_CacheLump(header, CMCACHE_BRUSHFIRSTLANES,
+			numbrushes, sizeof(int));
 
-	if (count < 1)
+	if (!count || !lanes || !first)
 	{
-		Com_Error(ERR_DROP, "Map with no planes");
+		return;
 	}
 
-	/* need to save space for box planes */
-	if (count > MAX_MAP_LEAFBRUSHES)
+	for (i = 0; i < numbrushes; i++)
 	{
-		Com_Error(ERR_DROP, "Map has too many leafbrushes");
+		if ((first[i] < 0) ||
+			(first[i] > count - ((map_brushes[i].numsides + 3) >> 2)))
+		{
+			return;
+		}
 	}
 
-	out = map_leafbrushes;
-	numleafbrushes = count;
-
-	for (i = 0; i < count; i++, in++, out++)
-	{
-		*out = LittleShort(*in);
-	}
+	map_brushlanes = lanes;
+	map_brushfirstlanes = first;
 }
+#endif
 
-void
-CMod_LoadBrushSides(lump_t *l)
+static qboolean
+CM_MapCache(char *name, unsigned checksum)
 {
-	int i, j;
-	cbrushside_t *out;
-	dbrushside_t *in;
-	int count;
-	int num;
+	char path[MAX_OSPATH];
+	cmcache_t *header;
+	int rows;
 
-	in = (void *)(cmod_base + l->fileofs);
+	CM_CacheName(name, checksum, path, sizeof(path));
+	cm_cachebase = Sys_MapFile(path, &cm_cachelength);
 
-	if (l->filelen % sizeof(*in))
+	if (!cm_cachebase)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		return false;
 	}
 
-	count = l->filelen / sizeof(*in);
+	header = cm_cachebase;
 
-	/* need to save space for box planes */
-	if (count > MAX_MAP_BRUSHSIDES)
+	if ((cm_cachelength < sizeof(*header)) ||
+		(header->ident != CMCACHE_IDENT) ||
+		(header->version != CMCACHE_VERSION) ||
+		(header->checksum != checksum) ||
+		(header->numplanes + 12 > MAX_MAP_PLANES) ||
+		(header->numnodes + 6 > MAX_MAP_NODES) ||
+		(header->numleafs + 1 > MAX_MAP_LEAFS) ||
+		(header->numleafbrushes + 1 > MAX_MAP_LEAFBRUSHES) ||
+		(header->numbrushes + 1 > MAX_MAP_BRUSHES) ||
+		(header->numbrushsides + 6 > MAX_MAP_BRUSHSIDES) ||
+		(header->numclusters > MAX_MAP_LEAFS) ||
+		(header->rowbytes != ((header->numclusters + 31) >> 5) << 2))
 	{
-		Com_Error(ERR_DROP, "Map has too many planes");
+		CM_UnmapCache();
+		return false;
 	}
 
-	out = map_brushsides;
-	numbrushsides = count;
+	rows = header->numclusters;
+
+	map_planes = CM_CacheLump(header, CMCACHE_PLANES,
+			header->numplanes + 12, sizeof(cplane_t));
+	map_nodes = CM_CacheLump(header, CMCACHE_NODES,
+			header->numnodes + 6, sizeof(cnode_t));
+	map_leafs = CM_CacheLump(header, CMCACHE_LEAFS,
+			header->numleafs + 1, sizeof(cleaf_t));
+	map_leafbrushes = CM_CacheLump(header, CMCACHE_LEAFBRUSHES,
+			header->numleafbrushes + 1, sizeof(unsigned short));
+	map_brushes = CM_CacheLump(header, CMCACHE_BRUSHES,
+			header->numbrushes + 1, sizeof(cbrush_t));
+	map_brushsides = CM_CacheLump(header, CMCACHE_BRUSHSIDES,
+			header->numbrushsides + 6, sizeof(cbrushside_t));
+	map_pvs = CM_CacheLump(header, CMCACHE_PVS, rows, header->rowbytes);
+	map_phs = CM_CacheLump(header, CMCACHE_PHS, rows, header->rowbytes);
+	map_flatnodes = CM_CacheLump(header, CMCACHE_FLATNODES,
+			header->numnodes + 6, sizeof(cflatnode_t));
+	map_flatnum = CM_CacheLump(header, CMCACHE_FLATNUM,
+			header->numnodes, sizeof(int));
+
+	if (!map_planes || !map_nodes || !map_leafs || !map_leafbrushes ||
+		!map_brushes || !map_brushsides || !map_pvs || !map_phs ||
+		!map_flatnodes || !map_flatnum || !CM_CheckCache(header))
+	{
+		Com_DPrintf("Ignoring the damaged %s\n", path);
+		CM_UnmapCache();
+		return false;
+	}
 
-	for (i = 0; i < count; i++, in++, out++)
-	{
-		num = LittleShort(in->planenum);
-		out->plane = &map_planes[num];
-		j = LittleShort(in->texinfo);
+	numplanes = header->numplanes;
+	numnodes = header->numnodes;
+	numleafs = header->numleafs;
+	numleafbrushes = header->numleafbrushes;
+	numbrushes = header->numbrushes;
+	numbrushsides = header->numbrushsides;
+	numclusters = header->numclusters;
+	map_visrowbytes = header->rowbytes;
+	solidleaf = 0;
+	emptyleaf = header->emptyleaf;
 
-		if (j >= numtexinfo)
-		{
-			Com_Error(ERR_DROP, "Bad brushside texinfo");
-		}
+	/* the box hull is in the file already */
+	CM_SetBoxHull();
 
-		out->surface = &map_surfaces[j];
-	}
+#ifdef CM_SIMD
+	CM_MapBrushLanes(header);
+#endif
+
+	Com_DPrintf("Mapped %s\n", path);
+
+	return true;
 }
 
-void
-CMod_LoadAreas(lump_t *l)
+static void
+CM_WriteCacheLump(FILE *f, cmcache_t *header, int lump, void *data, int len)
 {
-	int i;
-	carea_t *out;
-	darea_t *in;
-	int count;
+	static byte pad[16];
+	int ofs;
 
-	in = (void *)(cmod_base + l->fileofs);
+	ofs = ftell(f);
 
-	if (l->filelen % sizeof(*in))
+	if (ofs & 15)
 	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
+		fwrite(pad, 1, 16 - (ofs & 15), f);
+		ofs = ftell(f);
 	}
 
-	count = l->filelen / sizeof(*in);
+	header->lumps[lump].fileofs = ofs;
+	header->lumps[lump].filelen = len;
 
-	if (count > MAX_MAP_AREAS)
+	if (data)
 	{
-		Com_Error(ERR_DROP, "Map has too many areas");
+		fwrite(data, 1, len, f);
 	}
+}
 
-	out = map_areas;
-	numareas = count;
+static void
+CM_WriteCacheVis(FILE *f, cmcache_t *header, int lump, int vis)
+{
+	int i;
 
-	for (i = 0; i < count; i++, in++, out++)
+	CM_WriteCacheLump(f, header, lump, NULL, numclusters * header->rowbytes);
+
+	for (i = 0; i < numclusters; i++)
 	{
-		out->numareaportals = LittleLong(in->numareaportals);
-		out->firstareaportal = LittleLong(in->firstareaportal);
-		out->floodvalid = 0;
-		out->floodnum = 0;
+		memset(pvsrow, 0, header->rowbytes);
+		CM_DecompressVis(map_visibility +
+				LittleLong(map_vis->bitofs[i][vis]), pvsrow);
+		fwrite(pvsrow, 1, header->rowbytes, f);
 	}
 }
 
-void
-CMod_LoadAreaPortals(lump_t *l)
+/*
+ * Writes the just parsed map into the collision cache. It's
+ * written under a temporary name and renamed, so that other
+ * processes never map a half written file.
+ */
+static void
+CM_WriteCache(char *name, unsigned checksum)
 {
-	dareaportal_t *out;
-	dareaportal_t *in;
-	int count;
-
-	in = (void *)(cmod_base + l->fileofs);
+	char path[MAX_OSPATH];
+	char tmp[MAX_OSPATH];
+	cmcache_t header;
+	FILE *f;
+	qboolean ok;
 
-	if (l->filelen % sizeof(*in))
-	{
-		Com_Error(ERR_DROP, "MOD_LoadBmodel: funny lump size");
-	}
+	CM_CacheName(name, checksum, path, sizeof(path));
+	Com_sprintf(tmp, sizeof(tmp), "%s.%x", path,
+			(unsigned)(Sys_Nanoseconds() & 0xffffff));
 
-	count = l->filelen / sizeof(*in);
+	FS_CreatePath(tmp);
+	f = fopen(tmp, "wb");
 
-	if (count > MAX_MAP_AREAS)
+	if (!f)
 	{
-		Com_Error(ERR_DROP, "Map has too many areas");
+		Com_DPrintf("Couldn't write %s\n", tmp);
+		return;
 	}
 
-	out = map_areaportals;
-	numareaportals = count;
+	memset(&header, 0, sizeof(header));
+	header.ident = CMCACHE_IDENT;
+	header.version = CMCACHE_VERSION;
+	header.checksum = checksum;
+	header.numplanes = numplanes;
+	header.numnodes = numnodes;
+	header.numleafs = numleafs;
+	header.numleafbrushes = numleafbrushes;
+	header.numbrushes = numbrushes;
+	header.numbrushsides = numbrushsides;
+	header.numclusters = numclusters;
+	header.emptyleaf = emptyleaf;
+	header.rowbytes = ((numclusters + 31) >> 5) << 2;
+
+	/* room for the header, written last */
+	fwrite(&header, 1, sizeof(header), f);
+
+	CM_WriteCacheLump(f, &header, CMCACHE_PLANES, map_planes,
+			(numplanes + 12) * sizeof(cplane_t));
+	CM_WriteCacheLump(f, &header, CMCACHE_NODES, map_nodes,
+			(numnodes + 6) * sizeof(cnode_t));
+	CM_WriteCacheLump(f, &header, CMCACHE_LEAFS, map_leafs,
+			(numleafs + 1) * sizeof(cleaf_t));
+	CM_WriteCacheLump(f, &header, CMCACHE_LEAFBRUSHES, map_leafbrushes,
+			(numleafbrushes + 1) * sizeof(unsigned short));
+	CM_WriteCacheLump(f, &header, CMCACHE_BRUSHES, map_brushes,
+			(numbrushes + 1) * sizeof(cbrush_t));
+	CM_WriteCacheLump(f, &header, CMCACHE_BRUSHSIDES, map_brushsides,
+			(numbrushsides + 6) * sizeof(cbrushside_t));
+	CM_WriteCacheVis(f, &header, CMCACHE_PVS, DVIS_PVS);
+	CM_WriteCacheVis(f, &header, CMCACHE_PHS, DVIS_PHS);
+	CM_WriteCacheLump(f, &header, CMCACHE_FLATNODES, map_flatnodes,
+			(numnodes + 6) * sizeof(cflatnode_t));
+	CM_WriteCacheLump(f, &header, CMCACHE_FLATNUM, map_flatnum,
+			numnodes * sizeof(int));
+#ifdef CM_SIMD
+	if (map_brushlanes)
+	{
+		CM_WriteCacheLump(f, &header, CMCACHE_BRUSHLANES, map_brushlanes,
+				CM_NumBrushLanes() * sizeof(cbrushlanes_t));
+		CM_WriteCacheLump(f, &header, CMCACHE_BRUSHFIRSTLANES,
+				map_brushfirstlanes, numbrushes * sizeof(int));
+	}
+#endif
 
-	memcpy(out, in, sizeof(dareaportal_t) * count);
-}
+	fseek(f, 0, SEEK_SET);
+	fwrite(&header, 1, sizeof(header), f);
 
-void
-CMod_LoadVisibility(lump_t *l)
-{
-	numvisibility = l->filelen;
+	ok = !ferror(f);
 
-	if (l->filelen > MAX_MAP_VISIBILITY)
+	if (fclose(f) || !ok)
 	{
-		Com_Error(ERR_DROP, "Map has too large visibility lump");
+		Com_DPrintf("Couldn't write %s\n", tmp);
+		remove(tmp);
+		return;
 	}
 
-	memcpy(map_visibility, cmod_base + l->fileofs, l->filelen);
-
-	map_vis->numclusters = LittleLong(map_vis->numclusters);
-}
-
-void
-CMod_LoadEntityString(lump_t *l)
-{
-	numentitychars = l->filelen;
-
-	if (l->filelen > MAX_MAP_ENTSTRING)
+	if (rename(tmp, path))
 	{
-		Com_Error(ERR_DROP, "Map has too large entity lump");
+		remove(tmp); /* someone else was faster */
+		return;
 	}
 
-	memcpy(map_entitystring, cmod_base + l->fileofs, l->filelen);
+	Com_DPrintf("Wrote %s\n", path);
 }
 
 /*
@@ -1632,9 +3298,12 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	int i;
 	dheader_t header;
 	int length;
-	static unsigned last_checksum;
 
 	map_noareas = Cvar_Get("map_noareas", "0", 0);
+	map_cache = Cvar_Get("map_cache", "0", 0);
+	map_vismemory = Cvar_Get("map_vismemory", "32", 0);
+	map_simd = Cvar_Get("map_simd", "1", 0);
+	map_leafgrid = Cvar_Get("map_leafgrid", "1", 0);
 
 	if (!strcmp(map_name,
 				name) && (clientload || !Cvar_VariableValue("flushmap")))
@@ -1651,6 +3320,14 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 	}
 
 	/* free old stuff */
+	CM_StopCapture();
+	CM_FreeHeadnodeSets();
+	CM_FreeLeafGrid();
+	CM_UnmapCache();
+	CM_FreeVisRows();
+#ifdef CM_SIMD
+	CM_FreeBrushLanes();
+#endif
 	numplanes = 0;
 	numnodes = 0;
 	numleafs = 0;
@@ -1669,14 +3346,20 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 		return &map_cmodels[0]; /* cinematic servers won't have anything at all */
 	}
 
-	length = FS_LoadFile(name, (void **)&buf);
+	buf = (unsigned *)CM_TakePreload(name, &length, &last_checksum);
 
 	if (!buf)
 	{
-		Com_Error(ERR_DROP, "Couldn't load %s", name);
+		length = FS_LoadFile(name, (void **)&buf);
+
+		if (!buf)
+		{
+			Com_Error(ERR_DROP, "Couldn't load %s", name);
+		}
+
+		last_checksum = LittleLong(Com_BlockChecksum(buf, length));
 	}
 
-	last_checksum = LittleLong(Com_BlockChecksum(buf, length));
 	*checksum = last_checksum;
 
 	header = *(dheader_t *)buf;
@@ -1697,21 +3380,45 @@ CM_LoadMap(char *name, qboolean clientload, unsigned *checksum)
 
 	/* load into heap */
 	CMod_LoadSurfaces(&header.lumps[LUMP_TEXINFO]);
-	CMod_LoadLeafs(&header.lumps[LUMP_LEAFS]);
-	CMod_LoadLeafBrushes(&header.lumps[LUMP_LEAFBRUSHES]);
-	CMod_LoadPlanes(&header.lumps[LUMP_PLANES]);
-	CMod_LoadBrushes(&header.lumps[LUMP_BRUSHES]);
-	CMod_LoadBrushSides(&header.lumps[LUMP_BRUSHSIDES]);
 	CMod_LoadSubmodels(&header.lumps[LUMP_MODELS]);
-	CMod_LoadNodes(&header.lumps[LUMP_NODES]);
 	CMod_LoadAreas(&header.lumps[LUMP_AREAS]);
 	CMod_LoadAreaPortals(&header.lumps[LUMP_AREAPORTALS]);
-	CMod_LoadVisibility(&header.lumps[LUMP_VISIBILITY]);
 	CMod_LoadEntityString(&header.lumps[LUMP_ENTITIES]);
 
+	if (!map_cache->value || !CM_MapCache(name, last_checksum))
+	{
+		CMod_LoadLeafs(&header.lumps[LUMP_LEAFS]);
+		CMod_LoadLeafBrushes(&header.lumps[LUMP_LEAFBRUSHES]);
+		CMod_LoadPlanes(&header.lumps[LUMP_PLANES]);
+		CMod_LoadBrushes(&header.lumps[LUMP_BRUSHES]);
+		CMod_LoadBrushSides(&header.lumps[LUMP_BRUSHSIDES]);
+		CMod_LoadNodes(&header.lumps[LUMP_NODES]);
+		CMod_LoadVisibility(&header.lumps[LUMP_VISIBILITY]);
+
+		CM_InitBoxHull();
+		CM_BuildVisRows();
+		CM_BuildFlatNodes();
+#ifdef CM_SIMD
+		CM_BuildBrushLanes();
+#endif
+
+		if (map_cache->value)
+		{
+			CM_WriteCache(name, last_checksum);
+		}
+	}
+
 	FS_FreeFile(buf);
 
-	CM_InitBoxHull();
+#ifdef CM_SIMD
+	/* a cache written without them */
+	if (!map_brushlanes)
+	{
+		CM_BuildBrushLanes();
+	}
+#endif
+
+	CM_BuildLeafGrid();
 
 	memset(portalopen, 0, sizeof(portalopen));
 	FloodAreaConnections();
@@ -1759,6 +3466,14 @@ CM_EntityString(void)
 	return map_entitystring;
 }
 
+char *
+CM_MapName(unsigned *checksum)
+{
+	*checksum = last_checksum;
+
+	return map_name;
+}
+
 int
 CM_LeafContents(int leafnum)
 {
@@ -1840,37 +3555,250 @@ CM_DecompressVis(byte *in, byte *out)
 	while (out_p - out < row);
 }
 
-byte *
-CM_ClusterPVS(int cluster)
+/*
+ * The decompressed PVS and PHS rows. The whole matrix if it's not
+ * larger than map_vismemory megabytes, map_pvs and map_phs point into
+ * it then, like into a mapped collision cache. Otherwise a least
+ * recently used list of as many rows as fit, used by CM_ClusterPVS()
+ * and CM_ClusterPHS().
+ */
+#define VIS_MINROWS 64
+
+typedef struct
+{
+	int key; /* cluster * 2 + DVIS_PVS or DVIS_PHS, -1 if unused */
+	int prev, next;
+} visslot_t;
+
+static byte *vis_rows;
+static visslot_t *vis_slots;
+static int *vis_lookup; /* key to slot, -1 if not there */
+static int vis_numslots;
+static int vis_head, vis_tail;
+
+static void
+CM_FreeVisRows(void)
+{
+	if (vis_rows && (map_pvs == vis_rows))
+	{
+		map_pvs = map_phs = NULL;
+	}
+
+	free(vis_rows);
+	free(vis_slots);
+	free(vis_lookup);
+
+	vis_rows = NULL;
+	vis_slots = NULL;
+	vis_lookup = NULL;
+	vis_numslots = 0;
+}
+
+static void
+CM_BuildVisRows(void)
+{
+	int rowbytes, numrows, i;
+	double limit;
+
+	rowbytes = ((numclusters + 31) >> 5) << 2;
+	numrows = numclusters * 2;
+	limit = map_vismemory->value * 1024 * 1024;
+
+	if ((double)numrows * rowbytes <= limit)
+	{
+		vis_rows = calloc(numrows, rowbytes);
+
+		if (vis_rows)
+		{
+			map_visrowbytes = rowbytes;
+			map_pvs = vis_rows;
+			map_phs = vis_rows + numclusters * rowbytes;
+
+			for (i = 0; i < numclusters; i++)
+			{
+				CM_DecompressVis(map_visibility +
+						LittleLong(map_vis->bitofs[i][DVIS_PVS]),
+						map_pvs + i * rowbytes);
+				CM_DecompressVis(map_visibility +
+						LittleLong(map_vis->bitofs[i][DVIS_PHS]),
+						map_phs + i * rowbytes);
+			}
+
+			Com_DPrintf("Decompressed %i vis rows, %i KB\n", numrows,
+					numrows * rowbytes / 1024);
+			return;
+		}
+	}
+
+	/* too large, keep the recently used ones */
+	vis_numslots = (int)(limit / rowbytes);
+
+	if (vis_numslots < VIS_MINROWS)
+	{
+		vis_numslots = VIS_MINROWS;
+	}
+
+	if (vis_numslots > numrows)
+	{
+		vis_numslots = numrows;
+	}
+
+	vis_rows = calloc(vis_numslots, rowbytes);
+	vis_slots = malloc(vis_numslots * sizeof(visslot_t));
+	vis_lookup = malloc(numrows * sizeof(int));
+
+	if (!vis_rows || !vis_slots || !vis_lookup)
+	{
+		/* decompressed on every call */
+		CM_FreeVisRows();
+		return;
+	}
+
+	map_visrowbytes = rowbytes;
+
+	for (i = 0; i < numrows; i++)
+	{
+		vis_lookup[i] = -1;
+	}
+
+	for (i = 0; i < vis_numslots; i++)
+	{
+		vis_slots[i].key = -1;
+		vis_slots[i].prev = i - 1;
+		vis_slots[i].next = (i + 1 < vis_numslots) ? i + 1 : -1;
+	}
+
+	vis_head = 0;
+	vis_tail = vis_numslots - 1;
+
+	Com_DPrintf("Keeping %i of %i vis rows, %i KB\n", vis_numslots,
+			numrows, vis_numslots * rowbytes / 1024);
+}
+
+/*
+ * Returns a row from the least recently used list,
+ * decompressing it in place of the oldest one if
+ * it's not there.
+ */
+static const byte *
+CM_VisRow(int cluster, int vis)
+{
+	visslot_t *s;
+	int key, slot;
+
+	key = cluster * 2 + vis;
+	slot = vis_lookup[key];
+
+	if (slot == -1)
+	{
+		slot = vis_tail;
+		s = &vis_slots[slot];
+
+		if (s->key != -1)
+		{
+			vis_lookup[s->key] = -1;
+		}
+
+		s->key = key;
+		vis_lookup[key] = slot;
+
+		CM_DecompressVis(map_visibility +
+				LittleLong(map_vis->bitofs[cluster][vis]),
+				vis_rows + slot * map_visrowbytes);
+	}
+
+	if (slot != vis_head)
+	{
+		/* move it to the front */
+		s = &vis_slots[slot];
+		vis_slots[s->prev].next = s->next;
+
+		if (s->next != -1)
+		{
+			vis_slots[s->next].prev = s->prev;
+		}
+		else
+		{
+			vis_tail = s->prev;
+		}
+
+		s->prev = -1;
+		s->next = vis_head;
+		vis_slots[vis_head].prev = slot;
+		vis_head = slot;
+	}
+
+	return vis_rows + slot * map_visrowbytes;
+}
+
+/*
+ * Returns the row of the cluster. If it's not decompressed
+ * already it's decompressed into buffer, which must hold
+ * MAX_MAP_LEAFS / 8 bytes. Doesn't touch the least recently
+ * used rows, so it's safe to call in parallel.
+ */
+const byte *
+CM_ClusterPVS_r(int cluster, byte *buffer)
 {
 	if (cluster == -1)
 	{
-		memset(pvsrow, 0, (numclusters + 7) >> 3);
+		memset(buffer, 0, (numclusters + 7) >> 3);
+	}
+
+	else if (map_pvs)
+	{
+		return map_pvs + cluster * map_visrowbytes;
 	}
 
 	else
 	{
 		CM_DecompressVis(map_visibility +
-				LittleLong(map_vis->bitofs[cluster][DVIS_PVS]), pvsrow);
+				LittleLong(map_vis->bitofs[cluster][DVIS_PVS]), buffer);
 	}
 
-	return pvsrow;
+	return buffer;
 }
 
-byte *
-CM_ClusterPHS(int cluster)
+const byte *
+CM_ClusterPHS_r(int cluster, byte *buffer)
 {
 	if (cluster == -1)
 	{
-		memset(phsrow, 0, (numclusters + 7) >> 3);
+		memset(buffer, 0, (numclusters + 7) >> 3);
+	}
+
+	else if (map_phs)
+	{
+		return map_phs + cluster * map_visrowbytes;
 	}
 
 	else
 	{
 		CM_DecompressVis(map_visibility +
-				LittleLong(map_vis->bitofs[cluster][DVIS_PHS]), phsrow);
+				LittleLong(map_vis->bitofs[cluster][DVIS_PHS]), buffer);
+	}
+
+	return buffer;
+}
+
+const byte *
+CM_ClusterPVS(int cluster)
+{
+	if (vis_numslots && (cluster != -1))
+	{
+		return CM_VisRow(cluster, DVIS_PVS);
 	}
 
-	return phsrow;
+	return CM_ClusterPVS_r(cluster, pvsrow);
 }
 
+const byte *
+CM_ClusterPHS(int cluster)
+{
+	if (vis_numslots && (cluster != -1))
+	{
+		return CM_VisRow(cluster, DVIS_PHS);
+	}
+
+	return CM_ClusterPHS_r(cluster, phsrow);
+}
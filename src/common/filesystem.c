@@ -28,6 +28,8 @@
 #include "header/common.h"
 #include "../common/header/glob.h"
 
+void FS_Async_f(void);
+
 #ifdef ZIP
  #include "unzip/unzip.h"
 #endif
@@ -628,6 +630,58 @@ FS_FRead(void *buffer, int size, int count, fileHandle_t f)
 	return size;
 }
 
+/*
+ * Reads up to size bytes and returns how many were read. Unlike
+ * FS_Read() it never calls Com_Error() and touches nothing but
+ * the handle, so another thread can read from a handle that the
+ * main thread opened.
+ */
+int
+FS_ReadUnlocked(void *buffer, int size, fileHandle_t f)
+{
+	fsHandle_t *handle;
+	byte *buf;
+	int r;
+	int remaining;
+
+	if ((f < 1) || (f > MAX_HANDLES))
+	{
+		return 0;
+	}
+
+	handle = &fs_handles[f - 1];
+	remaining = size;
+	buf = (byte *)buffer;
+
+	while (remaining)
+	{
+		if (handle->file)
+		{
+			r = fread(buf, 1, remaining, handle->file);
+		}
+#ifdef ZIP
+		else if (handle->zip)
+		{
+			r = unzReadCurrentFile(handle->zip, buf, remaining);
+		}
+#endif
+		else
+		{
+			break;
+		}
+
+		if (r <= 0)
+		{
+			break;
+		}
+
+		remaining -= r;
+		buf += r;
+	}
+
+	return size - remaining;
+}
+
 /*
  * Filename are reletive to the quake search path. A null buffer will just
  * return the file length without loading.
@@ -1083,6 +1137,10 @@ FS_SetGamedir(char *dir)
 		return;
 	}
 
+	/* The preload thread may read from a pack
+	   or a handle that's closed below. */
+	CM_CancelPreload();
+
 	/* Free up any current game dir info. */
 	while (fs_searchPaths != fs_baseSearchPaths)
 	{
@@ -1531,6 +1589,7 @@ FS_InitFilesystem(void)
 	Cmd_AddCommand("path", FS_Path_f);
 	Cmd_AddCommand("link", FS_Link_f);
 	Cmd_AddCommand("dir", FS_Dir_f);
+	Cmd_AddCommand("fs_async", FS_Async_f);
 
 	/* basedir <path> Allows the game to run from outside the data tree.  */
 	fs_basedir = Cvar_Get("basedir",
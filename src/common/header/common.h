@@ -74,6 +74,8 @@ typedef struct sizebuf_s
 	int maxsize;
 	int cursize;
 	int readcount;
+	int bitpos;                 /* bits used in the last written byte */
+	int readbitpos;             /* bits consumed from the last read byte */
 } sizebuf_t;
 
 void SZ_Init(sizebuf_t *buf, byte *data, int length);
@@ -103,6 +105,12 @@ void MSG_WriteDeltaEntity(struct entity_state_s *from,
 		struct entity_state_s *to, sizebuf_t *msg,
 		qboolean force, qboolean newentity);
 void MSG_WriteDir(sizebuf_t *sb, vec3_t vector);
+void MSG_WriteBits(sizebuf_t *sb, int value, int bits);
+void MSG_WriteDeltaEntityPacked(struct entity_state_s *from,
+		struct entity_state_s *to, sizebuf_t *msg,
+		qboolean force, qboolean newentity, int *lastnum);
+void MSG_WriteEntityRemovePacked(sizebuf_t *msg, int number, int *lastnum);
+void MSG_WriteEntityEndPacked(sizebuf_t *msg);
 
 void MSG_BeginReading(sizebuf_t *sb);
 
@@ -123,8 +131,16 @@ void MSG_ReadDeltaUsercmd(sizebuf_t *sb,
 		struct usercmd_s *cmd);
 
 void MSG_ReadDir(sizebuf_t *sb, vec3_t vector);
+void MSG_ReadDeltaEntity(sizebuf_t *sb, struct entity_state_s *from,
+		struct entity_state_s *to, int number, int bits);
+
+void MSG_Bench_f(void);
 
 void MSG_ReadData(sizebuf_t *sb, void *buffer, int size);
+int MSG_ReadBits(sizebuf_t *sb, int bits);
+int MSG_ReadEntityBitsPacked(sizebuf_t *sb, unsigned *bits, int *lastnum);
+void MSG_ReadDeltaEntityPacked(sizebuf_t *sb, struct entity_state_s *from,
+		struct entity_state_s *to, int number, int bits);
 
 /* ================================================================== */
 
@@ -158,6 +174,29 @@ void Info_Print(char *s);
 
 #define PROTOCOL_VERSION 34
 
+/* Sent in svc_serverdata instead of PROTOCOL_VERSION
+   when NETCAP_PACKEDENTS was negotiated. Marks the
+   packet entities as bit packed, so client demos
+   recorded from such a stream are tagged, too. The
+   number is taken by no other Quake II protocol: 34 is
+   the original, 35 R1Q2, 36 Q2PRO, 37 the Q2PRO MVD
+   and 56 KMQuake2. Their clients and demo tools reject
+   it instead of misparsing our messages as their own. */
+#define PROTOCOL_PACKEDENTS 3434
+
+/* Optional protocol extensions. The client announces
+   them in the connect packet, the server answers with
+   the subset it accepted in client_connect. Peers not
+   knowing about them just ignore the additional
+   argument, so they fall back to plain protocol 34. */
+#define NETCAP_COMPRESS (1 << 0)      /* LZ compressed datagram payloads */
+#define NETCAP_PACKEDENTS (1 << 1)    /* bit packed entity deltas */
+#define NETCAP_FRAGMENT (1 << 2)      /* messages up to MAX_FRAGMSGLEN */
+#define NETCAP_TICKRATE (1 << 3)      /* a frame every svc_frametime msec */
+
+#define NETCAP_SUPPORTED (NETCAP_COMPRESS | NETCAP_PACKEDENTS | \
+		NETCAP_FRAGMENT | NETCAP_TICKRATE)
+
 /* ========================================= */
 
 #define PORT_MASTER 27900
@@ -166,7 +205,10 @@ void Info_Print(char *s);
 
 /* ========================================= */
 
-#define UPDATE_BACKUP 16    /* copies of entity_state_t to keep buffered */
+#define UPDATE_BACKUP 256   /* copies of entity_state_t the client keeps
+							   buffered, 16 100 msec frames at sv_fps 100.
+							   The server sizes its copies per map from
+							   sv_fps, see svs.update_backup */
 #define UPDATE_MASK (UPDATE_BACKUP - 1)
 
 /* server to client */
@@ -196,7 +238,8 @@ enum svc_ops_e
 	svc_playerinfo,             /* variable */
 	svc_packetentities,         /* [...] */
 	svc_deltapacketentities,    /* [...] */
-	svc_frame
+	svc_frame,
+	svc_frametime               /* [byte] msec between frames, NETCAP_TICKRATE only */
 };
 
 /* ============================================== */
@@ -296,6 +339,13 @@ enum clc_ops_e
 #define U_SOUND (1 << 26)
 #define U_SOLID (1 << 27)
 
+/* largest possible entity delta: 4 header bytes, the
+   number and all fields in their widest encoding. Like
+   the original client MSG_ReadDeltaEntity() reads both
+   U_FRAME8 and U_FRAME16 if both are set, one more byte
+   than the writer ever sends. */
+#define MAX_DELTAENTITY_SIZE 44
+
 /* CMD - Command text buffering and command execution */
 
 /*
@@ -426,6 +476,9 @@ void Cmd_ForwardToServer(void);
 
 extern cvar_t *cvar_vars;
 
+/* engine only, the game created or looked up the variable */
+#define CVAR_GAME 256
+
 cvar_t *Cvar_Get(char *var_name, char *value, int flags);
 
 /* creates the variable if it doesn't exist, or returns the existing one */
@@ -492,6 +545,7 @@ extern qboolean userinfo_modified;
 
 #define PORT_ANY -1
 #define MAX_MSGLEN 1400             /* max length of a message */
+#define MAX_FRAGMSGLEN 16384        /* same, when split into fragments */
 #define PACKET_HEADER 10            /* two ints and a short */
 
 typedef enum
@@ -533,11 +587,20 @@ char *NET_AdrToString(netadr_t a);
 qboolean NET_StringToAdr(char *s, netadr_t *a);
 void NET_Sleep(int msec);
 
+/* simulation of a bad link, net_loss, net_latency
+   and net_bandwidth. Called by the backends */
+qboolean NET_LagPacket(netsrc_t sock, int length, void *data, netadr_t to);
+void NET_SendLagPackets(void);
+int NET_LagSleep(int msec);
+
 /*=================================================================== */
 
 #define OLD_AVG 0.99
 #define MAX_LATENT 32
 
+#define NETCHAN_HISTORY 64              /* must be power of two */
+#define NETCHAN_HISTORY_MASK (NETCHAN_HISTORY - 1)
+
 typedef struct
 {
 	qboolean fatal_error;
@@ -563,21 +626,47 @@ typedef struct
 	int reliable_sequence;                  /* single bit */
 	int last_reliable_sequence;             /* sequence number of last send */
 
-	/* reliable staging and holding areas */
+	int capabilities;                       /* negotiated NETCAP_* extensions */
+
+	/* payload statistics, raw bytes vs. bytes on the wire */
+	unsigned int raw_out;
+	unsigned int wire_out;
+	unsigned int raw_in;
+	unsigned int wire_in;
+
+	/* link estimation, updated by Netchan_Process() from the
+	   acknowledges of the remote side */
+	int sent_time[NETCHAN_HISTORY];         /* curtime of each outgoing sequence */
+	int sent_size[NETCHAN_HISTORY];         /* bytes on the wire */
+	int rtt;                                /* smoothed round trip time in ms */
+	int rtt_min;                            /* lowest seen round trip time */
+	unsigned int acked;                     /* packets seen by the remote side */
+	unsigned int lost;                      /* packets never acknowledged */
+	unsigned int acked_bytes;
+
+	/* reliable staging and holding areas. Without
+	   NETCAP_FRAGMENT only MAX_MSGLEN bytes are used */
 	sizebuf_t message;          /* writing buffer to send to server */
-	byte message_buf[MAX_MSGLEN - 16];          /* leave space for header */
+	byte message_buf[MAX_FRAGMSGLEN - 16];      /* leave space for header */
 
 	/* message is copied to this buffer when it is first transfered */
 	int reliable_length;
-	byte reliable_buf[MAX_MSGLEN - 16];         /* unacked reliable message */
+	byte reliable_buf[MAX_FRAGMSGLEN - 16];     /* unacked reliable message */
+
+	/* reassembly of fragmented packets */
+	int fragment_sequence;
+	int fragment_length;                        /* 0 until the last one came */
+	unsigned fragment_mask;                     /* the fragments that came */
+	byte fragment_buf[MAX_FRAGMSGLEN];
 } netchan_t;
 
 extern netadr_t net_from;
 extern sizebuf_t net_message;
-extern byte net_message_buffer[MAX_MSGLEN];
+extern byte net_message_buffer[MAX_FRAGMSGLEN];
 
 void Netchan_Init(void);
-void Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport);
+void Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport,
+		int capabilities);
 
 qboolean Netchan_NeedReliable(netchan_t *chan);
 void Netchan_Transmit(netchan_t *chan, int length, byte *data);
@@ -587,17 +676,58 @@ qboolean Netchan_Process(netchan_t *chan, sizebuf_t *msg);
 
 qboolean Netchan_CanReliable(netchan_t *chan);
 
+/* LZ */
+
+int LZ_Compress(const byte *in, int inlen, byte *out, int outlen);
+int LZ_Decompress(const byte *in, int inlen, byte *out, int outlen);
+
 /* CMODEL */
 
 #include "files.h"
 
+/* Brush sides are clipped four at a time with SSE2. Only on x86_64,
+   where the scalar code uses SSE as well and both give the same
+   results, with x87 math they would differ in the last bits. */
+#if defined(__x86_64__) || defined(_M_X64)
+ #define CM_SIMD
+#endif
+
+/* What a trace works on. Traces with different contexts can run at
+   the same time, the functions without one share a global context. */
+typedef struct
+{
+	trace_t trace;
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t extents;
+	int contents;
+	qboolean ispoint;
+	qboolean simd;
+
+	/* the box hull, see CM_HeadnodeForBox_r() */
+	cplane_t boxplanes[12];
+
+	/* a brush checked by the current trace is
+	   stamped with checkcount, to avoid repeated
+	   testings when it's in more than one leaf */
+	int checkcount;
+	int brushchecks[MAX_MAP_BRUSHES];
+
+	int brushtraces;
+} cmtrace_t;
+
 cmodel_t *CM_LoadMap(char *name, qboolean clientload, unsigned *checksum);
+void CM_PreloadMap(char *name);
+void CM_CancelPreload(void);
 cmodel_t *CM_InlineModel(char *name);       /* *1, *2, etc */
 
 int CM_NumClusters(void);
 int CM_NumInlineModels(void);
 char *CM_EntityString(void);
 
+/* the loaded map, "" if there's none */
+char *CM_MapName(unsigned *checksum);
+
 /* creates a clipping hull for an arbitrary box */
 int CM_HeadnodeForBox(vec3_t mins, vec3_t maxs);
 
@@ -612,8 +742,40 @@ trace_t CM_TransformedBoxTrace(vec3_t start, vec3_t end,
 		vec3_t mins, vec3_t maxs, int headnode,
 		int brushmask, vec3_t origin, vec3_t angles);
 
-byte *CM_ClusterPVS(int cluster);
-byte *CM_ClusterPHS(int cluster);
+const byte *CM_ClusterPVS(int cluster);
+const byte *CM_ClusterPHS(int cluster);
+
+/* reentrant versions, everything they change is in ctx or buffer */
+void CM_InitTrace(cmtrace_t *ctx);
+int CM_HeadnodeForBox_r(cmtrace_t *ctx, vec3_t mins, vec3_t maxs);
+int CM_PointContents_r(cmtrace_t *ctx, vec3_t p, int headnode);
+int CM_TransformedPointContents_r(cmtrace_t *ctx, vec3_t p, int headnode,
+		vec3_t origin, vec3_t angles);
+trace_t CM_BoxTrace_r(cmtrace_t *ctx, vec3_t start, vec3_t end,
+		vec3_t mins, vec3_t maxs, int headnode, int brushmask);
+trace_t CM_TransformedBoxTrace_r(cmtrace_t *ctx, vec3_t start,
+		vec3_t end, vec3_t mins, vec3_t maxs, int headnode,
+		int brushmask, vec3_t origin, vec3_t angles);
+const byte *CM_ClusterPVS_r(int cluster, byte *buffer);
+const byte *CM_ClusterPHS_r(int cluster, byte *buffer);
+
+void CM_Stress_f(void);
+void CM_SIMDTest_f(void);
+void CM_Bench_f(void);
+
+/* query capture, see cmreplay.c */
+extern qboolean cm_capturing;
+void CM_Capture(char *name);
+void CM_StopCapture(void);
+void CM_CaptureTrace(vec3_t start, vec3_t end, vec3_t mins, vec3_t maxs,
+		int headnode, int brushmask, vec3_t origin, vec3_t angles,
+		trace_t *trace);
+void CM_CaptureContents(vec3_t p, int headnode, vec3_t origin,
+		vec3_t angles, int contents);
+void CM_CaptureLeafnums(vec3_t mins, vec3_t maxs, int listsize,
+		int count, int topnode);
+void CM_CaptureBox(vec3_t mins, vec3_t maxs, int headnode);
+void CM_Replay_f(void);
 
 int CM_PointLeafnum(vec3_t p);
 
@@ -630,9 +792,19 @@ void CM_SetAreaPortalState(int portalnum, qboolean open);
 qboolean CM_AreasConnected(int area1, int area2);
 
 int CM_WriteAreaBits(byte *buffer, int area);
-qboolean CM_HeadnodeVisible(int headnode, byte *visbits);
+qboolean CM_HeadnodeVisible(int headnode, const byte *visbits);
+
+/* the clusters below a node, bytes first to last are
+   the part of the bit vector that isn't empty */
+typedef struct
+{
+	byte *bits;
+	int first, last;                    /* first > last if empty */
+} headnodeset_t;
+
+const headnodeset_t *CM_HeadnodeClusters(int headnode);
 
-void CM_WritePortalState(FILE *f);
+void CM_WritePortalState(sizebuf_t *buf);
 
 /* PLAYER MOVEMENT CODE */
 
@@ -674,6 +846,7 @@ int FS_FOpenFile(const char *name, fileHandle_t *f, qboolean gamedir_only);
 void FS_FCloseFile(fileHandle_t f);
 int FS_Read(void *buffer, int size, fileHandle_t f);
 int FS_FRead(void *buffer, int size, int count, fileHandle_t f);
+int FS_ReadUnlocked(void *buffer, int size, fileHandle_t f);
 char **FS_ListFiles(char *findname, int *numfiles,
 		unsigned musthave, unsigned canthave);
 char **FS_ListFiles2(char *findname, int *numfiles,
@@ -694,6 +867,14 @@ int FS_LoadFile(char *path, void **buffer);
 void FS_FreeFile(void *buffer);
 void FS_CreatePath(char *path);
 
+/* files written in the background */
+typedef struct asyncfile_s asyncfile_t;
+
+asyncfile_t *FS_OpenAsync(const char *path, qboolean compress);
+void FS_WriteAsync(asyncfile_t *af, const void *buffer, int size);
+qboolean FS_CloseAsync(asyncfile_t *af);
+char *FS_AsyncName(asyncfile_t *af);
+
 /* MISC */
 
 #define ERR_FATAL 0         /* exit the entire game with a popup window */
@@ -769,10 +950,36 @@ void Sys_FreeLibrary(void *handle);
 void *Sys_LoadLibrary(const char *path, const char *sym, void **handle);
 void *Sys_GetProcAddress(void *handle, const char *sym);
 
+/* Threads for work that mustn't stall a frame. They may not
+   call Com_Error(), Com_Printf() and the like. NULL if the
+   thread couldn't be created. */
+void *Sys_CreateThread(void (*func)(void *), void *arg);
+void Sys_WaitThread(void *thread);
+void *Sys_CreateMutex(void);
+void Sys_DestroyMutex(void *mutex);
+void Sys_LockMutex(void *mutex);
+void Sys_UnlockMutex(void *mutex);
+
+/* flushes a file all the way to the disk */
+void Sys_SyncFile(FILE *f);
+
+/* renames src to dst, atomically replacing dst if it exists */
+qboolean Sys_ReplaceFile(const char *src, const char *dst);
+
+/* Maps a file copy on write. Pages that aren't written
+   to are shared with every other process mapping it. */
+void *Sys_MapFile(const char *path, int *length);
+void Sys_UnmapFile(void *base, int length);
+
+/* Names the function addr is in, for profiling. Returns
+   its start, or addr itself if it couldn't be found. */
+void *Sys_FindSymbol(void *addr, char *name, int size);
+
 /* CLIENT / SERVER SYSTEMS */
 
 void CL_Init(void);
 void CL_Drop(void);
+qboolean CL_Connected(void);
 void CL_Shutdown(void);
 void CL_Frame(int msec);
 void Con_Print(char *text);
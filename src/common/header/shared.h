@@ -285,6 +285,8 @@ void randk_seed(void);
 extern int curtime; /* time returned by last Sys_Milliseconds */
 
 int Sys_Milliseconds(void);
+long long Sys_Microseconds(void); /* for benchmarks and profiling */
+long long Sys_Nanoseconds(void); /* monotonic, for profiling */
 void Sys_Mkdir(char *path);
 
 /* large block stack allocation routines */
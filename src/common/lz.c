@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * A small and fast LZ77 style codec. It's used to compress network
+ * datagrams, so it's tuned for inputs smaller than MAX_MSGLEN. The
+ * stream is a sequence of chunks, each starting with a control byte:
+ *
+ *  000LLLLL                     literal run of L + 1 bytes
+ *  LLLOOOOO OOOOOOOO            back reference of L + 2 bytes,
+ *                               L being 1 to 6
+ *  111OOOOO LLLLLLLL OOOOOOOO   back reference of L + 9 bytes
+ *
+ * The offset O is the distance to the referenced data minus one,
+ * thus at most 8192 bytes can be looked back.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+#define LZ_MAX_LITERAL 32
+#define LZ_MAX_OFFSET (1 << 13)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (255 + 9)
+
+static int
+LZ_Hash(const byte *p)
+{
+	unsigned int v;
+
+	v = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Writes the pending literals. Returns
+ * the new output position or -1 if the
+ * output buffer is too small.
+ */
+static int
+LZ_FlushLiterals(const byte *in, int start, int count, byte *out,
+		int op, int outlen)
+{
+	int run;
+
+	while (count > 0)
+	{
+		run = count > LZ_MAX_LITERAL ? LZ_MAX_LITERAL : count;
+
+		if (op + 1 + run > outlen)
+		{
+			return -1;
+		}
+
+		out[op++] = run - 1;
+		memcpy(out + op, in + start, run);
+
+		op += run;
+		start += run;
+		count -= run;
+	}
+
+	return op;
+}
+
+/*
+ * Compresses inlen bytes from in into out. Returns the
+ * size of the compressed data or 0 if it doesn't fit
+ * into outlen bytes.
+ */
+int
+LZ_Compress(const byte *in, int inlen, byte *out, int outlen)
+{
+	/* positions are stored + 1, 0 marks an empty slot */
+	unsigned short htab[LZ_HASH_SIZE];
+	int ip, op;
+	int litstart;
+	int ref, off, len, maxlen;
+	int h;
+
+	if ((inlen <= 0) || (inlen >= 0xffff))
+	{
+		return 0;
+	}
+
+	memset(htab, 0, sizeof(htab));
+
+	ip = 0;
+	op = 0;
+	litstart = 0;
+
+	while (ip + LZ_MIN_MATCH <= inlen)
+	{
+		h = LZ_Hash(in + ip);
+		ref = htab[h] - 1;
+		htab[h] = ip + 1;
+
+		off = ip - ref - 1;
+
+		if ((ref < 0) || (off >= LZ_MAX_OFFSET) ||
+			(in[ref] != in[ip]) || (in[ref + 1] != in[ip + 1]) ||
+			(in[ref + 2] != in[ip + 2]))
+		{
+			ip++;
+			continue;
+		}
+
+		maxlen = inlen - ip;
+
+		if (maxlen > LZ_MAX_MATCH)
+		{
+			maxlen = LZ_MAX_MATCH;
+		}
+
+		len = LZ_MIN_MATCH;
+
+		while ((len < maxlen) && (in[ref + len] == in[ip + len]))
+		{
+			len++;
+		}
+
+		op = LZ_FlushLiterals(in, litstart, ip - litstart, out, op, outlen);
+
+		if ((op < 0) || (op + 3 > outlen))
+		{
+			return 0;
+		}
+
+		if (len - 2 < 7)
+		{
+			out[op++] = ((len - 2) << 5) | (off >> 8);
+		}
+		else
+		{
+			out[op++] = (7 << 5) | (off >> 8);
+			out[op++] = len - 9;
+		}
+
+		out[op++] = off & 0xff;
+
+		/* index the matched data, too. Helps
+		   a lot with repeating entity deltas */
+		len += ip;
+		ip++;
+
+		while ((ip < len) && (ip + LZ_MIN_MATCH <= inlen))
+		{
+			htab[LZ_Hash(in + ip)] = ip + 1;
+			ip++;
+		}
+
+		ip = len;
+		litstart = ip;
+	}
+
+	op = LZ_FlushLiterals(in, litstart, inlen - litstart, out, op, outlen);
+
+	if (op < 0)
+	{
+		return 0;
+	}
+
+	return op;
+}
+
+/*
+ * Decompresses inlen bytes from in into out. Returns
+ * the size of the decompressed data or -1 if the data
+ * is corrupt or doesn't fit into outlen bytes.
+ */
+int
+LZ_Decompress(const byte *in, int inlen, byte *out, int outlen)
+{
+	int ip, op;
+	int ctrl, len, ref;
+
+	ip = 0;
+	op = 0;
+
+	while (ip < inlen)
+	{
+		ctrl = in[ip++];
+
+		if (ctrl < LZ_MAX_LITERAL)
+		{
+			len = ctrl + 1;
+
+			if ((ip + len > inlen) || (op + len > outlen))
+			{
+				return -1;
+			}
+
+			memcpy(out + op, in + ip, len);
+
+			ip += len;
+			op += len;
+			continue;
+		}
+
+		len = ctrl >> 5;
+
+		if (len == 7)
+		{
+			if (ip >= inlen)
+			{
+				return -1;
+			}
+
+			len += in[ip++];
+		}
+
+		len += 2;
+
+		if (ip >= inlen)
+		{
+			return -1;
+		}
+
+		ref = op - ((ctrl & 0x1f) << 8) - in[ip++] - 1;
+
+		if ((ref < 0) || (op + len > outlen))
+		{
+			return -1;
+		}
+
+		/* the regions may overlap, so no memcpy() */
+		while (len--)
+		{
+			out[op++] = out[ref++];
+		}
+	}
+
+	return op;
+}
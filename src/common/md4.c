@@ -30,19 +30,15 @@
 		a = ROTATELEFT32(a, s);	\
 	}
 
-static uint32_t X[16];
-static uint32_t A, AA;
-static uint32_t B, BB;
-static uint32_t C, CC;
-static uint32_t D, DD;
-
+/* the state is passed around, not kept in statics,
+   so that several threads can checksum at once */
 static void
-DoMD4()
+DoMD4(uint32_t *state, const uint32_t *X)
 {
-	AA = A;
-	BB = B;
-	CC = C;
-	DD = D;
+	uint32_t A = state[0];
+	uint32_t B = state[1];
+	uint32_t C = state[2];
+	uint32_t D = state[3];
 
 	S(A, B, C, D, 0, 3);
 	S(D, A, B, C, 1, 7);
@@ -95,10 +91,10 @@ DoMD4()
 	U(C, D, A, B, 7, 11);
 	U(B, C, D, A, 15, 15);
 
-	A += AA;
-	B += BB;
-	C += CC;
-	D += DD;
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
 }
 
 static void
@@ -109,12 +105,14 @@ PerformMD4(const unsigned char *buf, int length, unsigned char *digest)
 
 	int i, j;
 	const unsigned char *ptr = buf;
+	uint32_t state[4];
+	uint32_t X[16];
 
 	/* initialize the MD buffer */
-	A = 0x67452301;
-	B = 0xEFCDAB89;
-	C = 0x98BADCFE;
-	D = 0x10325476;
+	state[0] = 0x67452301;
+	state[1] = 0xEFCDAB89;
+	state[2] = 0x98BADCFE;
+	state[3] = 0x10325476;
 
 	for (i = 0; i < len; i++)
 	{
@@ -126,7 +124,7 @@ PerformMD4(const unsigned char *buf, int length, unsigned char *digest)
 			ptr += 4;
 		}
 
-		DoMD4();
+		DoMD4(state, X);
 	}
 
 	i = rem / 4;
@@ -166,7 +164,7 @@ PerformMD4(const unsigned char *buf, int length, unsigned char *digest)
 			X[j] = 0;
 		}
 
-		DoMD4();
+		DoMD4(state, X);
 
 		j = 0;
 	}
@@ -179,33 +177,14 @@ PerformMD4(const unsigned char *buf, int length, unsigned char *digest)
 	X[14] = (length & 0x1FFFFFFF) << 3;
 	X[15] = (length & ~0x1FFFFFFF) >> 29;
 
-	DoMD4();
-
-	digest[0] = (A & 0x000000FF) >> 0;
-	digest[1] = (A & 0x0000FF00) >> 8;
-	digest[2] = (A & 0x00FF0000) >> 16;
-	digest[3] = (A & 0xFF000000) >> 24;
-	digest[4] = (B & 0x000000FF) >> 0;
-	digest[5] = (B & 0x0000FF00) >> 8;
-	digest[6] = (B & 0x00FF0000) >> 16;
-	digest[7] = (B & 0xFF000000) >> 24;
-	digest[8] = (C & 0x000000FF) >> 0;
-	digest[9] = (C & 0x0000FF00) >> 8;
-	digest[10] = (C & 0x00FF0000) >> 16;
-	digest[11] = (C & 0xFF000000) >> 24;
-	digest[12] = (D & 0x000000FF) >> 0;
-	digest[13] = (D & 0x0000FF00) >> 8;
-	digest[14] = (D & 0x00FF0000) >> 16;
-	digest[15] = (D & 0xFF000000) >> 24;
-
-	A = AA = 0;
-	B = BB = 0;
-	C = CC = 0;
-	D = DD = 0;
-
-	for (j = 0; j < 16; j++)
+	DoMD4(state, X);
+
+	for (i = 0; i < 4; i++)
 	{
-		X[j] = 0;
+		digest[i * 4 + 0] = (state[i] & 0x000000FF) >> 0;
+		digest[i * 4 + 1] = (state[i] & 0x0000FF00) >> 8;
+		digest[i * 4 + 2] = (state[i] & 0x00FF0000) >> 16;
+		digest[i * 4 + 3] = (state[i] & 0xFF000000) >> 24;
 	}
 }
 
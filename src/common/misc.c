@@ -35,6 +35,7 @@ cvar_t *developer;
 cvar_t *modder;
 cvar_t *timescale;
 cvar_t *fixedtime;
+cvar_t *cm_capture;
 #ifndef DEDICATED_ONLY
 cvar_t *showtrace;
 #endif
@@ -224,6 +225,11 @@ Qcommon_Init(int argc, char **argv)
 	/* init commands and vars */
 	Cmd_AddCommand("z_stats", Z_Stats_f);
 	Cmd_AddCommand("error", Com_Error_f);
+	Cmd_AddCommand("msgbench", MSG_Bench_f);
+	Cmd_AddCommand("cm_stress", CM_Stress_f);
+	Cmd_AddCommand("cm_simdtest", CM_SIMDTest_f);
+	Cmd_AddCommand("cm_bench", CM_Bench_f);
+	Cmd_AddCommand("cm_replay", CM_Replay_f);
 
 	host_speeds = Cvar_Get("host_speeds", "0", 0);
 	log_stats = Cvar_Get("log_stats", "0", 0);
@@ -232,6 +238,7 @@ Qcommon_Init(int argc, char **argv)
 	timescale = Cvar_Get("timescale", "1", 0);
 	fixedtime = Cvar_Get("fixedtime", "0", 0);
 	logfile_active = Cvar_Get("logfile", "1", CVAR_ARCHIVE);
+	cm_capture = Cvar_Get("cm_capture", "", 0);
 #ifndef DEDICATED_ONLY
 	showtrace = Cvar_Get("showtrace", "0", 0);
 #endif
@@ -331,6 +338,12 @@ Qcommon_Frame(int msec)
 		}
 	}
 
+	if (cm_capture->modified)
+	{
+		cm_capture->modified = false;
+		CM_Capture(cm_capture->string);
+	}
+
 	if (fixedtime->value)
 	{
 		msec = fixedtime->value;
@@ -409,5 +422,9 @@ Qcommon_Frame(int msec)
 void
 Qcommon_Shutdown(void)
 {
+	/* the rest of the capture is still queued */
+	CM_StopCapture();
+
+	CM_CancelPreload();
 }
 
@@ -24,6 +24,8 @@
  * =======================================================================
  */
 
+#include <stddef.h>
+
 #include "header/common.h"
 
 vec3_t bytedirs[NUMVERTEXNORMALS] = {
@@ -424,6 +426,101 @@ MSG_ReadDir(sizebuf_t *sb, vec3_t dir)
 	VectorCopy(bytedirs[b], dir);
 }
 
+/*
+ * Unchecked primitives for MSG_WriteDeltaEntity() and
+ * MSG_ReadDeltaEntity(). The callers make sure that
+ * MAX_DELTAENTITY_SIZE bytes are available.
+ */
+static byte *
+MSG_PutByte(byte *p, int c)
+{
+	p[0] = c & 0xff;
+
+	return p + 1;
+}
+
+static byte *
+MSG_PutShort(byte *p, int c)
+{
+	p[0] = c & 0xff;
+	p[1] = (c >> 8) & 0xff;
+
+	return p + 2;
+}
+
+static byte *
+MSG_PutLong(byte *p, int c)
+{
+	p[0] = c & 0xff;
+	p[1] = (c >> 8) & 0xff;
+	p[2] = (c >> 16) & 0xff;
+	p[3] = c >> 24;
+
+	return p + 4;
+}
+
+static int
+MSG_GetShort(const byte *p)
+{
+	return (short)(p[0] + (p[1] << 8));
+}
+
+static int
+MSG_GetLong(const byte *p)
+{
+	return p[0] + (p[1] << 8) + (p[2] << 16) + (p[3] << 24);
+}
+
+/* entity_state_t fields whose change maps to exactly one U_* bit */
+typedef struct
+{
+	int ofs;
+	int bit;
+} deltafield_t;
+
+static const deltafield_t delta_fields[] = {
+	{offsetof(entity_state_t, origin[0]), U_ORIGIN1},
+	{offsetof(entity_state_t, origin[1]), U_ORIGIN2},
+	{offsetof(entity_state_t, origin[2]), U_ORIGIN3},
+	{offsetof(entity_state_t, angles[0]), U_ANGLE1},
+	{offsetof(entity_state_t, angles[1]), U_ANGLE2},
+	{offsetof(entity_state_t, angles[2]), U_ANGLE3},
+	{offsetof(entity_state_t, modelindex), U_MODEL},
+	{offsetof(entity_state_t, modelindex2), U_MODEL2},
+	{offsetof(entity_state_t, modelindex3), U_MODEL3},
+	{offsetof(entity_state_t, modelindex4), U_MODEL4},
+	{offsetof(entity_state_t, solid), U_SOLID},
+	{offsetof(entity_state_t, sound), U_SOUND}
+};
+
+#define DELTA_FIELDS (int)(sizeof(delta_fields) / sizeof(delta_fields[0]))
+
+/*
+ * Returns the U_* bits of all fields in delta_fields[] that
+ * differ. The fields are compared as raw 32 bit words, this
+ * gets rid of the branches. The only difference to comparing
+ * the floats is that -0 and 0 are considered to be different.
+ */
+static int
+MSG_ChangedFields(const entity_state_t *from, const entity_state_t *to)
+{
+	unsigned int a, b;
+	int bits;
+	int i;
+
+	bits = 0;
+
+	for (i = 0; i < DELTA_FIELDS; i++)
+	{
+		memcpy(&a, (const byte *)from + delta_fields[i].ofs, sizeof(a));
+		memcpy(&b, (const byte *)to + delta_fields[i].ofs, sizeof(b));
+
+		bits |= -(a != b) & delta_fields[i].bit;
+	}
+
+	return bits;
+}
+
 /*
  * Writes part of a packetentities message.
  * Can delta from either a baseline or a previous packet_entity
@@ -435,6 +532,8 @@ MSG_WriteDeltaEntity(entity_state_t *from,
 		qboolean force,
 		qboolean newentity)
 {
+	byte buf[MAX_DELTAENTITY_SIZE];
+	byte *p;
 	int bits;
 
 	if (!to->number)
@@ -448,55 +547,23 @@ MSG_WriteDeltaEntity(entity_state_t *from,
 	}
 
 	/* send an update */
-	bits = 0;
+	bits = MSG_ChangedFields(from, to);
 
 	if (to->number >= 256)
 	{
 		bits |= U_NUMBER16; /* number8 is implicit otherwise */
 	}
 
-	if (to->origin[0] != from->origin[0])
-	{
-		bits |= U_ORIGIN1;
-	}
-
-	if (to->origin[1] != from->origin[1])
-	{
-		bits |= U_ORIGIN2;
-	}
-
-	if (to->origin[2] != from->origin[2])
-	{
-		bits |= U_ORIGIN3;
-	}
-
-	if (to->angles[0] != from->angles[0])
-	{
-		bits |= U_ANGLE1;
-	}
-
-	if (to->angles[1] != from->angles[1])
-	{
-		bits |= U_ANGLE2;
-	}
-
-	if (to->angles[2] != from->angles[2])
-	{
-		bits |= U_ANGLE3;
-	}
-
 	if (to->skinnum != from->skinnum)
 	{
 		if ((unsigned)to->skinnum < 256)
 		{
 			bits |= U_SKIN8;
 		}
-
 		else if ((unsigned)to->skinnum < 0x10000)
 		{
 			bits |= U_SKIN16;
 		}
-
 		else
 		{
 			bits |= (U_SKIN8 | U_SKIN16);
@@ -505,15 +572,7 @@ MSG_WriteDeltaEntity(entity_state_t *from,
 
 	if (to->frame != from->frame)
 	{
-		if (to->frame < 256)
-		{
-			bits |= U_FRAME8;
-		}
-
-		else
-		{
-			bits |= U_FRAME16;
-		}
+		bits |= (to->frame < 256) ? U_FRAME8 : U_FRAME16;
 	}
 
 	if (to->effects != from->effects)
@@ -522,12 +581,10 @@ MSG_WriteDeltaEntity(entity_state_t *from,
 		{
 			bits |= U_EFFECTS8;
 		}
-
 		else if (to->effects < 0x8000)
 		{
 			bits |= U_EFFECTS16;
 		}
-
 		else
 		{
 			bits |= U_EFFECTS8 | U_EFFECTS16;
@@ -540,235 +597,385 @@ MSG_WriteDeltaEntity(entity_state_t *from,
 		{
 			bits |= U_RENDERFX8;
 		}
-
 		else if (to->renderfx < 0x8000)
 		{
 			bits |= U_RENDERFX16;
 		}
-
 		else
 		{
 			bits |= U_RENDERFX8 | U_RENDERFX16;
 		}
 	}
 
-	if (to->solid != from->solid)
-	{
-		bits |= U_SOLID;
-	}
-
 	/* event is not delta compressed, just 0 compressed */
 	if (to->event)
 	{
 		bits |= U_EVENT;
 	}
 
-	if (to->modelindex != from->modelindex)
+	if (newentity || (to->renderfx & RF_BEAM))
 	{
-		bits |= U_MODEL;
+		bits |= U_OLDORIGIN;
 	}
 
-	if (to->modelindex2 != from->modelindex2)
+	/* write the message */
+	if (!bits && !force)
 	{
-		bits |= U_MODEL2;
+		return; /* nothing to send! */
 	}
 
-	if (to->modelindex3 != from->modelindex3)
+	if (bits & 0xff000000)
 	{
-		bits |= U_MODEL3;
+		bits |= U_MOREBITS3 | U_MOREBITS2 | U_MOREBITS1;
+	}
+	else if (bits & 0x00ff0000)
+	{
+		bits |= U_MOREBITS2 | U_MOREBITS1;
+	}
+	else if (bits & 0x0000ff00)
+	{
+		bits |= U_MOREBITS1;
 	}
 
-	if (to->modelindex4 != from->modelindex4)
+	/* the delta is assembled without any overflow
+	   checks and then appended in one go */
+	p = MSG_PutByte(buf, bits);
+
+	if (bits & U_MOREBITS1)
 	{
-		bits |= U_MODEL4;
+		p = MSG_PutByte(p, bits >> 8);
 	}
 
-	if (to->sound != from->sound)
+	if (bits & U_MOREBITS2)
 	{
-		bits |= U_SOUND;
+		p = MSG_PutByte(p, bits >> 16);
 	}
 
-	if (newentity || (to->renderfx & RF_BEAM))
+	if (bits & U_MOREBITS3)
 	{
-		bits |= U_OLDORIGIN;
+		p = MSG_PutByte(p, bits >> 24);
 	}
 
-	/* write the message */
-	if (!bits && !force)
+	if (bits & U_NUMBER16)
 	{
-		return; /* nothing to send! */
+		p = MSG_PutShort(p, to->number);
+	}
+	else
+	{
+		p = MSG_PutByte(p, to->number);
 	}
 
-	if (bits & 0xff000000)
+	if (bits & U_MODEL)
 	{
-		bits |= U_MOREBITS3 | U_MOREBITS2 | U_MOREBITS1;
+		p = MSG_PutByte(p, to->modelindex);
 	}
 
-	else if (bits & 0x00ff0000)
+	if (bits & U_MODEL2)
 	{
-		bits |= U_MOREBITS2 | U_MOREBITS1;
+		p = MSG_PutByte(p, to->modelindex2);
 	}
 
-	else if (bits & 0x0000ff00)
+	if (bits & U_MODEL3)
 	{
-		bits |= U_MOREBITS1;
+		p = MSG_PutByte(p, to->modelindex3);
 	}
 
-	MSG_WriteByte(msg, bits & 255);
+	if (bits & U_MODEL4)
+	{
+		p = MSG_PutByte(p, to->modelindex4);
+	}
 
-	if (bits & 0xff000000)
+	if (bits & U_FRAME8)
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
-		MSG_WriteByte(msg, (bits >> 16) & 255);
-		MSG_WriteByte(msg, (bits >> 24) & 255);
+		p = MSG_PutByte(p, to->frame);
 	}
 
-	else if (bits & 0x00ff0000)
+	if (bits & U_FRAME16)
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
-		MSG_WriteByte(msg, (bits >> 16) & 255);
+		p = MSG_PutShort(p, to->frame);
 	}
 
-	else if (bits & 0x0000ff00)
+	if ((bits & U_SKIN8) && (bits & U_SKIN16)) /*used for laser colors */
 	{
-		MSG_WriteByte(msg, (bits >> 8) & 255);
+		p = MSG_PutLong(p, to->skinnum);
+	}
+	else if (bits & U_SKIN8)
+	{
+		p = MSG_PutByte(p, to->skinnum);
+	}
+	else if (bits & U_SKIN16)
+	{
+		p = MSG_PutShort(p, to->skinnum);
 	}
 
-	if (bits & U_NUMBER16)
+	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
+	{
+		p = MSG_PutLong(p, to->effects);
+	}
+	else if (bits & U_EFFECTS8)
+	{
+		p = MSG_PutByte(p, to->effects);
+	}
+	else if (bits & U_EFFECTS16)
+	{
+		p = MSG_PutShort(p, to->effects);
+	}
+
+	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
+	{
+		p = MSG_PutLong(p, to->renderfx);
+	}
+	else if (bits & U_RENDERFX8)
+	{
+		p = MSG_PutByte(p, to->renderfx);
+	}
+	else if (bits & U_RENDERFX16)
+	{
+		p = MSG_PutShort(p, to->renderfx);
+	}
+
+	if (bits & U_ORIGIN1)
+	{
+		p = MSG_PutShort(p, (int)(to->origin[0] * 8));
+	}
+
+	if (bits & U_ORIGIN2)
+	{
+		p = MSG_PutShort(p, (int)(to->origin[1] * 8));
+	}
+
+	if (bits & U_ORIGIN3)
+	{
+		p = MSG_PutShort(p, (int)(to->origin[2] * 8));
+	}
+
+	if (bits & U_ANGLE1)
+	{
+		p = MSG_PutByte(p, (int)(to->angles[0] * 256 / 360));
+	}
+
+	if (bits & U_ANGLE2)
+	{
+		p = MSG_PutByte(p, (int)(to->angles[1] * 256 / 360));
+	}
+
+	if (bits & U_ANGLE3)
+	{
+		p = MSG_PutByte(p, (int)(to->angles[2] * 256 / 360));
+	}
+
+	if (bits & U_OLDORIGIN)
+	{
+		p = MSG_PutShort(p, (int)(to->old_origin[0] * 8));
+		p = MSG_PutShort(p, (int)(to->old_origin[1] * 8));
+		p = MSG_PutShort(p, (int)(to->old_origin[2] * 8));
+	}
+
+	if (bits & U_SOUND)
+	{
+		p = MSG_PutByte(p, to->sound);
+	}
+
+	if (bits & U_EVENT)
+	{
+		p = MSG_PutByte(p, to->event);
+	}
+
+	if (bits & U_SOLID)
 	{
-		MSG_WriteShort(msg, to->number);
+		p = MSG_PutShort(p, to->solid);
 	}
 
+	SZ_Write(msg, buf, p - buf);
+}
+
+/*
+ * Reads the fields of an entity delta, the header
+ * bits have already been read by the caller.
+ */
+void
+MSG_ReadDeltaEntity(sizebuf_t *msg_read, entity_state_t *from,
+		entity_state_t *to, int number, int bits)
+{
+	byte pad[MAX_DELTAENTITY_SIZE];
+	const byte *start, *p;
+	int avail;
+
+	/* set everything to the state we are delta'ing from */
+	*to = *from;
+
+	VectorCopy(from->origin, to->old_origin);
+	to->number = number;
+
+	/* check the size once and read unchecked afterwards.
+	   Close to the end of the message the rest of it is
+	   copied into a zero padded buffer. */
+	avail = msg_read->cursize - msg_read->readcount;
+
+	if (avail >= MAX_DELTAENTITY_SIZE)
+	{
+		start = msg_read->data + msg_read->readcount;
+	}
 	else
 	{
-		MSG_WriteByte(msg, to->number);
+		memset(pad, 0, sizeof(pad));
+
+		if (avail > 0)
+		{
+			memcpy(pad, msg_read->data + msg_read->readcount, avail);
+		}
+
+		start = pad;
 	}
 
+	p = start;
+
 	if (bits & U_MODEL)
 	{
-		MSG_WriteByte(msg, to->modelindex);
+		to->modelindex = *p++;
 	}
 
 	if (bits & U_MODEL2)
 	{
-		MSG_WriteByte(msg, to->modelindex2);
+		to->modelindex2 = *p++;
 	}
 
 	if (bits & U_MODEL3)
 	{
-		MSG_WriteByte(msg, to->modelindex3);
+		to->modelindex3 = *p++;
 	}
 
 	if (bits & U_MODEL4)
 	{
-		MSG_WriteByte(msg, to->modelindex4);
+		to->modelindex4 = *p++;
 	}
 
 	if (bits & U_FRAME8)
 	{
-		MSG_WriteByte(msg, to->frame);
+		to->frame = *p++;
 	}
 
 	if (bits & U_FRAME16)
 	{
-		MSG_WriteShort(msg, to->frame);
+		to->frame = MSG_GetShort(p);
+		p += 2;
 	}
 
-	if ((bits & U_SKIN8) && (bits & U_SKIN16)) /*used for laser colors */
+	/* used for laser colors */
+	if ((bits & U_SKIN8) && (bits & U_SKIN16))
 	{
-		MSG_WriteLong(msg, to->skinnum);
+		to->skinnum = MSG_GetLong(p);
+		p += 4;
 	}
-
 	else if (bits & U_SKIN8)
 	{
-		MSG_WriteByte(msg, to->skinnum);
+		to->skinnum = *p++;
 	}
-
 	else if (bits & U_SKIN16)
 	{
-		MSG_WriteShort(msg, to->skinnum);
+		to->skinnum = MSG_GetShort(p);
+		p += 2;
 	}
 
 	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
 	{
-		MSG_WriteLong(msg, to->effects);
+		to->effects = MSG_GetLong(p);
+		p += 4;
 	}
-
 	else if (bits & U_EFFECTS8)
 	{
-		MSG_WriteByte(msg, to->effects);
+		to->effects = *p++;
 	}
-
 	else if (bits & U_EFFECTS16)
 	{
-		MSG_WriteShort(msg, to->effects);
+		to->effects = MSG_GetShort(p);
+		p += 2;
 	}
 
 	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
 	{
-		MSG_WriteLong(msg, to->renderfx);
+		to->renderfx = MSG_GetLong(p);
+		p += 4;
 	}
-
 	else if (bits & U_RENDERFX8)
 	{
-		MSG_WriteByte(msg, to->renderfx);
+		to->renderfx = *p++;
 	}
-
 	else if (bits & U_RENDERFX16)
 	{
-		MSG_WriteShort(msg, to->renderfx);
+		to->renderfx = MSG_GetShort(p);
+		p += 2;
 	}
 
 	if (bits & U_ORIGIN1)
 	{
-		MSG_WriteCoord(msg, to->origin[0]);
+		to->origin[0] = MSG_GetShort(p) * (0.125f);
+		p += 2;
 	}
 
 	if (bits & U_ORIGIN2)
 	{
-		MSG_WriteCoord(msg, to->origin[1]);
+		to->origin[1] = MSG_GetShort(p) * (0.125f);
+		p += 2;
 	}
 
 	if (bits & U_ORIGIN3)
 	{
-		MSG_WriteCoord(msg, to->origin[2]);
+		to->origin[2] = MSG_GetShort(p) * (0.125f);
+		p += 2;
 	}
 
 	if (bits & U_ANGLE1)
 	{
-		MSG_WriteAngle(msg, to->angles[0]);
+		to->angles[0] = (signed char)*p++ * 1.40625f;
 	}
 
 	if (bits & U_ANGLE2)
 	{
-		MSG_WriteAngle(msg, to->angles[1]);
+		to->angles[1] = (signed char)*p++ * 1.40625f;
 	}
 
 	if (bits & U_ANGLE3)
 	{
-		MSG_WriteAngle(msg, to->angles[2]);
+		to->angles[2] = (signed char)*p++ * 1.40625f;
 	}
 
 	if (bits & U_OLDORIGIN)
 	{
-		MSG_WriteCoord(msg, to->old_origin[0]);
-		MSG_WriteCoord(msg, to->old_origin[1]);
-		MSG_WriteCoord(msg, to->old_origin[2]);
+		to->old_origin[0] = MSG_GetShort(p) * (0.125f);
+		to->old_origin[1] = MSG_GetShort(p + 2) * (0.125f);
+		to->old_origin[2] = MSG_GetShort(p + 4) * (0.125f);
+		p += 6;
 	}
 
 	if (bits & U_SOUND)
 	{
-		MSG_WriteByte(msg, to->sound);
+		to->sound = *p++;
 	}
 
 	if (bits & U_EVENT)
 	{
-		MSG_WriteByte(msg, to->event);
+		to->event = *p++;
+	}
+	else
+	{
+		to->event = 0;
 	}
 
 	if (bits & U_SOLID)
 	{
-		MSG_WriteShort(msg, to->solid);
+		to->solid = MSG_GetShort(p);
+		p += 2;
+	}
+
+	if (p - start > avail)
+	{
+		/* ran past the end, like the checked readers would */
+		msg_read->readcount = msg_read->cursize + 1;
+	}
+	else
+	{
+		msg_read->readcount += p - start;
 	}
 }
 
@@ -776,6 +983,7 @@ void
 MSG_BeginReading(sizebuf_t *msg)
 {
 	msg->readcount = 0;
+	msg->readbitpos = 0;
 }
 
 int
@@ -1042,3 +1250,619 @@ MSG_ReadData(sizebuf_t *msg_read, void *data, int len)
 	}
 }
 
+
+/*
+ * Bit packed entity deltas, used when NETCAP_PACKEDENTS was
+ * negotiated. Instead of the byte aligned U_* header and whole
+ * bytes or shorts per field the entities are written as one
+ * continuous bit stream:
+ *
+ *  - the entity number as distance to the previous entity,
+ *    a distance of 0 terminates the stream
+ *  - 1 bit remove flag
+ *  - 1 bit origin changed, followed by a 3 bit axis mask
+ *  - 1 bit angles changed, followed by a 3 bit axis mask
+ *  - 1 bit frame changed
+ *  - 1 bit for the rarely changing fields, followed by one
+ *    bit per field
+ *
+ * Numbers are written with the smallest of four field specific
+ * widths, selected by a 2 bit prefix. Origins and frames are
+ * written as difference to the old state, in the same precision
+ * as MSG_WriteCoord() and MSG_WriteAngle(), so the reconstructed
+ * state is the same as with the classic encoding.
+ */
+
+static const int packed_number[4] = {2, 4, 7, 10};
+static const int packed_coord[4] = {4, 8, 11, 17};
+static const int packed_frame[4] = {2, 5, 9, 32};
+static const int packed_byte[4] = {0, 4, 6, 8};
+static const int packed_skin[4] = {3, 8, 16, 32};
+static const int packed_flags[4] = {4, 8, 16, 32};
+static const int packed_solid[4] = {0, 5, 16, 32};
+
+static const int packed_origin[3] = {U_ORIGIN1, U_ORIGIN2, U_ORIGIN3};
+static const int packed_angles[3] = {U_ANGLE1, U_ANGLE2, U_ANGLE3};
+
+/* rarely changing fields, in stream order */
+static const int packed_rare[] = {
+	U_MODEL, U_MODEL2, U_MODEL3, U_MODEL4, U_SKIN8, U_EFFECTS8,
+	U_RENDERFX8, U_SOLID, U_SOUND, U_EVENT, U_OLDORIGIN
+};
+
+#define PACKED_RARE (int)(sizeof(packed_rare) / sizeof(packed_rare[0]))
+
+/*
+ * Appends the lowest bits of value to the buffer. The
+ * bits are filled into each byte from LSB to MSB.
+ */
+void
+MSG_WriteBits(sizebuf_t *sb, int value, int bits)
+{
+	unsigned int v;
+	int n;
+
+	v = value;
+
+	while (bits > 0)
+	{
+		if (!sb->bitpos)
+		{
+			*(byte *)SZ_GetSpace(sb, 1) = 0;
+		}
+
+		n = 8 - sb->bitpos;
+
+		if (n > bits)
+		{
+			n = bits;
+		}
+
+		sb->data[sb->cursize - 1] |= (v & ((1 << n) - 1)) << sb->bitpos;
+		sb->bitpos = (sb->bitpos + n) & 7;
+
+		v >>= n;
+		bits -= n;
+	}
+}
+
+/*
+ * Reads bits written by MSG_WriteBits(). Reading
+ * past the end of the buffer returns zero bits
+ * and leaves readcount behind cursize.
+ */
+int
+MSG_ReadBits(sizebuf_t *sb, int bits)
+{
+	unsigned int v;
+	int c, n, shift;
+
+	v = 0;
+	shift = 0;
+
+	while (bits > 0)
+	{
+		if (!sb->readbitpos)
+		{
+			sb->readcount++;
+		}
+
+		if (sb->readcount > sb->cursize)
+		{
+			c = 0;
+		}
+		else
+		{
+			c = sb->data[sb->readcount - 1];
+		}
+
+		n = 8 - sb->readbitpos;
+
+		if (n > bits)
+		{
+			n = bits;
+		}
+
+		v |= ((c >> sb->readbitpos) & ((1 << n) - 1)) << shift;
+		sb->readbitpos = (sb->readbitpos + n) & 7;
+
+		shift += n;
+		bits -= n;
+	}
+
+	return v;
+}
+
+static void
+MSG_WriteVarBits(sizebuf_t *sb, unsigned int value, const int *widths)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (value < (1u << widths[i]))
+		{
+			break;
+		}
+	}
+
+	MSG_WriteBits(sb, i, 2);
+	MSG_WriteBits(sb, value, widths[i]);
+}
+
+static unsigned int
+MSG_ReadVarBits(sizebuf_t *sb, const int *widths)
+{
+	return MSG_ReadBits(sb, widths[MSG_ReadBits(sb, 2)]);
+}
+
+/* maps small negative numbers to small positive ones */
+static unsigned int
+MSG_ZigZag(unsigned int d)
+{
+	return (d << 1) ^ (unsigned int)((int)d >> 31);
+}
+
+static unsigned int
+MSG_UnZigZag(unsigned int v)
+{
+	return (v >> 1) ^ (0u - (v & 1));
+}
+
+static int
+MSG_PackCoord(float f)
+{
+	return (short)(int)(f * 8);
+}
+
+static int
+MSG_PackAngle(float f)
+{
+	return (int)(f * 256 / 360) & 255;
+}
+
+static void
+MSG_WriteEntityHeaderPacked(sizebuf_t *msg, int number, int bits,
+		int *lastnum)
+{
+	int i;
+
+	MSG_WriteVarBits(msg, number - *lastnum, packed_number);
+	*lastnum = number;
+
+	MSG_WriteBits(msg, (bits & U_REMOVE) != 0, 1);
+
+	if (bits & U_REMOVE)
+	{
+		return;
+	}
+
+	MSG_WriteBits(msg, (bits & (U_ORIGIN1 | U_ORIGIN2 | U_ORIGIN3)) != 0, 1);
+
+	if (bits & (U_ORIGIN1 | U_ORIGIN2 | U_ORIGIN3))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			MSG_WriteBits(msg, (bits & packed_origin[i]) != 0, 1);
+		}
+	}
+
+	MSG_WriteBits(msg, (bits & (U_ANGLE1 | U_ANGLE2 | U_ANGLE3)) != 0, 1);
+
+	if (bits & (U_ANGLE1 | U_ANGLE2 | U_ANGLE3))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			MSG_WriteBits(msg, (bits & packed_angles[i]) != 0, 1);
+		}
+	}
+
+	MSG_WriteBits(msg, (bits & U_FRAME8) != 0, 1);
+
+	for (i = 0; i < PACKED_RARE; i++)
+	{
+		if (bits & packed_rare[i])
+		{
+			break;
+		}
+	}
+
+	MSG_WriteBits(msg, i < PACKED_RARE, 1);
+
+	if (i < PACKED_RARE)
+	{
+		for (i = 0; i < PACKED_RARE; i++)
+		{
+			MSG_WriteBits(msg, (bits & packed_rare[i]) != 0, 1);
+		}
+	}
+}
+
+/*
+ * Writes a bit packed delta update of an entity_state_t.
+ * Entities must be written with ascending numbers, lastnum
+ * is the number of the previous entity in the stream and
+ * must be 0 for the first one.
+ */
+void
+MSG_WriteDeltaEntityPacked(entity_state_t *from,
+		entity_state_t *to,
+		sizebuf_t *msg,
+		qboolean force,
+		qboolean newentity,
+		int *lastnum)
+{
+	int bits;
+	int i;
+	int qto[3];
+
+	if (!to->number)
+	{
+		Com_Error(ERR_FATAL, "Unset entity number");
+	}
+
+	if (to->number >= MAX_EDICTS)
+	{
+		Com_Error(ERR_FATAL, "Entity number >= MAX_EDICTS");
+	}
+
+	/* changes below the transmitted precision
+	   wouldn't reach the client anyways */
+	bits = 0;
+
+	for (i = 0; i < 3; i++)
+	{
+		qto[i] = MSG_PackCoord(to->origin[i]);
+
+		if (qto[i] != MSG_PackCoord(from->origin[i]))
+		{
+			bits |= packed_origin[i];
+		}
+
+		if (MSG_PackAngle(to->angles[i]) != MSG_PackAngle(from->angles[i]))
+		{
+			bits |= packed_angles[i];
+		}
+	}
+
+	if (to->frame != from->frame)
+	{
+		bits |= U_FRAME8;
+	}
+
+	if (to->modelindex != from->modelindex)
+	{
+		bits |= U_MODEL;
+	}
+
+	if (to->modelindex2 != from->modelindex2)
+	{
+		bits |= U_MODEL2;
+	}
+
+	if (to->modelindex3 != from->modelindex3)
+	{
+		bits |= U_MODEL3;
+	}
+
+	if (to->modelindex4 != from->modelindex4)
+	{
+		bits |= U_MODEL4;
+	}
+
+	if (to->skinnum != from->skinnum)
+	{
+		bits |= U_SKIN8;
+	}
+
+	if (to->effects != from->effects)
+	{
+		bits |= U_EFFECTS8;
+	}
+
+	if (to->renderfx != from->renderfx)
+	{
+		bits |= U_RENDERFX8;
+	}
+
+	if (to->solid != from->solid)
+	{
+		bits |= U_SOLID;
+	}
+
+	if (to->sound != from->sound)
+	{
+		bits |= U_SOUND;
+	}
+
+	/* event is not delta compressed, just 0 compressed */
+	if (to->event)
+	{
+		bits |= U_EVENT;
+	}
+
+	if (newentity || (to->renderfx & RF_BEAM))
+	{
+		bits |= U_OLDORIGIN;
+	}
+
+	if (!bits && !force)
+	{
+		return; /* nothing to send! */
+	}
+
+	MSG_WriteEntityHeaderPacked(msg, to->number, bits, lastnum);
+
+	for (i = 0; i < 3; i++)
+	{
+		if (bits & packed_origin[i])
+		{
+			MSG_WriteVarBits(msg, MSG_ZigZag(qto[i] -
+						MSG_PackCoord(from->origin[i])), packed_coord);
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		if (bits & packed_angles[i])
+		{
+			MSG_WriteBits(msg, MSG_PackAngle(to->angles[i]), 8);
+		}
+	}
+
+	if (bits & U_FRAME8)
+	{
+		MSG_WriteVarBits(msg, MSG_ZigZag((unsigned int)to->frame -
+					(unsigned int)from->frame), packed_frame);
+	}
+
+	if (bits & U_MODEL)
+	{
+		MSG_WriteVarBits(msg, to->modelindex & 255, packed_byte);
+	}
+
+	if (bits & U_MODEL2)
+	{
+		MSG_WriteVarBits(msg, to->modelindex2 & 255, packed_byte);
+	}
+
+	if (bits & U_MODEL3)
+	{
+		MSG_WriteVarBits(msg, to->modelindex3 & 255, packed_byte);
+	}
+
+	if (bits & U_MODEL4)
+	{
+		MSG_WriteVarBits(msg, to->modelindex4 & 255, packed_byte);
+	}
+
+	if (bits & U_SKIN8)
+	{
+		MSG_WriteVarBits(msg, to->skinnum, packed_skin);
+	}
+
+	if (bits & U_EFFECTS8)
+	{
+		MSG_WriteVarBits(msg, to->effects, packed_flags);
+	}
+
+	if (bits & U_RENDERFX8)
+	{
+		MSG_WriteVarBits(msg, to->renderfx, packed_flags);
+	}
+
+	if (bits & U_SOLID)
+	{
+		MSG_WriteVarBits(msg, to->solid, packed_solid);
+	}
+
+	if (bits & U_SOUND)
+	{
+		MSG_WriteVarBits(msg, to->sound & 255, packed_byte);
+	}
+
+	if (bits & U_EVENT)
+	{
+		MSG_WriteVarBits(msg, to->event & 255, packed_byte);
+	}
+
+	/* old_origin is usually close to the origin */
+	if (bits & U_OLDORIGIN)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			MSG_WriteVarBits(msg, MSG_ZigZag(MSG_PackCoord(to->old_origin[i]) -
+						qto[i]), packed_coord);
+		}
+	}
+}
+
+void
+MSG_WriteEntityRemovePacked(sizebuf_t *msg, int number, int *lastnum)
+{
+	MSG_WriteEntityHeaderPacked(msg, number, U_REMOVE, lastnum);
+}
+
+/*
+ * Terminates the bit packed entities. The
+ * next write starts at a byte boundary.
+ */
+void
+MSG_WriteEntityEndPacked(sizebuf_t *msg)
+{
+	MSG_WriteVarBits(msg, 0, packed_number);
+	msg->bitpos = 0;
+}
+
+/*
+ * Returns the entity number and the header bits, in
+ * the same U_* notation as the classic encoding. The
+ * number is 0 at the end of the entities.
+ */
+int
+MSG_ReadEntityBitsPacked(sizebuf_t *sb, unsigned *bits, int *lastnum)
+{
+	int delta;
+	int i;
+
+	*bits = 0;
+
+	delta = MSG_ReadVarBits(sb, packed_number);
+
+	if (!delta)
+	{
+		sb->readbitpos = 0;
+		return 0;
+	}
+
+	*lastnum += delta;
+
+	if (MSG_ReadBits(sb, 1))
+	{
+		*bits = U_REMOVE;
+		return *lastnum;
+	}
+
+	if (MSG_ReadBits(sb, 1))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			if (MSG_ReadBits(sb, 1))
+			{
+				*bits |= packed_origin[i];
+			}
+		}
+	}
+
+	if (MSG_ReadBits(sb, 1))
+	{
+		for (i = 0; i < 3; i++)
+		{
+			if (MSG_ReadBits(sb, 1))
+			{
+				*bits |= packed_angles[i];
+			}
+		}
+	}
+
+	if (MSG_ReadBits(sb, 1))
+	{
+		*bits |= U_FRAME8;
+	}
+
+	if (MSG_ReadBits(sb, 1))
+	{
+		for (i = 0; i < PACKED_RARE; i++)
+		{
+			if (MSG_ReadBits(sb, 1))
+			{
+				*bits |= packed_rare[i];
+			}
+		}
+	}
+
+	return *lastnum;
+}
+
+/*
+ * Counterpart of MSG_WriteDeltaEntityPacked(), bits
+ * are the header bits from MSG_ReadEntityBitsPacked().
+ */
+void
+MSG_ReadDeltaEntityPacked(sizebuf_t *sb, entity_state_t *from,
+		entity_state_t *to, int number, int bits)
+{
+	int i;
+
+	/* set everything to the state we are delta'ing from */
+	*to = *from;
+
+	VectorCopy(from->origin, to->old_origin);
+	to->number = number;
+
+	for (i = 0; i < 3; i++)
+	{
+		if (bits & packed_origin[i])
+		{
+			to->origin[i] = (short)(MSG_PackCoord(from->origin[i]) +
+					MSG_UnZigZag(MSG_ReadVarBits(sb, packed_coord))) * 0.125f;
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		if (bits & packed_angles[i])
+		{
+			to->angles[i] = (signed char)MSG_ReadBits(sb, 8) * 1.40625f;
+		}
+	}
+
+	if (bits & U_FRAME8)
+	{
+		to->frame = (unsigned int)from->frame +
+			MSG_UnZigZag(MSG_ReadVarBits(sb, packed_frame));
+	}
+
+	if (bits & U_MODEL)
+	{
+		to->modelindex = MSG_ReadVarBits(sb, packed_byte);
+	}
+
+	if (bits & U_MODEL2)
+	{
+		to->modelindex2 = MSG_ReadVarBits(sb, packed_byte);
+	}
+
+	if (bits & U_MODEL3)
+	{
+		to->modelindex3 = MSG_ReadVarBits(sb, packed_byte);
+	}
+
+	if (bits & U_MODEL4)
+	{
+		to->modelindex4 = MSG_ReadVarBits(sb, packed_byte);
+	}
+
+	if (bits & U_SKIN8)
+	{
+		to->skinnum = MSG_ReadVarBits(sb, packed_skin);
+	}
+
+	if (bits & U_EFFECTS8)
+	{
+		to->effects = MSG_ReadVarBits(sb, packed_flags);
+	}
+
+	if (bits & U_RENDERFX8)
+	{
+		to->renderfx = MSG_ReadVarBits(sb, packed_flags);
+	}
+
+	if (bits & U_SOLID)
+	{
+		to->solid = MSG_ReadVarBits(sb, packed_solid);
+	}
+
+	if (bits & U_SOUND)
+	{
+		to->sound = MSG_ReadVarBits(sb, packed_byte);
+	}
+
+	if (bits & U_EVENT)
+	{
+		to->event = MSG_ReadVarBits(sb, packed_byte);
+	}
+	else
+	{
+		to->event = 0;
+	}
+
+	if (bits & U_OLDORIGIN)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			to->old_origin[i] = (short)(MSG_PackCoord(to->origin[i]) +
+					MSG_UnZigZag(MSG_ReadVarBits(sb, packed_coord))) * 0.125f;
+		}
+	}
+}
@@ -0,0 +1,749 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Microbenchmark for the entity delta encoding. Encodes and decodes a
+ * large synthetic set of entity deltas with the current implementation
+ * and with the former field by field one and compares the results.
+ *
+ * =======================================================================
+ */
+
+#include "header/common.h"
+
+/*
+ * The field by field MSG_WriteDeltaEntity() as it was
+ * before the fast path, as reference for the benchmark.
+ */
+static void
+MSG_WriteDeltaEntityRef(entity_state_t *from,
+		entity_state_t *to,
+		sizebuf_t *msg,
+		qboolean force,
+		qboolean newentity)
+{
+	int bits;
+
+	if (!to->number)
+	{
+		Com_Error(ERR_FATAL, "Unset entity number");
+	}
+
+	if (to->number >= MAX_EDICTS)
+	{
+		Com_Error(ERR_FATAL, "Entity number >= MAX_EDICTS");
+	}
+
+	/* send an update */
+	bits = 0;
+
+	if (to->number >= 256)
+	{
+		bits |= U_NUMBER16; /* number8 is implicit otherwise */
+	}
+
+	if (to->origin[0] != from->origin[0])
+	{
+		bits |= U_ORIGIN1;
+	}
+
+	if (to->origin[1] != from->origin[1])
+	{
+		bits |= U_ORIGIN2;
+	}
+
+	if (to->origin[2] != from->origin[2])
+	{
+		bits |= U_ORIGIN3;
+	}
+
+	if (to->angles[0] != from->angles[0])
+	{
+		bits |= U_ANGLE1;
+	}
+
+	if (to->angles[1] != from->angles[1])
+	{
+		bits |= U_ANGLE2;
+	}
+
+	if (to->angles[2] != from->angles[2])
+	{
+		bits |= U_ANGLE3;
+	}
+
+	if (to->skinnum != from->skinnum)
+	{
+		if ((unsigned)to->skinnum < 256)
+		{
+			bits |= U_SKIN8;
+		}
+
+		else if ((unsigned)to->skinnum < 0x10000)
+		{
+			bits |= U_SKIN16;
+		}
+
+		else
+		{
+			bits |= (U_SKIN8 | U_SKIN16);
+		}
+	}
+
+	if (to->frame != from->frame)
+	{
+		if (to->frame < 256)
+		{
+			bits |= U_FRAME8;
+		}
+
+		else
+		{
+			bits |= U_FRAME16;
+		}
+	}
+
+	if (to->effects != from->effects)
+	{
+		if (to->effects < 256)
+		{
+			bits |= U_EFFECTS8;
+		}
+
+		else if (to->effects < 0x8000)
+		{
+			bits |= U_EFFECTS16;
+		}
+
+		else
+		{
+			bits |= U_EFFECTS8 | U_EFFECTS16;
+		}
+	}
+
+	if (to->renderfx != from->renderfx)
+	{
+		if (to->renderfx < 256)
+		{
+			bits |= U_RENDERFX8;
+		}
+
+		else if (to->renderfx < 0x8000)
+		{
+			bits |= U_RENDERFX16;
+		}
+
+		else
+		{
+			bits |= U_RENDERFX8 | U_RENDERFX16;
+		}
+	}
+
+	if (to->solid != from->solid)
+	{
+		bits |= U_SOLID;
+	}
+
+	/* event is not delta compressed, just 0 compressed */
+	if (to->event)
+	{
+		bits |= U_EVENT;
+	}
+
+	if (to->modelindex != from->modelindex)
+	{
+		bits |= U_MODEL;
+	}
+
+	if (to->modelindex2 != from->modelindex2)
+	{
+		bits |= U_MODEL2;
+	}
+
+	if (to->modelindex3 != from->modelindex3)
+	{
+		bits |= U_MODEL3;
+	}
+
+	if (to->modelindex4 != from->modelindex4)
+	{
+		bits |= U_MODEL4;
+	}
+
+	if (to->sound != from->sound)
+	{
+		bits |= U_SOUND;
+	}
+
+	if (newentity || (to->renderfx & RF_BEAM))
+	{
+		bits |= U_OLDORIGIN;
+	}
+
+	/* write the message */
+	if (!bits && !force)
+	{
+		return; /* nothing to send! */
+	}
+
+	if (bits & 0xff000000)
+	{
+		bits |= U_MOREBITS3 | U_MOREBITS2 | U_MOREBITS1;
+	}
+
+	else if (bits & 0x00ff0000)
+	{
+		bits |= U_MOREBITS2 | U_MOREBITS1;
+	}
+
+	else if (bits & 0x0000ff00)
+	{
+		bits |= U_MOREBITS1;
+	}
+
+	MSG_WriteByte(msg, bits & 255);
+
+	if (bits & 0xff000000)
+	{
+		MSG_WriteByte(msg, (bits >> 8) & 255);
+		MSG_WriteByte(msg, (bits >> 16) & 255);
+		MSG_WriteByte(msg, (bits >> 24) & 255);
+	}
+
+	else if (bits & 0x00ff0000)
+	{
+		MSG_WriteByte(msg, (bits >> 8) & 255);
+		MSG_WriteByte(msg, (bits >> 16) & 255);
+	}
+
+	else if (bits & 0x0000ff00)
+	{
+		MSG_WriteByte(msg, (bits >> 8) & 255);
+	}
+
+	if (bits & U_NUMBER16)
+	{
+		MSG_WriteShort(msg, to->number);
+	}
+
+	else
+	{
+		MSG_WriteByte(msg, to->number);
+	}
+
+	if (bits & U_MODEL)
+	{
+		MSG_WriteByte(msg, to->modelindex);
+	}
+
+	if (bits & U_MODEL2)
+	{
+		MSG_WriteByte(msg, to->modelindex2);
+	}
+
+	if (bits & U_MODEL3)
+	{
+		MSG_WriteByte(msg, to->modelindex3);
+	}
+
+	if (bits & U_MODEL4)
+	{
+		MSG_WriteByte(msg, to->modelindex4);
+	}
+
+	if (bits & U_FRAME8)
+	{
+		MSG_WriteByte(msg, to->frame);
+	}
+
+	if (bits & U_FRAME16)
+	{
+		MSG_WriteShort(msg, to->frame);
+	}
+
+	if ((bits & U_SKIN8) && (bits & U_SKIN16)) /*used for laser colors */
+	{
+		MSG_WriteLong(msg, to->skinnum);
+	}
+
+	else if (bits & U_SKIN8)
+	{
+		MSG_WriteByte(msg, to->skinnum);
+	}
+
+	else if (bits & U_SKIN16)
+	{
+		MSG_WriteShort(msg, to->skinnum);
+	}
+
+	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
+	{
+		MSG_WriteLong(msg, to->effects);
+	}
+
+	else if (bits & U_EFFECTS8)
+	{
+		MSG_WriteByte(msg, to->effects);
+	}
+
+	else if (bits & U_EFFECTS16)
+	{
+		MSG_WriteShort(msg, to->effects);
+	}
+
+	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
+	{
+		MSG_WriteLong(msg, to->renderfx);
+	}
+
+	else if (bits & U_RENDERFX8)
+	{
+		MSG_WriteByte(msg, to->renderfx);
+	}
+
+	else if (bits & U_RENDERFX16)
+	{
+		MSG_WriteShort(msg, to->renderfx);
+	}
+
+	if (bits & U_ORIGIN1)
+	{
+		MSG_WriteCoord(msg, to->origin[0]);
+	}
+
+	if (bits & U_ORIGIN2)
+	{
+		MSG_WriteCoord(msg, to->origin[1]);
+	}
+
+	if (bits & U_ORIGIN3)
+	{
+		MSG_WriteCoord(msg, to->origin[2]);
+	}
+
+	if (bits & U_ANGLE1)
+	{
+		MSG_WriteAngle(msg, to->angles[0]);
+	}
+
+	if (bits & U_ANGLE2)
+	{
+		MSG_WriteAngle(msg, to->angles[1]);
+	}
+
+	if (bits & U_ANGLE3)
+	{
+		MSG_WriteAngle(msg, to->angles[2]);
+	}
+
+	if (bits & U_OLDORIGIN)
+	{
+		MSG_WriteCoord(msg, to->old_origin[0]);
+		MSG_WriteCoord(msg, to->old_origin[1]);
+		MSG_WriteCoord(msg, to->old_origin[2]);
+	}
+
+	if (bits & U_SOUND)
+	{
+		MSG_WriteByte(msg, to->sound);
+	}
+
+	if (bits & U_EVENT)
+	{
+		MSG_WriteByte(msg, to->event);
+	}
+
+	if (bits & U_SOLID)
+	{
+		MSG_WriteShort(msg, to->solid);
+	}
+}
+
+/*
+ * Reference reader, the former CL_ParseDelta().
+ */
+static void
+MSG_ReadDeltaEntityRef(sizebuf_t *sb, entity_state_t *from,
+		entity_state_t *to, int number, int bits)
+{
+	/* set everything to the state we are delta'ing from */
+	*to = *from;
+
+	VectorCopy(from->origin, to->old_origin);
+	to->number = number;
+
+	if (bits & U_MODEL)
+	{
+		to->modelindex = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_MODEL2)
+	{
+		to->modelindex2 = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_MODEL3)
+	{
+		to->modelindex3 = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_MODEL4)
+	{
+		to->modelindex4 = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_FRAME8)
+	{
+		to->frame = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_FRAME16)
+	{
+		to->frame = MSG_ReadShort(sb);
+	}
+
+	/* used for laser colors */
+	if ((bits & U_SKIN8) && (bits & U_SKIN16))
+	{
+		to->skinnum = MSG_ReadLong(sb);
+	}
+	else if (bits & U_SKIN8)
+	{
+		to->skinnum = MSG_ReadByte(sb);
+	}
+	else if (bits & U_SKIN16)
+	{
+		to->skinnum = MSG_ReadShort(sb);
+	}
+
+	if ((bits & (U_EFFECTS8 | U_EFFECTS16)) == (U_EFFECTS8 | U_EFFECTS16))
+	{
+		to->effects = MSG_ReadLong(sb);
+	}
+	else if (bits & U_EFFECTS8)
+	{
+		to->effects = MSG_ReadByte(sb);
+	}
+	else if (bits & U_EFFECTS16)
+	{
+		to->effects = MSG_ReadShort(sb);
+	}
+
+	if ((bits & (U_RENDERFX8 | U_RENDERFX16)) == (U_RENDERFX8 | U_RENDERFX16))
+	{
+		to->renderfx = MSG_ReadLong(sb);
+	}
+	else if (bits & U_RENDERFX8)
+	{
+		to->renderfx = MSG_ReadByte(sb);
+	}
+	else if (bits & U_RENDERFX16)
+	{
+		to->renderfx = MSG_ReadShort(sb);
+	}
+
+	if (bits & U_ORIGIN1)
+	{
+		to->origin[0] = MSG_ReadCoord(sb);
+	}
+
+	if (bits & U_ORIGIN2)
+	{
+		to->origin[1] = MSG_ReadCoord(sb);
+	}
+
+	if (bits & U_ORIGIN3)
+	{
+		to->origin[2] = MSG_ReadCoord(sb);
+	}
+
+	if (bits & U_ANGLE1)
+	{
+		to->angles[0] = MSG_ReadAngle(sb);
+	}
+
+	if (bits & U_ANGLE2)
+	{
+		to->angles[1] = MSG_ReadAngle(sb);
+	}
+
+	if (bits & U_ANGLE3)
+	{
+		to->angles[2] = MSG_ReadAngle(sb);
+	}
+
+	if (bits & U_OLDORIGIN)
+	{
+		MSG_ReadPos(sb, to->old_origin);
+	}
+
+	if (bits & U_SOUND)
+	{
+		to->sound = MSG_ReadByte(sb);
+	}
+
+	if (bits & U_EVENT)
+	{
+		to->event = MSG_ReadByte(sb);
+	}
+	else
+	{
+		to->event = 0;
+	}
+
+	if (bits & U_SOLID)
+	{
+		to->solid = MSG_ReadShort(sb);
+	}
+}
+
+static int
+MSG_BenchReadEntityBits(sizebuf_t *sb, unsigned *bits)
+{
+	unsigned total;
+
+	total = MSG_ReadByte(sb);
+
+	if (total & U_MOREBITS1)
+	{
+		total |= MSG_ReadByte(sb) << 8;
+	}
+
+	if (total & U_MOREBITS2)
+	{
+		total |= MSG_ReadByte(sb) << 16;
+	}
+
+	if (total & U_MOREBITS3)
+	{
+		total |= MSG_ReadByte(sb) << 24;
+	}
+
+	*bits = total;
+
+	if (total & U_NUMBER16)
+	{
+		return MSG_ReadShort(sb);
+	}
+
+	return MSG_ReadByte(sb);
+}
+
+/*
+ * Fills the set with typical updates: most entities
+ * move and animate, only few change their models
+ * or effects.
+ */
+static void
+MSG_BenchFill(entity_state_t *from, entity_state_t *to, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+	{
+		memset(&from[i], 0, sizeof(entity_state_t));
+
+		from[i].number = 1 + i % (MAX_EDICTS - 1);
+
+		for (j = 0; j < 3; j++)
+		{
+			from[i].origin[j] = (short)(randk() & 0x7fff) * 0.125f;
+			from[i].angles[j] = (signed char)randk() * 1.40625f;
+		}
+
+		from[i].modelindex = randk() & 255;
+		from[i].frame = randk() % 200;
+		from[i].solid = (randk() & 1) ? 31 : randk() & 0x7fff;
+
+		to[i] = from[i];
+
+		if (randk() % 10 < 6)
+		{
+			to[i].origin[0] += (randk() % 64) * 0.125f;
+			to[i].origin[1] += (randk() % 64) * 0.125f;
+		}
+
+		if (randk() % 10 < 3)
+		{
+			to[i].origin[2] += (randk() % 64) * 0.125f;
+			to[i].angles[1] = (signed char)randk() * 1.40625f;
+		}
+
+		if (randk() % 2)
+		{
+			to[i].frame++;
+		}
+
+		if (randk() % 20 == 0)
+		{
+			to[i].modelindex2 = randk() & 255;
+			to[i].skinnum = randk() & 0xffff;
+		}
+
+		if (randk() % 20 == 0)
+		{
+			to[i].effects = randk();
+			to[i].renderfx = randk() & 0xff;
+		}
+
+		if (randk() % 10 == 0)
+		{
+			to[i].event = 1 + randk() % 8;
+		}
+	}
+}
+
+/*
+ * msgbench [entities] [iterations]
+ */
+void
+MSG_Bench_f(void)
+{
+	entity_state_t *from, *to, *out[2];
+	byte *data[2];
+	sizebuf_t msg[2];
+	long long start, wtime[2], rtime[2];
+	int count, iterations;
+	int impl, i, j;
+	int number;
+	unsigned bits;
+	const char *names[2] = {"before", "after"};
+
+	count = 16384;
+	iterations = 20;
+
+	if (Cmd_Argc() > 1)
+	{
+		count = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+	}
+
+	if (Cmd_Argc() > 2)
+	{
+		iterations = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
+	}
+
+	if ((count < 1) || (iterations < 1))
+	{
+		Com_Printf("Usage: msgbench [entities] [iterations]\n");
+		return;
+	}
+
+	from = Z_Malloc(count * sizeof(entity_state_t));
+	to = Z_Malloc(count * sizeof(entity_state_t));
+
+	MSG_BenchFill(from, to, count);
+
+	for (impl = 0; impl < 2; impl++)
+	{
+		out[impl] = Z_Malloc(count * sizeof(entity_state_t));
+		data[impl] = Z_Malloc(count * MAX_DELTAENTITY_SIZE);
+		SZ_Init(&msg[impl], data[impl], count * MAX_DELTAENTITY_SIZE);
+
+		wtime[impl] = 0;
+		rtime[impl] = 0;
+	}
+
+	/* the implementations take turns, so that
+	   neither of them runs on a cold cache */
+	for (j = 0; j < iterations; j++)
+	{
+		for (impl = 0; impl < 2; impl++)
+		{
+			start = Sys_Microseconds();
+
+			SZ_Clear(&msg[impl]);
+
+			for (i = 0; i < count; i++)
+			{
+				if (impl)
+				{
+					MSG_WriteDeltaEntity(&from[i], &to[i], &msg[impl],
+							false, false);
+				}
+				else
+				{
+					MSG_WriteDeltaEntityRef(&from[i], &to[i], &msg[impl],
+							false, false);
+				}
+			}
+
+			wtime[impl] += Sys_Microseconds() - start;
+		}
+
+		for (impl = 0; impl < 2; impl++)
+		{
+			start = Sys_Microseconds();
+
+			MSG_BeginReading(&msg[impl]);
+
+			/* unchanged entities aren't written */
+			for (i = 0; msg[impl].readcount < msg[impl].cursize; i++)
+			{
+				number = MSG_BenchReadEntityBits(&msg[impl], &bits);
+
+				while (to[i].number != number)
+				{
+					i++;
+				}
+
+				if (impl)
+				{
+					MSG_ReadDeltaEntity(&msg[impl], &from[i], &out[impl][i],
+							number, bits);
+				}
+				else
+				{
+					MSG_ReadDeltaEntityRef(&msg[impl], &from[i],
+							&out[impl][i], number, bits);
+				}
+			}
+
+			rtime[impl] += Sys_Microseconds() - start;
+		}
+	}
+
+	Com_Printf("%i entities, %i iterations, %i bytes\n", count, iterations,
+			msg[1].cursize);
+
+	for (impl = 0; impl < 2; impl++)
+	{
+		Com_Printf("%-7s write %6.2f Mentities/s  read %6.2f Mentities/s\n",
+				names[impl],
+				(double)count * iterations / (wtime[impl] ? wtime[impl] : 1),
+				(double)count * iterations / (rtime[impl] ? rtime[impl] : 1));
+	}
+
+	/* both implementations must produce the same results */
+	if ((msg[0].cursize != msg[1].cursize) ||
+		memcmp(data[0], data[1], msg[0].cursize) ||
+		memcmp(out[0], out[1], count * sizeof(entity_state_t)))
+	{
+		Com_Printf("Results differ!\n");
+	}
+
+	for (impl = 0; impl < 2; impl++)
+	{
+		Z_Free(out[impl]);
+		Z_Free(data[impl]);
+	}
+
+	Z_Free(from);
+	Z_Free(to);
+}
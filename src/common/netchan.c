@@ -79,15 +79,80 @@
  * frame, such as during the connection stage while waiting for the
  * client to load, then a packet only needs to be delivered if there is
  * something in the unacknowledged reliable
+ *
+ * If NETCAP_COMPRESS was negotiated, a single byte follows the header.
+ * If it's NETCHAN_RAW the payload is sent as is, if it's NETCHAN_LZ
+ * the payload (reliable and unreliable part together) is compressed.
+ * The receiver decompresses it in place, so everything after
+ * Netchan_Process() (including demo recording) sees a plain packet.
+ *
+ * If NETCAP_FRAGMENT was negotiated, packets may be up to
+ * MAX_FRAGMSGLEN bytes long. Larger than MAX_MSGLEN packets are
+ * split into fragments, each carrying the header of the packet with
+ * NETCHAN_FRAGMENT set in the sequence and a short with the offset
+ * of the fragment in the payload. The highest bit of the offset is
+ * set on all but the last fragment. The receiver collects them in
+ * any order and processes the packet once it's complete. A single
+ * lost fragment loses the whole packet, the reliable part is resent
+ * as usual.
+ * Loopback packets are never fragmented.
+ *
+ * The send time and size of the last NETCHAN_HISTORY packets are
+ * remembered. Every time the acknowledge sequence advances, the
+ * round trip time is sampled and all skipped sequences are counted
+ * as lost. The remote side acknowledges only the last packet it has
+ * received, so this assumes that it sends at least as often as we
+ * do. That's true for the client, which is all the rate control in
+ * the server needs.
+ *
+ * For testing, NET_SendPacket() can simulate a bad link. net_loss
+ * drops the given percentage of the packets, net_latency delays
+ * every packet by the given number of msec, loopback included, and
+ * net_bandwidth limits each direction to the given bytes per second,
+ * with a NETLAG_QUEUE msec queue that drops packets when it's full.
+ * The delayed packets are sent by NET_GetPacket().
  */
 
+#define NETCHAN_RAW 0
+#define NETCHAN_LZ 1
+
+/* sequence numbers never get that large */
+#define NETCHAN_FRAGMENT (1 << 30)
+#define NETCHAN_FRAGLEN 1280
+#define NETCHAN_MOREFRAGS 0x8000
+
+/* payloads smaller than this aren't worth the effort */
+#define NETCHAN_COMPRESS_MIN 32
+
+/* packets queued longer than this are dropped */
+#define NETLAG_QUEUE 250
+
+typedef struct netlagpacket_s
+{
+	int time; /* when it's sent */
+	netsrc_t sock;
+	netadr_t to;
+	int length;
+	struct netlagpacket_s *next;
+	byte data[1]; /* variable sized */
+} netlagpacket_t;
+
 cvar_t *showpackets;
 cvar_t *showdrop;
 cvar_t *qport;
+cvar_t *net_loss;
+cvar_t *net_latency;
+cvar_t *net_bandwidth;
+
+static netlagpacket_t *net_lagpackets;
+static netlagpacket_t **net_lagtail = &net_lagpackets;
+static double net_linkbusy[2]; /* per netsrc_t */
+static qboolean net_lagsending;
+static unsigned int net_lagseed = 1;
 
 netadr_t net_from;
 sizebuf_t net_message;
-byte net_message_buffer[MAX_MSGLEN];
+byte net_message_buffer[MAX_FRAGMSGLEN];
 
 void
 Netchan_Init(void)
@@ -100,6 +165,154 @@ Netchan_Init(void)
 	showpackets = Cvar_Get("showpackets", "0", 0);
 	showdrop = Cvar_Get("showdrop", "0", 0);
 	qport = Cvar_Get("qport", va("%i", port), CVAR_NOSET);
+
+	net_loss = Cvar_Get("net_loss", "0", 0);
+	net_latency = Cvar_Get("net_latency", "0", 0);
+	net_bandwidth = Cvar_Get("net_bandwidth", "0", 0);
+	net_lagseed = port | 1;
+}
+
+/*
+ * Called by NET_SendPacket(), returns true if the
+ * packet was dropped or queued to simulate a bad link.
+ */
+qboolean
+NET_LagPacket(netsrc_t sock, int length, void *data, netadr_t to)
+{
+	netlagpacket_t *pkt;
+	double start;
+	int now, time;
+
+	/* the queued packets themselves */
+	if (net_lagsending || !net_loss)
+	{
+		return false;
+	}
+
+	if ((net_loss->value <= 0) && (net_latency->value <= 0) &&
+		(net_bandwidth->value <= 0))
+	{
+		return false;
+	}
+
+	now = Sys_Milliseconds();
+	time = now;
+
+	if (net_loss->value > 0)
+	{
+		/* xorshift, randk() would change
+		   the input recordings */
+		net_lagseed ^= net_lagseed << 13;
+		net_lagseed ^= net_lagseed >> 17;
+		net_lagseed ^= net_lagseed << 5;
+
+		if ((net_lagseed % 10000) < net_loss->value * 100)
+		{
+			return true;
+		}
+	}
+
+	if (net_bandwidth->value > 0)
+	{
+		start = net_linkbusy[sock];
+
+		if (start < now)
+		{
+			start = now;
+		}
+
+		/* tail drop */
+		if (start - now > NETLAG_QUEUE)
+		{
+			return true;
+		}
+
+		net_linkbusy[sock] = start + length * 1000.0 / net_bandwidth->value;
+		time = (int)net_linkbusy[sock];
+	}
+
+	if (net_latency->value > 0)
+	{
+		time += (int)net_latency->value;
+	}
+
+	if (time <= now)
+	{
+		return false;
+	}
+
+	pkt = Z_Malloc(sizeof(*pkt) + length);
+	pkt->time = time;
+	pkt->sock = sock;
+	pkt->to = to;
+	pkt->length = length;
+	memcpy(pkt->data, data, length);
+
+	*net_lagtail = pkt;
+	net_lagtail = &pkt->next;
+
+	return true;
+}
+
+/*
+ * Sends the queued packets that are due,
+ * called by NET_GetPacket().
+ */
+void
+NET_SendLagPackets(void)
+{
+	netlagpacket_t *pkt;
+	int now;
+
+	if (!net_lagpackets)
+	{
+		return;
+	}
+
+	now = Sys_Milliseconds();
+	net_lagsending = true;
+
+	/* they're in the order they're due,
+	   as long as the cvars don't change */
+	while (net_lagpackets && (net_lagpackets->time <= now))
+	{
+		pkt = net_lagpackets;
+		net_lagpackets = pkt->next;
+
+		NET_SendPacket(pkt->sock, pkt->length, pkt->data, pkt->to);
+		Z_Free(pkt);
+	}
+
+	if (!net_lagpackets)
+	{
+		net_lagtail = &net_lagpackets;
+	}
+
+	net_lagsending = false;
+}
+
+/*
+ * How long NET_Sleep() may sleep without
+ * delaying a queued packet any further.
+ */
+int
+NET_LagSleep(int msec)
+{
+	int wait;
+
+	if (!net_lagpackets)
+	{
+		return msec;
+	}
+
+	wait = net_lagpackets->time - Sys_Milliseconds();
+
+	if (wait < 0)
+	{
+		wait = 0;
+	}
+
+	return (wait < msec) ? wait : msec;
 }
 
 /*
@@ -141,7 +354,8 @@ Netchan_OutOfBandPrint(int net_socket, netadr_t adr, char *format, ...)
  * called to open a channel to a remote system
  */
 void
-Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport)
+Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport,
+		int capabilities)
 {
 	memset(chan, 0, sizeof(*chan));
 
@@ -151,8 +365,18 @@ Netchan_Setup(netsrc_t sock, netchan_t *chan, netadr_t adr, int qport)
 	chan->last_received = curtime;
 	chan->incoming_sequence = 0;
 	chan->outgoing_sequence = 1;
+	chan->capabilities = capabilities;
+	chan->rtt_min = -1;
+
+	if (capabilities & NETCAP_FRAGMENT)
+	{
+		SZ_Init(&chan->message, chan->message_buf, sizeof(chan->message_buf));
+	}
+	else
+	{
+		SZ_Init(&chan->message, chan->message_buf, MAX_MSGLEN - 16);
+	}
 
-	SZ_Init(&chan->message, chan->message_buf, sizeof(chan->message_buf));
 	chan->message.allowoverflow = true;
 }
 
@@ -193,6 +417,228 @@ Netchan_NeedReliable(netchan_t *chan)
 	return send_reliable;
 }
 
+/*
+ * Appends the payload to the packet, either
+ * compressed or raw, whatever is smaller.
+ */
+static void
+Netchan_Compress(netchan_t *chan, sizebuf_t *send, sizebuf_t *payload)
+{
+	byte *mode;
+	int len;
+
+	mode = SZ_GetSpace(send, 1);
+	len = 0;
+
+	if (payload->cursize >= NETCHAN_COMPRESS_MIN)
+	{
+		len = LZ_Compress(payload->data, payload->cursize,
+				send->data + send->cursize, payload->cursize - 1);
+	}
+
+	if (len > 0)
+	{
+		*mode = NETCHAN_LZ;
+		send->cursize += len;
+	}
+	else
+	{
+		*mode = NETCHAN_RAW;
+		SZ_Write(send, payload->data, payload->cursize);
+		len = payload->cursize;
+	}
+
+	chan->raw_out += payload->cursize;
+	chan->wire_out += len + 1;
+}
+
+/*
+ * Decompresses the payload of msg in place.
+ * Returns false if it's corrupt.
+ */
+static qboolean
+Netchan_Decompress(netchan_t *chan, sizebuf_t *msg)
+{
+	byte buf[MAX_FRAGMSGLEN];
+	int start, mode, len;
+
+	start = msg->readcount;
+	mode = MSG_ReadByte(msg);
+
+	if (mode == NETCHAN_RAW)
+	{
+		len = msg->cursize - msg->readcount;
+		memmove(msg->data + start, msg->data + msg->readcount, len);
+	}
+	else if (mode == NETCHAN_LZ)
+	{
+		len = msg->maxsize - start;
+
+		if (len > sizeof(buf))
+		{
+			len = sizeof(buf);
+		}
+
+		len = LZ_Decompress(msg->data + msg->readcount,
+				msg->cursize - msg->readcount, buf, len);
+
+		if (len < 0)
+		{
+			return false;
+		}
+
+		memcpy(msg->data + start, buf, len);
+	}
+	else
+	{
+		return false;
+	}
+
+	chan->raw_in += len;
+	chan->wire_in += msg->cursize - start;
+
+	msg->cursize = start + len;
+	msg->readcount = start;
+
+	return true;
+}
+
+static void
+Netchan_WriteHeader(netchan_t *chan, sizebuf_t *send, unsigned w1,
+		unsigned w2)
+{
+	MSG_WriteLong(send, w1);
+	MSG_WriteLong(send, w2);
+
+	/* send the qport if we are a client */
+	if (chan->sock == NS_CLIENT)
+	{
+		MSG_WriteShort(send, qport->value);
+	}
+}
+
+/*
+ * Sends the payload of a too large
+ * packet as a series of fragments.
+ */
+static void
+Netchan_TransmitFragments(netchan_t *chan, sizebuf_t *send, int header,
+		unsigned w1, unsigned w2)
+{
+	sizebuf_t frag;
+	byte frag_buf[MAX_MSGLEN];
+	int offset, len;
+
+	for (offset = header; offset < send->cursize; offset += len)
+	{
+		len = send->cursize - offset;
+
+		if (len > NETCHAN_FRAGLEN)
+		{
+			len = NETCHAN_FRAGLEN;
+		}
+
+		SZ_Init(&frag, frag_buf, sizeof(frag_buf));
+
+		Netchan_WriteHeader(chan, &frag, w1 | NETCHAN_FRAGMENT, w2);
+
+		if (offset + len < send->cursize)
+		{
+			MSG_WriteShort(&frag, (offset - header) | NETCHAN_MOREFRAGS);
+		}
+		else
+		{
+			MSG_WriteShort(&frag, offset - header);
+		}
+
+		SZ_Write(&frag, send->data + offset, len);
+
+		NET_SendPacket(chan->sock, frag.cursize, frag.data,
+				chan->remote_address);
+	}
+}
+
+/*
+ * Collects the fragments of a packet. Returns true
+ * if the packet is complete, msg contains it then.
+ */
+static qboolean
+Netchan_Reassemble(netchan_t *chan, sizebuf_t *msg, int sequence)
+{
+	int start, offset, len, frag;
+	qboolean more;
+
+	offset = MSG_ReadShort(msg) & 0xffff;
+	more = (offset & NETCHAN_MOREFRAGS) != 0;
+	offset &= ~NETCHAN_MOREFRAGS;
+
+	start = msg->readcount;
+	len = msg->cursize - start;
+
+	/* a new packet, forget the incomplete one */
+	if (sequence != chan->fragment_sequence)
+	{
+		chan->fragment_sequence = sequence;
+		chan->fragment_length = 0;
+		chan->fragment_mask = 0;
+	}
+
+	/* all but the last fragment are NETCHAN_FRAGLEN
+	   bytes, the network may reorder or duplicate them */
+	frag = offset / NETCHAN_FRAGLEN;
+
+	if ((len < 0) || (offset % NETCHAN_FRAGLEN) ||
+		(more ? (len != NETCHAN_FRAGLEN) : (len > NETCHAN_FRAGLEN)) ||
+		(offset + len > sizeof(chan->fragment_buf)) ||
+		(chan->fragment_mask & (1u << frag)))
+	{
+		if (showdrop->value)
+		{
+			Com_Printf("%s:Dropped fragment of packet %i at %i\n",
+					NET_AdrToString(chan->remote_address),
+					sequence, offset);
+		}
+
+		return false;
+	}
+
+	memcpy(chan->fragment_buf + offset, msg->data + start, len);
+	chan->fragment_mask |= 1u << frag;
+
+	if (!more)
+	{
+		chan->fragment_length = offset + len;
+	}
+
+	/* wait for the last one and all before it */
+	if (!chan->fragment_length || (chan->fragment_mask !=
+			(1u << ((chan->fragment_length + NETCHAN_FRAGLEN - 1) /
+					NETCHAN_FRAGLEN)) - 1))
+	{
+		return false;
+	}
+
+	/* replace the fragment by the whole payload */
+	start -= 2;
+
+	if (start + chan->fragment_length > msg->maxsize)
+	{
+		chan->fragment_length = 0;
+		chan->fragment_mask = 0;
+		return false;
+	}
+
+	memcpy(msg->data + start, chan->fragment_buf, chan->fragment_length);
+
+	msg->cursize = start + chan->fragment_length;
+	msg->readcount = start;
+
+	chan->fragment_length = 0;
+	chan->fragment_mask = 0;
+
+	return true;
+}
+
 /*
  * tries to send an unreliable message to a connection, and handles the
  * transmition / retransmition of the reliable messages.
@@ -202,10 +648,13 @@ Netchan_NeedReliable(netchan_t *chan)
 void
 Netchan_Transmit(netchan_t *chan, int length, byte *data)
 {
-	sizebuf_t send;
-	byte send_buf[MAX_MSGLEN];
+	sizebuf_t send, payload;
+	sizebuf_t *body;
+	byte send_buf[MAX_FRAGMSGLEN];
+	byte payload_buf[MAX_FRAGMSGLEN];
 	qboolean send_reliable;
 	unsigned w1, w2;
+	int header;
 
 	/* check for message overflow */
 	if (chan->message.overflowed)
@@ -227,7 +676,14 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 
 	/* write the packet header */
-	SZ_Init(&send, send_buf, sizeof(send_buf));
+	if (chan->capabilities & NETCAP_FRAGMENT)
+	{
+		SZ_Init(&send, send_buf, sizeof(send_buf));
+	}
+	else
+	{
+		SZ_Init(&send, send_buf, MAX_MSGLEN);
+	}
 
 	w1 = (chan->outgoing_sequence & ~(1 << 31)) | (send_reliable << 31);
 	w2 =
@@ -237,34 +693,66 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	chan->outgoing_sequence++;
 	chan->last_sent = curtime;
 
-	MSG_WriteLong(&send, w1);
-	MSG_WriteLong(&send, w2);
+	Netchan_WriteHeader(chan, &send, w1, w2);
 
-	/* send the qport if we are a client */
-	if (chan->sock == NS_CLIENT)
+	header = send.cursize;
+
+	/* compressed payloads are assembled aside,
+	   leaving room for the compression marker */
+	if (chan->capabilities & NETCAP_COMPRESS)
 	{
-		MSG_WriteShort(&send, qport->value);
+		SZ_Init(&payload, payload_buf, send.maxsize - send.cursize - 1);
+		body = &payload;
+	}
+	else
+	{
+		body = &send;
 	}
 
 	/* copy the reliable message to the packet first */
 	if (send_reliable)
 	{
-		SZ_Write(&send, chan->reliable_buf, chan->reliable_length);
+		SZ_Write(body, chan->reliable_buf, chan->reliable_length);
 		chan->last_reliable_sequence = chan->outgoing_sequence;
 	}
 
 	/* add the unreliable part if space is available */
-	if (send.maxsize - send.cursize >= length)
+	if (body->maxsize - body->cursize >= length)
 	{
-		SZ_Write(&send, data, length);
+		SZ_Write(body, data, length);
 	}
 	else
 	{
 		Com_Printf("Netchan_Transmit: dumped unreliable\n");
 	}
 
+	if (body != &send)
+	{
+		Netchan_Compress(chan, &send, body);
+	}
+	else
+	{
+		chan->raw_out += send.cursize - header;
+		chan->wire_out += send.cursize - header;
+	}
+
+	/* remember it for the link estimation */
+	chan->sent_time[(chan->outgoing_sequence - 1) & NETCHAN_HISTORY_MASK] =
+		curtime;
+	chan->sent_size[(chan->outgoing_sequence - 1) & NETCHAN_HISTORY_MASK] =
+		send.cursize;
+
 	/* send the datagram */
-	NET_SendPacket(chan->sock, send.cursize, send.data, chan->remote_address);
+	if ((send.cursize > MAX_MSGLEN) &&
+		(chan->remote_address.type != NA_LOOPBACK))
+	{
+		Netchan_TransmitFragments(chan, &send, header, w1, w2);
+	}
+	else
+	{
+		NET_SendPacket(chan->sock, send.cursize, send.data,
+				chan->remote_address);
+	}
 
 	if (showpackets->value)
 	{
@@ -285,6 +773,66 @@ Netchan_Transmit(netchan_t *chan, int length, byte *data)
 	}
 }
 
+/*
+ * Updates the round trip time and loss counters
+ * with a new acknowledge from the remote side.
+ */
+static void
+Netchan_Estimate(netchan_t *chan, int sequence_ack)
+{
+	int skipped;
+	int sample;
+
+	skipped = sequence_ack - chan->incoming_acknowledged - 1;
+
+	if (skipped < 0)
+	{
+		return;
+	}
+
+	/* too old, the history was already overwritten */
+	if ((sequence_ack >= chan->outgoing_sequence) ||
+		(chan->outgoing_sequence - sequence_ack > NETCHAN_HISTORY))
+	{
+		return;
+	}
+
+	if (skipped > NETCHAN_HISTORY)
+	{
+		skipped = NETCHAN_HISTORY;
+	}
+
+	/* the first ack has nothing to compare with */
+	if (chan->incoming_acknowledged)
+	{
+		chan->lost += skipped;
+	}
+
+	chan->acked++;
+	chan->acked_bytes += chan->sent_size[sequence_ack & NETCHAN_HISTORY_MASK];
+
+	sample = curtime - chan->sent_time[sequence_ack & NETCHAN_HISTORY_MASK];
+
+	if (sample < 0)
+	{
+		return;
+	}
+
+	if ((chan->rtt_min < 0) || (sample < chan->rtt_min))
+	{
+		chan->rtt_min = sample;
+	}
+
+	if (chan->acked == 1)
+	{
+		chan->rtt = sample;
+	}
+	else
+	{
+		chan->rtt += (sample - chan->rtt) / 8;
+	}
+}
+
 /*
  * called when the current net_message is from remote_address
  * modifies net_message so that it points to the packet payload
@@ -294,6 +842,7 @@ Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 {
 	unsigned sequence, sequence_ack;
 	unsigned reliable_ack, reliable_message;
+	qboolean fragment;
 
 	/* get sequence numbers */
 	MSG_BeginReading(msg);
@@ -312,6 +861,14 @@ Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 	sequence &= ~(1 << 31);
 	sequence_ack &= ~(1 << 31);
 
+	fragment = false;
+
+	if (chan->capabilities & NETCAP_FRAGMENT)
+	{
+		fragment = (sequence & NETCHAN_FRAGMENT) != 0;
+		sequence &= ~NETCHAN_FRAGMENT;
+	}
+
 	if (showpackets->value)
 	{
 		if (reliable_message)
@@ -342,6 +899,33 @@ Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 		return false;
 	}
 
+	/* wait until all fragments have arrived */
+	if (fragment && !Netchan_Reassemble(chan, msg, sequence))
+	{
+		return false;
+	}
+
+	/* a corrupt payload is treated like a lost packet */
+	if (chan->capabilities & NETCAP_COMPRESS)
+	{
+		if (!Netchan_Decompress(chan, msg))
+		{
+			if (showdrop->value)
+			{
+				Com_Printf("%s:Corrupt compressed packet %i\n",
+						NET_AdrToString(chan->remote_address),
+						sequence);
+			}
+
+			return false;
+		}
+	}
+	else
+	{
+		chan->raw_in += msg->cursize - msg->readcount;
+		chan->wire_in += msg->cursize - msg->readcount;
+	}
+
 	/* dropped packets don't keep the message from being used */
 	chan->dropped = sequence - (chan->incoming_sequence + 1);
 
@@ -355,6 +939,8 @@ Netchan_Process(netchan_t *chan, sizebuf_t *msg)
 		}
 	}
 
+	Netchan_Estimate(chan, sequence_ack);
+
 	/* if the current outgoing reliable message has been acknowledged
 	 * clear the buffer to make way for the next */
 	if (reliable_ack == chan->reliable_sequence)
@@ -74,13 +74,20 @@ crandk(void)
 }
 
 /*
- * Seeds the PRNG
+ * Seeds the PRNG. It always starts
+ * over at the same state, so a new
+ * game gets the same numbers.
  */
 void
 randk_seed(void)
 {
 	uint64_t i;
 
+	j = 0;
+	carry = 0;
+	xs = 0;
+	cng = 0;
+
 	/* Seed QARY[] with CNG+XS: */
 	for (i = 0; i < QSIZE; i++)
 	{
@@ -38,6 +38,7 @@ void
 SZ_Clear(sizebuf_t *buf)
 {
 	buf->cursize = 0;
+	buf->bitpos = 0;
 	buf->overflowed = false;
 }
 
@@ -66,6 +67,7 @@ SZ_GetSpace(sizebuf_t *buf, int length)
 
 	data = buf->data + buf->cursize;
 	buf->cursize += length;
+	buf->bitpos = 0; /* byte writes always start a new byte */
 
 	return data;
 }
@@ -24,6 +24,8 @@
  * =======================================================================
  */
 
+#include <stddef.h>
+
 #include "header/local.h"
 
 game_locals_t game;
@@ -36,6 +38,11 @@ int sm_meat_index;
 int snd_fry;
 int meansOfDeath;
 
+/* seconds the entities move per G_RunFrame(), FRAMETIME
+   unless the server runs the game in subframes */
+double physicstime = FRAMETIME;
+qboolean subframe;
+
 edict_t *g_edicts;
 
 cvar_t *deathmatch;
@@ -57,6 +64,7 @@ cvar_t *filterban;
 
 cvar_t *sv_maxvelocity;
 cvar_t *sv_gravity;
+cvar_t *sv_tracebatch;
 
 cvar_t *sv_rollspeed;
 cvar_t *sv_rollangle;
@@ -94,6 +102,7 @@ void WriteLevel(char *filename);
 void ReadLevel(char *filename);
 void InitGame(void);
 void G_RunFrame(void);
+void G_SetFrameTime(float frametime);
 
 /* =================================================================== */
 
@@ -114,7 +123,44 @@ ShutdownGame(void)
 game_export_t *
 GetGameAPI(game_import_t *import)
 {
-	gi = *import;
+	cvar_t *imports;
+
+	/* older engines pass the original struct,
+	   the rest is only there if the engine
+	   says so in a cvar nobody else can set */
+	memcpy(&gi, import, offsetof(game_import_t, trace_batch));
+
+	imports = gi.cvar("sv_gameimports", "0", 0);
+
+	if ((imports->flags & CVAR_NOSET) &&
+		(imports->value >= GAME_IMPORTS_TRACEBATCH))
+	{
+		gi.trace_batch = import->trace_batch;
+	}
+	else
+	{
+		gi.trace_batch = NULL;
+	}
+
+	if ((imports->flags & CVAR_NOSET) &&
+		(imports->value >= GAME_IMPORTS_SAVEFILE))
+	{
+		gi.save_file = import->save_file;
+	}
+	else
+	{
+		gi.save_file = NULL;
+	}
+
+	if ((imports->flags & CVAR_NOSET) &&
+		(imports->value >= GAME_IMPORTS_EXPORTS))
+	{
+		gi.set_exports = import->set_exports;
+	}
+	else
+	{
+		gi.set_exports = NULL;
+	}
 
 	globals.apiversion = GAME_API_VERSION;
 	globals.Init = InitGame;
@@ -139,6 +185,14 @@ GetGameAPI(game_import_t *import)
 
 	globals.edict_size = sizeof(edict_t);
 
+	/* G_RunFrame() can be called more often than every FRAMETIME */
+	globals.SetFrameTime = G_SetFrameTime;
+
+	if (gi.set_exports)
+	{
+		gi.set_exports(GAME_EXPORTS_FRAMETIME);
+	}
+
 	/* Initalize the PRNG */
 	randk_seed();
 
@@ -409,7 +463,72 @@ ExitLevel(void)
 }
 
 /*
- * Advances the world by 0.1 seconds
+ * Moves the entities in between two
+ * frames. Nothing thinks, blocked
+ * pushers don't hurt, the clients
+ * are left to ClientThink()
+ */
+static void
+G_RunSubframe(void)
+{
+	int i;
+	edict_t *ent;
+
+	ent = &g_edicts[0];
+
+	for (i = 0; i < globals.num_edicts; i++, ent++)
+	{
+		if (!ent->inuse)
+		{
+			continue;
+		}
+
+		if ((i > 0) && (i <= maxclients->value))
+		{
+			continue;
+		}
+
+		level.current_entity = ent;
+
+		/* if the ground entity moved, make sure we are still on it */
+		if ((ent->groundentity) &&
+			(ent->groundentity->linkcount != ent->groundentity_linkcount))
+		{
+			ent->groundentity = NULL;
+
+			if (!(ent->flags & (FL_SWIM | FL_FLY)) &&
+				(ent->svflags & SVF_MONSTER))
+			{
+				M_CheckGround(ent);
+			}
+		}
+
+		G_RunEntity(ent);
+	}
+}
+
+/*
+ * The server runs the game more often than
+ * every 0.1 seconds, see game_export_t.
+ */
+void
+G_SetFrameTime(float frametime)
+{
+	physicstime = FRAMETIME;
+
+	if ((frametime > 0) && (frametime < FRAMETIME))
+	{
+		physicstime = frametime;
+	}
+}
+
+/*
+ * Advances the world by 0.1 seconds, or by
+ * what G_SetFrameTime() was told if the
+ * server runs the game more often. The
+ * frames in between are subframes, only
+ * the last one of each 0.1 seconds is a
+ * real frame.
  */
 void
 G_RunFrame(void)
@@ -417,6 +536,16 @@ G_RunFrame(void)
 	int i;
 	edict_t *ent;
 
+	level.time += physicstime;
+
+	if (level.time + 0.001 < (level.framenum + 1) * FRAMETIME)
+	{
+		subframe = true;
+		G_RunSubframe();
+		subframe = false;
+		return;
+	}
+
 	level.framenum++;
 	level.time = level.framenum * FRAMETIME;
 
@@ -128,6 +128,12 @@ SV_RunThink(edict_t *ent)
 		return true;
 	}
 
+	/* in the 0.1 second frames only */
+	if (subframe)
+	{
+		return true;
+	}
+
 	ent->nextthink = 0;
 
 	if (!ent->think)
@@ -380,7 +386,7 @@ SV_AddGravity(edict_t *ent)
 		return;
 	}
 
-	ent->velocity[2] -= ent->gravity * sv_gravity->value * FRAMETIME;
+	ent->velocity[2] -= ent->gravity * sv_gravity->value * physicstime;
 }
 
 /*
@@ -550,7 +556,8 @@ retry:
 		}
 	}
 
-	if (ent->inuse)
+	/* triggers are touched in the 0.1 second frames only */
+	if (ent->inuse && !subframe)
 	{
 		G_TouchTriggers(ent);
 	}
@@ -755,9 +762,12 @@ SV_Push(edict_t *pusher, vec3_t move, vec3_t amove)
 	}
 
 	/* see if anything we moved has touched a trigger */
-	for (p = pushed_p - 1; p >= pushed; p--)
+	if (!subframe)
 	{
-		G_TouchTriggers(p->ent);
+		for (p = pushed_p - 1; p >= pushed; p--)
+		{
+			G_TouchTriggers(p->ent);
+		}
 	}
 
 	return true;
@@ -796,8 +806,8 @@ SV_Physics_Pusher(edict_t *ent)
 			part->avelocity[0] || part->avelocity[1] || part->avelocity[2])
 		{
 			/* object is moving */
-			VectorScale(part->velocity, FRAMETIME, move);
-			VectorScale(part->avelocity, FRAMETIME, amove);
+			VectorScale(part->velocity, physicstime, move);
+			VectorScale(part->avelocity, physicstime, amove);
 
 			if (!SV_Push(part, move, amove))
 			{
@@ -819,14 +829,14 @@ SV_Physics_Pusher(edict_t *ent)
 		{
 			if (mv->nextthink > 0)
 			{
-				mv->nextthink += FRAMETIME;
+				mv->nextthink += physicstime;
 			}
 		}
 
 		/* if the pusher has a "blocked" function, call it
 		   otherwise, just stay in place until the obstacle
-		   is gone */
-		if (part->blocked)
+		   is gone. it hurts, so not more than once a frame */
+		if (part->blocked && !subframe)
 		{
 			part->blocked(part, obstacle);
 		}
@@ -875,8 +885,8 @@ SV_Physics_Noclip(edict_t *ent)
 		return;
 	}
 
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
-	VectorMA(ent->s.origin, FRAMETIME, ent->velocity, ent->s.origin);
+	VectorMA(ent->s.angles, physicstime, ent->avelocity, ent->s.angles);
+	VectorMA(ent->s.origin, physicstime, ent->velocity, ent->s.origin);
 
 	gi.linkentity(ent);
 }
@@ -947,10 +957,10 @@ SV_Physics_Toss(edict_t *ent)
 	}
 
 	/* move angles */
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
+	VectorMA(ent->s.angles, physicstime, ent->avelocity, ent->s.angles);
 
 	/* move origin */
-	VectorScale(ent->velocity, FRAMETIME, move);
+	VectorScale(ent->velocity, physicstime, move);
 	trace = SV_PushEntity(ent, move);
 
 	if (!ent->inuse)
@@ -1041,8 +1051,8 @@ SV_AddRotationalFriction(edict_t *ent)
 		return;
 	}
 
-	VectorMA(ent->s.angles, FRAMETIME, ent->avelocity, ent->s.angles);
-	adjustment = FRAMETIME * STOPSPEED * FRICTION;
+	VectorMA(ent->s.angles, physicstime, ent->avelocity, ent->s.angles);
+	adjustment = physicstime * STOPSPEED * FRICTION;
 
 	for (n = 0; n < 3; n++)
 	{
@@ -1135,7 +1145,7 @@ SV_Physics_Step(edict_t *ent)
 		speed = fabs(ent->velocity[2]);
 		control = speed < STOPSPEED ? STOPSPEED : speed;
 		friction = FRICTION / 3;
-		newspeed = speed - (FRAMETIME * control * friction);
+		newspeed = speed - (physicstime * control * friction);
 
 		if (newspeed < 0)
 		{
@@ -1151,7 +1161,7 @@ SV_Physics_Step(edict_t *ent)
 	{
 		speed = fabs(ent->velocity[2]);
 		control = speed < STOPSPEED ? STOPSPEED : speed;
-		newspeed = speed - (FRAMETIME * control * WATERFRICTION * ent->waterlevel);
+		newspeed = speed - (physicstime * control * WATERFRICTION * ent->waterlevel);
 
 		if (newspeed < 0)
 		{
@@ -1178,7 +1188,7 @@ SV_Physics_Step(edict_t *ent)
 					friction = FRICTION;
 
 					control = speed < STOPSPEED ? STOPSPEED : speed;
-					newspeed = speed - FRAMETIME * control * friction;
+					newspeed = speed - physicstime * control * friction;
 
 					if (newspeed < 0)
 					{
@@ -1202,10 +1212,14 @@ SV_Physics_Step(edict_t *ent)
 			mask = MASK_SOLID;
 		}
 
-		SV_FlyMove(ent, FRAMETIME, mask);
+		SV_FlyMove(ent, physicstime, mask);
 
 		gi.linkentity(ent);
-		G_TouchTriggers(ent);
+
+		if (!subframe)
+		{
+			G_TouchTriggers(ent);
+		}
 
 		if (!ent->inuse)
 		{
@@ -26,6 +26,8 @@
 
 #include "header/local.h"
 
+#define MAX_BATCH_PELLETS 32 /* more than DEFAULT_SSHOTGUN_COUNT */
+
 /*
  * This is a support routine used when a client is firing
  * a non-instant attack weapon.  It checks to see if a
@@ -166,6 +168,145 @@ fire_hit(edict_t *self, vec3_t aim, int damage, int kick)
 	return true;
 }
 
+/*
+ * Follows a bullet into water: Makes a splash
+ * where it entered, changes its course and
+ * traces on ignoring the water.
+ */
+static void
+fire_lead_water(edict_t *self, vec3_t start, vec3_t end, trace_t *tr,
+		qboolean *water, vec3_t water_start, int hspread, int vspread)
+{
+	vec3_t dir;
+	vec3_t forward, right, up;
+	float r;
+	float u;
+	int color;
+
+	*water = true;
+	VectorCopy(tr->endpos, water_start);
+
+	if (!VectorCompare(start, tr->endpos))
+	{
+		if (tr->contents & CONTENTS_WATER)
+		{
+			if (strcmp(tr->surface->name, "*brwater") == 0)
+			{
+				color = SPLASH_BROWN_WATER;
+			}
+			else
+			{
+				color = SPLASH_BLUE_WATER;
+			}
+		}
+		else if (tr->contents & CONTENTS_SLIME)
+		{
+			color = SPLASH_SLIME;
+		}
+		else if (tr->contents & CONTENTS_LAVA)
+		{
+			color = SPLASH_LAVA;
+		}
+		else
+		{
+			color = SPLASH_UNKNOWN;
+		}
+
+		if (color != SPLASH_UNKNOWN)
+		{
+			gi.WriteByte(svc_temp_entity);
+			gi.WriteByte(TE_SPLASH);
+			gi.WriteByte(8);
+			gi.WritePosition(tr->endpos);
+			gi.WriteDir(tr->plane.normal);
+			gi.WriteByte(color);
+			gi.multicast(tr->endpos, MULTICAST_PVS);
+		}
+
+		/* change bullet's course when it enters water */
+		VectorSubtract(end, start, dir);
+		vectoangles(dir, dir);
+		AngleVectors(dir, forward, right, up);
+		r = crandom() * hspread * 2;
+		u = crandom() * vspread * 2;
+		VectorMA(water_start, 8192, forward, end);
+		VectorMA(end, r, right, end);
+		VectorMA(end, u, up, end);
+	}
+
+	/* re-trace ignoring water this time */
+	*tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
+}
+
+/*
+ * Damages what the bullet hit or makes
+ * a puff, and draws the bubble trail.
+ */
+static void
+fire_lead_impact(edict_t *self, vec3_t aimdir, trace_t *tr, qboolean water,
+		vec3_t water_start, int damage, int kick, int te_impact, int mod)
+{
+	vec3_t dir;
+
+	/* send gun puff / flash */
+	if (!((tr->surface) && (tr->surface->flags & SURF_SKY)))
+	{
+		if (tr->fraction < 1.0)
+		{
+			if (tr->ent->takedamage)
+			{
+				T_Damage(tr->ent, self, self, aimdir, tr->endpos,
+						tr->plane.normal, damage, kick, DAMAGE_BULLET, mod);
+			}
+			else
+			{
+				if (strncmp(tr->surface->name, "sky", 3) != 0)
+				{
+					gi.WriteByte(svc_temp_entity);
+					gi.WriteByte(te_impact);
+					gi.WritePosition(tr->endpos);
+					gi.WriteDir(tr->plane.normal);
+					gi.multicast(tr->endpos, MULTICAST_PVS);
+
+					if (self->client)
+					{
+						PlayerNoise(self, tr->endpos, PNOISE_IMPACT);
+					}
+				}
+			}
+		}
+	}
+
+	/* if went through water, determine
+	   where the end and make a bubble trail */
+	if (water)
+	{
+		vec3_t pos;
+
+		VectorSubtract(tr->endpos, water_start, dir);
+		VectorNormalize(dir);
+		VectorMA(tr->endpos, -2, dir, pos);
+
+		if (gi.pointcontents(pos) & MASK_WATER)
+		{
+			VectorCopy(pos, tr->endpos);
+		}
+		else
+		{
+			*tr = gi.trace(pos, NULL, NULL, water_start, tr->ent, MASK_WATER);
+		}
+
+		VectorAdd(water_start, tr->endpos, pos);
+		VectorScale(pos, 0.5, pos);
+
+		gi.WriteByte(svc_temp_entity);
+		gi.WriteByte(TE_BUBBLETRAIL);
+		gi.WritePosition(water_start);
+		gi.WritePosition(tr->endpos);
+		gi.multicast(pos, MULTICAST_PVS);
+	}
+}
+
 /*
  * This is an internal support routine
  * used for bullet/pellet based weapons.
@@ -214,121 +355,118 @@ fire_lead(edict_t *self, vec3_t start, vec3_t aimdir, int damage, int kick,
 		/* see if we hit water */
 		if (tr.contents & MASK_WATER)
 		{
-			int color;
+			fire_lead_water(self, start, end, &tr, &water, water_start,
+					hspread, vspread);
+		}
+	}
 
-			water = true;
-			VectorCopy(tr.endpos, water_start);
+	fire_lead_impact(self, aimdir, &tr, water, water_start, damage, kick,
+			te_impact, mod);
+}
 
-			if (!VectorCompare(start, tr.endpos))
-			{
-				if (tr.contents & CONTENTS_WATER)
-				{
-					if (strcmp(tr.surface->name, "*brwater") == 0)
-					{
-						color = SPLASH_BROWN_WATER;
-					}
-					else
-					{
-						color = SPLASH_BLUE_WATER;
-					}
-				}
-				else if (tr.contents & CONTENTS_SLIME)
-				{
-					color = SPLASH_SLIME;
-				}
-				else if (tr.contents & CONTENTS_LAVA)
-				{
-					color = SPLASH_LAVA;
-				}
-				else
-				{
-					color = SPLASH_UNKNOWN;
-				}
+/*
+ * fire_lead() for all pellets of a shotgun
+ * blast, with their traces done in one
+ * gi.trace_batch call. Returns false if
+ * the engine can't batch traces.
+ */
+static qboolean
+fire_lead_batch(edict_t *self, vec3_t start, vec3_t aimdir, int damage,
+		int kick, int te_impact, int hspread, int vspread, int count,
+		int mod)
+{
+	traceray_t rays[MAX_BATCH_PELLETS];
+	int linkcount[MAX_BATCH_PELLETS];
+	trace_t tr;
+	vec3_t dir;
+	vec3_t forward, right, up;
+	float r;
+	float u;
+	vec3_t water_start;
+	qboolean water, startwater;
+	int content_mask = MASK_SHOT | MASK_WATER;
+	int i;
 
-				if (color != SPLASH_UNKNOWN)
-				{
-					gi.WriteByte(svc_temp_entity);
-					gi.WriteByte(TE_SPLASH);
-					gi.WriteByte(8);
-					gi.WritePosition(tr.endpos);
-					gi.WriteDir(tr.plane.normal);
-					gi.WriteByte(color);
-					gi.multicast(tr.endpos, MULTICAST_PVS);
-				}
+	if (!gi.trace_batch || !sv_tracebatch->value ||
+		(count > MAX_BATCH_PELLETS))
+	{
+		return false;
+	}
 
-				/* change bullet's course when it enters water */
-				VectorSubtract(end, start, dir);
-				vectoangles(dir, dir);
-				AngleVectors(dir, forward, right, up);
-				r = crandom() * hspread * 2;
-				u = crandom() * vspread * 2;
-				VectorMA(water_start, 8192, forward, end);
-				VectorMA(end, r, right, end);
-				VectorMA(end, u, up, end);
-			}
+	/* the same for all pellets */
+	tr = gi.trace(self->s.origin, NULL, NULL, start, self, MASK_SHOT);
 
-			/* re-trace ignoring water this time */
-			tr = gi.trace(water_start, NULL, NULL, end, self, MASK_SHOT);
+	if (tr.fraction < 1.0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			fire_lead_impact(self, aimdir, &tr, false, water_start, damage,
+					kick, te_impact, mod);
 		}
+
+		return true;
 	}
 
-	/* send gun puff / flash */
-	if (!((tr.surface) && (tr.surface->flags & SURF_SKY)))
+	vectoangles(aimdir, dir);
+	AngleVectors(dir, forward, right, up);
+
+	for (i = 0; i < count; i++)
 	{
-		if (tr.fraction < 1.0)
-		{
-			if (tr.ent->takedamage)
-			{
-				T_Damage(tr.ent, self, self, aimdir, tr.endpos, tr.plane.normal,
-						damage, kick, DAMAGE_BULLET, mod);
-			}
-			else
-			{
-				if (strncmp(tr.surface->name, "sky", 3) != 0)
-				{
-					gi.WriteByte(svc_temp_entity);
-					gi.WriteByte(te_impact);
-					gi.WritePosition(tr.endpos);
-					gi.WriteDir(tr.plane.normal);
-					gi.multicast(tr.endpos, MULTICAST_PVS);
+		r = crandom() * hspread;
+		u = crandom() * vspread;
+		VectorCopy(start, rays[i].start);
+		VectorMA(start, 8192, forward, rays[i].end);
+		VectorMA(rays[i].end, r, right, rays[i].end);
+		VectorMA(rays[i].end, u, up, rays[i].end);
+	}
 
-					if (self->client)
-					{
-						PlayerNoise(self, tr.endpos, PNOISE_IMPACT);
-					}
-				}
-			}
-		}
+	startwater = (gi.pointcontents(start) & MASK_WATER) != 0;
+
+	if (startwater)
+	{
+		content_mask &= ~MASK_WATER;
 	}
 
-	/* if went through water, determine
-	   where the end and make a bubble trail */
-	if (water)
+	gi.trace_batch(rays, count, NULL, NULL, self, content_mask);
+
+	for (i = 0; i < count; i++)
 	{
-		vec3_t pos;
+		linkcount[i] = rays[i].trace.ent->linkcount;
+	}
 
-		VectorSubtract(tr.endpos, water_start, dir);
-		VectorNormalize(dir);
-		VectorMA(tr.endpos, -2, dir, pos);
+	for (i = 0; i < count; i++)
+	{
+		tr = rays[i].trace;
 
-		if (gi.pointcontents(pos) & MASK_WATER)
+		/* an earlier pellet may have killed or gibbed
+		   what this one hit, trace it again like the
+		   pellets were fired one after another. */
+		if ((tr.ent != g_edicts) && (!tr.ent->inuse ||
+			(tr.ent->solid == SOLID_NOT) ||
+			(tr.ent->linkcount != linkcount[i])))
 		{
-			VectorCopy(pos, tr.endpos);
+			tr = gi.trace(start, NULL, NULL, rays[i].end, self, content_mask);
 		}
-		else
+
+		water = startwater;
+
+		if (water)
 		{
-			tr = gi.trace(pos, NULL, NULL, water_start, tr.ent, MASK_WATER);
+			VectorCopy(start, water_start);
 		}
 
-		VectorAdd(water_start, tr.endpos, pos);
-		VectorScale(pos, 0.5, pos);
+		/* see if we hit water */
+		if (tr.contents & MASK_WATER)
+		{
+			fire_lead_water(self, start, rays[i].end, &tr, &water,
+					water_start, hspread, vspread);
+		}
 
-		gi.WriteByte(svc_temp_entity);
-		gi.WriteByte(TE_BUBBLETRAIL);
-		gi.WritePosition(water_start);
-		gi.WritePosition(tr.endpos);
-		gi.multicast(pos, MULTICAST_PVS);
+		fire_lead_impact(self, aimdir, &tr, water, water_start, damage,
+				kick, te_impact, mod);
 	}
+
+	return true;
 }
 
 /*
@@ -363,6 +501,12 @@ fire_shotgun(edict_t *self, vec3_t start, vec3_t aimdir, int damage,
 		return;
 	}
 
+	if (fire_lead_batch(self, start, aimdir, damage, kick, TE_SHOTGUN,
+				hspread, vspread, count, mod))
+	{
+		return;
+	}
+
 	for (i = 0; i < count; i++)
 	{
 		fire_lead(self, start, aimdir, damage, kick, TE_SHOTGUN,
@@ -1060,7 +1204,7 @@ bfg_touch(edict_t *self, edict_t *other, cplane_t *plane, csurface_t *surf)
 					"weapons/bfg__x1b.wav"), 1, ATTN_NORM, 0);
 	self->solid = SOLID_NOT;
 	self->touch = NULL;
-	VectorMA(self->s.origin, -1 * FRAMETIME, self->velocity, self->s.origin);
+	VectorMA(self->s.origin, -1 * physicstime, self->velocity, self->s.origin);
 	VectorClear(self->velocity);
 	self->s.modelindex = gi.modelindex("sprites/s_bfg3.sp2");
 	self->s.frame = 0;
@@ -36,6 +36,18 @@
 
 #define GAME_API_VERSION 3
 
+/* the number of imports the engine passes after the original
+   API, in the CVAR_NOSET cvar sv_gameimports. Older engines
+   don't set it and pass the original struct only! */
+#define GAME_IMPORTS_TRACEBATCH 1
+#define GAME_IMPORTS_SAVEFILE 2
+#define GAME_IMPORTS_EXPORTS 3
+
+/* the number of exports the game appends after the original
+   API, it tells the engine with gi.set_exports(). Older games
+   don't and the engine only reads the original struct! */
+#define GAME_EXPORTS_FRAMETIME 1
+
 #define SVF_NOCLIENT 0x00000001 /* don't send entity to clients, even if it has effects */
 #define SVF_DEADMONSTER 0x00000002 /* treat as CONTENTS_DEADMONSTER for collision */
 #define SVF_MONSTER 0x00000004 /* treat as CONTENTS_MONSTER for collision */
@@ -101,6 +113,15 @@ struct edict_s
 
 /* =============================================================== */
 
+/* one ray of a trace_batch call */
+typedef struct
+{
+	vec3_t start, end;
+	trace_t trace; /* filled in by the engine */
+} traceray_t;
+
+/* =============================================================== */
+
 /* functions provided by the main engine */
 typedef struct
 {
@@ -181,6 +202,24 @@ typedef struct
 	void (*AddCommandString)(char *text);
 
 	void (*DebugGraph)(float value, int color);
+
+	/* traces several rays with the same box, passent and
+	   contentmask at once. Appended after the original API,
+	   only present if sv_gameimports is at least
+	   GAME_IMPORTS_TRACEBATCH. Older engines don't have it! */
+	void (*trace_batch)(traceray_t *rays, int numrays, vec3_t mins,
+			vec3_t maxs, edict_t *passent, int contentmask);
+
+	/* hands a savegame file the game put together in memory
+	   to the engine, which writes it out in the background.
+	   Only present if sv_gameimports is at least
+	   GAME_IMPORTS_SAVEFILE. */
+	void (*save_file)(char *filename, void *data, int size);
+
+	/* tells the engine which of the exports after the
+	   original API the game has. Only present if
+	   sv_gameimports is at least GAME_IMPORTS_EXPORTS. */
+	void (*set_exports)(int exports);
 } game_import_t;
 
 /* functions exported by the game subsystem */
@@ -234,4 +273,12 @@ typedef struct
 	int edict_size;
 	int num_edicts;             /* current number, <= max_edicts */
 	int max_edicts;
+
+	/* sets the seconds each following RunFrame() advances
+	   the world by, less than 0.1 if the server runs the
+	   game more often than every 100 msec. Called before
+	   each level is spawned or loaded. Appended after the
+	   original API, only there if the game announced at
+	   least GAME_EXPORTS_FRAMETIME with gi.set_exports(). */
+	void (*SetFrameTime)(float frametime);
 } game_export_t;
@@ -483,6 +483,9 @@ extern int lastgibframe;
 
 extern int meansOfDeath;
 
+extern double physicstime;
+extern qboolean subframe;
+
 extern edict_t *g_edicts;
 
 #define FOFS(x) (size_t)&(((edict_t *)NULL)->x)
@@ -510,6 +513,7 @@ extern cvar_t *filterban;
 
 extern cvar_t *sv_gravity;
 extern cvar_t *sv_maxvelocity;
+extern cvar_t *sv_tracebatch;
 
 extern cvar_t *gun_x, *gun_y, *gun_z;
 extern cvar_t *sv_rollspeed;
@@ -142,6 +142,17 @@ typedef struct
 	mmove_t *mmovePtr;
 } mmoveList_t;
 
+/*
+ * A savegame file put together in memory,
+ * handed to the engine in one piece.
+ */
+typedef struct
+{
+	byte *data;
+	int size;
+	int maxsize;
+} savebuf_t;
+
 /* ========================================================= */
 
 /*
@@ -221,6 +232,9 @@ InitGame(void)
 	sv_maxvelocity = gi.cvar("sv_maxvelocity", "2000", 0);
 	sv_gravity = gi.cvar("sv_gravity", "800", 0);
 
+	/* only used if the engine provides gi.trace_batch */
+	sv_tracebatch = gi.cvar("sv_tracebatch", "0", 0);
+
 	/* noset vars */
 	dedicated = gi.cvar("dedicated", "0", CVAR_NOSET);
 
@@ -367,6 +381,70 @@ FindMmoveByName(char *name)
 }
 
 
+/* ========================================================= */
+
+/*
+ * Appends to the savegame in memory,
+ * the buffer grows as needed.
+ */
+static void
+WriteBytes(savebuf_t *f, const void *data, int size)
+{
+	byte *newdata;
+
+	if (f->size + size > f->maxsize)
+	{
+		while (f->size + size > f->maxsize)
+		{
+			f->maxsize = f->maxsize ? f->maxsize * 2 : 0x40000;
+		}
+
+		newdata = gi.TagMalloc(f->maxsize, TAG_LEVEL);
+
+		if (f->data)
+		{
+			memcpy(newdata, f->data, f->size);
+			gi.TagFree(f->data);
+		}
+
+		f->data = newdata;
+	}
+
+	memcpy(f->data + f->size, data, size);
+	f->size += size;
+}
+
+/*
+ * Writes the savegame to the disk, through
+ * the engine if it can do that in the
+ * background, and frees it.
+ */
+static void
+WriteSavebuf(savebuf_t *f, const char *filename)
+{
+	FILE *file;
+
+	if (gi.save_file)
+	{
+		gi.save_file((char *)filename, f->data, f->size);
+	}
+	else
+	{
+		file = fopen(filename, "wb");
+
+		if (!file)
+		{
+			gi.error("Couldn't open %s", filename);
+		}
+
+		fwrite(f->data, f->size, 1, file);
+		fclose(file);
+	}
+
+	gi.TagFree(f->data);
+	memset(f, 0, sizeof(*f));
+}
+
 /* ========================================================= */
 
 /*
@@ -376,7 +454,7 @@ FindMmoveByName(char *name)
  * below this block into files.
  */
 void
-WriteField1(FILE *f, field_t *field, byte *base)
+WriteField1(savebuf_t *f, field_t *field, byte *base)
 {
 	void *p;
 	int len;
@@ -499,7 +577,7 @@ WriteField1(FILE *f, field_t *field, byte *base)
 }
 
 void
-WriteField2(FILE *f, field_t *field, byte *base)
+WriteField2(savebuf_t *f, field_t *field, byte *base)
 {
 	int len;
 	void *p;
@@ -520,7 +598,7 @@ WriteField2(FILE *f, field_t *field, byte *base)
 			if (*(char **)p)
 			{
 				len = strlen(*(char **)p) + 1;
-				fwrite(*(char **)p, len, 1, f);
+				WriteBytes(f, *(char **)p, len);
 			}
 
 			break;
@@ -536,7 +614,7 @@ WriteField2(FILE *f, field_t *field, byte *base)
 				}
 
 				len = strlen(func->funcStr)+1;
-				fwrite (func->funcStr, len, 1, f);
+				WriteBytes(f, func->funcStr, len);
 			}
 
 			break;
@@ -551,7 +629,7 @@ WriteField2(FILE *f, field_t *field, byte *base)
 				}
 
 				len = strlen(mmove->mmoveStr)+1;
-				fwrite (mmove->mmoveStr, len, 1, f);
+				WriteBytes(f, mmove->mmoveStr, len);
 			}
 
 			break;
@@ -705,7 +783,7 @@ ReadField(FILE *f, field_t *field, byte *base)
  * Write the client struct into a file.
  */
 void
-WriteClient(FILE *f, gclient_t *client)
+WriteClient(savebuf_t *f, gclient_t *client)
 {
 	field_t *field;
 	gclient_t temp;
@@ -720,7 +798,7 @@ WriteClient(FILE *f, gclient_t *client)
 	}
 
 	/* write the block */
-	fwrite(&temp, sizeof(temp), 1, f);
+	WriteBytes(f, &temp, sizeof(temp));
 
 	/* now write any allocated data following the edict */
 	for (field = clientfields; field->name; field++)
@@ -760,7 +838,7 @@ ReadClient(FILE *f, gclient_t *client)
 void
 WriteGame(const char *filename, qboolean autosave)
 {
-	FILE *f;
+	savebuf_t f;
 	int i;
 	char str_ver[32];
 	char str_game[32];
@@ -772,12 +850,7 @@ WriteGame(const char *filename, qboolean autosave)
 		SaveClientData();
 	}
 
-	f = fopen(filename, "wb");
-
-	if (!f)
-	{
-		gi.error("Couldn't open %s", filename);
-	}
+	memset(&f, 0, sizeof(f));
 
 	/* Savegame identification */
 	memset(str_ver, 0, sizeof(str_ver));
@@ -790,21 +863,21 @@ WriteGame(const char *filename, qboolean autosave)
 	Q_strlcpy(str_os, YQ2OSTYPE, sizeof(str_os) - 1);
 	Q_strlcpy(str_arch, YQ2ARCH, sizeof(str_arch) - 1);
 
-	fwrite(str_ver, sizeof(str_ver), 1, f);
-	fwrite(str_game, sizeof(str_game), 1, f);
-	fwrite(str_os, sizeof(str_os), 1, f);
-	fwrite(str_arch, sizeof(str_arch), 1, f);
+	WriteBytes(&f, str_ver, sizeof(str_ver));
+	WriteBytes(&f, str_game, sizeof(str_game));
+	WriteBytes(&f, str_os, sizeof(str_os));
+	WriteBytes(&f, str_arch, sizeof(str_arch));
 
 	game.autosaved = autosave;
-	fwrite(&game, sizeof(game), 1, f);
+	WriteBytes(&f, &game, sizeof(game));
 	game.autosaved = false;
 
 	for (i = 0; i < game.maxclients; i++)
 	{
-		WriteClient(f, &game.clients[i]);
+		WriteClient(&f, &game.clients[i]);
 	}
 
-	fclose(f);
+	WriteSavebuf(&f, filename);
 }
 
 /*
@@ -915,7 +988,7 @@ ReadGame(const char *filename)
  * WriteLevel.
  */
 void
-WriteEdict(FILE *f, edict_t *ent)
+WriteEdict(savebuf_t *f, edict_t *ent)
 {
 	field_t *field;
 	edict_t temp;
@@ -930,7 +1003,7 @@ WriteEdict(FILE *f, edict_t *ent)
 	}
 
 	/* write the block */
-	fwrite(&temp, sizeof(temp), 1, f);
+	WriteBytes(f, &temp, sizeof(temp));
 
 	/* now write any allocated data following the edict */
 	for (field = fields; field->name; field++)
@@ -945,7 +1018,7 @@ WriteEdict(FILE *f, edict_t *ent)
  * Called by WriteLevel.
  */
 void
-WriteLevelLocals(FILE *f)
+WriteLevelLocals(savebuf_t *f)
 {
 	field_t *field;
 	level_locals_t temp;
@@ -960,7 +1033,7 @@ WriteLevelLocals(FILE *f)
 	}
 
 	/* write the block */
-	fwrite(&temp, sizeof(temp), 1, f);
+	WriteBytes(f, &temp, sizeof(temp));
 
 	/* now write any allocated data following the edict */
 	for (field = levelfields; field->name; field++)
@@ -978,21 +1051,16 @@ WriteLevel(const char *filename)
 {
 	int i;
 	edict_t *ent;
-	FILE *f;
+	savebuf_t f;
 
-	f = fopen(filename, "wb");
-
-	if (!f)
-	{
-		gi.error("Couldn't open %s", filename);
-	}
+	memset(&f, 0, sizeof(f));
 
 	/* write out edict size for checking */
 	i = sizeof(edict_t);
-	fwrite(&i, sizeof(i), 1, f);
+	WriteBytes(&f, &i, sizeof(i));
 
 	/* write out level_locals_t */
-	WriteLevelLocals(f);
+	WriteLevelLocals(&f);
 
 	/* write out all the entities */
 	for (i = 0; i < globals.num_edicts; i++)
@@ -1004,14 +1072,14 @@ WriteLevel(const char *filename)
 			continue;
 		}
 
-		fwrite(&i, sizeof(i), 1, f);
-		WriteEdict(f, ent);
+		WriteBytes(&f, &i, sizeof(i));
+		WriteEdict(&f, ent);
 	}
 
 	i = -1;
-	fwrite(&i, sizeof(i), 1, f);
+	WriteBytes(&f, &i, sizeof(i));
 
-	fclose(f);
+	WriteSavebuf(&f, filename);
 }
 
 /* ========================================================== */
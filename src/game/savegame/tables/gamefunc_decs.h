@@ -29,15 +29,15 @@ extern void ReadLevel ( const char * filename ) ;
 extern void ReadLevelLocals ( FILE * f ) ;
 extern void ReadEdict ( FILE * f , edict_t * ent ) ;
 extern void WriteLevel ( const char * filename ) ;
-extern void WriteLevelLocals ( FILE * f ) ;
-extern void WriteEdict ( FILE * f , edict_t * ent ) ;
+extern void WriteLevelLocals ( savebuf_t * f ) ;
+extern void WriteEdict ( savebuf_t * f , edict_t * ent ) ;
 extern void ReadGame ( const char * filename ) ;
 extern void WriteGame ( const char * filename , qboolean autosave ) ;
 extern void ReadClient ( FILE * f , gclient_t * client ) ;
-extern void WriteClient ( FILE * f , gclient_t * client ) ;
+extern void WriteClient ( savebuf_t * f , gclient_t * client ) ;
 extern void ReadField ( FILE * f , field_t * field , byte * base ) ;
-extern void WriteField2 ( FILE * f , field_t * field , byte * base ) ;
-extern void WriteField1 ( FILE * f , field_t * field , byte * base ) ;
+extern void WriteField2 ( savebuf_t * f , field_t * field , byte * base ) ;
+extern void WriteField1 ( savebuf_t * f , field_t * field , byte * base ) ;
 extern mmove_t * FindMmoveByName ( char * name ) ;
 extern mmoveList_t * GetMmoveByAddress ( mmove_t * adr ) ;
 extern byte * FindFunctionByName ( char * name ) ;
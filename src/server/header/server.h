@@ -43,6 +43,16 @@
 #define EDICT_NUM(n) ((edict_t *)((byte *)ge->edicts + ge->edict_size * (n)))
 #define NUM_FOR_EDICT(e) (((byte *)(e) - (byte *)ge->edicts) / ge->edict_size)
 
+/* the frame number as seen by the client, see client_t.framediv */
+#define SV_CLIENTFRAME(c) (sv.framenum / (c)->framediv)
+
+/* the client frames that can be delta'd from, 1.6 seconds at any sv_fps */
+#define SV_UPDATEBACKUP(c) (16 * sv.framediv / (c)->framediv)
+
+/* the client's frame n in svs.client_frames, updates can be delta'd from here */
+#define SV_FRAME(c, n) (&svs.client_frames[((c) - svs.clients) * \
+			svs.update_backup + ((n) & (svs.update_backup - 1))])
+
 typedef enum
 {
 	ss_dead,            /* no map loaded */
@@ -60,9 +70,14 @@ typedef struct
 	qboolean attractloop;           /* running cinematics and demos for the local system only */
 	qboolean loadgame;              /* client begins should reuse existing entity */
 
-	unsigned time;                  /* always sv.framenum * 100 msec */
+	unsigned time;                  /* always sv.framenum * sv.frametime msec */
 	int framenum;
 
+	int frametime;                  /* msec per frame, set from sv_fps */
+	int framediv;                   /* frames per 100 msec game frame */
+	int gameframediv;               /* frames per ge->RunFrame(), 1 if the
+									   game runs subframes, else framediv */
+
 	char name[MAX_QPATH];           /* map name, or cinematic name */
 	struct cmodel_s *models[MAX_MODELS];
 
@@ -105,6 +120,9 @@ typedef struct client_s
 	char userinfo[MAX_INFO_STRING];     /* name, etc */
 
 	int lastframe;                      /* for delta compression */
+	int framediv;                       /* sent every framediv-th frame, 1
+										   with NETCAP_TICKRATE, otherwise
+										   sv.framediv */
 	usercmd_t lastcmd;                  /* for filling in big drops */
 
 	int commandMsec;                    /* every seconds this is reset, if user */
@@ -117,6 +135,15 @@ typedef struct client_s
 	int rate;
 	int surpressCount;                  /* number of messages rate supressed */
 
+	/* adaptive rate control, see SV_RateControl() */
+	int cc_rate;                        /* estimated bytes per second */
+	int cc_tokens;                      /* pacing allowance in bytes */
+	int cc_time;                        /* start of the current round trip */
+	unsigned int cc_lost;               /* netchan.lost at that time */
+	unsigned int cc_acked;              /* netchan.acked at that time */
+	qboolean cc_limited;                /* the rate was exhausted */
+	int cc_maxentities;                 /* entities per frame, 0 = all */
+
 	edict_t *edict;                     /* EDICT_NUM(clientnum+1) */
 	char name[32];                      /* extracted from userinfo, high bits masked */
 	int messagelevel;                   /* for filtering printed messages */
@@ -126,8 +153,6 @@ typedef struct client_s
 	sizebuf_t datagram;
 	byte datagram_buf[MAX_MSGLEN];
 
-	client_frame_t frames[UPDATE_BACKUP];     /* updates can be delta'd from here */
-
 	byte *download;                     /* file being downloaded */
 	int downloadsize;                   /* total bytes (can't use EOF because of paks) */
 	int downloadcount;                  /* bytes sent */
@@ -158,16 +183,19 @@ typedef struct
 										/* used to check late spawns */
 
 	client_t *clients;                  /* [maxclients->value]; */
-	int num_client_entities;            /* maxclients->value*UPDATE_BACKUP*MAX_PACKET_ENTITIES */
+	int num_client_entities;            /* maxclients->value*16*sv.framediv*64 */
 	int next_client_entities;           /* next client_entity to use */
 	entity_state_t *client_entities;    /* [num_client_entities] */
 
+	int update_backup;                  /* frames per client, power of 2 */
+	client_frame_t *client_frames;      /* [maxclients->value*update_backup] */
+
 	int last_heartbeat;
 
 	challenge_t challenges[MAX_CHALLENGES];    /* to prevent invalid IPs from connecting */
 
 	/* serverrecord values */
-	FILE *demofile;
+	asyncfile_t *demofile;
 	sizebuf_t demo_multicast;
 	byte demo_multicast_buf[MAX_MSGLEN];
 } server_static_t;
@@ -183,6 +211,14 @@ extern server_t sv;                         /* local server */
 extern cvar_t *sv_paused;
 extern cvar_t *maxclients;
 extern cvar_t *sv_noreload;                 /* don't reload level state when reentering */
+extern cvar_t *sv_ratecontrol;              /* adapt the rate to the link */
+extern cvar_t *sv_maxrate;
+extern cvar_t *sv_profile;
+extern cvar_t *sv_fps;
+extern cvar_t *sv_preload_next;
+extern cvar_t *sv_demo_compress;
+extern cvar_t *sv_tracecache;
+extern cvar_t *sv_tracebatch;
 extern cvar_t *sv_airaccelerate;            /* don't reload level state when reentering */
 											/* development tool */
 extern cvar_t *sv_enforcetime;
@@ -221,6 +257,7 @@ void SV_FlushRedirect(int sv_redirected, char *outputbuf);
 
 void SV_DemoCompleted(void);
 void SV_SendClientMessages(void);
+int SV_MessageSize(client_t *c);
 
 void SV_Multicast(vec3_t origin, multicast_t to);
 void SV_StartSound(vec3_t origin, edict_t *entity, int channel,
@@ -242,17 +279,112 @@ void SV_BuildClientFrame(client_t *client);
 
 void SV_Error(char *error, ...);
 
+/* synthetic clients for benchmarking */
+qboolean SV_BenchGetPacket(netadr_t *from, sizebuf_t *msg);
+void SV_Bench_f(void);
+void SV_TraceBench_f(void);
+void SV_PVSBench_f(void);
+
+/* headless test client for the netchan */
+void SV_NetTestFrame(void);
+int SV_NetTestSleep(int msec);
+void SV_NetTest_f(void);
+
+/* input recording and replay */
+void SV_InputConnect(client_t *cl, char *userinfo);
+void SV_InputUserinfo(client_t *cl);
+void SV_InputBegin(client_t *cl);
+void SV_InputCommand(client_t *cl, char *s);
+void SV_InputThink(client_t *cl, usercmd_t *cmd);
+void SV_InputDisconnect(client_t *cl);
+void SV_InputServerCommand(void);
+void SV_InputFrame(void);
+void SV_InputPrepFrame(void);
+void SV_InputRandom(void);
+void SV_InputStop(void);
+void SV_InputRestoreCvars(void);
+void SV_InputRecord_f(void);
+void SV_InputStop_f(void);
+void SV_InputReplay_f(void);
+
+/* frame profiler */
+typedef enum
+{
+	PROF_FRAME,
+	PROF_READPACKETS,
+	PROF_GAMEFRAME,
+	PROF_RUNFRAME,
+	PROF_SENDMESSAGES,
+	PROF_BUILDFRAME,
+	PROF_WRITEFRAME,
+	PROF_ZONES
+} profzone_t;
+
+typedef struct
+{
+	int frame;
+	long long start;                    /* ns */
+	int zones[PROF_ZONES];              /* ns spent in each zone */
+	int traces;
+	int links;
+	int links_unchanged;                /* skipped, nothing moved */
+	int links_inplace;                  /* moved, but in the same area node */
+	int tracehits;                      /* answered by the trace cache */
+	int contents;
+	int contentshits;
+} profframe_t;
+
+extern int sv_prof_traces;
+extern int sv_prof_links;
+extern int sv_prof_links_unchanged;
+extern int sv_prof_links_inplace;
+extern int sv_prof_tracehits;
+extern int sv_prof_contents;
+extern int sv_prof_contentshits;
+
+long long SV_ProfBegin(void);
+void SV_ProfEnd(profzone_t zone, int client, long long start);
+void SV_ProfCommit(void);
+profframe_t *SV_ProfLastFrame(void);
+char *SV_ProfZoneName(profzone_t zone);
+void SV_Prof_f(void);
+
+/* trace profiler, what the game asks for */
+typedef enum
+{
+	TRACEPROF_TRACE,
+	TRACEPROF_POINTCONTENTS,
+	TRACEPROF_INPVS,
+	TRACEPROF_INPHS,
+	TRACEPROF_TRACEBATCH,
+	TRACEPROF_KINDS
+} traceprofkind_t;
+
+extern cvar_t *sv_traceprofile;
+
+void SV_TraceProfAdd(traceprofkind_t kind, void *caller, long long time);
+void SV_TraceProfClear(void);
+void SV_TraceProfile_f(void);
+
 extern game_export_t *ge;
+extern int sv_gameexports;               /* see GAME_EXPORTS_FRAMETIME */
 
 void SV_InitGameProgs(void);
 void SV_ShutdownGameProgs(void);
 void SV_InitEdict(edict_t *e);
+qboolean SV_InPVS(vec3_t p1, vec3_t p2);
+qboolean SV_InPHS(vec3_t p1, vec3_t p2);
 
 /* server side savegame stuff */
 void SV_WipeSavegame(char *savename);
 void SV_CopySaveGame(char *src, char *dst);
 void SV_WriteLevelFile(void);
 void SV_WriteServerFile(qboolean autosave);
+void SV_SaveGameFile(char *filename, void *data, int size);
+void SV_StartSaves(void);
+void SV_WaitSaves(void);
+void SV_WaitSave(char *path);
+void SV_CheckSaves(void);
 void SV_Loadgame_f(void);
 void SV_Savegame_f(void);
 
@@ -275,8 +407,15 @@ int SV_AreaEdicts(vec3_t mins, vec3_t maxs, edict_t **list,
 
 int SV_PointContents(vec3_t p);
 
+/* forgets the traces of the last frame */
+void SV_ClearTraceCache(void);
+
 trace_t SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs,
 		vec3_t end, edict_t *passedict, int contentmask);
 
+/* SV_Trace() for several rays sharing box, passedict and contentmask */
+void SV_TraceBatch(traceray_t *rays, int numrays, vec3_t mins, vec3_t maxs,
+		edict_t *passedict, int contentmask);
+
 #endif
 
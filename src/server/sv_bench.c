@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Server load generator. Synthetic clients connect to the running
+ * server and send randomized usercmds every frame. Their packets are
+ * passed to SV_ReadPackets() through an in memory queue, so they take
+ * the same path as packets from real clients: netchan, command parsing
+ * and SV_ClientThink(). The replies are sent over the loopback, which
+ * nobody reads on a dedicated server. The server is acknowledging
+ * everything, like over a perfect link, thus delta compression works
+ * as it does for real clients.
+ *
+ * sv_tracebench times SV_Trace() alone, around the entities that
+ * are currently linked. sv_pvsbench does the same for SV_InPVS()
+ * and SV_InPHS() between them, without the trace profiler.
+ *
+ * =======================================================================
+ */
+
+#include "header/server.h"
+
+void SVC_DirectConnect(void);
+
+/* keep clear of the qport of real clients */
+#define BENCH_QPORT 0x7000
+
+#define BENCH_WARMUP 10
+
+typedef struct
+{
+	client_t *cl;
+	netadr_t adr;
+	int qport;
+	int outgoing_sequence;
+	int reliable_sequence;
+	qboolean begun;
+	usercmd_t cmds[3];
+	unsigned int wire_out;
+} benchclient_t;
+
+typedef struct
+{
+	netadr_t adr;
+	int cursize;
+	byte data[MAX_MSGLEN];
+} benchpacket_t;
+
+static benchclient_t bench_clients[MAX_CLIENTS];
+static int bench_numclients;
+
+static benchpacket_t bench_packets[MAX_CLIENTS];
+static int bench_numpackets;
+static int bench_nextpacket;
+
+static profframe_t *bench_times;
+static int bench_frames;
+
+static unsigned int bench_seed;
+
+static unsigned int
+SV_BenchRandom(void)
+{
+	/* xorshift, reproducible for a given seed */
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+
+	return bench_seed;
+}
+
+/*
+ * Hands the queued packets of the synthetic
+ * clients over to SV_ReadPackets()
+ */
+qboolean
+SV_BenchGetPacket(netadr_t *from, sizebuf_t *msg)
+{
+	benchpacket_t *pkt;
+
+	if (bench_nextpacket >= bench_numpackets)
+	{
+		bench_numpackets = 0;
+		bench_nextpacket = 0;
+		return false;
+	}
+
+	pkt = &bench_packets[bench_nextpacket++];
+
+	memcpy(msg->data, pkt->data, pkt->cursize);
+	msg->cursize = pkt->cursize;
+	*from = pkt->adr;
+
+	return true;
+}
+
+static void
+SV_BenchConnect(benchclient_t *bc, int num)
+{
+	char userinfo[MAX_INFO_STRING];
+	client_t *cl;
+	int i;
+
+	memset(bc, 0, sizeof(*bc));
+
+	/* the port keeps the clients apart in SVC_DirectConnect(),
+	   the qport in SV_ReadPackets() */
+	bc->adr.type = NA_LOOPBACK;
+	bc->adr.port = BigShort((short)(num + 1));
+	bc->qport = BENCH_QPORT + num;
+	bc->outgoing_sequence = 1;
+
+	Com_sprintf(userinfo, sizeof(userinfo),
+			"\\name\\bench%i\\skin\\male/grunt\\rate\\25000\\msg\\1\\hand\\2",
+			num);
+
+	net_from = bc->adr;
+	Cmd_TokenizeString(va("connect %i %i 0 \"%s\" %i", PROTOCOL_VERSION,
+				bc->qport, userinfo, NETCAP_SUPPORTED), false);
+	SVC_DirectConnect();
+
+	for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+	{
+		if ((cl->state == cs_connected) &&
+			(cl->netchan.remote_address.type == NA_LOOPBACK) &&
+			(cl->netchan.qport == bc->qport))
+		{
+			bc->cl = cl;
+			break;
+		}
+	}
+}
+
+/*
+ * Wanders around, turns, jumps and shoots now and then.
+ */
+static void
+SV_BenchMove(benchclient_t *bc)
+{
+	usercmd_t *cmd;
+	unsigned int r;
+
+	bc->cmds[0] = bc->cmds[1];
+	bc->cmds[1] = bc->cmds[2];
+
+	cmd = &bc->cmds[2];
+	r = SV_BenchRandom();
+
+	cmd->msec = sv.frametime;
+	cmd->angles[YAW] += ANGLE2SHORT((float)(r & 31) - 15.5f);
+	cmd->angles[PITCH] = ANGLE2SHORT((float)((r >> 5) & 15) - 7.5f);
+
+	/* change the direction about every second */
+	if (((r >> 9) & 7) == 0)
+	{
+		cmd->forwardmove = ((r >> 12) & 1) ? 400 : -200;
+		cmd->sidemove = ((r >> 13) & 1) ? 200 : -200;
+	}
+
+	cmd->upmove = (((r >> 14) & 15) == 0) ? 200 : 0;
+	cmd->buttons = (((r >> 18) & 7) == 0) ? BUTTON_ATTACK : 0;
+	cmd->impulse = 0;
+	cmd->lightlevel = 128;
+}
+
+/*
+ * Queues this frame's packet of a synthetic client. It
+ * acknowledges everything the server sent so far.
+ */
+static void
+SV_BenchSend(benchclient_t *bc)
+{
+	benchpacket_t *pkt;
+	netchan_t *chan;
+	sizebuf_t buf;
+	usercmd_t nullcmd;
+	qboolean reliable;
+	unsigned w1, w2;
+	int checksumIndex;
+
+	if (bench_numpackets >= MAX_CLIENTS)
+	{
+		return;
+	}
+
+	pkt = &bench_packets[bench_numpackets++];
+	pkt->adr = bc->adr;
+
+	chan = &bc->cl->netchan;
+
+	SZ_Init(&buf, pkt->data, sizeof(pkt->data));
+
+	reliable = !bc->begun;
+
+	if (reliable)
+	{
+		bc->reliable_sequence ^= 1;
+	}
+
+	w1 = (bc->outgoing_sequence & ~(1 << 31)) | (reliable << 31);
+	w2 = ((chan->outgoing_sequence - 1) & ~(1 << 31)) |
+		 (chan->reliable_sequence << 31);
+
+	MSG_WriteLong(&buf, w1);
+	MSG_WriteLong(&buf, w2);
+	MSG_WriteShort(&buf, bc->qport);
+
+	/* skip the configstrings and baselines,
+	   we aren't going to render anything */
+	if (!bc->begun)
+	{
+		MSG_WriteByte(&buf, clc_stringcmd);
+		MSG_WriteString(&buf, "new");
+		MSG_WriteByte(&buf, clc_stringcmd);
+		MSG_WriteString(&buf, va("begin %i", svs.spawncount));
+
+		bc->begun = true;
+	}
+
+	SV_BenchMove(bc);
+
+	MSG_WriteByte(&buf, clc_move);
+
+	checksumIndex = buf.cursize;
+	MSG_WriteByte(&buf, 0);
+
+	if (bc->cl->state == cs_spawned)
+	{
+		MSG_WriteLong(&buf, SV_CLIENTFRAME(bc->cl));
+	}
+	else
+	{
+		MSG_WriteLong(&buf, -1);
+	}
+
+	memset(&nullcmd, 0, sizeof(nullcmd));
+	MSG_WriteDeltaUsercmd(&buf, &nullcmd, &bc->cmds[0]);
+	MSG_WriteDeltaUsercmd(&buf, &bc->cmds[0], &bc->cmds[1]);
+	MSG_WriteDeltaUsercmd(&buf, &bc->cmds[1], &bc->cmds[2]);
+
+	buf.data[checksumIndex] = COM_BlockSequenceCRCByte(
+		buf.data + checksumIndex + 1, buf.cursize - checksumIndex - 1,
+		bc->outgoing_sequence);
+
+	bc->outgoing_sequence++;
+	pkt->cursize = buf.cursize;
+}
+
+static int
+SV_BenchCompare(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+SV_BenchReport(int numclients, long long elapsed)
+{
+	int *sorted;
+	unsigned int bytes;
+	long long busy;
+	int traces, links, unchanged, inplace;
+	int tracehits, contents, contentshits;
+	int zone, i;
+
+	sorted = Z_Malloc(bench_frames * sizeof(int));
+
+	Com_Printf("%i clients, %i frames at %i fps in %.2f seconds\n",
+			numclients, bench_frames, 1000 / sv.frametime,
+			elapsed / 1000000000.0);
+	Com_Printf("zone                     p50 us   p99 us   max us\n");
+	Com_Printf("---------------------- -------- -------- --------\n");
+
+	for (zone = 0; zone < PROF_ZONES; zone++)
+	{
+		for (i = 0; i < bench_frames; i++)
+		{
+			sorted[i] = bench_times[i].zones[zone];
+		}
+
+		qsort(sorted, bench_frames, sizeof(int), SV_BenchCompare);
+
+		Com_Printf("%-22s %8.1f %8.1f %8.1f\n", SV_ProfZoneName(zone),
+				sorted[bench_frames / 2] / 1000.0,
+				sorted[bench_frames * 99 / 100] / 1000.0,
+				sorted[bench_frames - 1] / 1000.0);
+	}
+
+	Z_Free(sorted);
+
+	traces = 0;
+	links = 0;
+	unchanged = 0;
+	inplace = 0;
+	tracehits = 0;
+	contents = 0;
+	contentshits = 0;
+	busy = 0;
+
+	for (i = 0; i < bench_frames; i++)
+	{
+		traces += bench_times[i].traces;
+		links += bench_times[i].links;
+		unchanged += bench_times[i].links_unchanged;
+		inplace += bench_times[i].links_inplace;
+		tracehits += bench_times[i].tracehits;
+		contents += bench_times[i].contents;
+		contentshits += bench_times[i].contentshits;
+		busy += bench_times[i].zones[PROF_FRAME];
+	}
+
+	/* what a real time server would spend per second */
+	Com_Printf("per second: %.2f ms busy\n",
+			busy / bench_frames * (1000 / sv.frametime) / 1000000.0);
+
+	Com_Printf("per frame: %i traces, %i links (%i unchanged, %i in place)\n",
+			traces / bench_frames, links / bench_frames,
+			unchanged / bench_frames, inplace / bench_frames);
+
+	if (sv_tracecache->value)
+	{
+		Com_Printf("trace cache: %.1f%% of traces, %.1f%% of %i point "
+				"contents per frame\n",
+				traces ? 100.0f * tracehits / traces : 0.0f,
+				contents ? 100.0f * contentshits / contents : 0.0f,
+				contents / bench_frames);
+	}
+
+	bytes = 0;
+
+	for (i = 0; i < numclients; i++)
+	{
+		bytes += bench_clients[i].cl->netchan.wire_out -
+			bench_clients[i].wire_out;
+	}
+
+	Com_Printf("bytes per client: %u per frame, %u per second\n",
+			bytes / numclients / bench_frames,
+			bytes / numclients / bench_frames * 1000 / sv.frametime);
+}
+
+/*
+ * sv_bench [clients] [frames] [seed]
+ *
+ * Connects synthetic clients and runs server
+ * frames as fast as possible, printing the
+ * percentiles of the profiler zones.
+ */
+void
+SV_Bench_f(void)
+{
+	char profile[16];
+	profframe_t *last;
+	int numclients, frames, i, j;
+	long long start;
+
+	start = 0;
+
+	if (!svs.initialized || (sv.state != ss_game))
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	/* the loopback is only unused on a dedicated server */
+	if (!dedicated->value)
+	{
+		Com_Printf("sv_bench needs a dedicated server.\n");
+		return;
+	}
+
+	numclients = Cmd_Argc() > 1 ? (int)strtol(Cmd_Argv(1), NULL, 10) : 8;
+	frames = Cmd_Argc() > 2 ? (int)strtol(Cmd_Argv(2), NULL, 10) : 600;
+	bench_seed = Cmd_Argc() > 3 ? (unsigned int)strtoul(Cmd_Argv(3), NULL, 10) : 1;
+
+	if (!bench_seed)
+	{
+		bench_seed = 1;
+	}
+
+	if ((numclients < 1) || (frames < 1))
+	{
+		Com_Printf("Usage: sv_bench [clients] [frames] [seed]\n");
+		return;
+	}
+
+	bench_numclients = 0;
+
+	for (i = 0; i < numclients; i++)
+	{
+		SV_BenchConnect(&bench_clients[bench_numclients], i);
+
+		if (!bench_clients[bench_numclients].cl)
+		{
+			Com_Printf("Only %i clients fit into the server.\n", i);
+			break;
+		}
+
+		bench_numclients++;
+	}
+
+	if (!bench_numclients)
+	{
+		return;
+	}
+
+	bench_frames = 0;
+	bench_times = Z_Malloc(frames * sizeof(profframe_t));
+
+	/* the timings come from the profiler */
+	Q_strlcpy(profile, sv_profile->string, sizeof(profile));
+	Cvar_Set("sv_profile", "1");
+
+	svs.realtime = sv.time;
+
+	for (i = 0; i < BENCH_WARMUP + frames; i++)
+	{
+		if (i == BENCH_WARMUP)
+		{
+			for (j = 0; j < bench_numclients; j++)
+			{
+				bench_clients[j].wire_out =
+					bench_clients[j].cl->netchan.wire_out;
+			}
+
+			start = Sys_Nanoseconds();
+		}
+
+		for (j = 0; j < bench_numclients; j++)
+		{
+			if (bench_clients[j].cl->state >= cs_connected)
+			{
+				SV_BenchSend(&bench_clients[j]);
+			}
+		}
+
+		SV_Frame(sv.frametime);
+
+		/* the map changed or the server went down */
+		if (!svs.initialized || (sv.state != ss_game))
+		{
+			break;
+		}
+
+		last = SV_ProfLastFrame();
+
+		if ((i >= BENCH_WARMUP) && last)
+		{
+			bench_times[bench_frames++] = *last;
+		}
+	}
+
+	Cvar_Set("sv_profile", profile);
+
+	if (bench_frames)
+	{
+		SV_BenchReport(bench_numclients, Sys_Nanoseconds() - start);
+	}
+
+	/* the clients leave without a trace */
+	for (j = 0; j < bench_numclients && svs.initialized; j++)
+	{
+		if (bench_clients[j].cl->state > cs_zombie)
+		{
+			SV_DropClient(bench_clients[j].cl);
+		}
+
+		bench_clients[j].cl->state = cs_free;
+	}
+
+	bench_numclients = 0;
+	bench_numpackets = 0;
+	bench_nextpacket = 0;
+
+	Z_Free(bench_times);
+	bench_times = NULL;
+}
+
+/*
+ * sv_tracebench [traces] [seed]
+ *
+ * Runs random traces around the linked entities,
+ * like the game does for movement and shots, and
+ * prints the number of traces per second.
+ */
+void
+SV_TraceBench_f(void)
+{
+	vec3_t pmins = {-16, -16, -24};
+	vec3_t pmaxs = {16, 16, 32};
+	vec3_t start, end;
+	edict_t *ents[MAX_EDICTS];
+	edict_t *ent;
+	trace_t tr;
+	long long begin, elapsed;
+	int numents, traces, hits, i, j;
+
+	if (!svs.initialized || (sv.state != ss_game))
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	traces = Cmd_Argc() > 1 ? (int)strtol(Cmd_Argv(1), NULL, 10) : 100000;
+	bench_seed = Cmd_Argc() > 2 ? (unsigned int)strtoul(Cmd_Argv(2), NULL, 10) : 1;
+
+	if (!bench_seed)
+	{
+		bench_seed = 1;
+	}
+
+	if (traces < 1)
+	{
+		Com_Printf("Usage: sv_tracebench [traces] [seed]\n");
+		return;
+	}
+
+	numents = 0;
+
+	for (i = 1; i < ge->num_edicts; i++)
+	{
+		ent = EDICT_NUM(i);
+
+		if (ent->inuse && ent->area.prev)
+		{
+			ents[numents++] = ent;
+		}
+	}
+
+	if (!numents)
+	{
+		Com_Printf("No entities linked.\n");
+		return;
+	}
+
+	hits = 0;
+	begin = Sys_Nanoseconds();
+
+	for (i = 0; i < traces; i++)
+	{
+		ent = ents[SV_BenchRandom() % numents];
+
+		for (j = 0; j < 3; j++)
+		{
+			start[j] = ent->s.origin[j] +
+				(float)(int)(SV_BenchRandom() % 257) - 128;
+		}
+
+		/* every other trace is a short move or a long shot */
+		if (i & 1)
+		{
+			for (j = 0; j < 3; j++)
+			{
+				end[j] = start[j] + (float)(int)(SV_BenchRandom() % 129) - 64;
+			}
+
+			tr = SV_Trace(start, pmins, pmaxs, end, NULL, MASK_PLAYERSOLID);
+		}
+		else
+		{
+			for (j = 0; j < 3; j++)
+			{
+				end[j] = start[j] + (float)(int)(SV_BenchRandom() % 2049) - 1024;
+			}
+
+			tr = SV_Trace(start, NULL, NULL, end, NULL, MASK_SHOT);
+		}
+
+		if (tr.ent && (tr.ent != ge->edicts))
+		{
+			hits++;
+		}
+	}
+
+	elapsed = Sys_Nanoseconds() - begin;
+
+	Com_Printf("%i traces around %i entities in %.2f ms\n", traces, numents,
+			elapsed / 1000000.0);
+	Com_Printf("%.0f traces per second, %i hit an entity\n",
+			traces / (elapsed / 1000000000.0), hits);
+}
+
+/*
+ * sv_pvsbench [calls] [seed]
+ *
+ * Calls SV_InPVS() and SV_InPHS() between random
+ * pairs of linked entities and prints the number
+ * of calls per second.
+ */
+void
+SV_PVSBench_f(void)
+{
+	edict_t *ents[MAX_EDICTS];
+	edict_t *ent, *other;
+	long long begin, elapsed[2];
+	int numents, calls, visible[2], i, j;
+
+	if (!svs.initialized || (sv.state != ss_game))
+	{
+		Com_Printf("No map running.\n");
+		return;
+	}
+
+	calls = Cmd_Argc() > 1 ? (int)strtol(Cmd_Argv(1), NULL, 10) : 1000000;
+	bench_seed = Cmd_Argc() > 2 ? (unsigned int)strtoul(Cmd_Argv(2), NULL, 10) : 1;
+
+	if (!bench_seed)
+	{
+		bench_seed = 1;
+	}
+
+	if (calls < 1)
+	{
+		Com_Printf("Usage: sv_pvsbench [calls] [seed]\n");
+		return;
+	}
+
+	numents = 0;
+
+	for (i = 1; i < ge->num_edicts; i++)
+	{
+		ent = EDICT_NUM(i);
+
+		if (ent->inuse && ent->area.prev)
+		{
+			ents[numents++] = ent;
+		}
+	}
+
+	if (numents < 2)
+	{
+		Com_Printf("Not enough entities linked.\n");
+		return;
+	}
+
+	for (j = 0; j < 2; j++)
+	{
+		visible[j] = 0;
+		begin = Sys_Nanoseconds();
+
+		for (i = 0; i < calls; i++)
+		{
+			ent = ents[SV_BenchRandom() % numents];
+			other = ents[SV_BenchRandom() % numents];
+
+			if (j ? SV_InPHS(ent->s.origin, other->s.origin) :
+				SV_InPVS(ent->s.origin, other->s.origin))
+			{
+				visible[j]++;
+			}
+		}
+
+		elapsed[j] = Sys_Nanoseconds() - begin;
+	}
+
+	Com_Printf("%i calls between %i entities\n", calls, numents);
+
+	for (j = 0; j < 2; j++)
+	{
+		Com_Printf("%s: %.0f calls per second, %.1f%% true\n",
+				j ? "SV_InPHS" : "SV_InPVS",
+				calls / (elapsed[j] / 1000000000.0),
+				100.0f * visible[j] / calls);
+	}
+}
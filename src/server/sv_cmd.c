@@ -238,6 +238,9 @@ SV_GameMap_f(void)
 		SV_WriteServerFile(true);
 		SV_CopySaveGame("current", "save0");
 	}
+
+	/* flush the savegame in the background */
+	SV_StartSaves();
 }
 
 /*
@@ -380,6 +383,67 @@ SV_Status_f(void)
 	Com_Printf("\n");
 }
 
+/*
+ * Prints the datagram compression statistics
+ * and the link estimation of the netchan
+ */
+void
+SV_Netstats_f(void)
+{
+	int i;
+	client_t *cl;
+	float ratio;
+	float loss;
+	int rate;
+
+	if (!svs.clients)
+	{
+		Com_Printf("No server running.\n");
+		return;
+	}
+
+	Com_Printf("num name            lz       raw out      wire out ratio  rtt  loss   rate\n");
+	Com_Printf("--- --------------- -- ------------- ------------- ----- ---- ----- ------\n");
+
+	for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+	{
+		if (!cl->state)
+		{
+			continue;
+		}
+
+		ratio = 1.0f;
+
+		if (cl->netchan.raw_out)
+		{
+			ratio = (float)cl->netchan.wire_out / cl->netchan.raw_out;
+		}
+
+		loss = 0;
+
+		if (cl->netchan.acked + cl->netchan.lost)
+		{
+			loss = 100.0f * cl->netchan.lost /
+				(cl->netchan.acked + cl->netchan.lost);
+		}
+
+		rate = cl->rate;
+
+		if (sv_ratecontrol->value && cl->cc_rate)
+		{
+			rate = cl->cc_rate;
+		}
+
+		Com_Printf("%3i %-15s %2s %13u %13u %5.2f %4i %4.1f%% %6i\n", i,
+				cl->name,
+				(cl->netchan.capabilities & NETCAP_COMPRESS) ? "on" : "--",
+				cl->netchan.raw_out, cl->netchan.wire_out, ratio,
+				cl->netchan.rtt, loss, rate);
+	}
+
+	Com_Printf("\n");
+}
+
 void
 SV_ConSay_f(void)
 {
@@ -507,16 +571,17 @@ SV_ServerRecord_f(void)
 	/* open the demo file */
 	Com_sprintf(name, sizeof(name), "%s/demos/%s.dm2", FS_Gamedir(), Cmd_Argv(1));
 
-	Com_Printf("recording to %s.\n", name);
 	FS_CreatePath(name);
-	svs.demofile = fopen(name, "wb");
+	svs.demofile = FS_OpenAsync(name, sv_demo_compress->value);
 
 	if (!svs.demofile)
 	{
-		Com_Printf("ERROR: couldn't open.\n");
+		Com_Printf("ERROR: couldn't open %s.\n", name);
 		return;
 	}
 
+	Com_Printf("recording to %s.\n", FS_AsyncName(svs.demofile));
+
 	/* setup a buffer to catch all multicasts */
 	SZ_Init(&svs.demo_multicast, svs.demo_multicast_buf,
 			sizeof(svs.demo_multicast_buf));
@@ -549,7 +614,7 @@ SV_ServerRecord_f(void)
 			if (buf.cursize + 67 >= buf.maxsize)
 			{
 				Com_Printf("not enough buffer space available.\n");
-				fclose(svs.demofile);
+				FS_CloseAsync(svs.demofile);
 				svs.demofile = NULL;
 				return;
 			}
@@ -559,8 +624,8 @@ SV_ServerRecord_f(void)
 	/* write it to the demo file */
 	Com_DPrintf("signon message length: %i\n", buf.cursize);
 	len = LittleLong(buf.cursize);
-	fwrite(&len, 4, 1, svs.demofile);
-	fwrite(buf.data, buf.cursize, 1, svs.demofile);
+	FS_WriteAsync(svs.demofile, &len, 4);
+	FS_WriteAsync(svs.demofile, buf.data, buf.cursize);
 }
 
 /*
@@ -575,7 +640,7 @@ SV_ServerStop_f(void)
 		return;
 	}
 
-	fclose(svs.demofile);
+	FS_CloseAsync(svs.demofile);
 	svs.demofile = NULL;
 	Com_Printf("Recording completed.\n");
 }
@@ -607,6 +672,7 @@ SV_ServerCommand_f(void)
 		return;
 	}
 
+	SV_InputServerCommand();
 	ge->ServerCommand();
 }
 
@@ -616,6 +682,16 @@ SV_InitOperatorCommands(void)
 	Cmd_AddCommand("heartbeat", SV_Heartbeat_f);
 	Cmd_AddCommand("kick", SV_Kick_f);
 	Cmd_AddCommand("status", SV_Status_f);
+	Cmd_AddCommand("netstats", SV_Netstats_f);
+	Cmd_AddCommand("sv_bench", SV_Bench_f);
+	Cmd_AddCommand("sv_tracebench", SV_TraceBench_f);
+	Cmd_AddCommand("sv_pvsbench", SV_PVSBench_f);
+	Cmd_AddCommand("sv_nettest", SV_NetTest_f);
+	Cmd_AddCommand("sv_prof", SV_Prof_f);
+	Cmd_AddCommand("trace_profile", SV_TraceProfile_f);
+	Cmd_AddCommand("sv_inputrecord", SV_InputRecord_f);
+	Cmd_AddCommand("sv_inputstop", SV_InputStop_f);
+	Cmd_AddCommand("sv_inputreplay", SV_InputReplay_f);
 	Cmd_AddCommand("serverinfo", SV_Serverinfo_f);
 	Cmd_AddCommand("dumpuser", SV_DumpUser_f);
 
@@ -28,6 +28,9 @@
 
 extern cvar_t *hostname;
 extern cvar_t *rcon_password;
+extern cvar_t *sv_compress;
+extern cvar_t *sv_packedents;
+extern cvar_t *sv_fragment;
 char *SV_StatusString(void);
 
 /*
@@ -133,6 +136,7 @@ SVC_GetChallenge(void)
 	{
 		/* overwrite the oldest */
 		svs.challenges[oldest].challenge = randk() & 0x7fff;
+		SV_InputRandom();
 		svs.challenges[oldest].adr = net_from;
 		svs.challenges[oldest].time = curtime;
 		i = oldest;
@@ -159,6 +163,7 @@ SVC_DirectConnect(void)
 	int version;
 	int qport;
 	int challenge;
+	int capabilities;
 
 	adr = net_from;
 
@@ -180,6 +185,27 @@ SVC_DirectConnect(void)
 
 	Q_strlcpy(userinfo, Cmd_Argv(4), sizeof(userinfo));
 
+	/* protocol extensions the client supports. Old
+	   clients don't send them, which ends up as 0 */
+	capabilities = (int)strtol(Cmd_Argv(5), (char **)NULL, 10);
+	capabilities &= NETCAP_SUPPORTED;
+
+	/* compressing loopback traffic is a waste of time */
+	if (!sv_compress->value || NET_IsLocalAddress(adr))
+	{
+		capabilities &= ~NETCAP_COMPRESS;
+	}
+
+	if (!sv_packedents->value)
+	{
+		capabilities &= ~NETCAP_PACKEDENTS;
+	}
+
+	if (!sv_fragment->value)
+	{
+		capabilities &= ~NETCAP_FRAGMENT;
+	}
+
 	/* force the IP key/value pair so the game can filter based on ip */
 	Info_SetValueForKey(userinfo, "ip", NET_AdrToString(net_from));
 
@@ -280,6 +306,8 @@ gotnewcl:
 	newcl->challenge = challenge; /* save challenge for checksumming */
 
 	/* get the game a chance to reject this connection or modify the userinfo */
+	SV_InputConnect(newcl, userinfo);
+
 	if (!(ge->ClientConnect(ent, userinfo)))
 	{
 		if (*Info_ValueForKey(userinfo, "rejmsg"))
@@ -303,11 +331,12 @@ gotnewcl:
 	SV_UserinfoChanged(newcl);
 
 	/* send the connect packet to the client */
-	Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect");
+	Netchan_OutOfBandPrint(NS_SERVER, adr, "client_connect %i", capabilities);
 
-	Netchan_Setup(NS_SERVER, &newcl->netchan, adr, qport);
+	Netchan_Setup(NS_SERVER, &newcl->netchan, adr, qport, capabilities);
 
 	newcl->state = cs_connected;
+	newcl->framediv = sv.framediv; /* until SV_New_f() */
 
 	SZ_Init(&newcl->datagram, newcl->datagram_buf, sizeof(newcl->datagram_buf));
 	newcl->datagram.allowoverflow = true;
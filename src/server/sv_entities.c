@@ -32,15 +32,18 @@ byte fatpvs[65536 / 8];
 
 /*
  * Writes a delta update of an entity_state_t list to the message.
+ * If packed is set, the bit packed encoding is used.
  */
 void
-SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
+SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg,
+		qboolean packed)
 {
 	entity_state_t *oldent, *newent;
 	int oldindex, newindex;
 	int oldnum, newnum;
 	int from_num_entities;
 	int bits;
+	int lastnum;
 
 	MSG_WriteByte(msg, svc_packetentities);
 
@@ -57,10 +60,11 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 	oldindex = 0;
 	newent = NULL;
 	oldent = NULL;
+	lastnum = 0;
 
 	while (newindex < to->num_entities || oldindex < from_num_entities)
 	{
-		if (msg->cursize > MAX_MSGLEN - 150)
+		if (msg->cursize > msg->maxsize - 150)
 		{
 			break;
 		}
@@ -94,8 +98,17 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 			   being emited if the entity has not changed at all
 			   note that players are always 'newentities', this
 			   updates their oldorigin always and prevents warping */
-			MSG_WriteDeltaEntity(oldent, newent, msg,
-					false, newent->number <= maxclients->value);
+			if (packed)
+			{
+				MSG_WriteDeltaEntityPacked(oldent, newent, msg, false,
+						newent->number <= maxclients->value, &lastnum);
+			}
+			else
+			{
+				MSG_WriteDeltaEntity(oldent, newent, msg,
+						false, newent->number <= maxclients->value);
+			}
+
 			oldindex++;
 			newindex++;
 			continue;
@@ -104,7 +117,17 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 		if (newnum < oldnum)
 		{
 			/* this is a new entity, send it from the baseline */
-			MSG_WriteDeltaEntity(&sv.baselines[newnum], newent, msg, true, true);
+			if (packed)
+			{
+				MSG_WriteDeltaEntityPacked(&sv.baselines[newnum], newent,
+						msg, true, true, &lastnum);
+			}
+			else
+			{
+				MSG_WriteDeltaEntity(&sv.baselines[newnum], newent,
+						msg, true, true);
+			}
+
 			newindex++;
 			continue;
 		}
@@ -112,6 +135,13 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 		if (newnum > oldnum)
 		{
 			/* the old entity isn't present in the new message */
+			if (packed)
+			{
+				MSG_WriteEntityRemovePacked(msg, oldnum, &lastnum);
+				oldindex++;
+				continue;
+			}
+
 			bits = U_REMOVE;
 
 			if (oldnum >= 256)
@@ -140,7 +170,14 @@ SV_EmitPacketEntities(client_frame_t *from, client_frame_t *to, sizebuf_t *msg)
 		}
 	}
 
-	MSG_WriteShort(msg, 0);
+	if (packed)
+	{
+		MSG_WriteEntityEndPacked(msg);
+	}
+	else
+	{
+		MSG_WriteShort(msg, 0);
+	}
 }
 
 void
@@ -384,9 +421,11 @@ SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
 {
 	client_frame_t *frame, *oldframe;
 	int lastframe;
+	int framenum;
 
 	/* this is the frame we are creating */
-	frame = &client->frames[sv.framenum & UPDATE_MASK];
+	framenum = SV_CLIENTFRAME(client);
+	frame = SV_FRAME(client, framenum);
 
 	if (client->lastframe <= 0)
 	{
@@ -394,7 +433,7 @@ SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
 		oldframe = NULL;
 		lastframe = -1;
 	}
-	else if (sv.framenum - client->lastframe >= (UPDATE_BACKUP - 3))
+	else if (framenum - client->lastframe >= (SV_UPDATEBACKUP(client) - 3))
 	{
 		/* client hasn't gotten a good message through in a long time */
 		oldframe = NULL;
@@ -403,12 +442,12 @@ SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
 	else
 	{
 		/* we have a valid message to delta from */
-		oldframe = &client->frames[client->lastframe & UPDATE_MASK];
+		oldframe = SV_FRAME(client, client->lastframe);
 		lastframe = client->lastframe;
 	}
 
 	MSG_WriteByte(msg, svc_frame);
-	MSG_WriteLong(msg, sv.framenum);
+	MSG_WriteLong(msg, framenum);
 	MSG_WriteLong(msg, lastframe); /* what we are delta'ing from */
 	MSG_WriteByte(msg, client->surpressCount); /* rate dropped packets */
 	client->surpressCount = 0;
@@ -421,7 +460,8 @@ SV_WriteFrameToClient(client_t *client, sizebuf_t *msg)
 	SV_WritePlayerstateToClient(oldframe, frame, msg);
 
 	/* delta encode the entities */
-	SV_EmitPacketEntities(oldframe, frame, msg);
+	SV_EmitPacketEntities(oldframe, frame, msg,
+			client->netchan.capabilities & NETCAP_PACKEDENTS);
 }
 
 /*
@@ -434,7 +474,7 @@ SV_FatPVS(vec3_t org)
 	int leafs[64];
 	int i, j, count;
 	int longs;
-	byte *src;
+	const byte *src;
 	vec3_t mins, maxs;
 
 	for (i = 0; i < 3; i++)
@@ -480,9 +520,85 @@ SV_FatPVS(vec3_t org)
 
 		for (j = 0; j < longs; j++)
 		{
-			((long *)fatpvs)[j] |= ((long *)src)[j];
+			((int *)fatpvs)[j] |= ((const int *)src)[j];
+		}
+	}
+}
+
+static int
+SV_DistanceCompare(const void *a, const void *b)
+{
+	float da, db;
+
+	da = *(const float *)a;
+	db = *(const float *)b;
+
+	if (da < db)
+	{
+		return -1;
+	}
+
+	return da > db;
+}
+
+/*
+ * Keeps only the client->cc_maxentities entities nearest to
+ * org, if the adaptive rate control found the frame to be too
+ * large for the link. The client's own entity is always sent.
+ * The order by entity number is preserved for delta encoding.
+ */
+static void
+SV_PruneClientFrame(client_t *client, client_frame_t *frame, vec3_t org)
+{
+	float dist[MAX_EDICTS];
+	float sorted[MAX_EDICTS];
+	entity_state_t *state;
+	vec3_t delta;
+	float limit;
+	int i, kept;
+
+	for (i = 0; i < frame->num_entities; i++)
+	{
+		state = &svs.client_entities[(frame->first_entity + i) %
+				svs.num_client_entities];
+
+		if (state->number == client->edict->s.number)
+		{
+			dist[i] = -1;
+		}
+		else
+		{
+			VectorSubtract(org, state->origin, delta);
+			dist[i] = DotProduct(delta, delta);
+		}
+	}
+
+	memcpy(sorted, dist, frame->num_entities * sizeof(float));
+	qsort(sorted, frame->num_entities, sizeof(float), SV_DistanceCompare);
+
+	limit = sorted[client->cc_maxentities - 1];
+	kept = 0;
+
+	for (i = 0; i < frame->num_entities && kept < client->cc_maxentities; i++)
+	{
+		if (dist[i] > limit)
+		{
+			continue;
+		}
+
+		if (kept != i)
+		{
+			svs.client_entities[(frame->first_entity + kept) %
+				svs.num_client_entities] =
+				svs.client_entities[(frame->first_entity + i) %
+					svs.num_client_entities];
 		}
+
+		kept++;
 	}
+
+	svs.next_client_entities = frame->first_entity + kept;
+	frame->num_entities = kept;
 }
 
 /*
@@ -502,8 +618,8 @@ SV_BuildClientFrame(client_t *client)
 	int clientarea, clientcluster;
 	int leafnum;
 	int c_fullsend;
-	byte *clientphs;
-	byte *bitvector;
+	const byte *clientphs;
+	const byte *bitvector;
 
 	clent = client->edict;
 
@@ -513,7 +629,7 @@ SV_BuildClientFrame(client_t *client)
 	}
 
 	/* this is the frame we are creating */
-	frame = &client->frames[sv.framenum & UPDATE_MASK];
+	frame = SV_FRAME(client, SV_CLIENTFRAME(client));
 
 	frame->senttime = svs.realtime; /* save it for ping calc later */
 
@@ -657,6 +773,13 @@ SV_BuildClientFrame(client_t *client)
 		svs.next_client_entities++;
 		frame->num_entities++;
 	}
+
+	/* over the estimated bandwidth, drop distant entities */
+	if (sv_ratecontrol->value && client->cc_maxentities &&
+		(frame->num_entities > client->cc_maxentities))
+	{
+		SV_PruneClientFrame(client, frame, org);
+	}
 }
 
 /*
@@ -678,13 +801,19 @@ SV_RecordDemoMessage(void)
 		return;
 	}
 
+	/* demos are played back at 100 msec per frame */
+	if (sv.framenum % sv.framediv)
+	{
+		return;
+	}
+
 	memset(&nostate, 0, sizeof(nostate));
 	SZ_Init(&buf, buf_data, sizeof(buf_data));
 
 	/* write a frame message that doesn't
 	   contain a player_state_t */
 	MSG_WriteByte(&buf, svc_frame);
-	MSG_WriteLong(&buf, sv.framenum);
+	MSG_WriteLong(&buf, sv.framenum / sv.framediv);
 
 	MSG_WriteByte(&buf, svc_packetentities);
 
@@ -713,7 +842,7 @@ SV_RecordDemoMessage(void)
 
 	/* now write the entire message to the file, prefixed by the length */
 	len = LittleLong(buf.cursize);
-	fwrite(&len, 4, 1, svs.demofile);
-	fwrite(buf.data, buf.cursize, 1, svs.demofile);
+	FS_WriteAsync(svs.demofile, &len, 4);
+	FS_WriteAsync(svs.demofile, buf.data, buf.cursize);
 }
 
@@ -31,6 +31,7 @@ void SCR_DebugGraph(float value, int color);
 #endif
  
 game_export_t *ge;
+int sv_gameexports;
 
 /*
  * Sends the contents of the mutlicast buffer to a single client
@@ -274,15 +275,73 @@ PF_WriteAngle(float f)
 }
 
 /*
- * Also checks portalareas so that doors block sight
+ * The game's traces, with sv_traceprofile set
+ * they're attributed to the function calling.
  */
+static trace_t
+PF_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passent, int contentmask)
+{
+	trace_t trace;
+	long long begin;
+
+	if (!sv_traceprofile->value)
+	{
+		return SV_Trace(start, mins, maxs, end, passent, contentmask);
+	}
+
+	begin = Sys_Nanoseconds();
+	trace = SV_Trace(start, mins, maxs, end, passent, contentmask);
+	SV_TraceProfAdd(TRACEPROF_TRACE, __builtin_return_address(0),
+			Sys_Nanoseconds() - begin);
+
+	return trace;
+}
+
+static void
+PF_TraceBatch(traceray_t *rays, int numrays, vec3_t mins, vec3_t maxs,
+		edict_t *passent, int contentmask)
+{
+	long long begin;
+
+	if (!sv_traceprofile->value)
+	{
+		SV_TraceBatch(rays, numrays, mins, maxs, passent, contentmask);
+		return;
+	}
+
+	begin = Sys_Nanoseconds();
+	SV_TraceBatch(rays, numrays, mins, maxs, passent, contentmask);
+	SV_TraceProfAdd(TRACEPROF_TRACEBATCH, __builtin_return_address(0),
+			Sys_Nanoseconds() - begin);
+}
+
+static int
+PF_PointContents(vec3_t p)
+{
+	long long begin;
+	int contents;
+
+	if (!sv_traceprofile->value)
+	{
+		return SV_PointContents(p);
+	}
+
+	begin = Sys_Nanoseconds();
+	contents = SV_PointContents(p);
+	SV_TraceProfAdd(TRACEPROF_POINTCONTENTS, __builtin_return_address(0),
+			Sys_Nanoseconds() - begin);
+
+	return contents;
+}
+
 qboolean
-PF_inPVS(vec3_t p1, vec3_t p2)
+SV_InPVS(vec3_t p1, vec3_t p2)
 {
 	int leafnum;
 	int cluster;
 	int area1, area2;
-	byte *mask;
+	const byte *mask;
 
 	leafnum = CM_PointLeafnum(p1);
 	cluster = CM_LeafCluster(leafnum);
@@ -306,16 +365,13 @@ PF_inPVS(vec3_t p1, vec3_t p2)
 	return true;
 }
 
-/*
- * Also checks portalareas so that doors block sound
- */
 qboolean
-PF_inPHS(vec3_t p1, vec3_t p2)
+SV_InPHS(vec3_t p1, vec3_t p2)
 {
 	int leafnum;
 	int cluster;
 	int area1, area2;
-	byte *mask;
+	const byte *mask;
 
 	leafnum = CM_PointLeafnum(p1);
 	cluster = CM_LeafCluster(leafnum);
@@ -339,6 +395,50 @@ PF_inPHS(vec3_t p1, vec3_t p2)
 	return true;
 }
 
+/*
+ * Also checks portalareas so that doors block sight
+ */
+qboolean
+PF_inPVS(vec3_t p1, vec3_t p2)
+{
+	long long begin;
+	qboolean visible;
+
+	if (!sv_traceprofile->value)
+	{
+		return SV_InPVS(p1, p2);
+	}
+
+	begin = Sys_Nanoseconds();
+	visible = SV_InPVS(p1, p2);
+	SV_TraceProfAdd(TRACEPROF_INPVS, __builtin_return_address(0),
+			Sys_Nanoseconds() - begin);
+
+	return visible;
+}
+
+/*
+ * Also checks portalareas so that doors block sound
+ */
+qboolean
+PF_inPHS(vec3_t p1, vec3_t p2)
+{
+	long long begin;
+	qboolean audible;
+
+	if (!sv_traceprofile->value)
+	{
+		return SV_InPHS(p1, p2);
+	}
+
+	begin = Sys_Nanoseconds();
+	audible = SV_InPHS(p1, p2);
+	SV_TraceProfAdd(TRACEPROF_INPHS, __builtin_return_address(0),
+			Sys_Nanoseconds() - begin);
+
+	return audible;
+}
+
 void
 PF_StartSound(edict_t *entity, int channel, int sound_num,
 		float volume, float attenuation, float timeofs)
@@ -367,6 +467,41 @@ SV_ShutdownGameProgs(void)
 	ge->Shutdown();
 	Sys_UnloadGame();
 	ge = NULL;
+	sv_gameexports = 0;
+
+	/* the callers were addresses in the game */
+	SV_TraceProfClear();
+}
+
+/*
+ * The game announces the exports it
+ * has after the original API, see
+ * GAME_EXPORTS_FRAMETIME.
+ */
+static void
+PF_SetExports(int exports)
+{
+	sv_gameexports = exports;
+}
+
+/*
+ * The cvars the game uses are marked
+ * for the input recording, it restores
+ * them in the replay.
+ */
+static cvar_t *
+PF_cvar(char *var_name, char *value, int flags)
+{
+	cvar_t *var;
+
+	var = Cvar_Get(var_name, value, flags);
+
+	if (var)
+	{
+		var->flags |= CVAR_GAME;
+	}
+
+	return var;
 }
 
 /*
@@ -397,8 +532,9 @@ SV_InitGameProgs(void)
 	import.linkentity = SV_LinkEdict;
 	import.unlinkentity = SV_UnlinkEdict;
 	import.BoxEdicts = SV_AreaEdicts;
-	import.trace = SV_Trace;
-	import.pointcontents = SV_PointContents;
+	import.trace = PF_Trace;
+	import.pointcontents = PF_PointContents;
+	import.trace_batch = PF_TraceBatch;
 	import.setmodel = PF_setmodel;
 	import.inPVS = PF_inPVS;
 	import.inPHS = PF_inPHS;
@@ -426,7 +562,7 @@ SV_InitGameProgs(void)
 	import.TagFree = Z_Free;
 	import.FreeTags = Z_FreeTags;
 
-	import.cvar = Cvar_Get;
+	import.cvar = PF_cvar;
 	import.cvar_set = Cvar_Set;
 	import.cvar_forceset = Cvar_ForceSet;
 
@@ -442,6 +578,17 @@ SV_InitGameProgs(void)
 	import.SetAreaPortalState = CM_SetAreaPortalState;
 	import.AreasConnected = CM_AreasConnected;
 
+	import.save_file = SV_SaveGameFile;
+	import.set_exports = PF_SetExports;
+
+	/* tells the game which of the imports
+	   after the original API are there */
+	Cvar_FullSet("sv_gameimports", va("%i", GAME_IMPORTS_EXPORTS),
+			CVAR_NOSET);
+
+	/* older games don't call set_exports() */
+	sv_gameexports = 0;
+
 	ge = (game_export_t *)Sys_GetGameAPI(&import);
 
 	if (!ge)
@@ -141,6 +141,7 @@ SV_CheckForSavegame(void)
 
 	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sav",
 			FS_Gamedir(), sv.name);
+	SV_WaitSave(name);
 	f = fopen(name, "rb");
 
 	if (!f)
@@ -164,7 +165,7 @@ SV_CheckForSavegame(void)
 		previousState = sv.state;
 		sv.state = ss_loading;
 
-		for (i = 0; i < 100; i++)
+		for (i = 0; i < 100 * sv.framediv / sv.gameframediv; i++)
 		{
 			ge->RunFrame();
 		}
@@ -173,6 +174,146 @@ SV_CheckForSavegame(void)
 	}
 }
 
+/*
+ * Guesses the map following the current one, like the game
+ * would find it: nextserver, the deathmatch sv_maplist or
+ * the first target_changelevel of the map.
+ */
+static qboolean
+SV_NextMapName(char *name, int size)
+{
+	char list[MAX_TOKEN_CHARS];
+	char *data, *token, *first;
+	static const char *seps = " ,\n\r";
+	qboolean changelevel;
+
+	/* set by "map a+b" and cinematics */
+	Q_strlcpy(list, Cvar_VariableString("nextserver"), sizeof(list));
+	data = list;
+	token = COM_Parse(&data);
+
+	if (data && !strcmp(token, "gamemap"))
+	{
+		Q_strlcpy(name, COM_Parse(&data), size);
+		return name[0] != 0;
+	}
+
+	if (Cvar_VariableValue("deathmatch") &&
+		((int)Cvar_VariableValue("dmflags") & DF_SAME_LEVEL))
+	{
+		return false;
+	}
+
+	/* the map rotation */
+	if (Cvar_VariableValue("deathmatch") &&
+		Cvar_VariableString("sv_maplist")[0])
+	{
+		Q_strlcpy(list, Cvar_VariableString("sv_maplist"), sizeof(list));
+		first = NULL;
+
+		for (token = strtok(list, seps); token; token = strtok(NULL, seps))
+		{
+			if (!first)
+			{
+				first = token;
+			}
+
+			if (!Q_stricmp(token, sv.name))
+			{
+				token = strtok(NULL, seps);
+				Q_strlcpy(name, token ? token : first, size);
+				return true;
+			}
+		}
+	}
+
+	/* the map's own exit */
+	data = CM_EntityString();
+
+	while (1)
+	{
+		token = COM_Parse(&data);
+
+		if (!data || (token[0] != '{'))
+		{
+			return false;
+		}
+
+		changelevel = false;
+		name[0] = 0;
+
+		while (1)
+		{
+			token = COM_Parse(&data);
+
+			if (!data || (token[0] == '}'))
+			{
+				break;
+			}
+
+			if (!strcmp(token, "classname"))
+			{
+				changelevel = !strcmp(COM_Parse(&data), "target_changelevel");
+			}
+			else if (!strcmp(token, "map"))
+			{
+				Q_strlcpy(name, COM_Parse(&data), size);
+			}
+			else
+			{
+				COM_Parse(&data);
+			}
+		}
+
+		if (changelevel && name[0])
+		{
+			return true;
+		}
+	}
+}
+
+/*
+ * Starts reading the next map in the background,
+ * so that the level change doesn't wait for it.
+ */
+static void
+SV_PreloadNextMap(void)
+{
+	char name[MAX_QPATH];
+	char *ch;
+	int l;
+
+	if (!SV_NextMapName(name, sizeof(name)))
+	{
+		return;
+	}
+
+	/* same syntax as for SV_Map() */
+	if ((ch = strchr(name, '+')))
+	{
+		*ch = 0;
+	}
+
+	if ((ch = strchr(name, '$')))
+	{
+		*ch = 0;
+	}
+
+	if (name[0] == '*')
+	{
+		memmove(name, name + 1, strlen(name));
+	}
+
+	l = strlen(name);
+
+	if (!l || ((l > 4) && (name[l - 4] == '.')))
+	{
+		return; /* cinematic, demo or picture */
+	}
+
+	CM_PreloadMap(va("maps/%s.bsp", name));
+}
+
 /*
  * Change the server to a new map, taking all connected
  * clients along with it.
@@ -183,6 +324,9 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 {
 	int i;
 	unsigned checksum;
+	int start, loaded;
+
+	start = Sys_Milliseconds();
 
 	if (attractloop)
 	{
@@ -197,6 +341,9 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 		FS_FCloseFile(sv.demofile);
 	}
 
+	/* an input recording covers one level */
+	SV_InputStop();
+
 	svs.spawncount++; /* any partially connected client will be restarted */
 	sv.state = ss_dead;
 	Com_SetServerState(sv.state);
@@ -237,6 +384,75 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 		svs.clients[i].lastframe = -1;
 	}
 
+	/* the game runs in 100 msec frames, sv_fps can
+	   only split them into an integral number of msec */
+	sv.framediv = 1;
+
+	if (serverstate == ss_game)
+	{
+		sv.framediv = (int)sv_fps->value / 10;
+
+		if (sv.framediv < 1)
+		{
+			sv.framediv = 1;
+		}
+		else if (sv.framediv > 10)
+		{
+			sv.framediv = 10;
+		}
+
+		while (100 % sv.framediv)
+		{
+			sv.framediv--;
+		}
+
+		if (sv.framediv * 10 != sv_fps->value)
+		{
+			Com_Printf("sv_fps %g not supported, using %i.\n",
+					sv_fps->value, sv.framediv * 10);
+		}
+	}
+
+	sv.frametime = 100 / sv.framediv;
+
+	/* a game that can run in between its 100 msec
+	   frames is run every frame and told how long
+	   they are, older games every 100 msec */
+	sv.gameframediv = sv.framediv;
+
+	if (sv_gameexports >= GAME_EXPORTS_FRAMETIME)
+	{
+		sv.gameframediv = 1;
+		ge->SetFrameTime(sv.frametime / 1000.0f);
+	}
+
+	/* the delta history covers the same time at any
+	   sv_fps, the clients had to reconnect above */
+	if (svs.client_entities)
+	{
+		Z_Free(svs.client_entities);
+	}
+
+	svs.num_client_entities = maxclients->value * 16 * sv.framediv * 64;
+	svs.next_client_entities = 0;
+	svs.client_entities =
+		Z_Malloc(sizeof(entity_state_t) * svs.num_client_entities);
+
+	if (svs.client_frames)
+	{
+		Z_Free(svs.client_frames);
+	}
+
+	svs.update_backup = 16;
+
+	while (svs.update_backup < 16 * sv.framediv)
+	{
+		svs.update_backup <<= 1;
+	}
+
+	svs.client_frames = Z_Malloc(sizeof(client_frame_t) *
+			maxclients->value * svs.update_backup);
+
 	sv.time = 1000;
 
 	strcpy(sv.name, server);
@@ -254,6 +470,8 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 				false, &checksum);
 	}
 
+	loaded = Sys_Milliseconds();
+
 	Com_sprintf(sv.configstrings[CS_MAPCHECKSUM],
 			sizeof(sv.configstrings[CS_MAPCHECKSUM]),
 			"%i", checksum);
@@ -277,8 +495,10 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 	ge->SpawnEntities(sv.name, CM_EntityString(), spawnpoint);
 
 	/* run two frames to allow everything to settle */
-	ge->RunFrame();
-	ge->RunFrame();
+	for (i = 0; i < 2 * sv.framediv / sv.gameframediv; i++)
+	{
+		ge->RunFrame();
+	}
 
 	/* verify game didn't clobber important stuff */
 	if ((int)checksum !=
@@ -300,6 +520,14 @@ SV_SpawnServer(char *server, char *spawnpoint, server_state_t serverstate,
 	/* set serverinfo variable */
 	Cvar_FullSet("mapname", sv.name, CVAR_SERVERINFO | CVAR_NOSET);
 
+	Com_DPrintf("SpawnServer: %i ms, %i ms loading the map\n",
+			Sys_Milliseconds() - start, loaded - start);
+
+	if ((serverstate == ss_game) && sv_preload_next->value)
+	{
+		SV_PreloadNextMap();
+	}
+
 	Com_Printf("------------------------------------\n\n");
 }
 
@@ -376,10 +604,6 @@ SV_InitGame(void)
 
 	svs.spawncount = randk();
 	svs.clients = Z_Malloc(sizeof(client_t) * maxclients->value);
-	svs.num_client_entities = maxclients->value * UPDATE_BACKUP * 64;
-	svs.client_entities =
-		Z_Malloc( sizeof(entity_state_t) * svs.num_client_entities);
-
 	/* init network stuff */
 	NET_Config((maxclients->value > 1));
 
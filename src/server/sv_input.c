@@ -0,0 +1,862 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Input recording and replay for the game module. "sv_inputrecord"
+ * restarts the server on a map and records everything that's passed
+ * into the game: connects, userinfos, client and server commands,
+ * usercmds, disconnects, the frames and the end of the server frames,
+ * where the entity events are cleared. "sv_inputreplay" restarts the
+ * server the same way and feeds the recording to the game as fast as
+ * possible, without networking, timing ge->RunFrame().
+ *
+ * The game is loaded fresh for both, so its random number generator
+ * starts at the same state. Where the server shares the generator with
+ * the game, which is the case if the symbols of the executable are
+ * exported, the numbers the server takes are recorded and taken again
+ * in the replay. The client's aren't, record on a dedicated server.
+ * The cvars that change the game are recorded and set for the replay,
+ * their old values are restored when it's over. After
+ * each frame a hash of the entity states and player states is recorded,
+ * the replay compares them to find where it went another way.
+ *
+ * =======================================================================
+ */
+
+#include "header/server.h"
+
+#define INPUT_IDENT (('R' << 24) + ('I' << 16) + ('Q' << 8) + 'Y')
+#define INPUT_VERSION 1
+
+typedef enum
+{
+	INPUT_END,
+	INPUT_CONNECT,       /* client, userinfo */
+	INPUT_USERINFO,      /* client, userinfo */
+	INPUT_BEGIN,         /* client */
+	INPUT_COMMAND,       /* client, command line */
+	INPUT_THINK,         /* client, usercmd */
+	INPUT_DISCONNECT,    /* client */
+	INPUT_SERVERCOMMAND, /* command line */
+	INPUT_FRAME,         /* hash */
+	INPUT_RANDOM,        /* count */
+	INPUT_PREPFRAME      /* events cleared */
+} inputevent_t;
+
+typedef struct inputcvar_s
+{
+	char *name;
+	char *string;
+	struct inputcvar_s *next;
+} inputcvar_t;
+
+static asyncfile_t *input_file;
+static qboolean input_recording;
+static int input_frames;
+static int input_randoms;
+
+/* the values the replay changed */
+static inputcvar_t *input_cvars;
+
+/*
+ * FNV-1a
+ */
+static unsigned int
+SV_InputHashData(unsigned int hash, const void *data, int size)
+{
+	const byte *p = data;
+	int i;
+
+	for (i = 0; i < size; i++)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Hashes what the server knows
+ * about the entities and players.
+ */
+static unsigned int
+SV_InputHash(void)
+{
+	unsigned int hash;
+	edict_t *ent;
+	int i;
+
+	hash = 2166136261u;
+
+	for (i = 0; i < ge->num_edicts; i++)
+	{
+		ent = EDICT_NUM(i);
+
+		if (!ent->inuse)
+		{
+			continue;
+		}
+
+		hash = SV_InputHashData(hash, &i, sizeof(i));
+		hash = SV_InputHashData(hash, &ent->s, sizeof(ent->s));
+		hash = SV_InputHashData(hash, &ent->svflags, sizeof(ent->svflags));
+		hash = SV_InputHashData(hash, ent->mins, sizeof(ent->mins));
+		hash = SV_InputHashData(hash, ent->maxs, sizeof(ent->maxs));
+		hash = SV_InputHashData(hash, &ent->solid, sizeof(ent->solid));
+		hash = SV_InputHashData(hash, &ent->clipmask, sizeof(ent->clipmask));
+
+		if (ent->client)
+		{
+			hash = SV_InputHashData(hash, &ent->client->ps,
+					sizeof(ent->client->ps));
+		}
+	}
+
+	return hash;
+}
+
+static void
+SV_InputWrite(sizebuf_t *buf)
+{
+	byte data[8];
+	sizebuf_t rnd;
+
+	/* the random numbers the server took
+	   since the last event go first */
+	if (input_randoms)
+	{
+		SZ_Init(&rnd, data, sizeof(data));
+		MSG_WriteByte(&rnd, INPUT_RANDOM);
+		MSG_WriteLong(&rnd, input_randoms);
+		FS_WriteAsync(input_file, rnd.data, rnd.cursize);
+
+		input_randoms = 0;
+	}
+
+	FS_WriteAsync(input_file, buf->data, buf->cursize);
+}
+
+static void
+SV_InputClientEvent(inputevent_t event, client_t *cl, char *string)
+{
+	byte data[MAX_STRING_CHARS + 16];
+	sizebuf_t buf;
+
+	if (!input_recording)
+	{
+		return;
+	}
+
+	SZ_Init(&buf, data, sizeof(data));
+	MSG_WriteByte(&buf, event);
+	MSG_WriteByte(&buf, cl ? (int)(cl - svs.clients) : 0);
+
+	if (string)
+	{
+		MSG_WriteString(&buf, string);
+	}
+
+	SV_InputWrite(&buf);
+}
+
+void
+SV_InputConnect(client_t *cl, char *userinfo)
+{
+	SV_InputClientEvent(INPUT_CONNECT, cl, userinfo);
+}
+
+void
+SV_InputUserinfo(client_t *cl)
+{
+	SV_InputClientEvent(INPUT_USERINFO, cl, cl->userinfo);
+}
+
+void
+SV_InputBegin(client_t *cl)
+{
+	SV_InputClientEvent(INPUT_BEGIN, cl, NULL);
+}
+
+void
+SV_InputCommand(client_t *cl, char *s)
+{
+	SV_InputClientEvent(INPUT_COMMAND, cl, s);
+}
+
+void
+SV_InputDisconnect(client_t *cl)
+{
+	SV_InputClientEvent(INPUT_DISCONNECT, cl, NULL);
+}
+
+void
+SV_InputServerCommand(void)
+{
+	SV_InputClientEvent(INPUT_SERVERCOMMAND, NULL,
+			va("%s %s", Cmd_Argv(0), Cmd_Args()));
+}
+
+void
+SV_InputThink(client_t *cl, usercmd_t *cmd)
+{
+	byte data[32];
+	sizebuf_t buf;
+	int i;
+
+	if (!input_recording)
+	{
+		return;
+	}
+
+	SZ_Init(&buf, data, sizeof(data));
+	MSG_WriteByte(&buf, INPUT_THINK);
+	MSG_WriteByte(&buf, (int)(cl - svs.clients));
+	MSG_WriteByte(&buf, cmd->msec);
+	MSG_WriteByte(&buf, cmd->buttons);
+
+	for (i = 0; i < 3; i++)
+	{
+		MSG_WriteShort(&buf, cmd->angles[i]);
+	}
+
+	MSG_WriteShort(&buf, cmd->forwardmove);
+	MSG_WriteShort(&buf, cmd->sidemove);
+	MSG_WriteShort(&buf, cmd->upmove);
+	MSG_WriteByte(&buf, cmd->impulse);
+	MSG_WriteByte(&buf, cmd->lightlevel);
+
+	SV_InputWrite(&buf);
+}
+
+/*
+ * Called by SV_PrepWorldFrame().
+ */
+void
+SV_InputPrepFrame(void)
+{
+	SV_InputClientEvent(INPUT_PREPFRAME, NULL, NULL);
+}
+
+/*
+ * Called after the server took a
+ * number from randk().
+ */
+void
+SV_InputRandom(void)
+{
+	if (input_recording)
+	{
+		input_randoms++;
+	}
+}
+
+/*
+ * Called after each ge->RunFrame().
+ */
+void
+SV_InputFrame(void)
+{
+	byte data[8];
+	sizebuf_t buf;
+
+	if (!input_recording)
+	{
+		return;
+	}
+
+	SZ_Init(&buf, data, sizeof(data));
+	MSG_WriteByte(&buf, INPUT_FRAME);
+	MSG_WriteLong(&buf, SV_InputHash());
+
+	SV_InputWrite(&buf);
+
+	input_frames++;
+}
+
+/*
+ * Ends the recording, called by sv_inputstop,
+ * on map changes and server shutdown.
+ */
+void
+SV_InputStop(void)
+{
+	byte data[1];
+	sizebuf_t buf;
+
+	if (!input_file)
+	{
+		return;
+	}
+
+	if (input_recording)
+	{
+		SZ_Init(&buf, data, sizeof(data));
+		MSG_WriteByte(&buf, INPUT_END);
+		SV_InputWrite(&buf);
+	}
+
+	Com_Printf("Recorded %i frames to %s.\n", input_frames,
+			FS_AsyncName(input_file));
+
+	FS_CloseAsync(input_file);
+	input_file = NULL;
+	input_recording = false;
+}
+
+/*
+ * The cvars that are set for the replay,
+ * the server and game settings and those
+ * the game looks at. Not "game", only
+ * FS_SetGamedir() may change it.
+ */
+static qboolean
+SV_InputCvar(cvar_t *var)
+{
+	if (var->flags & (CVAR_NOSET | CVAR_USERINFO))
+	{
+		return false;
+	}
+
+	if (!strcmp(var->name, "game"))
+	{
+		return false;
+	}
+
+	/* decides how often the game is run */
+	if (!strcmp(var->name, "sv_fps"))
+	{
+		return true;
+	}
+
+	return (var->flags & (CVAR_SERVERINFO | CVAR_LATCH | CVAR_GAME)) != 0;
+}
+
+/*
+ * Sets a recorded cvar, the old
+ * value is kept for afterwards.
+ */
+static void
+SV_InputSetCvar(char *name, char *value)
+{
+	inputcvar_t *saved;
+	cvar_t *var;
+
+	for (var = cvar_vars; var; var = var->next)
+	{
+		if (!strcmp(var->name, name))
+		{
+			break;
+		}
+	}
+
+	if (var && (var->flags & (CVAR_NOSET | CVAR_USERINFO)))
+	{
+		return;
+	}
+
+	if (!strcmp(name, "game"))
+	{
+		return;
+	}
+
+	/* the ones the replay created stay */
+	if (var)
+	{
+		saved = Z_Malloc(sizeof(*saved));
+		saved->name = CopyString(name);
+		saved->string = CopyString(var->string);
+		saved->next = input_cvars;
+		input_cvars = saved;
+	}
+
+	Cvar_ForceSet(name, value);
+}
+
+/*
+ * Called by SV_Shutdown(), puts back what
+ * a replay changed once it's over or failed.
+ */
+void
+SV_InputRestoreCvars(void)
+{
+	inputcvar_t *saved;
+
+	while (input_cvars)
+	{
+		saved = input_cvars;
+		input_cvars = saved->next;
+
+		Cvar_ForceSet(saved->name, saved->string);
+
+		Z_Free(saved->name);
+		Z_Free(saved->string);
+		Z_Free(saved);
+	}
+}
+
+/*
+ * Restarts the server on map
+ * with a freshly loaded game.
+ */
+static void
+SV_InputRestart(char *map)
+{
+	if (svs.initialized)
+	{
+		SV_Shutdown("Server restarted\n", true);
+	}
+
+	/* like the "map" command */
+	SV_WipeSavegame("current");
+	SV_Map(false, map, false);
+}
+
+/*
+ * sv_inputrecord <name> <map>
+ */
+void
+SV_InputRecord_f(void)
+{
+	char name[MAX_OSPATH], demo[MAX_QPATH], map[MAX_QPATH];
+	byte data[MAX_MSGLEN];
+	sizebuf_t buf;
+	cvar_t *var;
+
+	if (Cmd_Argc() != 3)
+	{
+		Com_Printf("Usage: sv_inputrecord <name> <map>\n");
+		return;
+	}
+
+	if (input_file)
+	{
+		Com_Printf("Already recording.\n");
+		return;
+	}
+
+	if (strstr(Cmd_Argv(1), "..") || strstr(Cmd_Argv(1), "/") ||
+		strstr(Cmd_Argv(1), "\\"))
+	{
+		Com_Printf("Illegal filename.\n");
+		return;
+	}
+
+	Q_strlcpy(demo, Cmd_Argv(1), sizeof(demo));
+	Q_strlcpy(map, Cmd_Argv(2), sizeof(map));
+
+	SV_InputRestart(map);
+
+	if (sv.state != ss_game)
+	{
+		return;
+	}
+
+	Com_sprintf(name, sizeof(name), "%s/demos/%s.inp", FS_Gamedir(), demo);
+	FS_CreatePath(name);
+
+	input_file = FS_OpenAsync(name, false);
+
+	if (!input_file)
+	{
+		Com_Printf("ERROR: couldn't open %s.\n", name);
+		return;
+	}
+
+	SZ_Init(&buf, data, sizeof(data));
+	MSG_WriteLong(&buf, INPUT_IDENT);
+	MSG_WriteLong(&buf, INPUT_VERSION);
+	MSG_WriteString(&buf, sv.name);
+
+	for (var = cvar_vars; var; var = var->next)
+	{
+		if (!SV_InputCvar(var))
+		{
+			continue;
+		}
+
+		if (buf.cursize + strlen(var->name) + strlen(var->string) + 3 >
+			buf.maxsize)
+		{
+			SV_InputWrite(&buf);
+			SZ_Clear(&buf);
+		}
+
+		MSG_WriteString(&buf, var->name);
+		MSG_WriteString(&buf, var->string);
+	}
+
+	MSG_WriteString(&buf, "");
+	SV_InputWrite(&buf);
+
+	input_recording = true;
+	input_frames = 0;
+	input_randoms = 0;
+
+	Com_Printf("Recording input to %s.\n", name);
+}
+
+void
+SV_InputStop_f(void)
+{
+	if (!input_file)
+	{
+		Com_Printf("Not recording input.\n");
+		return;
+	}
+
+	SV_InputStop();
+}
+
+static void
+SV_InputReadCmd(sizebuf_t *msg, usercmd_t *cmd)
+{
+	int i;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	cmd->msec = MSG_ReadByte(msg);
+	cmd->buttons = MSG_ReadByte(msg);
+
+	for (i = 0; i < 3; i++)
+	{
+		cmd->angles[i] = MSG_ReadShort(msg);
+	}
+
+	cmd->forwardmove = MSG_ReadShort(msg);
+	cmd->sidemove = MSG_ReadShort(msg);
+	cmd->upmove = MSG_ReadShort(msg);
+	cmd->impulse = MSG_ReadByte(msg);
+	cmd->lightlevel = MSG_ReadByte(msg);
+}
+
+/*
+ * Sets up a client slot like
+ * SVC_DirectConnect() and
+ * SV_New_f() do.
+ */
+static void
+SV_InputConnectClient(client_t *cl, char *userinfo)
+{
+	char info[MAX_INFO_STRING];
+	netadr_t adr;
+	int num;
+
+	num = (int)(cl - svs.clients);
+
+	memset(cl, 0, sizeof(*cl));
+	cl->edict = EDICT_NUM(num + 1);
+
+	Q_strlcpy(info, userinfo, sizeof(info));
+
+	if (!ge->ClientConnect(cl->edict, info))
+	{
+		return;
+	}
+
+	Q_strlcpy(cl->userinfo, info, sizeof(cl->userinfo));
+
+	memset(&adr, 0, sizeof(adr));
+	adr.type = NA_LOOPBACK;
+	adr.port = BigShort((short)(num + 1));
+	Netchan_Setup(NS_SERVER, &cl->netchan, adr, 0, 0);
+
+	cl->state = cs_connected;
+	cl->framediv = sv.framediv;
+
+	/* done by SV_New_f() */
+	cl->edict->s.number = num + 1;
+
+	SZ_Init(&cl->datagram, cl->datagram_buf, sizeof(cl->datagram_buf));
+	cl->datagram.allowoverflow = true;
+}
+
+static int
+SV_InputCompare(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * sv_inputreplay <name>
+ */
+void
+SV_InputReplay_f(void)
+{
+	char name[MAX_QPATH], map[MAX_QPATH];
+	char cvarname[MAX_STRING_CHARS];
+	int length, event, num, frames, i;
+	int mismatches, firstmismatch;
+	long long start, elapsed, frame, think;
+	unsigned int hash, recorded;
+	int *times;
+	sizebuf_t msg;
+	client_t *cl;
+	usercmd_t cmd;
+	byte *data;
+	char *s;
+
+	if (Cmd_Argc() != 2)
+	{
+		Com_Printf("Usage: sv_inputreplay <name>\n");
+		return;
+	}
+
+	if (input_file)
+	{
+		Com_Printf("Can't replay while recording.\n");
+		return;
+	}
+
+	Com_sprintf(name, sizeof(name), "demos/%s.inp", Cmd_Argv(1));
+	length = FS_LoadFile(name, (void **)&data);
+
+	if (!data)
+	{
+		Com_Printf("Couldn't load %s.\n", name);
+		return;
+	}
+
+	SZ_Init(&msg, data, length);
+	msg.cursize = length;
+	MSG_BeginReading(&msg);
+
+	if ((MSG_ReadLong(&msg) != INPUT_IDENT) ||
+		(MSG_ReadLong(&msg) != INPUT_VERSION))
+	{
+		Com_Printf("%s is not an input recording.\n", name);
+		FS_FreeFile(data);
+		return;
+	}
+
+	Q_strlcpy(map, MSG_ReadString(&msg), sizeof(map));
+
+	/* maxclients and the like can't change
+	   under a running server */
+	if (svs.initialized)
+	{
+		SV_Shutdown("Server restarted\n", true);
+	}
+
+	while (1)
+	{
+		Q_strlcpy(cvarname, MSG_ReadString(&msg), sizeof(cvarname));
+
+		if (!cvarname[0])
+		{
+			break;
+		}
+
+		SV_InputSetCvar(cvarname, MSG_ReadString(&msg));
+	}
+
+	/* at least as many as there are frames */
+	frames = 0;
+
+	for (i = msg.readcount; i < length; i++)
+	{
+		if (data[i] == INPUT_FRAME)
+		{
+			frames++;
+		}
+	}
+
+	times = Z_Malloc((frames + 1) * sizeof(int));
+
+	SV_InputRestart(map);
+
+	if (sv.state != ss_game)
+	{
+		Z_Free(times);
+		FS_FreeFile(data);
+		SV_InputRestoreCvars();
+		return;
+	}
+
+	Com_Printf("Replaying %s on %s.\n", name, map);
+
+	frames = 0;
+	mismatches = 0;
+	firstmismatch = -1;
+	frame = think = 0;
+	start = Sys_Nanoseconds();
+
+	while (msg.readcount < msg.cursize)
+	{
+		event = MSG_ReadByte(&msg);
+
+		if ((event == INPUT_END) || (event == -1))
+		{
+			break;
+		}
+
+		if (event == INPUT_FRAME)
+		{
+			recorded = MSG_ReadLong(&msg);
+
+			elapsed = Sys_Nanoseconds();
+			ge->RunFrame();
+			elapsed = Sys_Nanoseconds() - elapsed;
+
+			times[frames] = (int)elapsed;
+			frame += elapsed;
+
+			sv.framenum += sv.gameframediv;
+			sv.time = sv.framenum * sv.frametime;
+
+			hash = SV_InputHash();
+
+			if (hash != recorded)
+			{
+				if (firstmismatch < 0)
+				{
+					firstmismatch = frames;
+				}
+
+				mismatches++;
+			}
+
+			frames++;
+
+			/* nobody reads the messages */
+			for (i = 0, cl = svs.clients; i < maxclients->value; i++, cl++)
+			{
+				if (cl->state >= cs_connected)
+				{
+					SZ_Clear(&cl->netchan.message);
+					SZ_Clear(&cl->datagram);
+				}
+			}
+
+			continue;
+		}
+
+		if (event == INPUT_RANDOM)
+		{
+			for (i = MSG_ReadLong(&msg); i > 0; i--)
+			{
+				randk();
+			}
+
+			continue;
+		}
+
+		if (event == INPUT_PREPFRAME)
+		{
+			MSG_ReadByte(&msg);
+			SV_PrepWorldFrame();
+			continue;
+		}
+
+		if (event == INPUT_SERVERCOMMAND)
+		{
+			MSG_ReadByte(&msg);
+			Cmd_TokenizeString(MSG_ReadString(&msg), false);
+			ge->ServerCommand();
+			continue;
+		}
+
+		num = MSG_ReadByte(&msg);
+
+		if ((num < 0) || (num >= maxclients->value))
+		{
+			Com_Printf("Bad client number %i in %s.\n", num, name);
+			break;
+		}
+
+		cl = &svs.clients[num];
+		sv_client = cl;
+		sv_player = cl->edict;
+
+		switch (event)
+		{
+			case INPUT_CONNECT:
+				SV_InputConnectClient(cl, MSG_ReadString(&msg));
+				break;
+
+			case INPUT_USERINFO:
+				Q_strlcpy(cl->userinfo, MSG_ReadString(&msg),
+						sizeof(cl->userinfo));
+				ge->ClientUserinfoChanged(cl->edict, cl->userinfo);
+				break;
+
+			case INPUT_BEGIN:
+				cl->state = cs_spawned;
+				ge->ClientBegin(cl->edict);
+				break;
+
+			case INPUT_COMMAND:
+				s = MSG_ReadString(&msg);
+				Cmd_TokenizeString(s, false);
+				ge->ClientCommand(cl->edict);
+				break;
+
+			case INPUT_THINK:
+				SV_InputReadCmd(&msg, &cmd);
+
+				elapsed = Sys_Nanoseconds();
+				ge->ClientThink(cl->edict, &cmd);
+				think += Sys_Nanoseconds() - elapsed;
+				break;
+
+			case INPUT_DISCONNECT:
+				ge->ClientDisconnect(cl->edict);
+				cl->state = cs_free;
+				break;
+
+			default:
+				Com_Printf("Bad event %i in %s.\n", event, name);
+				msg.readcount = msg.cursize;
+				break;
+		}
+	}
+
+	elapsed = Sys_Nanoseconds() - start;
+
+	Com_Printf("%i frames in %.2f seconds\n", frames, elapsed / 1000000000.0);
+
+	if (frames)
+	{
+		qsort(times, frames, sizeof(int), SV_InputCompare);
+
+		Com_Printf("ge->RunFrame: %.1f us avg, %.1f us p50, %.1f us p99, "
+				"%.1f us max\n", frame / 1000.0 / frames,
+				times[frames / 2] / 1000.0,
+				times[(int)(frames * 0.99f)] / 1000.0,
+				times[frames - 1] / 1000.0);
+		Com_Printf("ge->ClientThink: %.1f us per frame\n",
+				think / 1000.0 / frames);
+	}
+
+	if (mismatches)
+	{
+		Com_Printf("NOT deterministic: %i of %i frames differ, "
+				"the first is frame %i.\n", mismatches, frames,
+				firstmismatch);
+	}
+	else
+	{
+		Com_Printf("Deterministic, all %i frames match.\n", frames);
+	}
+
+	Z_Free(times);
+	FS_FreeFile(data);
+
+	SV_Shutdown("Replay finished\n", false);
+}
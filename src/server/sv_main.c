@@ -49,6 +49,18 @@ cvar_t *maxclients; /* rename sv_maxclients */
 cvar_t *sv_showclamp;
 cvar_t *hostname;
 cvar_t *public_server; /* should heartbeats be sent */
+cvar_t *sv_compress; /* allow compressed datagrams */
+cvar_t *sv_packedents; /* allow bit packed entities */
+cvar_t *sv_fragment; /* allow fragmented messages */
+cvar_t *sv_ratecontrol; /* estimate the bandwidth instead of using rate */
+cvar_t *sv_maxrate; /* upper bound of the estimation */
+cvar_t *sv_profile; /* record frame timings for sv_prof */
+cvar_t *sv_fps; /* server frames per second */
+cvar_t *sv_preload_next; /* read the next map in the background */
+cvar_t *sv_demo_compress; /* gzip serverrecord demos */
+cvar_t *sv_tracecache; /* reuse identical traces within a frame */
+cvar_t *sv_tracebatch; /* the game batches traces with gi.trace_batch */
+cvar_t *sv_traceprofile; /* attribute the game's traces to callers */
 
 void Master_Shutdown(void);
 void SV_ConnectionlessPacket(void);
@@ -68,6 +80,7 @@ SV_DropClient(client_t *drop)
 	{
 		/* call the prog function for removing a client
 		   this will remove the body, among other things */
+		SV_InputDisconnect(drop);
 		ge->ClientDisconnect(drop->edict);
 	}
 
@@ -176,7 +189,7 @@ SV_GiveMsec(void)
 	int i;
 	client_t *cl;
 
-	if (sv.framenum & 15)
+	if (sv.framenum % (16 * sv.framediv))
 	{
 		return;
 	}
@@ -201,7 +214,8 @@ SV_ReadPackets(void)
 	client_t *cl;
 	int qport;
 
-	while (NET_GetPacket(NS_SERVER, &net_from, &net_message))
+	while (NET_GetPacket(NS_SERVER, &net_from, &net_message) ||
+		   SV_BenchGetPacket(&net_from, &net_message))
 	{
 		/* check for connectionless packet (0xffffffff) first */
 		if (*(int *)net_message.data == -1)
@@ -327,11 +341,15 @@ SV_PrepWorldFrame(void)
 		/* events only last for a single message */
 		ent->s.event = 0;
 	}
+
+	SV_InputPrepFrame();
 }
 
 void
 SV_RunGameFrame(void)
 {
+	long long prof;
+
 #ifndef DEDICATED_ONLY
 
 	if (host_speeds->value)
@@ -346,12 +364,24 @@ SV_RunGameFrame(void)
 	   compression can get confused when a client
 	   has the "current" frame */
 	sv.framenum++;
-	sv.time = sv.framenum * 100;
+	sv.time = sv.framenum * sv.frametime;
 
 	/* don't run if paused */
 	if (!sv_paused->value || (maxclients->value > 1))
 	{
-		ge->RunFrame();
+		/* the game counts in 100 msec frames (FRAMETIME),
+		   unless it runs subframes the frames in between
+		   only process the client moves and send them out */
+		if (!(sv.framenum % sv.gameframediv))
+		{
+			SV_ClearTraceCache();
+
+			prof = SV_ProfBegin();
+			ge->RunFrame();
+			SV_ProfEnd(PROF_RUNFRAME, -1, prof);
+
+			SV_InputFrame();
+		}
 
 		/* never get more than one tic behind */
 		if (sv.time < svs.realtime)
@@ -378,6 +408,8 @@ SV_RunGameFrame(void)
 void
 SV_Frame(int msec)
 {
+	long long frame, prof;
+
 #ifndef DEDICATED_ONLY
 	time_before_game = time_after_game = 0;
 #endif
@@ -388,32 +420,45 @@ SV_Frame(int msec)
 		return;
 	}
 
+	frame = SV_ProfBegin();
+
 	svs.realtime += msec;
 
 	/* keep the random time dependent */
 	randk();
+	SV_InputRandom();
+
+	/* report finished savegames */
+	SV_CheckSaves();
 
 	/* check timeouts */
 	SV_CheckTimeouts();
 
+	/* the test client answers before the packets are read */
+	SV_NetTestFrame();
+
 	/* get packets from clients */
+	prof = SV_ProfBegin();
 	SV_ReadPackets();
+	SV_ProfEnd(PROF_READPACKETS, -1, prof);
 
 	/* move autonomous things around if enough time has passed */
 	if (!sv_timedemo->value && (svs.realtime < sv.time))
 	{
 		/* never let the time get too far off */
-		if (sv.time - svs.realtime > 100)
+		if (sv.time - svs.realtime > sv.frametime)
 		{
 			if (sv_showclamp->value)
 			{
 				Com_Printf("sv lowclamp\n");
 			}
 
-			svs.realtime = sv.time - 100;
+			svs.realtime = sv.time - sv.frametime;
 		}
 
-		NET_Sleep(sv.time - svs.realtime);
+		SV_ProfEnd(PROF_FRAME, -1, frame);
+
+		NET_Sleep(SV_NetTestSleep(sv.time - svs.realtime));
 		return;
 	}
 
@@ -424,10 +469,14 @@ SV_Frame(int msec)
 	SV_GiveMsec();
 
 	/* let everything in the world think and move */
+	prof = SV_ProfBegin();
 	SV_RunGameFrame();
+	SV_ProfEnd(PROF_GAMEFRAME, -1, prof);
 
 	/* send messages back to the clients that had packets read this frame */
+	prof = SV_ProfBegin();
 	SV_SendClientMessages();
+	SV_ProfEnd(PROF_SENDMESSAGES, -1, prof);
 
 	/* save the entire world state if recording a serverdemo */
 	SV_RecordDemoMessage();
@@ -437,6 +486,9 @@ SV_Frame(int msec)
 
 	/* clear teleport flags, etc for next frame */
 	SV_PrepWorldFrame();
+
+	SV_ProfEnd(PROF_FRAME, -1, frame);
+	SV_ProfCommit();
 }
 
 /*
@@ -533,6 +585,7 @@ SV_UserinfoChanged(client_t *cl)
 	int i;
 
 	/* call prog code to allow overrides */
+	SV_InputUserinfo(cl);
 	ge->ClientUserinfoChanged(cl->edict, cl->userinfo);
 
 	/* name for C code */
@@ -613,6 +666,19 @@ SV_Init(void)
 
 	public_server = Cvar_Get("public", "0", 0);
 
+	sv_compress = Cvar_Get("sv_compress", "0", CVAR_ARCHIVE);
+	sv_packedents = Cvar_Get("sv_packedents", "0", CVAR_ARCHIVE);
+	sv_fragment = Cvar_Get("sv_fragment", "0", CVAR_ARCHIVE);
+	sv_ratecontrol = Cvar_Get("sv_ratecontrol", "0", CVAR_ARCHIVE);
+	sv_maxrate = Cvar_Get("sv_maxrate", "100000", CVAR_ARCHIVE);
+	sv_profile = Cvar_Get("sv_profile", "0", 0);
+	sv_fps = Cvar_Get("sv_fps", "10", 0);
+	sv_preload_next = Cvar_Get("sv_preload_next", "0", 0);
+	sv_demo_compress = Cvar_Get("demo_compress", "0", CVAR_ARCHIVE);
+	sv_tracecache = Cvar_Get("sv_tracecache", "0", 0);
+	sv_tracebatch = Cvar_Get("sv_tracebatch", "1", 0);
+	sv_traceprofile = Cvar_Get("sv_traceprofile", "0", 0);
+
 	SZ_Init(&net_message, net_message_buffer, sizeof(net_message_buffer));
 }
 
@@ -675,6 +741,14 @@ SV_Shutdown(char *finalmsg, qboolean reconnect)
 		SV_FinalMessage(finalmsg, reconnect);
 	}
 
+	/* write out pending savegames */
+	SV_WaitSaves();
+
+	/* the next map won't come */
+	CM_CancelPreload();
+
+	SV_InputStop();
+
 	Master_Shutdown();
 	SV_ShutdownGameProgs();
 
@@ -698,11 +772,19 @@ SV_Shutdown(char *finalmsg, qboolean reconnect)
 		Z_Free(svs.client_entities);
 	}
 
+	if (svs.client_frames)
+	{
+		Z_Free(svs.client_frames);
+	}
+
 	if (svs.demofile)
 	{
-		fclose(svs.demofile);
+		FS_CloseAsync(svs.demofile);
 	}
 
 	memset(&svs, 0, sizeof(svs));
+
+	/* after an input replay or if it failed */
+	SV_InputRestoreCvars();
 }
 
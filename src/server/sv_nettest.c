@@ -0,0 +1,702 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Network test client. "sv_nettest" connects a headless client to the
+ * running dedicated server, over the loopback or UDP, and goes through
+ * the whole connection process like a real client: challenge, connect,
+ * serverdata, configstrings, baselines, begin. It measures the time
+ * from the challenge request to the first frame and reconnects a given
+ * number of times. After the last connect it may stay in the game for a
+ * while, sending a move every client frame, and report how many of the
+ * frames arrived. "nodelta" asks for full frames, like cl_nodelta.
+ *
+ * Together with net_loss, net_latency and net_bandwidth this measures
+ * the netchan over a bad link without a client build. The client runs
+ * on each SV_Frame() call before the packets are read. The server wakes
+ * up at least every NETTEST_FRAME msec and for every delayed packet.
+ *
+ * =======================================================================
+ */
+
+#include "header/server.h"
+
+/* like CL_CheckForResend() */
+#define NETTEST_RESEND 3000
+
+/* msec between two client frames, 60 fps */
+#define NETTEST_FRAME 16
+
+typedef enum
+{
+	nt_idle,
+	nt_wait,        /* for the last connection to time out */
+	nt_challenge,
+	nt_connect,
+	nt_connected,
+	nt_spawned
+} netteststate_t;
+
+static struct
+{
+	netteststate_t state;
+	netadr_t adr;
+	netchan_t netchan;
+	int capabilities;
+	int challenge;
+	int qport;
+	int rate;
+
+	int connects;       /* still to do */
+	int streamtime;     /* msec to stay after the last connect */
+	int time;           /* of the current state */
+	int lastsend;
+	int lastframe;
+	qboolean nodelta;   /* full frames like cl_nodelta */
+	usercmd_t cmds[3];
+
+	/* connect to spawn times */
+	int numtimes;
+	int mintime, maxtime, totaltime;
+	int packets;
+
+	/* the stream after the last connect */
+	int frames;
+	int bytes;
+	int lost;
+	int unparsed;
+} nettest;
+
+static void
+SV_NetTestPrint(char *s)
+{
+	Com_Printf("sv_nettest: %s", s);
+}
+
+/*
+ * Parses and drops the next entity of
+ * a svc_spawnbaseline message.
+ */
+static void
+SV_NetTestBaseline(sizebuf_t *msg)
+{
+	entity_state_t nullstate, state;
+	unsigned bits, b;
+	int number;
+
+	bits = MSG_ReadByte(msg);
+
+	if (bits & U_MOREBITS1)
+	{
+		b = MSG_ReadByte(msg);
+		bits |= b << 8;
+	}
+
+	if (bits & U_MOREBITS2)
+	{
+		b = MSG_ReadByte(msg);
+		bits |= b << 16;
+	}
+
+	if (bits & U_MOREBITS3)
+	{
+		b = MSG_ReadByte(msg);
+		bits |= b << 24;
+	}
+
+	if (bits & U_NUMBER16)
+	{
+		number = MSG_ReadShort(msg);
+	}
+	else
+	{
+		number = MSG_ReadByte(msg);
+	}
+
+	memset(&nullstate, 0, sizeof(nullstate));
+	MSG_ReadDeltaEntity(msg, &nullstate, &state, number, bits);
+}
+
+/*
+ * Runs the commands the server stuffs into
+ * the client's command buffer while connecting.
+ */
+static void
+SV_NetTestStuffText(char *text)
+{
+	char *line, *next;
+
+	for (line = text; line && *line; line = next)
+	{
+		next = strchr(line, '\n');
+
+		if (next)
+		{
+			*next++ = '\0';
+		}
+
+		Cmd_TokenizeString(line, false);
+
+		if (!strcmp(Cmd_Argv(0), "cmd"))
+		{
+			MSG_WriteByte(&nettest.netchan.message, clc_stringcmd);
+			MSG_WriteString(&nettest.netchan.message, Cmd_Args());
+		}
+		else if (!strcmp(Cmd_Argv(0), "precache"))
+		{
+			MSG_WriteByte(&nettest.netchan.message, clc_stringcmd);
+			MSG_WriteString(&nettest.netchan.message,
+					va("begin %s\n", Cmd_Argv(1)));
+		}
+	}
+}
+
+static void
+SV_NetTestSpawned(void)
+{
+	int time;
+
+	time = curtime - nettest.time;
+
+	if (!nettest.numtimes || (time < nettest.mintime))
+	{
+		nettest.mintime = time;
+	}
+
+	if (time > nettest.maxtime)
+	{
+		nettest.maxtime = time;
+	}
+
+	nettest.totaltime += time;
+	nettest.numtimes++;
+
+	SV_NetTestPrint(va("connect %i: %i ms to the first frame, "
+				"%i packets from the server\n", nettest.numtimes, time,
+				nettest.packets));
+
+	nettest.state = nt_spawned;
+	nettest.time = curtime;
+	nettest.frames = 0;
+	nettest.bytes = 0;
+	nettest.lost = 0;
+	nettest.unparsed = 0;
+}
+
+/*
+ * Reads the server messages of a packet, as far
+ * as a client that doesn't render anything needs.
+ */
+static void
+SV_NetTestParse(sizebuf_t *msg)
+{
+	int cmd, flags, i;
+	vec3_t pos;
+
+	while (msg->readcount < msg->cursize)
+	{
+		cmd = MSG_ReadByte(msg);
+
+		switch (cmd)
+		{
+			case svc_nop:
+				break;
+
+			case svc_disconnect:
+				SV_NetTestPrint("disconnected by the server\n");
+				nettest.state = nt_idle;
+				return;
+
+			case svc_reconnect:
+				SV_NetTestPrint("the server changed the map\n");
+				nettest.state = nt_idle;
+				return;
+
+			case svc_print:
+				MSG_ReadByte(msg);
+				MSG_ReadString(msg);
+				break;
+
+			case svc_centerprint:
+			case svc_layout:
+				MSG_ReadString(msg);
+				break;
+
+			case svc_stufftext:
+				SV_NetTestStuffText(MSG_ReadString(msg));
+				break;
+
+			case svc_serverdata:
+				MSG_ReadLong(msg); /* protocol */
+				MSG_ReadLong(msg); /* servercount */
+				MSG_ReadByte(msg); /* attractloop */
+				MSG_ReadString(msg); /* gamedir */
+				MSG_ReadShort(msg); /* playernum */
+				MSG_ReadString(msg); /* levelname */
+				break;
+
+			case svc_configstring:
+				MSG_ReadShort(msg);
+				MSG_ReadString(msg);
+				break;
+
+			case svc_spawnbaseline:
+				SV_NetTestBaseline(msg);
+				break;
+
+			case svc_inventory:
+				for (i = 0; i < MAX_ITEMS; i++)
+				{
+					MSG_ReadShort(msg);
+				}
+
+				break;
+
+			case svc_muzzleflash:
+			case svc_muzzleflash2:
+				MSG_ReadShort(msg);
+				MSG_ReadByte(msg);
+				break;
+
+			case svc_sound:
+				flags = MSG_ReadByte(msg);
+				MSG_ReadByte(msg);
+
+				if (flags & SND_VOLUME)
+				{
+					MSG_ReadByte(msg);
+				}
+
+				if (flags & SND_ATTENUATION)
+				{
+					MSG_ReadByte(msg);
+				}
+
+				if (flags & SND_OFFSET)
+				{
+					MSG_ReadByte(msg);
+				}
+
+				if (flags & SND_ENT)
+				{
+					MSG_ReadShort(msg);
+				}
+
+				if (flags & SND_POS)
+				{
+					MSG_ReadPos(msg, pos);
+				}
+
+				break;
+
+			case svc_frame:
+				/* the frame number is all we need, the
+				   rest is the player and the entities */
+				nettest.lastframe = MSG_ReadLong(msg);
+				nettest.frames++;
+
+				if (nettest.state == nt_connected)
+				{
+					SV_NetTestSpawned();
+				}
+
+				return;
+
+			default:
+				/* temp entities and the like, we
+				   lose the rest of the packet */
+				nettest.unparsed++;
+				return;
+		}
+	}
+}
+
+static void
+SV_NetTestConnectionless(sizebuf_t *msg)
+{
+	char *s;
+
+	MSG_BeginReading(msg);
+	MSG_ReadLong(msg); /* skip the -1 */
+
+	s = MSG_ReadStringLine(msg);
+	Cmd_TokenizeString(s, false);
+
+	if (!strcmp(Cmd_Argv(0), "challenge") && (nettest.state == nt_challenge))
+	{
+		nettest.challenge = (int)strtol(Cmd_Argv(1), (char **)NULL, 10);
+		nettest.state = nt_connect;
+		nettest.lastsend = 0;
+	}
+	else if (!strcmp(Cmd_Argv(0), "client_connect") &&
+			 (nettest.state == nt_connect))
+	{
+		Netchan_Setup(NS_CLIENT, &nettest.netchan, nettest.adr,
+				nettest.qport, (int)strtol(Cmd_Argv(1), (char **)NULL, 10));
+
+		MSG_WriteByte(&nettest.netchan.message, clc_stringcmd);
+		MSG_WriteString(&nettest.netchan.message, "new");
+
+		nettest.state = nt_connected;
+		nettest.lastframe = -1;
+	}
+	else if (!strcmp(Cmd_Argv(0), "print"))
+	{
+		SV_NetTestPrint(MSG_ReadString(msg));
+	}
+}
+
+static void
+SV_NetTestRead(void)
+{
+	byte data[MAX_FRAGMSGLEN];
+	netadr_t from;
+	sizebuf_t msg;
+
+	SZ_Init(&msg, data, sizeof(data));
+
+	while (NET_GetPacket(NS_CLIENT, &from, &msg))
+	{
+		if (!NET_CompareAdr(from, nettest.adr))
+		{
+			continue;
+		}
+
+		if (*(int *)msg.data == -1)
+		{
+			SV_NetTestConnectionless(&msg);
+			continue;
+		}
+
+		if (nettest.state < nt_connected)
+		{
+			continue;
+		}
+
+		if (!Netchan_Process(&nettest.netchan, &msg))
+		{
+			continue;
+		}
+
+		nettest.packets++;
+		nettest.bytes += msg.cursize;
+		nettest.lost += nettest.netchan.dropped;
+
+		SV_NetTestParse(&msg);
+
+		if (nettest.state == nt_idle)
+		{
+			return;
+		}
+	}
+}
+
+/*
+ * Sends a move like CL_SendCmd(), standing still
+ * and acknowledging the last frame.
+ */
+static void
+SV_NetTestMove(void)
+{
+	byte data[MAX_MSGLEN];
+	sizebuf_t buf;
+	usercmd_t nullcmd;
+	int checksumIndex;
+	int msec;
+
+	msec = curtime - nettest.lastsend;
+	msec = (msec > 250) ? 250 : msec;
+
+	nettest.cmds[0] = nettest.cmds[1];
+	nettest.cmds[1] = nettest.cmds[2];
+	memset(&nettest.cmds[2], 0, sizeof(usercmd_t));
+	nettest.cmds[2].msec = msec;
+	nettest.cmds[2].lightlevel = 128;
+
+	SZ_Init(&buf, data, sizeof(data));
+
+	MSG_WriteByte(&buf, clc_move);
+
+	checksumIndex = buf.cursize;
+	MSG_WriteByte(&buf, 0);
+
+	MSG_WriteLong(&buf, nettest.nodelta ? -1 : nettest.lastframe);
+
+	memset(&nullcmd, 0, sizeof(nullcmd));
+	MSG_WriteDeltaUsercmd(&buf, &nullcmd, &nettest.cmds[0]);
+	MSG_WriteDeltaUsercmd(&buf, &nettest.cmds[0], &nettest.cmds[1]);
+	MSG_WriteDeltaUsercmd(&buf, &nettest.cmds[1], &nettest.cmds[2]);
+
+	buf.data[checksumIndex] = COM_BlockSequenceCRCByte(
+		buf.data + checksumIndex + 1, buf.cursize - checksumIndex - 1,
+		nettest.netchan.outgoing_sequence);
+
+	Netchan_Transmit(&nettest.netchan, buf.cursize, buf.data);
+}
+
+static void
+SV_NetTestDisconnect(void)
+{
+	byte final[32];
+	int i;
+
+	/* like CL_Disconnect() */
+	final[0] = clc_stringcmd;
+	strcpy((char *)final + 1, "disconnect");
+
+	for (i = 0; i < 3; i++)
+	{
+		Netchan_Transmit(&nettest.netchan, strlen((char *)final), final);
+	}
+}
+
+static void
+SV_NetTestReport(void)
+{
+	float seconds;
+	int expected;
+
+	if (nettest.numtimes)
+	{
+		SV_NetTestPrint(va("%i connects: %i ms min, %i ms avg, %i ms max\n",
+					nettest.numtimes, nettest.mintime,
+					nettest.totaltime / nettest.numtimes, nettest.maxtime));
+	}
+
+	if (nettest.state == nt_spawned)
+	{
+		seconds = (curtime - nettest.time) / 1000.0f;
+
+		/* without NETCAP_TICKRATE a frame every 100 msec */
+		expected = (curtime - nettest.time) / 100;
+
+		if ((seconds > 0) && expected)
+		{
+			SV_NetTestPrint(va("%.1f seconds: %i of %i frames (%.0f%%), "
+						"%i bytes/s, %i packets lost, %i not parsed\n",
+						seconds, nettest.frames, expected,
+						100.0f * nettest.frames / expected,
+						(int)(nettest.bytes / seconds), nettest.lost,
+						nettest.unparsed));
+		}
+	}
+}
+
+/*
+ * Starts over with the challenge request,
+ * the connect time is measured from here.
+ */
+static void
+SV_NetTestConnect(void)
+{
+	nettest.state = nt_challenge;
+	nettest.time = curtime;
+	nettest.lastsend = 0;
+	nettest.packets = 0;
+}
+
+/*
+ * Called at the start of every SV_Frame()
+ */
+void
+SV_NetTestFrame(void)
+{
+	char userinfo[MAX_INFO_STRING];
+
+	if (nettest.state == nt_idle)
+	{
+		return;
+	}
+
+	curtime = Sys_Milliseconds();
+
+	SV_NetTestRead();
+
+	switch (nettest.state)
+	{
+		case nt_idle:
+			return;
+
+		case nt_wait:
+			/* SV_CheckTimeouts() frees the slot */
+			if (curtime - nettest.time <
+				1000 * Cvar_VariableValue("zombietime") + 500)
+			{
+				return;
+			}
+
+			SV_NetTestConnect();
+
+			/* fall through */
+
+		case nt_challenge:
+			if (!nettest.lastsend ||
+				(curtime - nettest.lastsend > NETTEST_RESEND))
+			{
+				Netchan_OutOfBandPrint(NS_CLIENT, nettest.adr,
+						"getchallenge\n");
+				nettest.lastsend = curtime;
+			}
+
+			return;
+
+		case nt_connect:
+			if (!nettest.lastsend ||
+				(curtime - nettest.lastsend > NETTEST_RESEND))
+			{
+				Com_sprintf(userinfo, sizeof(userinfo),
+						"\\name\\nettest\\skin\\male/grunt\\rate\\%i"
+						"\\msg\\1\\hand\\2", nettest.rate);
+				Netchan_OutOfBandPrint(NS_CLIENT, nettest.adr,
+						"connect %i %i %i \"%s\" %i\n", PROTOCOL_VERSION,
+						nettest.qport, nettest.challenge, userinfo,
+						nettest.capabilities);
+				nettest.lastsend = curtime;
+			}
+
+			return;
+
+		case nt_connected:
+			/* the reliable commands or a keepalive */
+			if (nettest.netchan.message.cursize ||
+				(curtime - nettest.netchan.last_sent > 1000))
+			{
+				Netchan_Transmit(&nettest.netchan, 0, nettest.netchan.message_buf);
+			}
+
+			return;
+
+		case nt_spawned:
+			if (nettest.connects > 1)
+			{
+				nettest.connects--;
+				SV_NetTestDisconnect();
+				nettest.state = nt_wait;
+				nettest.time = curtime;
+				return;
+			}
+
+			if (curtime - nettest.time < nettest.streamtime)
+			{
+				if (curtime - nettest.lastsend >= NETTEST_FRAME)
+				{
+					SV_NetTestMove();
+					nettest.lastsend = curtime;
+				}
+
+				return;
+			}
+
+			SV_NetTestReport();
+			SV_NetTestDisconnect();
+			nettest.state = nt_idle;
+			return;
+	}
+}
+
+/*
+ * The server only wakes up for its own socket, the test
+ * client must read its packets as often as a real one.
+ */
+int
+SV_NetTestSleep(int msec)
+{
+	if ((nettest.state == nt_idle) || (msec < NETTEST_FRAME))
+	{
+		return msec;
+	}
+
+	return NETTEST_FRAME;
+}
+
+/*
+ * sv_nettest [connects] [address] [seconds] [nodelta]
+ */
+void
+SV_NetTest_f(void)
+{
+	char *address;
+
+	if (Cmd_Argc() > 5)
+	{
+		Com_Printf("Usage: sv_nettest [connects] [address] [seconds] "
+				"[nodelta]\n");
+		return;
+	}
+
+	if (!dedicated->value || (sv.state != ss_game))
+	{
+		Com_Printf("sv_nettest needs a dedicated server running a map.\n");
+		return;
+	}
+
+	if (nettest.state != nt_idle)
+	{
+		Com_Printf("sv_nettest is already running.\n");
+		return;
+	}
+
+	memset(&nettest, 0, sizeof(nettest));
+
+	nettest.connects = (Cmd_Argc() > 1) ? atoi(Cmd_Argv(1)) : 5;
+	address = (Cmd_Argc() > 2) ? Cmd_Argv(2) : "localhost";
+	nettest.streamtime = (Cmd_Argc() > 3) ? (int)(atof(Cmd_Argv(3)) * 1000) : 0;
+	nettest.nodelta = (Cmd_Argc() > 4) && !strcmp(Cmd_Argv(4), "nodelta");
+
+	if (nettest.connects < 1)
+	{
+		nettest.connects = 1;
+	}
+
+	if (!NET_StringToAdr(address, &nettest.adr))
+	{
+		Com_Printf("Bad address %s\n", address);
+		return;
+	}
+
+	if (!nettest.adr.port && (nettest.adr.type != NA_LOOPBACK))
+	{
+		nettest.adr.port = BigShort((short)Cvar_VariableValue("port"));
+	}
+
+	/* no packed entities and no compression, they're
+	   not parsed. sv_fragment decides on the rest */
+	nettest.capabilities = NETCAP_FRAGMENT;
+
+	/* Netchan_Transmit() sends the qport cvar */
+	nettest.qport = (int)Cvar_VariableValue("qport");
+
+	/* the client's rate, if set */
+	nettest.rate = (int)Cvar_VariableValue("rate");
+
+	if (nettest.rate <= 0)
+	{
+		nettest.rate = 8000;
+	}
+
+	Com_Printf("sv_nettest: %i connects to %s, rate %i, net_loss %g, "
+			"net_latency %g, net_bandwidth %g\n", nettest.connects,
+			address, nettest.rate, Cvar_VariableValue("net_loss"),
+			Cvar_VariableValue("net_latency"),
+			Cvar_VariableValue("net_bandwidth"));
+
+	curtime = Sys_Milliseconds();
+	SV_NetTestConnect();
+}
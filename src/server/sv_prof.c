@@ -0,0 +1,610 @@
+/*
+ * Copyright (C) 2017 Yamagi Quake II contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *
+ * =======================================================================
+ *
+ * Server frame profiler. With sv_profile set, the phases of SV_Frame()
+ * and the per client work are timed with a monotonic nanosecond clock.
+ * The last PROF_FRAMES frames are kept as a summary, the last
+ * PROF_EVENTS timed zones as single events. "sv_prof dump" writes them
+ * out as CSV or Chrome trace event JSON (chrome://tracing, Perfetto),
+ * so a spike can be looked at after it happened.
+ *
+ * SV_Frame() is called much more often than the server runs a frame,
+ * reading packets in between. The time of these calls is added to the
+ * next frame that's actually run.
+ *
+ * With sv_traceprofile set, the game's traces, point contents and PVS
+ * and PHS checks are counted and timed by the function that called
+ * them, found by its return address. "trace_profile" prints the
+ * callers that took the most time.
+ *
+ * =======================================================================
+ */
+
+#include "header/server.h"
+
+#define PROF_FRAMES 1024
+#define PROF_EVENTS 32768
+#define PROF_CALLERS 1024 /* must be a power of two */
+#define PROF_TOPCALLERS 25
+
+typedef struct
+{
+	long long start;
+	int duration;
+	short zone;
+	short client;
+	int frame;
+} profevent_t;
+
+static char *prof_zonenames[PROF_ZONES] = {
+	"SV_Frame",
+	"SV_ReadPackets",
+	"SV_RunGameFrame",
+	"ge->RunFrame",
+	"SV_SendClientMessages",
+	"SV_BuildClientFrame",
+	"SV_WriteFrameToClient"
+};
+
+static profframe_t prof_frames[PROF_FRAMES];
+static int prof_numframes;
+
+static profframe_t prof_current;
+static qboolean prof_pending;
+
+static profevent_t prof_events[PROF_EVENTS];
+static int prof_numevents;
+
+typedef struct
+{
+	void *caller; /* return address, NULL if unused */
+	traceprofkind_t kind;
+	int calls;
+	long long time;
+} profcaller_t;
+
+static char *prof_kindnames[TRACEPROF_KINDS] = {
+	"trace",
+	"pointcontents",
+	"inPVS",
+	"inPHS",
+	"trace_batch"
+};
+
+static profcaller_t prof_callers[PROF_CALLERS];
+static int prof_numcallers;
+static int prof_lostcalls; /* the table was full */
+
+int sv_prof_traces;
+int sv_prof_links;
+int sv_prof_links_unchanged;
+int sv_prof_links_inplace;
+int sv_prof_tracehits;
+int sv_prof_contents;
+int sv_prof_contentshits;
+
+/*
+ * Returns the start time of a zone,
+ * 0 if the profiler is disabled.
+ */
+long long
+SV_ProfBegin(void)
+{
+	if (!sv_profile->value)
+	{
+		return 0;
+	}
+
+	return Sys_Nanoseconds();
+}
+
+/*
+ * Ends a zone started by SV_ProfBegin(). client
+ * is the client number or -1 for global work.
+ */
+void
+SV_ProfEnd(profzone_t zone, int client, long long start)
+{
+	profevent_t *ev;
+	int duration;
+
+	if (!start)
+	{
+		return;
+	}
+
+	duration = (int)(Sys_Nanoseconds() - start);
+
+	if (!prof_pending)
+	{
+		memset(&prof_current, 0, sizeof(prof_current));
+		prof_current.start = start;
+		prof_pending = true;
+	}
+
+	prof_current.zones[zone] += duration;
+
+	ev = &prof_events[prof_numevents % PROF_EVENTS];
+	prof_numevents++;
+
+	ev->start = start;
+	ev->duration = duration;
+	ev->zone = zone;
+	ev->client = client;
+	ev->frame = sv.framenum;
+}
+
+/*
+ * Finishes the current frame, called at
+ * the end of each frame that was run.
+ */
+void
+SV_ProfCommit(void)
+{
+	if (prof_pending)
+	{
+		prof_current.frame = sv.framenum;
+		prof_current.traces = sv_prof_traces;
+		prof_current.links = sv_prof_links;
+		prof_current.links_unchanged = sv_prof_links_unchanged;
+		prof_current.links_inplace = sv_prof_links_inplace;
+		prof_current.tracehits = sv_prof_tracehits;
+		prof_current.contents = sv_prof_contents;
+		prof_current.contentshits = sv_prof_contentshits;
+
+		prof_frames[prof_numframes % PROF_FRAMES] = prof_current;
+		prof_numframes++;
+
+		prof_pending = false;
+	}
+
+	sv_prof_traces = 0;
+	sv_prof_links = 0;
+	sv_prof_links_unchanged = 0;
+	sv_prof_links_inplace = 0;
+	sv_prof_tracehits = 0;
+	sv_prof_contents = 0;
+	sv_prof_contentshits = 0;
+}
+
+/*
+ * Returns the last finished frame or
+ * NULL if nothing was recorded yet.
+ */
+profframe_t *
+SV_ProfLastFrame(void)
+{
+	if (!prof_numframes)
+	{
+		return NULL;
+	}
+
+	return &prof_frames[(prof_numframes - 1) % PROF_FRAMES];
+}
+
+char *
+SV_ProfZoneName(profzone_t zone)
+{
+	return prof_zonenames[zone];
+}
+
+static void
+SV_ProfWriteCSV(FILE *f, int first)
+{
+	profframe_t *fr;
+	int i, z;
+
+	fprintf(f, "frame,start_ms");
+
+	for (z = 0; z < PROF_ZONES; z++)
+	{
+		fprintf(f, ",%s_us", prof_zonenames[z]);
+	}
+
+	fprintf(f, ",traces,links,links_unchanged,links_inplace,"
+			"trace_hits,contents,contents_hits\n");
+
+	for (i = first; i < prof_numframes; i++)
+	{
+		fr = &prof_frames[i % PROF_FRAMES];
+
+		fprintf(f, "%i,%.3f", fr->frame,
+				(fr->start - prof_frames[first % PROF_FRAMES].start) / 1000000.0);
+
+		for (z = 0; z < PROF_ZONES; z++)
+		{
+			fprintf(f, ",%.1f", fr->zones[z] / 1000.0);
+		}
+
+		fprintf(f, ",%i,%i,%i,%i,%i,%i,%i\n", fr->traces, fr->links,
+				fr->links_unchanged, fr->links_inplace, fr->tracehits,
+				fr->contents, fr->contentshits);
+	}
+}
+
+static void
+SV_ProfWriteTrace(FILE *f, int first)
+{
+	profevent_t *ev;
+	profframe_t *fr;
+	long long base;
+	int i;
+
+	base = prof_events[first % PROF_EVENTS].start;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (i = first; i < prof_numevents; i++)
+	{
+		ev = &prof_events[i % PROF_EVENTS];
+
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%i",
+				prof_zonenames[ev->zone], (ev->start - base) / 1000.0,
+				ev->duration / 1000.0, ev->frame);
+
+		if (ev->client >= 0)
+		{
+			fprintf(f, ",\"client\":%i", ev->client);
+		}
+
+		fprintf(f, "}},\n");
+	}
+
+	/* the counters, as far as the events go back */
+	for (i = prof_numframes > PROF_FRAMES ? prof_numframes - PROF_FRAMES : 0;
+		 i < prof_numframes; i++)
+	{
+		fr = &prof_frames[i % PROF_FRAMES];
+
+		if (fr->start < base)
+		{
+			continue;
+		}
+
+		fprintf(f, "{\"name\":\"counts\",\"ph\":\"C\",\"pid\":1,\"tid\":1,"
+				"\"ts\":%.3f,\"args\":{\"traces\":%i,\"links\":%i,"
+				"\"links_unchanged\":%i,\"links_inplace\":%i}},\n",
+				(fr->start - base) / 1000.0, fr->traces, fr->links,
+				fr->links_unchanged, fr->links_inplace);
+	}
+
+	/* no trailing comma in JSON */
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"args\":{\"name\":\"q2ded\"}}\n]}\n");
+}
+
+static void
+SV_ProfDump(char *filename)
+{
+	char name[MAX_OSPATH];
+	FILE *f;
+	int len;
+
+	if (!prof_numframes)
+	{
+		Com_Printf("Nothing recorded, set sv_profile 1.\n");
+		return;
+	}
+
+	Com_sprintf(name, sizeof(name), "%s/%s", FS_Gamedir(), filename);
+	FS_CreatePath(name);
+
+	f = fopen(name, "w");
+
+	if (!f)
+	{
+		Com_Printf("Couldn't open %s.\n", name);
+		return;
+	}
+
+	len = (int)strlen(name);
+
+	if ((len > 5) && !Q_stricmp(name + len - 5, ".json"))
+	{
+		SV_ProfWriteTrace(f, prof_numevents > PROF_EVENTS ?
+				prof_numevents - PROF_EVENTS : 0);
+	}
+	else
+	{
+		SV_ProfWriteCSV(f, prof_numframes > PROF_FRAMES ?
+				prof_numframes - PROF_FRAMES : 0);
+	}
+
+	fclose(f);
+
+	Com_Printf("Wrote %s.\n", name);
+}
+
+static void
+SV_ProfSummary(void)
+{
+	profframe_t *fr;
+	long long total[PROF_ZONES];
+	int max[PROF_ZONES];
+	int links, unchanged, inplace;
+	int traces, tracehits, contents, contentshits;
+	int first, count, i, z;
+
+	first = prof_numframes > PROF_FRAMES ? prof_numframes - PROF_FRAMES : 0;
+	count = prof_numframes - first;
+
+	if (!count)
+	{
+		Com_Printf("Nothing recorded, set sv_profile 1.\n");
+		return;
+	}
+
+	memset(total, 0, sizeof(total));
+	memset(max, 0, sizeof(max));
+	links = unchanged = inplace = 0;
+	traces = tracehits = contents = contentshits = 0;
+
+	for (i = first; i < prof_numframes; i++)
+	{
+		fr = &prof_frames[i % PROF_FRAMES];
+
+		links += fr->links;
+		unchanged += fr->links_unchanged;
+		inplace += fr->links_inplace;
+		traces += fr->traces;
+		tracehits += fr->tracehits;
+		contents += fr->contents;
+		contentshits += fr->contentshits;
+
+		for (z = 0; z < PROF_ZONES; z++)
+		{
+			total[z] += fr->zones[z];
+
+			if (fr->zones[z] > max[z])
+			{
+				max[z] = fr->zones[z];
+			}
+		}
+	}
+
+	Com_Printf("last %i frames\n", count);
+	Com_Printf("zone                     avg us   max us\n");
+	Com_Printf("---------------------- -------- --------\n");
+
+	for (z = 0; z < PROF_ZONES; z++)
+	{
+		Com_Printf("%-22s %8.1f %8.1f\n", prof_zonenames[z],
+				total[z] / count / 1000.0, max[z] / 1000.0);
+	}
+
+	if (links)
+	{
+		Com_Printf("%.1f links per frame, %.1f%% unchanged, %.1f%% in place\n",
+				(float)links / count, 100.0f * unchanged / links,
+				100.0f * inplace / links);
+	}
+
+	if (tracehits || contentshits)
+	{
+		Com_Printf("trace cache: %.1f%% of %.1f traces, %.1f%% of %.1f "
+				"point contents per frame\n",
+				traces ? 100.0f * tracehits / traces : 0.0f,
+				(float)traces / count,
+				contents ? 100.0f * contentshits / contents : 0.0f,
+				(float)contents / count);
+	}
+}
+
+/*
+ * sv_prof [dump <file.csv|file.json>|clear]
+ */
+void
+SV_Prof_f(void)
+{
+	if ((Cmd_Argc() == 3) && !strcmp(Cmd_Argv(1), "dump"))
+	{
+		SV_ProfDump(Cmd_Argv(2));
+	}
+	else if ((Cmd_Argc() == 2) && !strcmp(Cmd_Argv(1), "clear"))
+	{
+		prof_numframes = 0;
+		prof_numevents = 0;
+		prof_pending = false;
+	}
+	else if (Cmd_Argc() == 1)
+	{
+		SV_ProfSummary();
+	}
+	else
+	{
+		Com_Printf("Usage: sv_prof [dump <file.csv|file.json>|clear]\n");
+	}
+}
+
+/*
+ * Counts a call the game made, caller is
+ * where it returns to in the game.
+ */
+void
+SV_TraceProfAdd(traceprofkind_t kind, void *caller, long long time)
+{
+	profcaller_t *pc;
+	size_t hash;
+
+	hash = ((size_t)caller >> 2) * 31 + kind;
+
+	while (1)
+	{
+		pc = &prof_callers[hash & (PROF_CALLERS - 1)];
+
+		if ((pc->caller == caller) && (pc->kind == kind))
+		{
+			break;
+		}
+
+		if (!pc->caller)
+		{
+			/* keep some room, probing gets slow */
+			if (prof_numcallers >= PROF_CALLERS * 3 / 4)
+			{
+				prof_lostcalls++;
+				return;
+			}
+
+			pc->caller = caller;
+			pc->kind = kind;
+			prof_numcallers++;
+			break;
+		}
+
+		hash++;
+	}
+
+	pc->calls++;
+	pc->time += time;
+}
+
+/*
+ * Forgets the callers, their addresses
+ * are stale once the game is unloaded.
+ */
+void
+SV_TraceProfClear(void)
+{
+	memset(prof_callers, 0, sizeof(prof_callers));
+	prof_numcallers = 0;
+	prof_lostcalls = 0;
+}
+
+static int
+SV_TraceProfCompare(const void *a, const void *b)
+{
+	const profcaller_t *pa = a;
+	const profcaller_t *pb = b;
+
+	if (pa->time != pb->time)
+	{
+		return pa->time < pb->time ? 1 : -1;
+	}
+
+	return pb->calls - pa->calls;
+}
+
+/*
+ * trace_profile [clear]
+ */
+void
+SV_TraceProfile_f(void)
+{
+	profcaller_t *merged;
+	long long total[TRACEPROF_KINDS];
+	int calls[TRACEPROF_KINDS];
+	char name[64];
+	int count, i, j;
+
+	if ((Cmd_Argc() == 2) && !strcmp(Cmd_Argv(1), "clear"))
+	{
+		SV_TraceProfClear();
+		return;
+	}
+
+	if (Cmd_Argc() != 1)
+	{
+		Com_Printf("Usage: trace_profile [clear]\n");
+		return;
+	}
+
+	if (!prof_numcallers)
+	{
+		Com_Printf("Nothing recorded, set sv_traceprofile 1.\n");
+		return;
+	}
+
+	/* the return addresses within one
+	   function are added up */
+	merged = Z_Malloc(prof_numcallers * sizeof(profcaller_t));
+	count = 0;
+
+	memset(total, 0, sizeof(total));
+	memset(calls, 0, sizeof(calls));
+
+	for (i = 0; i < PROF_CALLERS; i++)
+	{
+		if (!prof_callers[i].caller)
+		{
+			continue;
+		}
+
+		total[prof_callers[i].kind] += prof_callers[i].time;
+		calls[prof_callers[i].kind] += prof_callers[i].calls;
+
+		merged[count] = prof_callers[i];
+		merged[count].caller = Sys_FindSymbol(prof_callers[i].caller,
+				name, sizeof(name));
+
+		for (j = 0; j < count; j++)
+		{
+			if ((merged[j].caller == merged[count].caller) &&
+				(merged[j].kind == merged[count].kind))
+			{
+				merged[j].calls += merged[count].calls;
+				merged[j].time += merged[count].time;
+				break;
+			}
+		}
+
+		if (j == count)
+		{
+			count++;
+		}
+	}
+
+	qsort(merged, count, sizeof(profcaller_t), SV_TraceProfCompare);
+
+	Com_Printf("kind              calls    total ms  avg us  caller\n");
+	Com_Printf("------------- --------- ----------- -------  ------\n");
+
+	for (i = 0; i < count && i < PROF_TOPCALLERS; i++)
+	{
+		Sys_FindSymbol(merged[i].caller, name, sizeof(name));
+
+		Com_Printf("%-13s %9i %11.2f %7.2f  %s\n",
+				prof_kindnames[merged[i].kind], merged[i].calls,
+				merged[i].time / 1000000.0,
+				merged[i].time / 1000.0 / merged[i].calls, name);
+	}
+
+	Com_Printf("\n");
+
+	for (i = 0; i < TRACEPROF_KINDS; i++)
+	{
+		if (calls[i])
+		{
+			Com_Printf("%-13s %9i %11.2f %7.2f  all callers\n",
+					prof_kindnames[i], calls[i], total[i] / 1000000.0,
+					total[i] / 1000.0 / calls[i]);
+		}
+	}
+
+	if (prof_lostcalls)
+	{
+		Com_Printf("%i calls weren't counted, too many callers.\n",
+				prof_lostcalls);
+	}
+
+	Z_Free(merged);
+}
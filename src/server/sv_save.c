@@ -29,160 +29,581 @@
 void CM_ReadPortalState(fileHandle_t f);
 
 /*
- * Delete save/<XXX>/
+ * Savegames are written in the background. The server
+ * side files are put together in memory, the game hands
+ * its files over with gi.save_file() (older games write
+ * them to <name>.tmp themselves). All of them are queued
+ * as operations and handed to a thread at the end of the
+ * savegame or level change, which flushes them to the
+ * disk and renames them over the old files. A savegame
+ * on the disk is therefore either complete or not there,
+ * and the frame doesn't wait for the disk.
+ *
+ * Everything reading a savegame waits for the pending
+ * operations on its files first.
  */
-void
-SV_WipeSavegame(char *savename)
+
+typedef enum
 {
-	char name[MAX_OSPATH];
-	char *s;
+	SAVE_WRITE,  /* data to dst */
+	SAVE_COMMIT, /* dst.tmp, written by an older game, to dst */
+	SAVE_COPY,   /* src to dst */
+	SAVE_REMOVE  /* dst */
+} saveoptype_t;
 
-	Com_DPrintf("SV_WipeSaveGame(%s)\n", savename);
+typedef struct saveop_s
+{
+	saveoptype_t type;
+	char src[MAX_OSPATH];
+	char dst[MAX_OSPATH];
+	byte *data;
+	int size;
+	struct saveop_s *next;
+} saveop_t;
 
-	Com_sprintf(name, sizeof(name), "%s/save/%s/server.ssv",
-				FS_Gamedir(), savename);
+static saveop_t *save_pending;
+static saveop_t **save_pendingtail = &save_pending;
 
-	remove(name);
+/* owned by the thread while it runs */
+static saveop_t *save_running;
+static char save_failed[MAX_OSPATH];
+static long long save_nanoseconds;
 
-	Com_sprintf(name, sizeof(name), "%s/save/%s/game.ssv",
-				FS_Gamedir(), savename);
+static void *save_thread;
+static void *save_mutex;
+static qboolean save_done;
 
-	remove(name);
+/* time the frame spent on the pending savegame */
+static long long save_stall;
 
-	Com_sprintf(name, sizeof(name), "%s/save/%s/*.sav", FS_Gamedir(), savename);
-	s = Sys_FindFirst(name, 0, 0);
+/*
+ * Flushes tmp to the disk and
+ * renames it over dst.
+ */
+static qboolean
+SV_ReplaceFile(FILE *f, char *tmp, char *dst)
+{
+	Sys_SyncFile(f);
 
-	while (s)
+	if (ferror(f))
 	{
-		remove(s);
-		s = Sys_FindNext(0, 0);
+		fclose(f);
+		remove(tmp);
+		return false;
 	}
 
-	Sys_FindClose();
-	Com_sprintf(name, sizeof(name), "%s/save/%s/*.sv2", FS_Gamedir(), savename);
-	s = Sys_FindFirst(name, 0, 0);
+	fclose(f);
 
-	while (s)
+	return Sys_ReplaceFile(tmp, dst);
+}
+
+/*
+ * Runs in the save thread: No
+ * Com_Printf(), no zone memory.
+ */
+static qboolean
+SV_RunSaveOp(saveop_t *op)
+{
+	char tmp[MAX_OSPATH];
+	byte buffer[65536];
+	FILE *f1, *f2;
+	size_t l;
+
+	Com_sprintf(tmp, sizeof(tmp), "%s.tmp", op->dst);
+
+	switch (op->type)
 	{
-		remove(s);
-		s = Sys_FindNext(0, 0);
+		case SAVE_WRITE:
+			f2 = fopen(tmp, "wb");
+
+			if (!f2)
+			{
+				return false;
+			}
+
+			fwrite(op->data, 1, op->size, f2);
+
+			return SV_ReplaceFile(f2, tmp, op->dst);
+
+		case SAVE_COMMIT:
+			f2 = fopen(tmp, "rb+");
+
+			if (!f2)
+			{
+				return false;
+			}
+
+			return SV_ReplaceFile(f2, tmp, op->dst);
+
+		case SAVE_COPY:
+			f1 = fopen(op->src, "rb");
+
+			if (!f1)
+			{
+				/* nothing to copy */
+				return true;
+			}
+
+			f2 = fopen(tmp, "wb");
+
+			if (!f2)
+			{
+				fclose(f1);
+				return false;
+			}
+
+			while ((l = fread(buffer, 1, sizeof(buffer), f1)) > 0)
+			{
+				fwrite(buffer, 1, l, f2);
+			}
+
+			fclose(f1);
+
+			return SV_ReplaceFile(f2, tmp, op->dst);
+
+		case SAVE_REMOVE:
+			remove(op->dst);
+			return true;
 	}
 
-	Sys_FindClose();
+	return true;
 }
 
-void
-CopyFile(char *src, char *dst)
+static void
+SV_RunSaveOps(void)
 {
-	FILE *f1, *f2;
-	size_t l;
-	byte buffer[65536];
+	long long start;
+	saveop_t *op;
+
+	start = Sys_Nanoseconds();
+	save_failed[0] = '\0';
+
+	for (op = save_running; op; op = op->next)
+	{
+		if (!SV_RunSaveOp(op) && !save_failed[0])
+		{
+			Q_strlcpy(save_failed, op->dst, sizeof(save_failed));
+		}
+	}
 
-	Com_DPrintf("CopyFile (%s, %s)\n", src, dst);
+	save_nanoseconds = Sys_Nanoseconds() - start;
+}
+
+static void
+SV_SaveThread(void *arg)
+{
+	SV_RunSaveOps();
 
-	f1 = fopen(src, "rb");
+	Sys_LockMutex(save_mutex);
+	save_done = true;
+	Sys_UnlockMutex(save_mutex);
+}
 
-	if (!f1)
+static void
+SV_FinishSaves(void)
+{
+	saveop_t *op, *next;
+
+	if (save_failed[0])
+	{
+		Com_Printf("Couldn't write %s\n", save_failed);
+	}
+
+	Com_DPrintf("Savegame: %.1f ms in the background\n",
+			save_nanoseconds / 1000000.0);
+
+	for (op = save_running; op; op = next)
+	{
+		next = op->next;
+		free(op->data);
+		free(op);
+	}
+
+	save_running = NULL;
+}
+
+/*
+ * Waits for the running operations.
+ */
+static void
+SV_JoinSaves(void)
+{
+	if (!save_thread)
 	{
 		return;
 	}
 
-	f2 = fopen(dst, "wb");
+	Sys_WaitThread(save_thread);
+	save_thread = NULL;
+	save_done = false;
 
-	if (!f2)
+	SV_FinishSaves();
+}
+
+/*
+ * Hands the pending operations to
+ * the save thread.
+ */
+void
+SV_StartSaves(void)
+{
+	if (!save_pending)
 	{
-		fclose(f1);
 		return;
 	}
 
-	while (1)
+	SV_JoinSaves();
+
+	Com_DPrintf("Savegame: %.1f ms in the frame\n", save_stall / 1000000.0);
+	save_stall = 0;
+
+	save_running = save_pending;
+	save_pending = NULL;
+	save_pendingtail = &save_pending;
+
+	if (!save_mutex)
+	{
+		save_mutex = Sys_CreateMutex();
+	}
+
+	if (save_mutex)
+	{
+		save_thread = Sys_CreateThread(SV_SaveThread, NULL);
+	}
+
+	if (!save_thread)
+	{
+		SV_RunSaveOps();
+		SV_FinishSaves();
+	}
+}
+
+/*
+ * Writes out everything.
+ */
+void
+SV_WaitSaves(void)
+{
+	SV_StartSaves();
+	SV_JoinSaves();
+}
+
+/*
+ * Writes out everything if the file
+ * at path isn't on the disk yet.
+ */
+void
+SV_WaitSave(char *path)
+{
+	saveop_t *op;
+
+	for (op = save_pending; op; op = op->next)
 	{
-		l = fread(buffer, 1, sizeof(buffer), f1);
+		if (!strcmp(op->dst, path))
+		{
+			SV_WaitSaves();
+			return;
+		}
+	}
 
-		if (!l)
+	for (op = save_running; op; op = op->next)
+	{
+		if (!strcmp(op->dst, path))
 		{
-			break;
+			SV_JoinSaves();
+			return;
+		}
+	}
+}
+
+/*
+ * Called each server frame, reports
+ * finished savegames.
+ */
+void
+SV_CheckSaves(void)
+{
+	qboolean done;
+
+	if (!save_thread)
+	{
+		return;
+	}
+
+	Sys_LockMutex(save_mutex);
+	done = save_done;
+	Sys_UnlockMutex(save_mutex);
+
+	if (done)
+	{
+		SV_JoinSaves();
+	}
+}
+
+static saveop_t *
+SV_QueueSave(saveoptype_t type, char *dst)
+{
+	saveop_t *op;
+
+	/* the running operations may touch the same files */
+	SV_JoinSaves();
+
+	op = malloc(sizeof(*op));
+
+	if (!op)
+	{
+		Com_Error(ERR_FATAL, "SV_QueueSave: couldn't allocate");
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	Q_strlcpy(op->dst, dst, sizeof(op->dst));
+
+	*save_pendingtail = op;
+	save_pendingtail = &op->next;
+
+	return op;
+}
+
+static void
+SV_RemoveSaveFiles(char *savename, qboolean queue)
+{
+	char name[MAX_OSPATH];
+	char *patterns[] = {"server.ssv", "game.ssv", "*.sav", "*.sv2"};
+	char *s;
+	int i;
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+	{
+		Com_sprintf(name, sizeof(name), "%s/save/%s/%s",
+				FS_Gamedir(), savename, patterns[i]);
+
+		if (!strchr(name, '*'))
+		{
+			if (queue)
+			{
+				SV_QueueSave(SAVE_REMOVE, name);
+			}
+			else
+			{
+				remove(name);
+			}
+
+			continue;
 		}
 
-		fwrite(buffer, 1, l, f2);
+		s = Sys_FindFirst(name, 0, 0);
+
+		while (s)
+		{
+			if (queue)
+			{
+				SV_QueueSave(SAVE_REMOVE, s);
+			}
+			else
+			{
+				remove(s);
+			}
+
+			s = Sys_FindNext(0, 0);
+		}
+
+		Sys_FindClose();
 	}
+}
 
-	fclose(f1);
-	fclose(f2);
+/*
+ * Delete save/<XXX>/
+ */
+void
+SV_WipeSavegame(char *savename)
+{
+	Com_DPrintf("SV_WipeSaveGame(%s)\n", savename);
+
+	SV_WaitSaves();
+	SV_RemoveSaveFiles(savename, false);
+}
+
+static void
+SV_QueueCopy(char *src, char *dst)
+{
+	saveop_t *op;
+
+	for (op = save_pending; op; op = op->next)
+	{
+		if ((op->type == SAVE_COPY) && !strcmp(op->src, src) &&
+			!strcmp(op->dst, dst))
+		{
+			return;
+		}
+	}
+
+	op = SV_QueueSave(SAVE_COPY, dst);
+	Q_strlcpy(op->src, src, sizeof(op->src));
+}
+
+/*
+ * Queues the copy of a level, the
+ * .sav and the .sv2 file.
+ */
+static void
+SV_QueueCopyLevel(char *src, char *dst, char *file)
+{
+	char name[MAX_OSPATH], name2[MAX_OSPATH];
+	size_t l;
+
+	Com_sprintf(name, sizeof(name), "%s/save/%s/%s", FS_Gamedir(), src, file);
+	Com_sprintf(name2, sizeof(name2), "%s/save/%s/%s", FS_Gamedir(), dst, file);
+	SV_QueueCopy(name, name2);
+
+	/* change sav to sv2 */
+	l = strlen(name);
+	strcpy(name + l - 3, "sv2");
+	l = strlen(name2);
+	strcpy(name2 + l - 3, "sv2");
+	SV_QueueCopy(name, name2);
 }
 
 void
 SV_CopySaveGame(char *src, char *dst)
 {
 	char name[MAX_OSPATH], name2[MAX_OSPATH];
+	long long start;
+	saveop_t *op;
 	size_t l, len;
 	char *found;
 
 	Com_DPrintf("SV_CopySaveGame(%s, %s)\n", src, dst);
 
-	SV_WipeSavegame(dst);
+	start = Sys_Nanoseconds();
+
+	/* the listings below must see the running operations */
+	SV_JoinSaves();
+
+	SV_RemoveSaveFiles(dst, true);
 
 	/* copy the savegame over */
 	Com_sprintf(name, sizeof(name), "%s/save/%s/server.ssv", FS_Gamedir(), src);
 	Com_sprintf(name2, sizeof(name2), "%s/save/%s/server.ssv", FS_Gamedir(), dst);
 	FS_CreatePath(name2);
-	CopyFile(name, name2);
+	SV_QueueCopy(name, name2);
 
 	Com_sprintf(name, sizeof(name), "%s/save/%s/game.ssv", FS_Gamedir(), src);
 	Com_sprintf(name2, sizeof(name2), "%s/save/%s/game.ssv", FS_Gamedir(), dst);
-	CopyFile(name, name2);
+	SV_QueueCopy(name, name2);
 
+	/* the levels that are still queued... */
 	Com_sprintf(name, sizeof(name), "%s/save/%s/", FS_Gamedir(), src);
 	len = strlen(name);
+
+	for (op = save_pending; op; op = op->next)
+	{
+		l = strlen(op->dst);
+
+		if ((op->type == SAVE_WRITE || op->type == SAVE_COMMIT) &&
+			!strncmp(op->dst, name, len) && (l > len + 4) &&
+			!strcmp(op->dst + l - 4, ".sav") && !strchr(op->dst + len, '/'))
+		{
+			SV_QueueCopyLevel(src, dst, op->dst + len);
+		}
+	}
+
+	/* ...and the ones on the disk */
 	Com_sprintf(name, sizeof(name), "%s/save/%s/*.sav", FS_Gamedir(), src);
 	found = Sys_FindFirst(name, 0, 0);
 
 	while (found)
 	{
-		strcpy(name + len, found + len);
+		SV_QueueCopyLevel(src, dst, found + len);
+		found = Sys_FindNext(0, 0);
+	}
 
-		Com_sprintf(name2, sizeof(name2), "%s/save/%s/%s",
-					FS_Gamedir(), dst, found + len);
-		CopyFile(name, name2);
+	Sys_FindClose();
 
-		/* change sav to sv2 */
-		l = strlen(name);
-		strcpy(name + l - 3, "sv2");
-		l = strlen(name2);
-		strcpy(name2 + l - 3, "sv2");
-		CopyFile(name, name2);
+	save_stall += Sys_Nanoseconds() - start;
+}
 
-		found = Sys_FindNext(0, 0);
+/*
+ * gi.save_file(), the game put a file together in
+ * memory instead of writing it to filename. If
+ * it's the <name>.tmp of a pending SAVE_COMMIT the
+ * data is written to <name> by the save thread.
+ */
+void
+SV_SaveGameFile(char *filename, void *data, int size)
+{
+	char tmp[MAX_OSPATH];
+	long long start;
+	saveop_t *op;
+
+	start = Sys_Nanoseconds();
+
+	for (op = save_pending; op; op = op->next)
+	{
+		Com_sprintf(tmp, sizeof(tmp), "%s.tmp", op->dst);
+
+		if ((op->type == SAVE_COMMIT) && !strcmp(tmp, filename))
+		{
+			break;
+		}
 	}
 
-	Sys_FindClose();
+	if (!op)
+	{
+		op = SV_QueueSave(SAVE_WRITE, filename);
+	}
+
+	op->type = SAVE_WRITE;
+	op->data = malloc(size);
+	op->size = size;
+
+	if (!op->data)
+	{
+		Com_Error(ERR_FATAL, "SV_SaveGameFile: couldn't allocate");
+	}
+
+	/* the game frees its copy */
+	memcpy(op->data, data, size);
+
+	save_stall += Sys_Nanoseconds() - start;
 }
 
 void
 SV_WriteLevelFile(void)
 {
 	char name[MAX_OSPATH];
-	FILE *f;
+	long long start;
+	sizebuf_t buf;
+	saveop_t *op;
+	int size;
 
 	Com_DPrintf("SV_WriteLevelFile()\n");
 
-	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sv2",
-				FS_Gamedir(), sv.name);
-	f = fopen(name, "wb");
+	start = Sys_Nanoseconds();
 
-	if (!f)
+	size = sizeof(sv.configstrings) + MAX_MAP_AREAPORTALS * sizeof(qboolean);
+	SZ_Init(&buf, malloc(size), size);
+
+	if (!buf.data)
 	{
-		Com_Printf("Failed to open %s\n", name);
-		return;
+		Com_Error(ERR_FATAL, "SV_WriteLevelFile: couldn't allocate");
 	}
 
-	fwrite(sv.configstrings, sizeof(sv.configstrings), 1, f);
-	CM_WritePortalState(f);
-	fclose(f);
+	SZ_Write(&buf, sv.configstrings, sizeof(sv.configstrings));
+	CM_WritePortalState(&buf);
+
+	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sv2",
+				FS_Gamedir(), sv.name);
+	op = SV_QueueSave(SAVE_WRITE, name);
+	op->data = buf.data;
+	op->size = buf.cursize;
 
 	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sav",
 				FS_Gamedir(), sv.name);
-	ge->WriteLevel(name);
+	SV_QueueSave(SAVE_COMMIT, name);
+	ge->WriteLevel(va("%s.tmp", name));
+
+	save_stall += Sys_Nanoseconds() - start;
 }
 
 void
@@ -193,6 +614,13 @@ SV_ReadLevelFile(void)
 
 	Com_DPrintf("SV_ReadLevelFile()\n");
 
+	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sv2",
+				FS_Gamedir(), sv.name);
+	SV_WaitSave(name);
+	Com_sprintf(name, sizeof(name), "%s/save/current/%s.sav",
+				FS_Gamedir(), sv.name);
+	SV_WaitSave(name);
+
 	Com_sprintf(name, sizeof(name), "save/current/%s.sv2", sv.name);
 	FS_FOpenFile(name, &f, true);
 
@@ -214,22 +642,35 @@ SV_ReadLevelFile(void)
 void
 SV_WriteServerFile(qboolean autosave)
 {
-	FILE *f;
 	cvar_t *var;
 	char name[MAX_OSPATH], string[128];
 	char comment[32];
 	time_t aclock;
 	struct tm *newtime;
+	long long start;
+	sizebuf_t buf;
+	saveop_t *op;
+	int size;
 
 	Com_DPrintf("SV_WriteServerFile(%s)\n", autosave ? "true" : "false");
 
-	Com_sprintf(name, sizeof(name), "%s/save/current/server.ssv", FS_Gamedir());
-	f = fopen(name, "wb");
+	start = Sys_Nanoseconds();
 
-	if (!f)
+	size = sizeof(comment) + sizeof(svs.mapcmd);
+
+	for (var = cvar_vars; var; var = var->next)
 	{
-		Com_Printf("Couldn't write %s\n", name);
-		return;
+		if (var->flags & CVAR_LATCH)
+		{
+			size += LATCH_CVAR_SAVELENGTH + sizeof(string);
+		}
+	}
+
+	SZ_Init(&buf, malloc(size), size);
+
+	if (!buf.data)
+	{
+		Com_Error(ERR_FATAL, "SV_WriteServerFile: couldn't allocate");
 	}
 
 	/* write the comment field */
@@ -252,10 +693,10 @@ SV_WriteServerFile(qboolean autosave)
 				sv.configstrings[CS_NAME]);
 	}
 
-	fwrite(comment, 1, sizeof(comment), f);
+	SZ_Write(&buf, comment, sizeof(comment));
 
 	/* write the mapcmd */
-	fwrite(svs.mapcmd, 1, sizeof(svs.mapcmd), f);
+	SZ_Write(&buf, svs.mapcmd, sizeof(svs.mapcmd));
 
 	/* write all CVAR_LATCH cvars
 	   these will be things like coop,
@@ -278,15 +719,21 @@ SV_WriteServerFile(qboolean autosave)
 		memset(string, 0, sizeof(string));
 		strcpy(cvarname, var->name);
 		strcpy(string, var->string);
-		fwrite(cvarname, 1, sizeof(cvarname), f);
-		fwrite(string, 1, sizeof(string), f);
+		SZ_Write(&buf, cvarname, sizeof(cvarname));
+		SZ_Write(&buf, string, sizeof(string));
 	}
 
-	fclose(f);
+	Com_sprintf(name, sizeof(name), "%s/save/current/server.ssv", FS_Gamedir());
+	op = SV_QueueSave(SAVE_WRITE, name);
+	op->data = buf.data;
+	op->size = buf.cursize;
 
 	/* write game state */
 	Com_sprintf(name, sizeof(name), "%s/save/current/game.ssv", FS_Gamedir());
-	ge->WriteGame(name, autosave);
+	SV_QueueSave(SAVE_COMMIT, name);
+	ge->WriteGame(va("%s.tmp", name), autosave);
+
+	save_stall += Sys_Nanoseconds() - start;
 }
 
 void
@@ -299,6 +746,8 @@ SV_ReadServerFile(void)
 
 	Com_DPrintf("SV_ReadServerFile()\n");
 
+	SV_WaitSaves();
+
 	Com_sprintf(name, sizeof(name), "save/current/server.ssv");
 	FS_FOpenFile(name, &f, true);
 
@@ -364,6 +813,9 @@ SV_Loadgame_f(void)
 		Com_Printf("Bad savedir.\n");
 	}
 
+	/* a savegame to this slot may still be written */
+	SV_WaitSaves();
+
 	/* make sure the server.ssv file exists */
 	Com_sprintf(name, sizeof(name), "%s/save/%s/server.ssv",
 				FS_Gamedir(), Cmd_Argv(1));
@@ -442,6 +894,9 @@ SV_Savegame_f(void)
 	/* copy it off */
 	SV_CopySaveGame("current", dir);
 
+	/* the files are flushed in the background */
+	SV_StartSaves();
+
 	Com_Printf("Done.\n");
 }
 
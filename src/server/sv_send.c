@@ -150,7 +150,7 @@ void
 SV_Multicast(vec3_t origin, multicast_t to)
 {
 	client_t *client;
-	byte *mask;
+	const byte *mask;
 	int leafnum = 0, cluster;
 	int j;
 	qboolean reliable;
@@ -415,20 +415,217 @@ SV_StartSound(vec3_t origin, edict_t *entity, int channel, int soundindex,
 	}
 }
 
+/*
+ * Adaptive rate control. Instead of trusting the rate the
+ * client claims, the bandwidth is estimated from the acknowledges
+ * seen by the netchan. Once per round trip the estimation is
+ * lowered by a quarter if packets were lost, nothing was
+ * acknowledged or the round trip time grew well over its
+ * minimum (queues are filling up), and
+ * raised by SV_CC_STEP if the rate was exhausted and the link
+ * looks fine. Packets are paced with a token bucket, refilled
+ * every server frame.
+ */
+#define SV_CC_MINRATE 2000
+#define SV_CC_STEP 1000
+#define SV_CC_MINENTITIES 8
+
+/*
+ * Returns the msec between two frames sent to the client
+ */
+static int
+SV_FrameMsec(client_t *c)
+{
+	return sv.frametime * c->framediv;
+}
+
+static void
+SV_RateControl(client_t *c)
+{
+	netchan_t *chan;
+	int maxrate;
+	int epoch;
+	int burst;
+
+	chan = &c->netchan;
+
+	maxrate = (int)sv_maxrate->value;
+
+	if (maxrate < SV_CC_MINRATE)
+	{
+		maxrate = SV_CC_MINRATE;
+	}
+
+	/* start with what the client asked for */
+	if (!c->cc_rate)
+	{
+		c->cc_rate = c->rate;
+		c->cc_time = curtime;
+		c->cc_lost = chan->lost;
+		c->cc_acked = chan->acked;
+	}
+
+	epoch = chan->rtt > 100 ? chan->rtt : 100;
+
+	if (curtime - c->cc_time >= epoch)
+	{
+		/* no acknowledge at all is the worst case of loss */
+		if ((chan->lost != c->cc_lost) || (chan->acked == c->cc_acked) ||
+			((chan->rtt_min >= 0) && (chan->rtt > chan->rtt_min * 2 + 50)))
+		{
+			c->cc_rate -= c->cc_rate / 4;
+		}
+		else if (c->cc_limited)
+		{
+			c->cc_rate += SV_CC_STEP;
+		}
+
+		c->cc_time = curtime;
+		c->cc_lost = chan->lost;
+		c->cc_acked = chan->acked;
+		c->cc_limited = false;
+	}
+
+	if (c->cc_rate < SV_CC_MINRATE)
+	{
+		c->cc_rate = SV_CC_MINRATE;
+	}
+	else if (c->cc_rate > maxrate)
+	{
+		c->cc_rate = maxrate;
+	}
+
+	/* allow a small burst, but always a full packet */
+	burst = c->cc_rate / 4;
+
+	if (burst < MAX_MSGLEN)
+	{
+		burst = MAX_MSGLEN;
+	}
+
+	c->cc_tokens += c->cc_rate * SV_FrameMsec(c) / 1000;
+
+	if (c->cc_tokens > burst)
+	{
+		c->cc_tokens = burst;
+	}
+}
+
+/*
+ * Charges a sent frame to the token bucket and adjusts
+ * the number of entities per frame to the frame budget.
+ * SV_BuildClientFrame() drops the most distant entities
+ * if there are more.
+ */
+static void
+SV_RateControlSent(client_t *c)
+{
+	client_frame_t *frame;
+	int size;
+	int budget;
+
+	/* not under rate control, e.g. over the loopback */
+	if (!c->cc_rate)
+	{
+		return;
+	}
+
+	size = c->netchan.sent_size[(c->netchan.outgoing_sequence - 1) &
+		NETCHAN_HISTORY_MASK];
+	budget = c->cc_rate * SV_FrameMsec(c) / 1000;
+
+	c->cc_tokens -= size;
+
+	frame = SV_FRAME(c, SV_CLIENTFRAME(c));
+
+	if (size > budget)
+	{
+		c->cc_limited = true;
+
+		if (frame->num_entities > SV_CC_MINENTITIES)
+		{
+			c->cc_maxentities = frame->num_entities * budget / size;
+
+			if (c->cc_maxentities < SV_CC_MINENTITIES)
+			{
+				c->cc_maxentities = SV_CC_MINENTITIES;
+			}
+		}
+	}
+	else if (c->cc_maxentities)
+	{
+		/* entities are still held back */
+		c->cc_limited = true;
+
+		if (size < budget * 3 / 4)
+		{
+			c->cc_maxentities += c->cc_maxentities / 8 + 1;
+
+			if (c->cc_maxentities >= MAX_EDICTS)
+			{
+				c->cc_maxentities = 0;
+			}
+		}
+	}
+}
+
+/*
+ * The most a single message to the client may carry.
+ * With NETCAP_FRAGMENT that's half a second at its
+ * rate, a thin link would lose a fragment of every
+ * larger message and the connect would never finish.
+ */
+int
+SV_MessageSize(client_t *c)
+{
+	int size;
+
+	if (!(c->netchan.capabilities & NETCAP_FRAGMENT))
+	{
+		return MAX_MSGLEN;
+	}
+
+	/* the loopback takes everything */
+	if (c->netchan.remote_address.type == NA_LOOPBACK)
+	{
+		return MAX_FRAGMSGLEN;
+	}
+
+	size = c->rate / 2;
+
+	if (size < MAX_MSGLEN)
+	{
+		size = MAX_MSGLEN;
+	}
+	else if (size > MAX_FRAGMSGLEN)
+	{
+		size = MAX_FRAGMSGLEN;
+	}
+
+	return size;
+}
+
 qboolean
 SV_SendClientDatagram(client_t *client)
 {
-	byte msg_buf[MAX_MSGLEN];
+	byte msg_buf[MAX_FRAGMSGLEN];
 	sizebuf_t msg;
+	long long prof;
 
+	prof = SV_ProfBegin();
 	SV_BuildClientFrame(client);
+	SV_ProfEnd(PROF_BUILDFRAME, client - svs.clients, prof);
+
+	/* larger frames are split up by the netchan */
+	SZ_Init(&msg, msg_buf, SV_MessageSize(client));
 
-	SZ_Init(&msg, msg_buf, sizeof(msg_buf));
 	msg.allowoverflow = true;
 
 	/* send over all the relevant entity_state_t
 	   and the player_state_t */
+	prof = SV_ProfBegin();
 	SV_WriteFrameToClient(client, &msg);
+	SV_ProfEnd(PROF_WRITEFRAME, client - svs.clients, prof);
 
 	/* copy the accumulated multicast datagram
 	   for this client out to the message
@@ -456,7 +653,12 @@ SV_SendClientDatagram(client_t *client)
 	Netchan_Transmit(&client->netchan, msg.cursize, msg.data);
 
 	/* record the size for rate estimation */
-	client->message_size[sv.framenum % RATE_MESSAGES] = msg.cursize;
+	client->message_size[SV_CLIENTFRAME(client) % RATE_MESSAGES] = msg.cursize;
+
+	if (sv_ratecontrol->value)
+	{
+		SV_RateControlSent(client);
+	}
 
 	return true;
 }
@@ -489,6 +691,21 @@ SV_RateDrop(client_t *c)
 		return false;
 	}
 
+	if (sv_ratecontrol->value)
+	{
+		SV_RateControl(c);
+
+		if (c->cc_tokens < 0)
+		{
+			c->cc_limited = true;
+			c->surpressCount++;
+			c->message_size[SV_CLIENTFRAME(c) % RATE_MESSAGES] = 0;
+			return true;
+		}
+
+		return false;
+	}
+
 	total = 0;
 
 	for (i = 0; i < RATE_MESSAGES; i++)
@@ -496,10 +713,12 @@ SV_RateDrop(client_t *c)
 		total += c->message_size[i];
 	}
 
-	if (total > c->rate)
+	/* rate is per second, the window
+	   is RATE_MESSAGES frames long */
+	if (total > c->rate * RATE_MESSAGES / 10 * SV_FrameMsec(c) / 100)
 	{
 		c->surpressCount++;
-		c->message_size[sv.framenum % RATE_MESSAGES] = 0;
+		c->message_size[SV_CLIENTFRAME(c) % RATE_MESSAGES] = 0;
 		return true;
 	}
 
@@ -512,7 +731,7 @@ SV_SendClientMessages(void)
 	int i;
 	client_t *c;
 	int msglen;
-	byte msgbuf[MAX_MSGLEN];
+	byte msgbuf[MAX_FRAGMSGLEN];
 	size_t r;
 
 	msglen = 0;
@@ -543,10 +762,12 @@ SV_SendClientMessages(void)
 				return;
 			}
 
-			if (msglen > MAX_MSGLEN)
+			/* demos recorded with NETCAP_FRAGMENT
+			   may contain larger messages */
+			if (msglen > MAX_FRAGMSGLEN)
 			{
 				Com_Error(ERR_DROP,
-						"SV_SendClientMessages: msglen > MAX_MSGLEN");
+						"SV_SendClientMessages: msglen > MAX_FRAGMSGLEN");
 			}
 
 			r = FS_FRead(msgbuf, msglen, 1, sv.demofile);
@@ -586,6 +807,12 @@ SV_SendClientMessages(void)
 		}
 		else if (c->state == cs_spawned)
 		{
+			/* not a frame for this client */
+			if (sv.framenum % c->framediv)
+			{
+				continue;
+			}
+
 			/* don't overrun bandwidth */
 			if (SV_RateDrop(c))
 			{
@@ -30,6 +30,61 @@
 
 edict_t *sv_player;
 
+/*
+ * Demos recorded from a server with another sv_fps
+ * have the frame time right after the serverdata.
+ * They're played back at that rate.
+ */
+static void
+SV_DemoFrametime(void)
+{
+	static byte buf[MAX_FRAGMSGLEN];
+	sizebuf_t msg;
+	int len;
+	int frametime;
+
+	if (FS_FRead(&len, 4, 1, sv.demofile) != 4)
+	{
+		return;
+	}
+
+	len = LittleLong(len);
+
+	if ((len <= 0) || (len > MAX_FRAGMSGLEN) ||
+		(FS_FRead(buf, len, 1, sv.demofile) != len))
+	{
+		return;
+	}
+
+	SZ_Init(&msg, buf, sizeof(buf));
+	msg.cursize = len;
+
+	if (MSG_ReadByte(&msg) != svc_serverdata)
+	{
+		return;
+	}
+
+	MSG_ReadLong(&msg); /* protocol */
+	MSG_ReadLong(&msg); /* servercount */
+	MSG_ReadByte(&msg); /* attractloop */
+	MSG_ReadString(&msg); /* gamedir */
+	MSG_ReadShort(&msg); /* playernum */
+	MSG_ReadString(&msg); /* levelname */
+
+	if (MSG_ReadByte(&msg) != svc_frametime)
+	{
+		return;
+	}
+
+	frametime = MSG_ReadByte(&msg);
+
+	if ((frametime > 0) && !(100 % frametime))
+	{
+		sv.frametime = frametime;
+		sv.time = sv.framenum * sv.frametime;
+	}
+}
+
 void
 SV_BeginDemoserver(void)
 {
@@ -42,6 +97,17 @@ SV_BeginDemoserver(void)
 	{
 		Com_Error(ERR_DROP, "Couldn't open %s\n", name);
 	}
+
+	SV_DemoFrametime();
+
+	/* start over, the first message wasn't sent yet */
+	FS_FCloseFile(sv.demofile);
+	FS_FOpenFile(name, &sv.demofile, false);
+
+	if (!sv.demofile)
+	{
+		Com_Error(ERR_DROP, "Couldn't open %s\n", name);
+	}
 }
 
 /*
@@ -76,7 +142,15 @@ SV_New_f(void)
 
 	/* send the serverdata */
 	MSG_WriteByte(&sv_client->netchan.message, svc_serverdata);
-	MSG_WriteLong(&sv_client->netchan.message, PROTOCOL_VERSION);
+	if (sv_client->netchan.capabilities & NETCAP_PACKEDENTS)
+	{
+		MSG_WriteLong(&sv_client->netchan.message, PROTOCOL_PACKEDENTS);
+	}
+	else
+	{
+		MSG_WriteLong(&sv_client->netchan.message, PROTOCOL_VERSION);
+	}
+
 	MSG_WriteLong(&sv_client->netchan.message, svs.spawncount);
 	MSG_WriteByte(&sv_client->netchan.message, sv.attractloop);
 	MSG_WriteString(&sv_client->netchan.message, gamedir);
@@ -95,6 +169,23 @@ SV_New_f(void)
 	/* send full levelname */
 	MSG_WriteString(&sv_client->netchan.message, sv.configstrings[CS_NAME]);
 
+	/* clients not knowing about other frame
+	   times get every 100 msec frame only */
+	if (sv_client->netchan.capabilities & NETCAP_TICKRATE)
+	{
+		sv_client->framediv = 1;
+
+		if (sv.frametime != 100)
+		{
+			MSG_WriteByte(&sv_client->netchan.message, svc_frametime);
+			MSG_WriteByte(&sv_client->netchan.message, sv.frametime);
+		}
+	}
+	else
+	{
+		sv_client->framediv = sv.framediv;
+	}
+
 	/* game server */
 	if (sv.state == ss_game)
 	{
@@ -135,7 +226,8 @@ SV_Configstrings_f(void)
 	start = (int)strtol(Cmd_Argv(2), (char **)NULL, 10);
 
 	/* write a packet full of data */
-	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
+	while (sv_client->netchan.message.cursize <
+		   SV_MessageSize(sv_client) / 2 &&
 		   start < MAX_CONFIGSTRINGS)
 	{
 		if (sv.configstrings[start][0])
@@ -191,7 +283,8 @@ SV_Baselines_f(void)
 	memset(&nullstate, 0, sizeof(nullstate));
 
 	/* write a packet full of data */
-	while (sv_client->netchan.message.cursize < MAX_MSGLEN / 2 &&
+	while (sv_client->netchan.message.cursize <
+		   SV_MessageSize(sv_client) / 2 &&
 		   start < MAX_EDICTS)
 	{
 		base = &sv.baselines[start];
@@ -238,6 +331,7 @@ SV_Begin_f(void)
 	sv_client->state = cs_spawned;
 
 	/* call the game begin function */
+	SV_InputBegin(sv_client);
 	ge->ClientBegin(sv_player);
 
 	Cbuf_InsertFromDefer();
@@ -473,6 +567,7 @@ SV_ExecuteUserCommand(char *s)
 
 	if (!u->name && (sv.state == ss_game))
 	{
+		SV_InputCommand(sv_client, s);
 		ge->ClientCommand(sv_player);
 	}
 }
@@ -489,6 +584,7 @@ SV_ClientThink(client_t *cl, usercmd_t *cmd)
 		return;
 	}
 
+	SV_InputThink(cl, cmd);
 	ge->ClientThink(cl->edict, cmd);
 }
 
@@ -567,7 +663,7 @@ SV_ExecuteClientMessage(client_t *cl)
 					if (cl->lastframe > 0)
 					{
 						cl->frame_latency[cl->lastframe & (LATENCY_COUNTS - 1)] =
-							svs.realtime - cl->frames[cl->lastframe & UPDATE_MASK].senttime;
+							svs.realtime - SV_FRAME(cl, cl->lastframe)->senttime;
 					}
 				}
 
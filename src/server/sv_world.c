@@ -24,12 +24,20 @@
  * =======================================================================
  */
 
+#include <limits.h>
+
 #include "header/server.h"
 
-#define AREA_DEPTH 4
-#define AREA_NODES 32
+#define AREA_NODES 2048
+#define AREA_MINSIZE 128 /* nodes smaller than twice this aren't split */
+#define AREA_SPLITCOUNT 8 /* leafs with more edicts are split */
 #define MAX_TOTAL_ENT_LEAFS 128
 
+/* must be powers of two */
+#define TRACECACHE_SIZE 1024
+#define CONTENTSCACHE_SIZE 256
+#define TRACECACHE_DIRTY 64
+
 #define STRUCT_FROM_LINK(l, t, m) ((t *)((byte *)l - (byte *)&(((t *)NULL)->m)))
 #define EDICT_FROM_AREA(l) STRUCT_FROM_LINK(l, edict_t, area)
 
@@ -37,6 +45,8 @@ typedef struct areanode_s
 {
 	int axis; /* -1 = leaf node */
 	float dist;
+	float loose; /* the children overlap by this on each side of dist */
+	vec3_t mins, maxs;
 	struct areanode_s *children[2];
 	link_t trigger_edicts;
 	link_t solid_edicts;
@@ -45,6 +55,63 @@ typedef struct areanode_s
 areanode_t sv_areanodes[AREA_NODES];
 int sv_numareanodes;
 
+/* What an edict was last linked with. Most edicts
+   are relinked each frame without having moved. */
+typedef struct
+{
+	qboolean valid;
+	vec3_t origin, angles;
+	vec3_t mins, maxs;
+	vec3_t absmin, absmax;
+	int solid, s_solid;
+	int deadmonster;
+	areanode_t *node; /* NULL if not in an area list */
+} linkcache_t;
+
+static linkcache_t sv_linkcache[MAX_EDICTS];
+
+/* With sv_tracecache set, the results of SV_Trace() and
+   SV_PointContents() are kept until the next frame. The
+   game asks the same things over and over, monsters
+   checking for the player, the ground below them and so
+   on. Each time a solid edict is linked somewhere else or
+   unlinked its old and new boxes are logged, sv_tracegen
+   counts them. An entry stays valid while none of the
+   boxes logged after it touches the area it looked at.
+   Beyond TRACECACHE_DIRTY boxes it's thrown away.
+
+   Whatever the game changes without relinking, like the
+   owner, isn't noticed before the next frame. That's why
+   it's off by default. */
+typedef struct
+{
+	int gen;
+	vec3_t start, end;
+	vec3_t mins, maxs;
+	vec3_t boxmins, boxmaxs;
+	edict_t *passedict;
+	int contentmask;
+	trace_t trace;
+} tracecache_t;
+
+typedef struct
+{
+	int gen;
+	vec3_t p;
+	int contents;
+} contentscache_t;
+
+typedef struct
+{
+	vec3_t mins, maxs;
+} tracedirty_t;
+
+static tracecache_t sv_tracecache_entries[TRACECACHE_SIZE];
+static contentscache_t sv_contentscache_entries[CONTENTSCACHE_SIZE];
+static tracedirty_t sv_tracedirty[TRACECACHE_DIRTY];
+static int sv_tracegen = 1;
+static int sv_traceflush = 1; /* older entries are invalid */
+
 float *area_mins, *area_maxs;
 edict_t **area_list;
 int area_count, area_maxcount;
@@ -75,15 +142,10 @@ InsertLinkBefore(link_t *l, link_t *before)
 	l->next->prev = l;
 }
 
-/*
- * Builds a uniformly subdivided tree for the given world size
- */
-areanode_t *
-SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
+static areanode_t *
+SV_AllocAreaNode(vec3_t mins, vec3_t maxs)
 {
 	areanode_t *anode;
-	vec3_t size;
-	vec3_t mins1, maxs1, mins2, maxs2;
 
 	anode = &sv_areanodes[sv_numareanodes];
 	sv_numareanodes++;
@@ -91,36 +153,234 @@ SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
 	ClearLink(&anode->trigger_edicts);
 	ClearLink(&anode->solid_edicts);
 
-	if (depth == AREA_DEPTH)
+	anode->axis = -1;
+	anode->children[0] = anode->children[1] = NULL;
+	VectorCopy(mins, anode->mins);
+	VectorCopy(maxs, anode->maxs);
+
+	return anode;
+}
+
+/*
+ * Returns the deepest node below the given one, that
+ * the edict's box fits into. The children of a node are
+ * loose, they reach over the split plane by an eighth of
+ * the node's size. Edicts go down by their center and only
+ * stay in a node if they cross that margin, so players,
+ * items and projectiles end up in the leafs instead of
+ * piling up in the nodes they happen to cross.
+ */
+static areanode_t *
+SV_AreaNodeForEdict(areanode_t *node, edict_t *ent)
+{
+	while (node->axis != -1)
+	{
+		if (ent->absmin[node->axis] + ent->absmax[node->axis] > 2 * node->dist)
+		{
+			if (ent->absmin[node->axis] < node->dist - node->loose)
+			{
+				break; /* crosses the node */
+			}
+
+			node = node->children[0];
+		}
+		else
+		{
+			if (ent->absmax[node->axis] > node->dist + node->loose)
+			{
+				break; /* crosses the node */
+			}
+
+			node = node->children[1];
+		}
+	}
+
+	return node;
+}
+
+static void SV_SplitAreaNode(areanode_t *node);
+
+static void
+SV_LinkToAreaNode(areanode_t *node, edict_t *ent)
+{
+	link_t *list, *l;
+	int count;
+
+	if (ent->solid == SOLID_TRIGGER)
+	{
+		list = &node->trigger_edicts;
+	}
+	else
+	{
+		list = &node->solid_edicts;
+	}
+
+	InsertLinkBefore(&ent->area, list);
+	sv_linkcache[NUM_FOR_EDICT(ent)].node = node;
+
+	if (node->axis != -1)
 	{
-		anode->axis = -1;
-		anode->children[0] = anode->children[1] = NULL;
-		return anode;
+		return;
 	}
 
-	VectorSubtract(maxs, mins, size);
+	count = 0;
+
+	for (l = list->next; l != list; l = l->next)
+	{
+		if (++count > AREA_SPLITCOUNT)
+		{
+			SV_SplitAreaNode(node);
+			break;
+		}
+	}
+}
+
+/*
+ * Splits a leaf that got too crowded. The tree starts
+ * as a single node covering the world and only grows
+ * where the edicts are.
+ */
+static void
+SV_SplitAreaNode(areanode_t *node)
+{
+	link_t *start, *l, *next;
+	areanode_t *child;
+	edict_t *ent;
+	vec3_t size;
+	vec3_t mins1, maxs1, mins2, maxs2;
+	int axis, i;
+
+	VectorSubtract(node->maxs, node->mins, size);
 
 	if (size[0] > size[1])
 	{
-		anode->axis = 0;
+		axis = 0;
 	}
 	else
 	{
-		anode->axis = 1;
+		axis = 1;
+	}
+
+	if ((size[axis] < 2 * AREA_MINSIZE) ||
+		(sv_numareanodes + 2 > AREA_NODES))
+	{
+		return;
 	}
 
-	anode->dist = 0.5f * (maxs[anode->axis] + mins[anode->axis]);
-	VectorCopy(mins, mins1);
-	VectorCopy(mins, mins2);
-	VectorCopy(maxs, maxs1);
-	VectorCopy(maxs, maxs2);
+	node->axis = axis;
+	node->dist = 0.5f * (node->maxs[axis] + node->mins[axis]);
+	node->loose = size[axis] / 8;
 
-	maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
+	VectorCopy(node->mins, mins1);
+	VectorCopy(node->mins, mins2);
+	VectorCopy(node->maxs, maxs1);
+	VectorCopy(node->maxs, maxs2);
 
-	anode->children[0] = SV_CreateAreaNode(depth + 1, mins2, maxs2);
-	anode->children[1] = SV_CreateAreaNode(depth + 1, mins1, maxs1);
+	maxs1[axis] = mins2[axis] = node->dist;
 
-	return anode;
+	node->children[0] = SV_AllocAreaNode(mins2, maxs2);
+	node->children[1] = SV_AllocAreaNode(mins1, maxs1);
+
+	/* move down what fits into the children */
+	for (i = 0; i < 2; i++)
+	{
+		start = i ? &node->trigger_edicts : &node->solid_edicts;
+
+		for (l = start->next; l != start; l = next)
+		{
+			next = l->next;
+			ent = EDICT_FROM_AREA(l);
+			child = SV_AreaNodeForEdict(node, ent);
+
+			if (child != node)
+			{
+				RemoveLink(l);
+				SV_LinkToAreaNode(child, ent);
+			}
+		}
+	}
+}
+
+static void
+SV_NextTraceGen(void)
+{
+	if (sv_tracegen == INT_MAX)
+	{
+		memset(sv_tracecache_entries, 0, sizeof(sv_tracecache_entries));
+		memset(sv_contentscache_entries, 0, sizeof(sv_contentscache_entries));
+		sv_tracegen = 0;
+		sv_traceflush = 1;
+	}
+
+	sv_tracegen++;
+}
+
+void
+SV_ClearTraceCache(void)
+{
+	SV_NextTraceGen();
+	sv_traceflush = sv_tracegen;
+}
+
+/*
+ * Something solid appeared in or vanished from
+ * the box, traces touching it are recalculated.
+ */
+static void
+SV_TraceDirty(const vec3_t mins, const vec3_t maxs)
+{
+	tracedirty_t *dirty;
+
+	SV_NextTraceGen();
+
+	dirty = &sv_tracedirty[sv_tracegen & (TRACECACHE_DIRTY - 1)];
+	VectorCopy(mins, dirty->mins);
+	VectorCopy(maxs, dirty->maxs);
+}
+
+/*
+ * True if nothing changed in the box
+ * since the entry with gen was made.
+ */
+static qboolean
+SV_TraceCacheValid(int gen, const vec3_t mins, const vec3_t maxs)
+{
+	tracedirty_t *dirty;
+	int i;
+
+	if ((gen < sv_traceflush) || (sv_tracegen - gen > TRACECACHE_DIRTY))
+	{
+		return false;
+	}
+
+	for (i = gen + 1; i <= sv_tracegen; i++)
+	{
+		dirty = &sv_tracedirty[i & (TRACECACHE_DIRTY - 1)];
+
+		if ((dirty->mins[0] <= maxs[0]) && (dirty->maxs[0] >= mins[0]) &&
+			(dirty->mins[1] <= maxs[1]) && (dirty->maxs[1] >= mins[1]) &&
+			(dirty->mins[2] <= maxs[2]) && (dirty->maxs[2] >= mins[2]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static unsigned int
+SV_TraceHash(unsigned int hash, const vec3_t v)
+{
+	unsigned int bits;
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		memcpy(&bits, &v[i], sizeof(bits));
+		hash = (hash ^ bits) * 16777619;
+	}
+
+	return hash;
 }
 
 void
@@ -128,25 +388,82 @@ SV_ClearWorld(void)
 {
 	memset(sv_areanodes, 0, sizeof(sv_areanodes));
 	sv_numareanodes = 0;
-	SV_CreateAreaNode(0, sv.models[1]->mins, sv.models[1]->maxs);
+	SV_AllocAreaNode(sv.models[1]->mins, sv.models[1]->maxs);
+
+	memset(sv_linkcache, 0, sizeof(sv_linkcache));
+
+	/* the edicts are reused */
+	SV_ClearTraceCache();
 }
 
 void
 SV_UnlinkEdict(edict_t *ent)
 {
+	linkcache_t *cache;
+
+	cache = &sv_linkcache[NUM_FOR_EDICT(ent)];
+
 	if (!ent->area.prev)
 	{
+		cache->valid = false;
 		return; /* not linked in anywhere */
 	}
 
+	if (cache->valid)
+	{
+		SV_TraceDirty(cache->absmin, cache->absmax);
+	}
+	else
+	{
+		SV_ClearTraceCache();
+	}
+
+	cache->valid = false;
+
 	RemoveLink(&ent->area);
 	ent->area.prev = ent->area.next = NULL;
 }
 
+/*
+ * True if nothing that goes into linking the
+ * edict changed since it was linked the last
+ * time, so the result would be the same.
+ */
+static qboolean
+SV_LinkUnchanged(edict_t *ent, linkcache_t *cache)
+{
+	if (!cache->valid || !ent->linkcount)
+	{
+		return false;
+	}
+
+	/* still in the area list it was put into? */
+	if ((ent->solid != SOLID_NOT) && !ent->area.prev)
+	{
+		return false;
+	}
+
+	if ((ent->solid != cache->solid) ||
+		((ent->svflags & SVF_DEADMONSTER) != cache->deadmonster) ||
+		(ent->s.solid != cache->s_solid))
+	{
+		return false;
+	}
+
+	/* the game writes the abs box by itself sometimes */
+	return VectorCompare(ent->s.origin, cache->origin) &&
+		   VectorCompare(ent->s.angles, cache->angles) &&
+		   VectorCompare(ent->mins, cache->mins) &&
+		   VectorCompare(ent->maxs, cache->maxs) &&
+		   VectorCompare(ent->absmin, cache->absmin) &&
+		   VectorCompare(ent->absmax, cache->absmax);
+}
+
 void
 SV_LinkEdict(edict_t *ent)
 {
 	areanode_t *node;
+	linkcache_t *cache;
 	int leafs[MAX_TOTAL_ENT_LEAFS];
 	int clusters[MAX_TOTAL_ENT_LEAFS];
 	int num_leafs;
@@ -154,21 +471,43 @@ SV_LinkEdict(edict_t *ent)
 	int area;
 	int topnode;
 
-	if (ent->area.prev)
-	{
-		SV_UnlinkEdict(ent); /* unlink from old position */
-	}
+	sv_prof_links++;
 
 	if (ent == ge->edicts)
 	{
+		SV_UnlinkEdict(ent);
 		return; /* don't add the world */
 	}
 
 	if (!ent->inuse)
 	{
+		SV_UnlinkEdict(ent);
+		return;
+	}
+
+	cache = &sv_linkcache[NUM_FOR_EDICT(ent)];
+
+	if (SV_LinkUnchanged(ent, cache))
+	{
+		sv_prof_links_unchanged++;
+		ent->linkcount++;
 		return;
 	}
 
+	/* where it was before, triggers
+	   aren't seen by traces */
+	if (ent->area.prev)
+	{
+		if (cache->valid)
+		{
+			SV_TraceDirty(cache->absmin, cache->absmax);
+		}
+		else
+		{
+			SV_ClearTraceCache();
+		}
+	}
+
 	/* set the size */
 	VectorSubtract(ent->maxs, ent->mins, ent->size);
 
@@ -352,6 +691,13 @@ SV_LinkEdict(edict_t *ent)
 		}
 	}
 
+	/* the clusters below the headnode, so that
+	   SV_BuildClientFrame() needn't walk the tree */
+	if (ent->num_clusters == -1)
+	{
+		CM_HeadnodeClusters(ent->headnode);
+	}
+
 	/* if first time, make sure old_origin is valid */
 	if (!ent->linkcount)
 	{
@@ -362,42 +708,49 @@ SV_LinkEdict(edict_t *ent)
 
 	if (ent->solid == SOLID_NOT)
 	{
-		return;
+		node = NULL;
+	}
+	else
+	{
+		node = SV_AreaNodeForEdict(sv_areanodes, ent);
 	}
 
-	/* find the first node that the ent's box crosses */
-	node = sv_areanodes;
-
-	while (1)
+	/* an edict that stays in its node keeps its place in the
+	   list, everything else is moved over to the new node */
+	if (ent->area.prev && node && (node == cache->node) &&
+		((ent->solid == SOLID_TRIGGER) == (cache->solid == SOLID_TRIGGER)))
 	{
-		if (node->axis == -1)
+		sv_prof_links_inplace++;
+	}
+	else
+	{
+		if (ent->area.prev)
 		{
-			break;
+			RemoveLink(&ent->area);
+			ent->area.prev = ent->area.next = NULL;
 		}
 
-		if (ent->absmin[node->axis] > node->dist)
+		if (node)
 		{
-			node = node->children[0];
-		}
-		else if (ent->absmax[node->axis] < node->dist)
-		{
-			node = node->children[1];
-		}
-		else
-		{
-			break; /* crosses the node */
+			SV_LinkToAreaNode(node, ent);
 		}
 	}
 
-	/* link it in */
-	if (ent->solid == SOLID_TRIGGER)
-	{
-		InsertLinkBefore(&ent->area, &node->trigger_edicts);
-	}
-	else
+	if ((ent->solid == SOLID_BBOX) || (ent->solid == SOLID_BSP))
 	{
-		InsertLinkBefore(&ent->area, &node->solid_edicts);
+		SV_TraceDirty(ent->absmin, ent->absmax);
 	}
+
+	cache->valid = true;
+	VectorCopy(ent->s.origin, cache->origin);
+	VectorCopy(ent->s.angles, cache->angles);
+	VectorCopy(ent->mins, cache->mins);
+	VectorCopy(ent->maxs, cache->maxs);
+	VectorCopy(ent->absmin, cache->absmin);
+	VectorCopy(ent->absmax, cache->absmax);
+	cache->solid = ent->solid;
+	cache->s_solid = ent->s.solid;
+	cache->deadmonster = ent->svflags & SVF_DEADMONSTER;
 }
 
 void
@@ -451,13 +804,13 @@ SV_AreaEdicts_r(areanode_t *node)
 		return; /* terminal node */
 	}
 
-	/* recurse down both sides */
-	if (area_maxs[node->axis] > node->dist)
+	/* recurse down both sides, they overlap */
+	if (area_maxs[node->axis] >= node->dist - node->loose)
 	{
 		SV_AreaEdicts_r(node->children[0]);
 	}
 
-	if (area_mins[node->axis] < node->dist)
+	if (area_mins[node->axis] <= node->dist + node->loose)
 	{
 		SV_AreaEdicts_r(node->children[1]);
 	}
@@ -489,10 +842,27 @@ int
 SV_PointContents(vec3_t p)
 {
 	edict_t *touch[MAX_EDICTS], *hit;
+	contentscache_t *cache;
 	int i, num;
 	int contents, c2;
 	int headnode;
 
+	sv_prof_contents++;
+	cache = NULL;
+
+	if (sv_tracecache->value)
+	{
+		cache = &sv_contentscache_entries[SV_TraceHash(2166136261u, p) &
+			(CONTENTSCACHE_SIZE - 1)];
+
+		if (VectorCompare(cache->p, p) &&
+			SV_TraceCacheValid(cache->gen, p, p))
+		{
+			sv_prof_contentshits++;
+			return cache->contents;
+		}
+	}
+
 	/* get base contents from world */
 	contents = CM_PointContents(p, sv.models[1]->headnode);
 
@@ -511,6 +881,13 @@ SV_PointContents(vec3_t p)
 		contents |= c2;
 	}
 
+	if (cache)
+	{
+		cache->gen = sv_tracegen;
+		VectorCopy(p, cache->p);
+		cache->contents = contents;
+	}
+
 	return contents;
 }
 
@@ -554,18 +931,81 @@ SV_HullForEntity(edict_t *ent)
 	return CM_HeadnodeForBox(ent->mins, ent->maxs);
 }
 
-void
-SV_ClipMoveToEntities(moveclip_t *clip)
+/*
+ * The area query returns everything in the bounding box
+ * of the whole move, for long diagonal traces that's a lot.
+ * Returns false if the line swept by the moving box misses
+ * the edict's absolute box, so the exact clip can be skipped.
+ */
+static qboolean
+SV_MoveTouchesEdict(moveclip_t *clip, edict_t *touch)
 {
-	int i, num;
-	edict_t *touchlist[MAX_EDICTS], *touch;
+	float enter, leave, t1, t2, delta, mins, maxs;
+	int i;
+
+	enter = 0;
+	leave = 1;
+
+	for (i = 0; i < 3; i++)
+	{
+		/* the edict's box grown by the moving box */
+		mins = touch->absmin[i] - clip->maxs[i];
+		maxs = touch->absmax[i] - clip->mins[i];
+		delta = clip->end[i] - clip->start[i];
+
+		if (delta == 0)
+		{
+			if ((clip->start[i] < mins) || (clip->start[i] > maxs))
+			{
+				return false;
+			}
+
+			continue;
+		}
+
+		t1 = (mins - clip->start[i]) / delta;
+		t2 = (maxs - clip->start[i]) / delta;
+
+		if (t1 > t2)
+		{
+			delta = t1;
+			t1 = t2;
+			t2 = delta;
+		}
+
+		if (t1 > enter)
+		{
+			enter = t1;
+		}
+
+		if (t2 < leave)
+		{
+			leave = t2;
+		}
+
+		if (enter > leave)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Clips the move against the entities in touchlist. The
+ * list may be a superset of the entities in the move's
+ * bounds, SV_MoveTouchesEdict() sorts the others out.
+ */
+static void
+SV_ClipMoveToList(moveclip_t *clip, edict_t **touchlist, int num)
+{
+	int i;
+	edict_t *touch;
 	trace_t trace;
 	int headnode;
 	float *angles;
 
-	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, touchlist,
-			MAX_EDICTS, AREA_SOLID);
-
 	/* be careful, it is possible to have an entity in this
 	   list removed before we get to it (killtriggered) */
 	for (i = 0; i < num; i++)
@@ -606,6 +1046,11 @@ SV_ClipMoveToEntities(moveclip_t *clip)
 			continue;
 		}
 
+		if (!SV_MoveTouchesEdict(clip, touch))
+		{
+			continue;
+		}
+
 		/* might intersect, so do an exact clip */
 		headnode = SV_HullForEntity(touch);
 		angles = touch->s.angles;
@@ -650,6 +1095,18 @@ SV_ClipMoveToEntities(moveclip_t *clip)
 	}
 }
 
+void
+SV_ClipMoveToEntities(moveclip_t *clip)
+{
+	int num;
+	edict_t *touchlist[MAX_EDICTS];
+
+	num = SV_AreaEdicts(clip->boxmins, clip->boxmaxs, touchlist,
+			MAX_EDICTS, AREA_SOLID);
+
+	SV_ClipMoveToList(clip, touchlist, num);
+}
+
 void
 SV_TraceBounds(vec3_t start, vec3_t mins, vec3_t maxs,
 		vec3_t end, vec3_t boxmins, vec3_t boxmaxs)
@@ -671,26 +1128,12 @@ SV_TraceBounds(vec3_t start, vec3_t mins, vec3_t maxs,
 	}
 }
 
-/*
- * Moves the given mins/maxs volume through the world from start to end.
- * Passedict and edicts owned by passedict are explicitly not checked.
- */
-trace_t
-SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+static trace_t
+SV_ClipMove(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 		edict_t *passedict, int contentmask)
 {
 	moveclip_t clip;
 
-	if (!mins)
-	{
-		mins = vec3_origin;
-	}
-
-	if (!maxs)
-	{
-		maxs = vec3_origin;
-	}
-
 	memset(&clip, 0, sizeof(moveclip_t));
 
 	/* clip to world */
@@ -722,3 +1165,190 @@ SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 	return clip.trace;
 }
 
+/*
+ * Moves the given mins/maxs volume through the world from start to end.
+ * Passedict and edicts owned by passedict are explicitly not checked.
+ */
+trace_t
+SV_Trace(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
+		edict_t *passedict, int contentmask)
+{
+	tracecache_t *cache;
+	unsigned int hash;
+
+	sv_prof_traces++;
+
+	if (!mins)
+	{
+		mins = vec3_origin;
+	}
+
+	if (!maxs)
+	{
+		maxs = vec3_origin;
+	}
+
+	if (!sv_tracecache->value)
+	{
+		return SV_ClipMove(start, mins, maxs, end, passedict, contentmask);
+	}
+
+	hash = SV_TraceHash(2166136261u, start);
+	hash = SV_TraceHash(hash, end);
+	hash = SV_TraceHash(hash, mins);
+	hash = SV_TraceHash(hash, maxs);
+	hash = (hash ^ (unsigned int)contentmask) * 16777619;
+	hash = (hash ^ (unsigned int)(passedict ?
+				NUM_FOR_EDICT(passedict) + 1 : 0)) * 16777619;
+
+	cache = &sv_tracecache_entries[(hash ^ (hash >> 16)) &
+		(TRACECACHE_SIZE - 1)];
+
+	if ((cache->passedict == passedict) &&
+		(cache->contentmask == contentmask) &&
+		VectorCompare(cache->start, start) &&
+		VectorCompare(cache->end, end) &&
+		VectorCompare(cache->mins, mins) &&
+		VectorCompare(cache->maxs, maxs) &&
+		SV_TraceCacheValid(cache->gen, cache->boxmins, cache->boxmaxs))
+	{
+		sv_prof_tracehits++;
+		return cache->trace;
+	}
+
+	cache->trace = SV_ClipMove(start, mins, maxs, end, passedict, contentmask);
+	cache->gen = sv_tracegen;
+	cache->passedict = passedict;
+	cache->contentmask = contentmask;
+	VectorCopy(start, cache->start);
+	VectorCopy(end, cache->end);
+	VectorCopy(mins, cache->mins);
+	VectorCopy(maxs, cache->maxs);
+	SV_TraceBounds(start, mins, maxs, end, cache->boxmins, cache->boxmaxs);
+
+	return cache->trace;
+}
+
+/*
+ * Clips the rays rays[first] to rays[last - 1], whose
+ * bounds all overlap, against one shared entity list.
+ */
+static void
+SV_TraceBatchGroup(traceray_t *rays, int first, int last, vec3_t mins,
+		vec3_t maxs, edict_t *passedict, int contentmask, vec3_t boxmins,
+		vec3_t boxmaxs)
+{
+	int i, num;
+	edict_t *touchlist[MAX_EDICTS];
+	moveclip_t clip;
+
+	num = SV_AreaEdicts(boxmins, boxmaxs, touchlist, MAX_EDICTS, AREA_SOLID);
+
+	for (i = first; i < last; i++)
+	{
+		memset(&clip, 0, sizeof(moveclip_t));
+
+		/* clip to world */
+		clip.trace = CM_BoxTrace(rays[i].start, rays[i].end,
+				mins, maxs, 0, contentmask);
+		clip.trace.ent = ge->edicts;
+
+		if (clip.trace.fraction != 0)
+		{
+			clip.contentmask = contentmask;
+			clip.start = rays[i].start;
+			clip.end = rays[i].end;
+			clip.mins = mins;
+			clip.maxs = maxs;
+			clip.passedict = passedict;
+
+			VectorCopy(mins, clip.mins2);
+			VectorCopy(maxs, clip.maxs2);
+
+			SV_TraceBounds(clip.start, clip.mins2, clip.maxs2,
+					clip.end, clip.boxmins, clip.boxmaxs);
+
+			/* clip to other solid entities */
+			SV_ClipMoveToList(&clip, touchlist, num);
+		}
+
+		rays[i].trace = clip.trace;
+	}
+}
+
+/*
+ * Traces several rays with the same box, passedict and
+ * contentmask. The results are the same as with one
+ * SV_Trace() per ray, but rays with overlapping bounds
+ * share the area search for the entities they may hit.
+ */
+void
+SV_TraceBatch(traceray_t *rays, int numrays, vec3_t mins, vec3_t maxs,
+		edict_t *passedict, int contentmask)
+{
+	vec3_t boxmins, boxmaxs;
+	vec3_t raymins, raymaxs;
+	int i, j, first;
+
+	sv_prof_traces += numrays;
+
+	if (numrays <= 0)
+	{
+		return;
+	}
+
+	if (!mins)
+	{
+		mins = vec3_origin;
+	}
+
+	if (!maxs)
+	{
+		maxs = vec3_origin;
+	}
+
+	first = 0;
+	SV_TraceBounds(rays[0].start, mins, maxs, rays[0].end, boxmins, boxmaxs);
+
+	for (i = 1; i < numrays; i++)
+	{
+		SV_TraceBounds(rays[i].start, mins, maxs, rays[i].end,
+				raymins, raymaxs);
+
+		for (j = 0; j < 3; j++)
+		{
+			if ((raymins[j] > boxmaxs[j]) || (raymaxs[j] < boxmins[j]))
+			{
+				break;
+			}
+		}
+
+		if (j < 3)
+		{
+			/* disjoint, the union would only add clutter */
+			SV_TraceBatchGroup(rays, first, i, mins, maxs, passedict,
+					contentmask, boxmins, boxmaxs);
+
+			first = i;
+			VectorCopy(raymins, boxmins);
+			VectorCopy(raymaxs, boxmaxs);
+			continue;
+		}
+
+		for (j = 0; j < 3; j++)
+		{
+			if (raymins[j] < boxmins[j])
+			{
+				boxmins[j] = raymins[j];
+			}
+
+			if (raymaxs[j] > boxmaxs[j])
+			{
+				boxmaxs[j] = raymaxs[j];
+			}
+		}
+	}
+
+	SV_TraceBatchGroup(rays, first, numrays, mins, maxs, passedict,
+			contentmask, boxmins, boxmaxs);
+}